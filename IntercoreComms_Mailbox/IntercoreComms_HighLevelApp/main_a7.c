@@ -26,8 +26,23 @@
 #include <applibs/application.h>
 
 #include "eventloop_timer_utilities.h"
+#include "socket_stream.h"
 
-#define RECV_BUFF_SIZE 32
+#define RECV_BUFF_SIZE SOCKET_STREAM_MSG_LEN
+// Only this much of each message is logged.
+#define RECV_LOG_LEN 32
+
+// A payload of this size is streamed to the RTApp every STREAM_TX_PERIOD messages.
+#define STREAM_TX_LEN 4096
+#define STREAM_TX_PERIOD 10
+
+// While the RTApp's ring buffer is full, the rest of a payload is retried every
+// millisecond, for up to a second before it is dropped.
+#define STREAM_TX_RETRY_NS 1000000
+#define STREAM_TX_RETRIES 1000
+
+// Largest payload which can be streamed from the RTApp.
+#define STREAM_RX_LEN 8192
 
 /// <summary>
 /// Exit codes for this application. These are used for the
@@ -46,20 +61,29 @@ typedef enum {
     ExitCode_Init_SetSockOpt = 8,
     ExitCode_Init_RegisterIo = 9,
     ExitCode_Main_EventLoopFail = 10,
-    ExitCode_Main_EventLoopSimReboot = 11
+    ExitCode_Main_EventLoopSimReboot = 11,
+    ExitCode_Init_StreamTimer = 12
 } ExitCode;
 
 static int sockFd = -1;
 static EventLoop *eventLoop = NULL;
 static EventLoopTimer *sendTimer = NULL;
+static EventLoopTimer *streamTimer = NULL;
 static EventRegistration *socketEventReg = NULL;
 static volatile sig_atomic_t exitCode = ExitCode_Success;
 
+static SocketStream stream;
+static uint8_t streamRxBuffer[STREAM_RX_LEN];
+static struct timespec streamRxLast = {0};
+static unsigned streamTxRetries = 0;
+
 static const char rtAppComponentId[] = "005180bc-402f-4cb3-a662-72937dbcde47";
 
 static void TerminationHandler(int signalNumber);
 static void SendTimerEventHandler(EventLoopTimer *timer);
 static void SendMessageToRTApp(void);
+static void SendStreamToRTApp(void);
+static void StreamTimerEventHandler(EventLoopTimer *timer);
 static void SocketEventHandler(EventLoop *el, int fd, EventLoop_IoEvents events, void *context);
 static void InitSigterm(void);
 static ExitCode InitHandlers(void);
@@ -85,6 +109,12 @@ static void SendTimerEventHandler(EventLoopTimer *timer)
     }
 
     SendMessageToRTApp();
+
+    static int count = 0;
+    if (++count >= STREAM_TX_PERIOD) {
+        count = 0;
+        SendStreamToRTApp();
+    }
 }
 
 /// <summary>
@@ -108,6 +138,80 @@ static void SendMessageToRTApp(void)
     }
 }
 
+/// <summary>
+///     Helper function for TimerEventHandler streams a payload too large for one message
+///     to the real-time capable application.
+/// </summary>
+static void SendStreamToRTApp(void)
+{
+    static uint8_t txStream[STREAM_TX_LEN];
+
+    // The buffer is still in use while the previous payload is being sent.
+    if (SocketStream_Sending(&stream)) {
+        Log_Debug("WARNING: Still streaming the previous payload, skipping this one\n");
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(txStream); i++) {
+        txStream[i] = (uint8_t)('a' + (i % 26));
+    }
+
+    Log_Debug("Streaming: %zu bytes\n", sizeof(txStream));
+    streamTxRetries = 0;
+    int result = SocketStream_Send(&stream, sockFd, txStream, sizeof(txStream));
+    if (result == -1) {
+        Log_Debug("ERROR: Unable to stream payload: %d (%s)\n", errno, strerror(errno));
+        SocketStream_Cancel(&stream);
+    } else if (result == 0) {
+        static const struct timespec retry = {.tv_sec = 0, .tv_nsec = STREAM_TX_RETRY_NS};
+        SetEventLoopTimerOneShot(streamTimer, &retry);
+    }
+}
+
+/// <summary>
+///     Handle stream timer event by sending more of the payload being streamed, once the
+///     real-time capable application has made room for it.
+/// </summary>
+static void StreamTimerEventHandler(EventLoopTimer *timer)
+{
+    if (ConsumeEventLoopTimerEvent(timer) != 0) {
+        exitCode = ExitCode_TimerHandler_Consume;
+        return;
+    }
+
+    int result = SocketStream_Pump(&stream, sockFd);
+    if (result == -1) {
+        Log_Debug("ERROR: Unable to stream payload: %d (%s)\n", errno, strerror(errno));
+        SocketStream_Cancel(&stream);
+    } else if ((result == 0) && (++streamTxRetries >= STREAM_TX_RETRIES)) {
+        Log_Debug("ERROR: RTApp stopped reading, dropping streamed payload\n");
+        SocketStream_Cancel(&stream);
+    } else if (result == 0) {
+        static const struct timespec retry = {.tv_sec = 0, .tv_nsec = STREAM_TX_RETRY_NS};
+        SetEventLoopTimerOneShot(timer, &retry);
+    }
+}
+
+/// <summary>
+///     Logs a payload streamed from the real-time capable application, and the rate
+///     since the previous one.
+/// </summary>
+static void StreamReceived(size_t size)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double seconds = (double)(now.tv_sec - streamRxLast.tv_sec) +
+                     ((double)(now.tv_nsec - streamRxLast.tv_nsec) / 1e9);
+    streamRxLast = now;
+
+    Log_Debug("Received stream of %zu bytes (%.2f MB/s since the previous one)\n", size,
+              (seconds > 0) ? ((double)size / (seconds * 1e6)) : 0.0);
+    if (stream.rxDropped > 0) {
+        Log_Debug("Streams dropped: %u\n", stream.rxDropped);
+    }
+}
+
 static bool MsgParseIsReboot(char rxBuf[RECV_BUFF_SIZE], int len)
 {
     if (!rxBuf || len <= 0) {
@@ -123,10 +227,8 @@ static bool MsgParseIsReboot(char rxBuf[RECV_BUFF_SIZE], int len)
 static void SocketEventHandler(EventLoop *el, int fd, EventLoop_IoEvents events, void *context)
 {
     // Read response from real-time capable application.
-    // If the RTApp has sent more than 32 bytes, then truncate.
     char rxBuf[RECV_BUFF_SIZE];
     int bytesReceived = recv(fd, rxBuf, sizeof(rxBuf), 0);
-    Log_Debug("SocketEventHandler\n");
 
     if (bytesReceived == -1) {
         Log_Debug("ERROR: Unable to receive message: %d (%s)\n", errno, strerror(errno));
@@ -134,8 +236,20 @@ static void SocketEventHandler(EventLoop *el, int fd, EventLoop_IoEvents events,
         return;
     }
 
+    // Stream fragments are collected up without logging each one.
+    size_t streamSize;
+    int streamResult = SocketStream_Receive(&stream, rxBuf, (size_t)bytesReceived, &streamSize);
+    if (streamResult == 1) {
+        StreamReceived(streamSize);
+    }
+    if (streamResult != -1) {
+        return;
+    }
+
+    Log_Debug("SocketEventHandler\n");
+
     Log_Debug("Received %d bytes: ", bytesReceived);
-    for (int i = 0; i < bytesReceived; ++i) {
+    for (int i = 0; (i < bytesReceived) && (i < RECV_LOG_LEN); ++i) {
         Log_Debug("%c", isprint(rxBuf[i]) ? rxBuf[i] : '.');
     }
     Log_Debug("\n");
@@ -168,6 +282,8 @@ static void InitSigterm(void)
 /// </returns>
 static ExitCode InitHandlers(void)
 {
+    SocketStream_Init(&stream, streamRxBuffer, sizeof(streamRxBuffer));
+
     eventLoop = EventLoop_Create();
     if (eventLoop == NULL) {
         Log_Debug("Could not create event loop.\n");
@@ -181,6 +297,12 @@ static ExitCode InitHandlers(void)
         return ExitCode_Init_SendTimer;
     }
 
+    // Armed while a streamed payload waits for room in the RTApp's ring buffer.
+    streamTimer = CreateEventLoopDisarmedTimer(eventLoop, &StreamTimerEventHandler);
+    if (streamTimer == NULL) {
+        return ExitCode_Init_StreamTimer;
+    }
+
     // Open a connection to the RTApp.
     sockFd = Application_Connect(rtAppComponentId);
     if (sockFd == -1) {
@@ -228,6 +350,7 @@ static void CloseFdAndPrintError(int fd, const char *fdName)
 static void CloseHandlers(void)
 {
     DisposeEventLoopTimer(sendTimer);
+    DisposeEventLoopTimer(streamTimer);
     EventLoop_UnregisterIo(eventLoop, socketEventReg);
     EventLoop_Close(eventLoop);
 
@@ -0,0 +1,150 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/socket.h>
+
+#include "socket_stream.h"
+
+void SocketStream_Init(SocketStream *stream, void *buffer, size_t size)
+{
+    memset(stream, 0, sizeof(*stream));
+    stream->rxBuffer = buffer;
+    stream->rxBufferSize = size;
+}
+
+int SocketStream_Send(SocketStream *stream, int fd, const void *data, size_t size)
+{
+    if (!stream || !data || (size == 0) || (size > UINT32_MAX)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (stream->txData) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    stream->txData = data;
+    stream->txLength = (uint32_t)size;
+    stream->txOffset = 0;
+    return SocketStream_Pump(stream, fd);
+}
+
+int SocketStream_Pump(SocketStream *stream, int fd)
+{
+    static uint8_t msg[SOCKET_STREAM_MSG_LEN];
+
+    if (!stream) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (stream->txData) {
+        size_t len = stream->txLength - stream->txOffset;
+        if (len > SOCKET_STREAM_FRAGMENT_LEN) {
+            len = SOCKET_STREAM_FRAGMENT_LEN;
+        }
+
+        SocketStreamHeader header = {.magic = SOCKET_STREAM_MAGIC,
+                                     .seq = stream->txSeq,
+                                     .length = stream->txLength,
+                                     .offset = stream->txOffset};
+        memcpy(msg, &header, sizeof(header));
+        memcpy(&msg[sizeof(header)], &stream->txData[stream->txOffset], len);
+
+        // The socket refuses messages while the RTApp's ring buffer is full, leave the
+        // rest for the next call rather than waiting for it to catch up.
+        if (send(fd, msg, sizeof(header) + len, 0) == -1) {
+            if ((errno != EAGAIN) && (errno != ENOBUFS)) {
+                return -1;
+            }
+            stream->txFull++;
+            return 0;
+        }
+
+        stream->txSeq++;
+        stream->txOffset += (uint32_t)len;
+        if (stream->txOffset >= stream->txLength) {
+            stream->txData = NULL;
+        }
+    }
+
+    return 1;
+}
+
+bool SocketStream_Sending(const SocketStream *stream)
+{
+    return (stream && stream->txData);
+}
+
+void SocketStream_Cancel(SocketStream *stream)
+{
+    if (stream) {
+        stream->txData = NULL;
+    }
+}
+
+static void SocketStreamDrop(SocketStream *stream)
+{
+    if (stream->rxActive) {
+        stream->rxDropped++;
+        stream->rxActive = false;
+    }
+}
+
+int SocketStream_Receive(SocketStream *stream, const void *msg, size_t len, size_t *payloadSize)
+{
+    SocketStreamHeader header;
+    if (!stream || !msg || (len <= sizeof(header))) {
+        return -1;
+    }
+
+    memcpy(&header, msg, sizeof(header));
+    if (header.magic != SOCKET_STREAM_MAGIC) {
+        return -1;
+    }
+
+    const uint8_t *msg8 = msg;
+    len -= sizeof(header);
+
+    bool inOrder = stream->rxActive && (header.seq == stream->rxSeq) &&
+                   (header.length == stream->rxLength) && (header.offset == stream->rxOffset);
+    stream->rxSeq = header.seq + 1;
+
+    if (!inOrder) {
+        SocketStreamDrop(stream);
+
+        // A payload can only be picked up from its first fragment.
+        if (header.offset != 0) {
+            return 0;
+        }
+        if (header.length > stream->rxBufferSize) {
+            stream->rxDropped++;
+            return 0;
+        }
+
+        stream->rxActive = true;
+        stream->rxLength = header.length;
+        stream->rxOffset = 0;
+    }
+
+    if (len > (stream->rxLength - stream->rxOffset)) {
+        SocketStreamDrop(stream);
+        return 0;
+    }
+
+    memcpy(&stream->rxBuffer[stream->rxOffset], &msg8[sizeof(header)], len);
+    stream->rxOffset += (uint32_t)len;
+
+    if (stream->rxOffset < stream->rxLength) {
+        return 0;
+    }
+
+    stream->rxActive = false;
+    if (payloadSize) {
+        *payloadSize = stream->rxLength;
+    }
+    return 1;
+}
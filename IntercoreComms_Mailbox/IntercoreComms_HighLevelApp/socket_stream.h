@@ -0,0 +1,92 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Sends and receives payloads too large for a single intercore message, in the
+// fragment format of the RTApp's SocketStream.c.
+
+/// <summary>
+/// Largest message which can be sent to or received from the RTApp.
+/// </summary>
+#define SOCKET_STREAM_MSG_LEN 1040
+
+#define SOCKET_STREAM_MAGIC 0x5354524d // "STRM"
+
+/// <summary>
+/// Starts each fragment, followed by up to SOCKET_STREAM_FRAGMENT_LEN bytes of payload.
+/// </summary>
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t length;
+    uint32_t offset;
+} SocketStreamHeader;
+
+#define SOCKET_STREAM_FRAGMENT_LEN (SOCKET_STREAM_MSG_LEN - sizeof(SocketStreamHeader))
+
+typedef struct {
+    uint32_t txSeq;
+    // Times SocketStream_Pump stopped as the RTApp's ring buffer was full.
+    uint32_t txFull;
+    // The payload being sent, NULL when there isn't one.
+    const uint8_t *txData;
+    uint32_t txLength;
+    uint32_t txOffset;
+
+    uint8_t *rxBuffer;
+    size_t rxBufferSize;
+    bool rxActive;
+    uint32_t rxSeq;
+    uint32_t rxLength;
+    uint32_t rxOffset;
+    // Payloads thrown away as fragments were missing or didn't fit.
+    uint32_t rxDropped;
+} SocketStream;
+
+/// <summary>
+///     Initialises a stream, the buffer holds payloads being reassembled.
+/// </summary>
+void SocketStream_Init(SocketStream *stream, void *buffer, size_t size);
+
+/// <summary>
+///     Starts sending a payload in fragments, which must stay untouched until it's been
+///     sent. Only one payload is sent at a time, otherwise fails with EBUSY.
+/// </summary>
+/// <returns>As for SocketStream_Pump</returns>
+int SocketStream_Send(SocketStream *stream, int fd, const void *data, size_t size);
+
+/// <summary>
+///     Sends as many fragments of the payload as the RTApp's ring buffer takes, without
+///     waiting for it to make room.
+/// </summary>
+/// <returns>
+///     1 once the whole payload has been sent, 0 if the ring buffer filled up first, in
+///     which case this should be called again later, or -1 with errno set.
+/// </returns>
+int SocketStream_Pump(SocketStream *stream, int fd);
+
+/// <summary>
+///     Whether a payload is still being sent.
+/// </summary>
+bool SocketStream_Sending(const SocketStream *stream);
+
+/// <summary>
+///     Gives up on the payload being sent, the RTApp throws away the fragments it already
+///     has when the next payload starts.
+/// </summary>
+void SocketStream_Cancel(SocketStream *stream);
+
+/// <summary>
+///     Takes a message received from the RTApp.
+/// </summary>
+/// <returns>
+///     1 if it completed a payload, which is in the buffer and its length in payloadSize,
+///     0 if it was a fragment of a payload still being received, or -1 if it wasn't a
+///     fragment and should be handled by the caller.
+/// </returns>
+int SocketStream_Receive(SocketStream *stream, const void *msg, size_t len, size_t *payloadSize);
@@ -11,6 +11,7 @@
 #include <stddef.h>
 
 #include "lib/MBox.h"
+#include "lib/NVIC.h"
 
 #include "Socket.h"
 
@@ -41,6 +42,14 @@ typedef struct {
     uint32_t      reserved;
 } Socket_Msg_Header;
 
+// Nothing is read from or written to the ring buffers unless connected, as
+// they're replaced by negotiation.
+typedef enum {
+    SOCKET_STATE_CONNECTED = 0,
+    SOCKET_STATE_NEGOTIATING,
+    SOCKET_STATE_DISCONNECTED,
+} Socket_State;
+
 /* Handle to socket connection containing state of shared ring buffer
 
    ringRemote state is updated by the A7 core and read by the M4 core
@@ -49,11 +58,78 @@ struct Socket {
     bool               open;
     void             (*rx_cb)(Socket*);
     MBox              *mailbox;
+    volatile Socket_State state;
     Socket_Ringbuffer  ringRemote;
     Socket_Ringbuffer  ringLocal;
+
+    // Set between Socket_WriteReserve and Socket_WriteCommit, the reserved
+    // block starts at the local write index which isn't published until then.
+    bool               writeReserved;
+    uint32_t           writeReserveSize;
+
+    // Blocks are committed up to writePosition, but only published to the
+    // HLApp by Socket__Flush, which may run from the coalescing timer's
+    // interrupt so is kept from running part way through a commit.
+    uint32_t           writePosition;
+    uint32_t           writePending;
+    bool               corked;
+    uint32_t           coalesceBytes;
+    GPT               *coalesceTimer;
+    uint32_t           coalesceTimeout;
+
+    // Set between Socket_ReadPeek and Socket_ReadRelease, this is where the
+    // local read index moves to on release.
+    bool               readPeeked;
+    uint32_t           readReleasePosition;
+#if SOCKET_RING_STATS
+    uint32_t           readPeekSize;
+#endif
+
+    // Optional flow control, messages refused by the ring buffer wait in
+    // the overflow buffer and the space callback is called from the next
+    // mailbox interrupt.
+    GPT               *clock;
+    uint8_t           *overflow;
+    uint32_t           overflowSize;
+    uint32_t           overflowUsed;
+    void             (*space_cb)(Socket*);
+    volatile bool      spaceWanted;
+
+    // Set by Socket_NegotiateStart, the negotiation completes from the FIFO
+    // interrupt or fails once negotiateTimeout has passed, from the one-shot
+    // negotiateTimer's interrupt if there is one.
+    uint32_t           negotiateStart;
+    uint32_t           negotiateTimeout;
+    GPT               *negotiateTimer;
+
+    Socket_Stats       stats;
+#if SOCKET_RING_STATS
+    // Commit times of the messages the HLApp hasn't read yet, oldest first,
+    // each with the ring position just past its block. They're kept here as
+    // the HLApp may have freed a block, and the space been reused, before the
+    // interrupt telling of it is handled.
+    struct {
+        uint32_t end;
+        uint32_t time;
+    }                  latencyStamps[SOCKET_LATENCY_STAMPS];
+    uint32_t           latencyFirst;
+    uint32_t           latencyStamped;
+    // Where the HLApp had read up to when the stamps were last checked.
+    uint32_t           ringStatsPosition;
+    Socket_RingStats   ringStats;
+#endif
 };
 
-static Socket context = {0};
+// Starts each message in the overflow buffer, followed by its data padded
+// to a word.
+typedef struct {
+    Component_Id recipient;
+    uint32_t     size;
+} Socket_Overflow_Header;
+
+static Socket context  = {0};
+// Opened by Socket_OpenLoopback, this has no mailbox.
+static Socket loopback = {0};
 
 // Buffer descriptor commands
 #define SOCKET_CMD_LOCAL_BUFFER_DESC  0xba5e0001
@@ -64,7 +140,7 @@ static Socket context = {0};
 #define RB_ALIGNMENT 16
 // Maximum payload size in bytes. This does not include a header which
 // is prepended by
-#define RB_MAX_PAYLOAD_LEN 1040
+#define RB_MAX_PAYLOAD_LEN SOCKET_MAX_PAYLOAD_LEN
 
 static const uint8_t SOCKET_PORT_MSG_RECV = 1;
 static const uint8_t SOCKET_PORT_MSG_SENT = 0;
@@ -77,6 +153,49 @@ static uint32_t RoundUp(uint32_t value, uint32_t alignment)
     return (value + (alignment - 1)) & ~(alignment - 1);
 }
 
+// Lets words be copied between buffers of any type.
+typedef uint32_t __attribute__((__may_alias__)) Socket_Word;
+
+// Copies to or from the ring buffers. Blocks start 16-byte aligned, so when
+// source and destination share their alignment within a word, the bytes up
+// to a word boundary are copied singly and the rest in 16-byte bursts, then
+// words, then single bytes.
+static void Socket__Copy(void *dest, const void *src, size_t size)
+{
+    if ((((uintptr_t)dest ^ (uintptr_t)src) % sizeof(Socket_Word)) != 0) {
+        __builtin_memcpy(dest, src, size);
+        return;
+    }
+
+    uint8_t       *dest8 = (uint8_t *)dest;
+    const uint8_t *src8  = (const uint8_t *)src;
+    for (; (size > 0) && (((uintptr_t)dest8 % sizeof(Socket_Word)) != 0); size--) {
+        *dest8++ = *src8++;
+    }
+
+    Socket_Word       *dest32 = (Socket_Word *)dest8;
+    const Socket_Word *src32  = (const Socket_Word *)src8;
+#ifdef __arm__
+    for (; size >= (4 * sizeof(Socket_Word)); size -= (4 * sizeof(Socket_Word))) {
+        __asm__ volatile(
+            "ldmia %[src]!, {r3, r4, r5, r6}\n\t"
+            "stmia %[dest]!, {r3, r4, r5, r6}"
+            : [src] "+r" (src32), [dest] "+r" (dest32)
+            :
+            : "r3", "r4", "r5", "r6", "memory");
+    }
+#endif
+    for (; size >= sizeof(Socket_Word); size -= sizeof(Socket_Word)) {
+        *dest32++ = *src32++;
+    }
+
+    dest8 = (uint8_t *)dest32;
+    src8  = (const uint8_t *)src32;
+    for (; size > 0; size--) {
+        *dest8++ = *src8++;
+    }
+}
+
 static Socket_Ringbuffer Socket_Ringbuffer__Parse_Desc(uint32_t buffer_desc)
 {
     Socket_Ringbuffer buffer;
@@ -84,21 +203,53 @@ static Socket_Ringbuffer Socket_Ringbuffer__Parse_Desc(uint32_t buffer_desc)
     buffer.capacity = (1U << (buffer_desc & 0x1F)) - sizeof(Socket_Ringbuffer_Header);
     // The buffer header is a 32-byte aligned pointer which is stored in the
     // top 27 bits.
-    buffer.sharedData = (Socket_Ringbuffer_Shared*)(buffer_desc & ~0x1F);
+    buffer.sharedData = (Socket_Ringbuffer_Shared*)(uintptr_t)(buffer_desc & ~0x1F);
 
     return buffer;
 }
 
+static void Socket__Negotiate_Step(Socket *socket, bool expired);
+static void Socket__Stats_Dequeued(Socket *socket);
+
+// The HLApp only writes to the FIFO to negotiate, either in reply to
+// Socket_NegotiateStart or because it has restarted.
+static void Socket__FIFO_Available(void *user_data)
+{
+    Socket *handle = (Socket*)user_data;
+    if (!handle || !handle->open) {
+        return;
+    }
+
+    if (handle->state == SOCKET_STATE_NEGOTIATING) {
+        Socket__Negotiate_Step(handle, false);
+    } else if (handle->rx_cb) {
+        // Lets the application see Socket_NegotiationPending.
+        handle->rx_cb(handle);
+    }
+}
+
 static void Socket__Msg_Available(void *user_data, uint8_t port)
 {
-    if ((port != SOCKET_PORT_MSG_RECV) || !user_data ||
-        (port >= MBOX_SW_INT_PORT_COUNT))
-    {
+    if (!user_data || (port >= MBOX_SW_INT_PORT_COUNT)) {
         return;
     }
 
     Socket *handle = (Socket*)user_data;
 
+    Socket__Stats_Dequeued(handle);
+
+    // The HLApp signals after reading as well as after writing, and either
+    // may follow it freeing space, so a writer which was refused space is
+    // told on any interrupt and checks again.
+    if (handle->spaceWanted && handle->space_cb) {
+        handle->spaceWanted = false;
+        handle->space_cb(handle);
+    }
+
+    if (port != SOCKET_PORT_MSG_RECV) {
+        return;
+    }
+
     handle->rx_cb(handle);
 }
 
@@ -111,7 +262,7 @@ Socket* Socket_Open(void (*rx_cb)(Socket*))
     // Initialise MBox and FIFO
     MBox *mbox;
     if ((mbox = MBox_FIFO_Open(
-        MT3620_UNIT_MBOX_CA7, NULL, NULL, NULL, &context, -1, -1)) == NULL) {
+        MT3620_UNIT_MBOX_CA7, Socket__FIFO_Available, NULL, NULL, &context, -1, -1)) == NULL) {
         return NULL;
     }
 
@@ -137,14 +288,49 @@ Socket* Socket_Open(void (*rx_cb)(Socket*))
     return &context;
 }
 
+Socket* Socket_OpenLoopback(void *buffer, uint32_t size, void (*rx_cb)(Socket*))
+{
+    if (loopback.open || !buffer || (((uintptr_t)buffer % RB_ALIGNMENT) != 0) ||
+        (size < (sizeof(Socket_Ringbuffer_Header) + (2 * RB_ALIGNMENT)))) {
+        return NULL;
+    }
+
+    // Both directions share one ring, so that what's written is read back,
+    // the write index being published by the write path and the read index
+    // by the read path just as they would be for the HLApp.
+    Socket_Ringbuffer ring;
+    ring.sharedData = (Socket_Ringbuffer_Shared*)buffer;
+    ring.capacity   = (size - sizeof(Socket_Ringbuffer_Header)) & ~(RB_ALIGNMENT - 1);
+    __builtin_memset(&ring.sharedData->header, 0, sizeof(Socket_Ringbuffer_Header));
+
+    __builtin_memset(&loopback, 0, sizeof(loopback));
+    loopback.ringRemote = ring;
+    loopback.ringLocal  = ring;
+    loopback.rx_cb      = rx_cb;
+    loopback.open       = true;
+
+    return &loopback;
+}
+
 int32_t Socket_Close(Socket *socket)
 {
     if (!socket || !socket->open) {
         return ERROR_PARAMETER;
     }
 
-    MBox_SW_Interrupt_Teardown(socket->mailbox);
-    MBox_FIFO_Close(socket->mailbox);
+    if (socket->coalesceTimer && GPT_IsEnabled(socket->coalesceTimer)) {
+        GPT_Stop(socket->coalesceTimer);
+    }
+    socket->coalesceTimer = NULL;
+    if (socket->negotiateTimer && GPT_IsEnabled(socket->negotiateTimer)) {
+        GPT_Stop(socket->negotiateTimer);
+    }
+    socket->negotiateTimer = NULL;
+
+    if (socket->mailbox) {
+        MBox_SW_Interrupt_Teardown(socket->mailbox);
+        MBox_FIFO_Close(socket->mailbox);
+    }
     socket->open = false;
 
     return ERROR_NONE;
@@ -153,29 +339,19 @@ int32_t Socket_Close(Socket *socket)
 
 bool Socket_NegotiationPending(Socket *socket)
 {
-    if (!socket)    {
+    if (!socket || !socket->mailbox ||
+        (socket->state == SOCKET_STATE_NEGOTIATING)) {
         return false;
     }
 
     return (MBox_FIFO_Reads_Available(socket->mailbox) != 0);
 }
 
-int32_t Socket_Negotiate(Socket *socket)
+// Helper function for negotiation, sets up the ring buffers from the
+// descriptors read from the FIFO.
+static int32_t Socket__Negotiate_Parse(
+    Socket *socket, const uint32_t *cmd, const uint32_t *data)
 {
-    if (!socket) {
-        return ERROR_SOCKET_NEGOTIATION;
-    }
-
-    // Get buffer descriptors from MBox FIFO
-    uint32_t  cmd[FIFO_MSG_NEG_LEN], data[FIFO_MSG_NEG_LEN];
-
-    // Block and wait for A7 core to negotiate buffer descriptors
-    if (MBox_FIFO_ReadSync(socket->mailbox, cmd, data, FIFO_MSG_NEG_LEN) != ERROR_NONE)
-    {
-        MBox_FIFO_Close(socket->mailbox);
-        return ERROR_SOCKET_NEGOTIATION;
-    }
-
     // Parse buffer descriptors
     Socket_Ringbuffer ringRemote, ringLocal;
     unsigned parsed = 0;
@@ -208,16 +384,155 @@ int32_t Socket_Negotiate(Socket *socket)
         return ERROR_SOCKET_NEGOTIATION;
     }
 
-    socket->ringRemote = ringRemote;
-    socket->ringLocal  = ringLocal;
+    socket->ringRemote    = ringRemote;
+    socket->ringLocal     = ringLocal;
+    socket->writeReserved = false;
+    socket->writePosition = RB_WRITE_INDEX(ringLocal);
+    socket->writePending  = 0;
+    socket->readPeeked    = false;
+#if SOCKET_RING_STATS
+    socket->ringStatsPosition = RB_READ_INDEX(ringRemote);
+    socket->latencyStamped    = 0;
+#endif
+
+    if (socket->coalesceTimer && GPT_IsEnabled(socket->coalesceTimer)) {
+        GPT_Stop(socket->coalesceTimer);
+    }
 
     return ERROR_NONE;
 }
 
+int32_t Socket_Negotiate(Socket *socket)
+{
+    if (!socket || !socket->mailbox) {
+        return ERROR_SOCKET_NEGOTIATION;
+    }
+
+    if (socket->state == SOCKET_STATE_NEGOTIATING) {
+        return ERROR_BUSY;
+    }
+
+    // Get buffer descriptors from MBox FIFO
+    uint32_t  cmd[FIFO_MSG_NEG_LEN], data[FIFO_MSG_NEG_LEN];
+
+    // Block and wait for A7 core to negotiate buffer descriptors
+    if (MBox_FIFO_ReadSync(socket->mailbox, cmd, data, FIFO_MSG_NEG_LEN) != ERROR_NONE)
+    {
+        MBox_FIFO_Close(socket->mailbox);
+        return ERROR_SOCKET_NEGOTIATION;
+    }
+
+    int32_t error = Socket__Negotiate_Parse(socket, cmd, data);
+    socket->state = (error == ERROR_NONE ?
+        SOCKET_STATE_CONNECTED : SOCKET_STATE_DISCONNECTED);
+    return error;
+}
+
+// Helper function for asynchronous negotiation, IRQs must be blocked or this
+// must be called from an interrupt. Completes the negotiation once all the
+// descriptors have arrived, or fails it once it's timed out or expired is set.
+static void Socket__Negotiate_Step(Socket *socket, bool expired)
+{
+    if (socket->state != SOCKET_STATE_NEGOTIATING) {
+        return;
+    }
+
+    if (MBox_FIFO_Reads_Available(socket->mailbox) >= FIFO_MSG_NEG_LEN) {
+        uint32_t cmd[FIFO_MSG_NEG_LEN], data[FIFO_MSG_NEG_LEN];
+        int32_t  error = MBox_FIFO_Read(socket->mailbox, cmd, data, FIFO_MSG_NEG_LEN);
+        if (error == ERROR_NONE) {
+            error = Socket__Negotiate_Parse(socket, cmd, data);
+        }
+        socket->state = (error == ERROR_NONE ?
+            SOCKET_STATE_CONNECTED : SOCKET_STATE_DISCONNECTED);
+    } else if (expired || (socket->clock && (socket->negotiateTimeout != 0) &&
+        ((GPT_GetRunningTime(socket->clock, GPT_UNITS_MICROSEC) - socket->negotiateStart)
+            >= socket->negotiateTimeout))) {
+        socket->state = SOCKET_STATE_DISCONNECTED;
+    } else {
+        return;
+    }
 
-void Socket_Reset(Socket *socket)
+    if (socket->negotiateTimer && GPT_IsEnabled(socket->negotiateTimer)) {
+        GPT_Stop(socket->negotiateTimer);
+    }
+
+    // Writers held back while negotiating can try again.
+    if (socket->space_cb) {
+        socket->spaceWanted = false;
+        socket->space_cb(socket);
+    }
+}
+
+static void Socket__Negotiate_Timeout(GPT *timer)
+{
+    if (context.open && (context.negotiateTimer == timer)) {
+        Socket__Negotiate_Step(&context, true);
+    }
+}
+
+int32_t Socket_NegotiateStart(Socket *socket, uint32_t timeout)
+{
+    if (!socket || !socket->mailbox) {
+        return ERROR_SOCKET_NEGOTIATION;
+    }
+
+    uint32_t prevBasePri = NVIC_BlockIRQs();
+    if (socket->state != SOCKET_STATE_NEGOTIATING) {
+        // Anything not yet handed to the HLApp is lost with the old ring
+        // buffer, as is any reservation or peeked message.
+        if (socket->coalesceTimer && GPT_IsEnabled(socket->coalesceTimer)) {
+            GPT_Stop(socket->coalesceTimer);
+        }
+        socket->writeReserved    = false;
+        socket->readPeeked       = false;
+        socket->negotiateStart   = (socket->clock ?
+            GPT_GetRunningTime(socket->clock, GPT_UNITS_MICROSEC) : 0);
+        socket->negotiateTimeout = timeout;
+        socket->state            = SOCKET_STATE_NEGOTIATING;
+
+        // This may be the coalescing timer, stopped above.
+        if (socket->negotiateTimer && (timeout != 0)) {
+            if (GPT_IsEnabled(socket->negotiateTimer)) {
+                GPT_Stop(socket->negotiateTimer);
+            }
+            GPT_StartTimeout(socket->negotiateTimer, timeout,
+                GPT_UNITS_MICROSEC, Socket__Negotiate_Timeout);
+        }
+    }
+
+    // The descriptors may all be waiting already.
+    Socket__Negotiate_Step(socket, false);
+    NVIC_RestoreIRQs(prevBasePri);
+
+    return Socket_NegotiateStatus(socket);
+}
+
+int32_t Socket_NegotiateStatus(Socket *socket)
 {
     if (!socket) {
+        return ERROR_PARAMETER;
+    }
+
+    uint32_t prevBasePri = NVIC_BlockIRQs();
+    Socket__Negotiate_Step(socket, false);
+    Socket_State state = socket->state;
+    NVIC_RestoreIRQs(prevBasePri);
+
+    switch (state) {
+    case SOCKET_STATE_CONNECTED:
+        return ERROR_NONE;
+    case SOCKET_STATE_NEGOTIATING:
+        return ERROR_BUSY;
+    default:
+        return ERROR_SOCKET_NEGOTIATION;
+    }
+}
+
+
+void Socket_Reset(Socket *socket)
+{
+    if (!socket || !socket->mailbox) {
         return;
     }
 
@@ -229,11 +544,69 @@ static void Socket__Signal(Socket *socket, uint8_t port)
     // Ensure memory writes have completed (not just been sent) before raising interrupt.
     // "no instruction that appears in program order after the DSB instruction can execute until the
     // DSB completes" ARMv7M Architecture Reference Manual, ARM DDI 0403E.d S A3.7.3
+#ifdef __arm__
     __asm__ volatile("dsb");
+#else
+    // Host build (see test/), where the mailbox is a thread.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+
+    // A loopback socket is its own reader, so is told of what it wrote.
+    if (!socket->mailbox) {
+        if ((port == SOCKET_PORT_MSG_SENT) && socket->rx_cb) {
+            socket->rx_cb(socket);
+        } else if (port == SOCKET_PORT_MSG_RECV) {
+            Socket__Stats_Dequeued(socket);
+        }
+        return;
+    }
+
     MBox_SW_Interrupt_Trigger(socket->mailbox, port);
 }
 
-// Helper function for Socket_Write. Writes data to the local ringbuffer,
+// Publishes every committed block with one interrupt, IRQs must be blocked
+// or this must be called from an interrupt.
+static void Socket__Flush(Socket *socket)
+{
+    // Nothing is held back while negotiating, when the coalescing timer may
+    // be timing the negotiation instead.
+    if (socket->state != SOCKET_STATE_CONNECTED) {
+        return;
+    }
+
+    if (socket->coalesceTimer && GPT_IsEnabled(socket->coalesceTimer)) {
+        GPT_Stop(socket->coalesceTimer);
+    }
+
+    uint32_t localWritePosition = socket->writePosition;
+    if (localWritePosition == RB_WRITE_INDEX(socket->ringLocal)) {
+        return;
+    }
+
+    // Ensure write position update is seen after new content has been written.
+    // Corresponding acquire is on high-level core.
+    __atomic_store(
+        &(RB_WRITE_INDEX(socket->ringLocal)),
+        &localWritePosition, __ATOMIC_RELEASE);
+    socket->writePending = 0;
+    socket->stats.writeSignals++;
+
+    Socket__Signal(socket, SOCKET_PORT_MSG_SENT);
+}
+
+// A timer started before corking is left to run out, the messages then wait
+// for Socket_Uncork.
+static void Socket__Coalesce_Timeout(GPT *timer)
+{
+    if (context.open && (context.coalesceTimer == timer) && !context.corked) {
+        Socket__Flush(&context);
+    }
+    if (loopback.open && (loopback.coalesceTimer == timer) && !loopback.corked) {
+        Socket__Flush(&loopback);
+    }
+}
+
+// Helper function for the writes. Writes data to the local ringbuffer,
 // and wraps around to start of buffer if required. Returns updated write position.
 static uint32_t Socket__Write_RB(
     const Socket_Ringbuffer *rb, uint32_t startPos, const void *src, size_t size)
@@ -249,9 +622,9 @@ static uint32_t Socket__Write_RB(
 
     const uint8_t *src8 = (const uint8_t *)src;
 
-    __builtin_memcpy(&(rb->sharedData->data[startPos]), src8, writeToEnd);
+    Socket__Copy(&(rb->sharedData->data[startPos]), src8, writeToEnd);
     // If not enough space to write all data before end of buffer, then write remainder at start.
-    __builtin_memcpy(&(rb->sharedData->data[0]), src8 + writeToEnd, size - writeToEnd);
+    Socket__Copy(&(rb->sharedData->data[0]), src8 + writeToEnd, size - writeToEnd);
 
     uint32_t finalPos = startPos + size;
     if (finalPos > rb->capacity) {
@@ -260,18 +633,38 @@ static uint32_t Socket__Write_RB(
     return finalPos;
 }
 
-int32_t Socket_Write(
-    Socket             *socket,
-    const Component_Id *recipient,
-    const void         *data,
-    uint32_t            size)
+// Helper function for the reads and writes, returns the position reached after size
+// bytes from startPos, wrapping around to the start of the buffer.
+static uint32_t Socket__Advance_RB(
+    const Socket_Ringbuffer *rb, uint32_t startPos, uint32_t size)
 {
-    if (!socket || !recipient || !data || (size == 0)) {
-        return ERROR_PARAMETER;
+    uint32_t finalPos = startPos + size;
+    if (finalPos >= rb->capacity) {
+        finalPos -= rb->capacity;
     }
+    return finalPos;
+}
 
-    if (size > RB_MAX_PAYLOAD_LEN) {
-        return ERROR_SOCKET_INSUFFICIENT_SPACE;
+// Helper function for the reads and writes, points payload at size bytes of the ring
+// buffer from startPos, splitting them where they wrap around.
+static void Socket__Payload_RB(
+    const Socket_Ringbuffer *rb, uint32_t startPos, uint32_t size,
+    Socket_Payload *payload)
+{
+    uint32_t spaceToEnd = rb->capacity - startPos;
+
+    payload->data[0] = &(rb->sharedData->data[startPos]);
+    payload->size[0] = (size > spaceToEnd ? spaceToEnd : size);
+    payload->data[1] = &(rb->sharedData->data[0]);
+    payload->size[1] = size - payload->size[0];
+}
+
+// Helper function for the writes. Finds the free space in the local ring
+// buffer, returns false if the indices are corrupt.
+static bool Socket__Write_Space(const Socket *socket, uint32_t *availSpace)
+{
+    if (socket->state != SOCKET_STATE_CONNECTED) {
+        return false;
     }
 
     // Last position read by HLApp. Corresponding release occurs on
@@ -279,130 +672,651 @@ int32_t Socket_Write(
     uint32_t remoteReadPosition;
     __atomic_load(&(RB_READ_INDEX(socket->ringRemote)),
         &remoteReadPosition, __ATOMIC_ACQUIRE);
-    // Last position written to by RTApp.
-    uint32_t localWritePosition = RB_WRITE_INDEX(socket->ringLocal);
+    // Last position written to by RTApp, which may not be published yet.
+    uint32_t localWritePosition = socket->writePosition;
 
     // Sanity check read and write positions.
     if ((remoteReadPosition >= socket->ringLocal.capacity) ||
         ((remoteReadPosition % RB_ALIGNMENT) != 0) ||
         (localWritePosition >= socket->ringLocal.capacity) ||
         ((localWritePosition % RB_ALIGNMENT) != 0)) {
-        return ERROR_SOCKET_INSUFFICIENT_SPACE;
+        return false;
     }
 
     // If the read pointer is behind the write pointer, then the free space
     // wraps around, and the used space doesn't.
-    uint32_t availSpace;
     if (remoteReadPosition <= localWritePosition) {
-        availSpace = remoteReadPosition - localWritePosition +
+        *availSpace = remoteReadPosition - localWritePosition +
             socket->ringLocal.capacity;
     } else {
-        availSpace = remoteReadPosition - localWritePosition;
+        *availSpace = remoteReadPosition - localWritePosition;
+    }
+
+    return true;
+}
+
+uint32_t Socket_WriteSpace(const Socket *socket)
+{
+    uint32_t availSpace;
+    if (!socket || !Socket__Write_Space(socket, &availSpace)) {
+        return 0;
+    }
+
+    // As checked by Socket_WriteReserve.
+    uint32_t overhead = sizeof(uint32_t) + sizeof(Socket_Msg_Header) + RB_ALIGNMENT;
+    if (availSpace <= overhead) {
+        return 0;
+    }
+
+    return (availSpace - overhead);
+}
+
+static void Socket__Overflow_Drain(Socket *socket);
+
+// Helper function for the writes, reserves room in the ring buffer without
+// regard for the overflow buffer, which Socket__Overflow_Drain relies on.
+static int32_t Socket__Write_Reserve(
+    Socket             *socket,
+    const Component_Id *recipient,
+    uint32_t            size,
+    Socket_Payload     *payload)
+{
+    if (socket->writeReserved) {
+        return ERROR_BUSY;
+    }
+
+    uint32_t localWritePosition = socket->writePosition;
+    uint32_t availSpace;
+    if ((size > RB_MAX_PAYLOAD_LEN) || !Socket__Write_Space(socket, &availSpace)) {
+        return ERROR_SOCKET_INSUFFICIENT_SPACE;
     }
 
     // Check whether there is enough space to enqueue the next block.
     uint32_t reqBlockSize = sizeof(uint32_t) + sizeof(Socket_Msg_Header) + size;
 
     if (availSpace < reqBlockSize + RB_ALIGNMENT) {
+        // The HLApp can't free any space taken by messages held back, so
+        // hand them over now. Callers may retry in a loop, so IRQs are only
+        // blocked when there's something to hand over.
+        if (localWritePosition != RB_WRITE_INDEX(socket->ringLocal)) {
+            uint32_t prevBasePri = NVIC_BlockIRQs();
+            Socket__Flush(socket);
+            NVIC_RestoreIRQs(prevBasePri);
+        }
         return ERROR_SOCKET_INSUFFICIENT_SPACE;
     }
 
-    // The value in the block size field does not include the space taken by the
-    // block size field itself.
-    uint32_t blockSizeExcSizeField = reqBlockSize - sizeof(uint32_t);
-    localWritePosition = Socket__Write_RB(
-        &(socket->ringLocal), localWritePosition, &blockSizeExcSizeField,
-        sizeof(blockSizeExcSizeField));
+    // The block size is written on commit, once the payload size is final.
+    uint32_t position = Socket__Advance_RB(
+        &(socket->ringLocal), localWritePosition, sizeof(uint32_t));
 
     // Write header
     Socket_Msg_Header msg_header = {0};
     msg_header.comp_id = *recipient;
-    localWritePosition = Socket__Write_RB(
-        &(socket->ringLocal), localWritePosition,
+    position = Socket__Write_RB(
+        &(socket->ringLocal), position,
         &msg_header, sizeof(Socket_Msg_Header));
-
-    // Write data
-    localWritePosition = Socket__Write_RB(
-        &(socket->ringLocal), localWritePosition, data, size);
-
-    // Advance write position to start of next possible block.
-    localWritePosition = RoundUp(localWritePosition, RB_ALIGNMENT);
-    if (localWritePosition >= socket->ringLocal.capacity) {
-        localWritePosition -= socket->ringLocal.capacity;
+    if (position >= socket->ringLocal.capacity) {
+        position -= socket->ringLocal.capacity;
     }
 
-    // Ensure write position update is seen after new content has been written.
-    // Corresponding acquire is on high-level core.
-    __atomic_store(
-        &(RB_WRITE_INDEX(socket->ringLocal)),
-        &localWritePosition, __ATOMIC_RELEASE);
+    Socket__Payload_RB(&(socket->ringLocal), position, size, payload);
 
-    Socket__Signal(socket, SOCKET_PORT_MSG_SENT);
+    socket->writeReserved    = true;
+    socket->writeReserveSize = size;
 
     return ERROR_NONE;
 }
 
-// Helper function for Socket_Read. Reads data from the remote ring buffer,
-// and wraps around to start of buffer if required. Returns updated read position.
-static uint32_t Socket__Read_RB(
-    const Socket_Ringbuffer *rb, uint32_t startPos, void *dest, size_t size)
+int32_t Socket_WriteReserve(
+    Socket             *socket,
+    const Component_Id *recipient,
+    uint32_t            size,
+    Socket_Payload     *payload)
 {
-    uint32_t availToEnd = rb->capacity - startPos;
-
-    uint32_t readFromEnd = size;
-    // If the available data wraps around the end of the buffer then only read
-    // availToEnd bytes before subsequently reading from the start of the buffer.
-    if (size > availToEnd) {
-        readFromEnd = availToEnd;
+    if (!socket || !recipient || !payload || (size == 0)) {
+        return ERROR_PARAMETER;
     }
 
-    uint8_t *dest8 = (uint8_t *)dest;
-    __builtin_memcpy(dest, &(rb->sharedData->data[startPos]), readFromEnd);
+    if (socket->writeReserved) {
+        return ERROR_BUSY;
+    }
 
-    // If block wrapped around the end of the buffer, then read remainder from start.
-    __builtin_memcpy(dest8 + readFromEnd, &(rb->sharedData->data[0]), size - readFromEnd);
+    if (socket->state == SOCKET_STATE_DISCONNECTED) {
+        return ERROR_SOCKET_NEGOTIATION;
+    }
 
-    uint32_t finalPos = startPos + size;
-    if (finalPos > rb->capacity) {
-        finalPos -= rb->capacity;
+    // Messages waiting in the overflow buffer go first, a reservation can't
+    // overtake them.
+    if (socket->overflowUsed > 0) {
+        Socket__Overflow_Drain(socket);
+        if (socket->overflowUsed > 0) {
+            socket->spaceWanted = true;
+            return ERROR_SOCKET_INSUFFICIENT_SPACE;
+        }
     }
-    return finalPos;
+
+    return Socket__Write_Reserve(socket, recipient, size, payload);
 }
 
-int32_t Socket_Read(
-    Socket       *socket,
-    Component_Id *sender,
-    void         *data,
-    uint32_t     *size)
+int32_t Socket_WriteCommit(Socket *socket, uint32_t size)
 {
-    if (!socket || !sender || !data || !size) {
+    if (!socket || !socket->writeReserved ||
+        (size > socket->writeReserveSize)) {
         return ERROR_PARAMETER;
     }
-    // Don't read message content until have seen that remote write position has been updated.
-    // Corresponding release occurs on high-level core.
-    uint32_t remoteWritePosition;
-    __atomic_load(&(RB_WRITE_INDEX(socket->ringRemote)), &remoteWritePosition, __ATOMIC_ACQUIRE);
-    // Last position read from by this RTApp.
-    uint32_t localReadPosition = RB_READ_INDEX(socket->ringLocal);
 
-    // Sanity check read and write positions.
-    if ((remoteWritePosition >= socket->ringRemote.capacity) ||
-        ((remoteWritePosition % RB_ALIGNMENT) != 0) ||
-        (localReadPosition >= socket->ringRemote.capacity) ||
-        ((localReadPosition % RB_ALIGNMENT) != 0)) {
-        return ERROR_SOCKET_INSUFFICIENT_SPACE;
+    socket->writeReserved = false;
+    if (size == 0) {
+        return ERROR_NONE;
     }
 
-    // Get the maximum amount of available data. The actual block size may be
-    // smaller than this.
+    uint32_t localWritePosition = socket->writePosition;
 
-    uint32_t availData;
-    // If data is contiguous in buffer then difference between write and read positions...
-    if (remoteWritePosition >= localReadPosition) {
-        availData = remoteWritePosition - localReadPosition;
-    }
-    // ...else data wraps around end and resumes at start of buffer
-    else {
+    // The value in the block size field does not include the space taken by the
+    // block size field itself.
+    uint32_t blockSizeExcSizeField = sizeof(Socket_Msg_Header) + size;
+    Socket__Write_RB(
+        &(socket->ringLocal), localWritePosition, &blockSizeExcSizeField,
+        sizeof(blockSizeExcSizeField));
+
+    // Advance write position to start of next possible block.
+    uint32_t prevWritePosition = localWritePosition;
+    localWritePosition = RoundUp(
+        localWritePosition + sizeof(uint32_t) + blockSizeExcSizeField,
+        RB_ALIGNMENT);
+    if (localWritePosition >= socket->ringLocal.capacity) {
+        localWritePosition -= socket->ringLocal.capacity;
+    }
+
+    uint32_t prevBasePri = NVIC_BlockIRQs();
+    socket->writePosition = localWritePosition;
+    socket->writePending += size;
+    socket->stats.writeMessages++;
+
+#if SOCKET_RING_STATS
+    // Stamps of messages already read are used up first, so they're all
+    // ahead of the HLApp's read position and make room for this one's.
+    Socket__Stats_Dequeued(socket);
+    if (socket->clock && (socket->latencyStamped < SOCKET_LATENCY_STAMPS)) {
+        uint32_t index = ((socket->latencyFirst + socket->latencyStamped)
+            % SOCKET_LATENCY_STAMPS);
+        socket->latencyStamps[index].end  = localWritePosition;
+        socket->latencyStamps[index].time =
+            GPT_GetRunningTime(socket->clock, GPT_UNITS_MICROSEC);
+        socket->latencyStamped++;
+    }
+
+    socket->ringStats.txBytes += size;
+    socket->ringStats.txMessages++;
+    if (localWritePosition <= prevWritePosition) {
+        socket->ringStats.txWraps++;
+    }
+    uint32_t availSpace;
+    if (Socket__Write_Space(socket, &availSpace) &&
+        ((socket->ringLocal.capacity - availSpace) > socket->ringStats.txPeak)) {
+        socket->ringStats.txPeak = socket->ringLocal.capacity - availSpace;
+    }
+#else
+    (void)prevWritePosition;
+#endif
+
+    // While corked, messages are only published by uncorking or when the
+    // ring fills up, not by the coalescing limits.
+    bool coalescing = ((socket->coalesceBytes != 0) || (socket->coalesceTimer != NULL));
+    if (socket->corked) {
+    } else if (!coalescing ||
+        ((socket->coalesceBytes != 0) && (socket->writePending >= socket->coalesceBytes))) {
+        Socket__Flush(socket);
+    } else if (socket->coalesceTimer && !GPT_IsEnabled(socket->coalesceTimer)) {
+        GPT_StartTimeout(socket->coalesceTimer, socket->coalesceTimeout,
+            GPT_UNITS_MICROSEC, Socket__Coalesce_Timeout);
+    }
+    NVIC_RestoreIRQs(prevBasePri);
+
+    return ERROR_NONE;
+}
+
+// Helper function for the writes, copies a whole message into the ring.
+static int32_t Socket__Write_Msg(
+    Socket             *socket,
+    const Component_Id *recipient,
+    const void         *data,
+    uint32_t            size)
+{
+    Socket_Payload payload;
+    int32_t error = Socket__Write_Reserve(socket, recipient, size, &payload);
+    if (error != ERROR_NONE) {
+        return error;
+    }
+
+    // Write data
+    const uint8_t *src8 = (const uint8_t *)data;
+    Socket__Copy(payload.data[0], src8, payload.size[0]);
+    Socket__Copy(payload.data[1], src8 + payload.size[0], payload.size[1]);
+
+    return Socket_WriteCommit(socket, size);
+}
+
+static uint32_t Socket__Overflow_Len(uint32_t size)
+{
+    return (sizeof(Socket_Overflow_Header) + size + 3) & ~3U;
+}
+
+// Moves messages from the overflow buffer into the ring buffer, in order,
+// until it's empty or the ring buffer is full.
+static void Socket__Overflow_Drain(Socket *socket)
+{
+    uint32_t pos = 0;
+    while (pos < socket->overflowUsed) {
+        Socket_Overflow_Header header;
+        __builtin_memcpy(&header, &socket->overflow[pos], sizeof(header));
+        if (Socket__Write_Msg(socket, &header.recipient,
+            &socket->overflow[pos + sizeof(header)], header.size) != ERROR_NONE) {
+            break;
+        }
+        pos += Socket__Overflow_Len(header.size);
+    }
+
+    if (pos > 0) {
+        socket->overflowUsed -= pos;
+        __builtin_memmove(socket->overflow, &socket->overflow[pos], socket->overflowUsed);
+    }
+}
+
+static bool Socket__Overflow_Push(
+    Socket             *socket,
+    const Component_Id *recipient,
+    const void         *data,
+    uint32_t            size)
+{
+    uint32_t len = Socket__Overflow_Len(size);
+    if (!socket->overflow || (len > (socket->overflowSize - socket->overflowUsed))) {
+        return false;
+    }
+
+    Socket_Overflow_Header header = {
+        .recipient = *recipient,
+        .size      = size,
+    };
+    __builtin_memcpy(&socket->overflow[socket->overflowUsed], &header, sizeof(header));
+    __builtin_memcpy(&socket->overflow[socket->overflowUsed + sizeof(header)], data, size);
+    socket->overflowUsed += len;
+    return true;
+}
+
+// Helper function for the writes, writes a message to the ring buffer or
+// else, if overflow is set, the overflow buffer, keeping them in order.
+static int32_t Socket__Write_Flow(
+    Socket             *socket,
+    const Component_Id *recipient,
+    const void         *data,
+    uint32_t            size,
+    bool                overflow)
+{
+    if (size > RB_MAX_PAYLOAD_LEN) {
+        return ERROR_SOCKET_INSUFFICIENT_SPACE;
+    }
+
+    // A renegotiation can only time out when checked.
+    if (socket->state == SOCKET_STATE_NEGOTIATING) {
+        Socket_NegotiateStatus(socket);
+    }
+
+    // After a failed negotiation there's no ring buffer to write to until the
+    // next one, so messages aren't kept for it.
+    if (socket->state == SOCKET_STATE_DISCONNECTED) {
+        return ERROR_SOCKET_NEGOTIATION;
+    }
+
+    // Messages already waiting go first.
+    if (socket->overflowUsed > 0) {
+        Socket__Overflow_Drain(socket);
+    }
+
+    int32_t error = ERROR_SOCKET_INSUFFICIENT_SPACE;
+    if (socket->overflowUsed == 0) {
+        error = Socket__Write_Msg(socket, recipient, data, size);
+    }
+    if (error != ERROR_SOCKET_INSUFFICIENT_SPACE) {
+        return error;
+    }
+
+    socket->spaceWanted = true;
+    if (overflow && Socket__Overflow_Push(socket, recipient, data, size)) {
+        socket->stats.writeOverflowed++;
+        return ERROR_NONE;
+    }
+
+    return error;
+}
+
+int32_t Socket_Write(
+    Socket             *socket,
+    const Component_Id *recipient,
+    const void         *data,
+    uint32_t            size)
+{
+    if (!socket || !recipient || !data || (size == 0)) {
+        return ERROR_PARAMETER;
+    }
+
+    int32_t error = Socket__Write_Flow(socket, recipient, data, size, true);
+    if (error == ERROR_SOCKET_INSUFFICIENT_SPACE) {
+        socket->stats.writeDropped++;
+#if SOCKET_RING_STATS
+        socket->ringStats.txRejected++;
+#endif
+    }
+
+    return error;
+}
+
+int32_t Socket_WriteWait(
+    Socket             *socket,
+    const Component_Id *recipient,
+    const void         *data,
+    uint32_t            size,
+    uint32_t            timeout)
+{
+    if (!socket || !socket->clock || !recipient || !data || (size == 0)) {
+        return ERROR_PARAMETER;
+    }
+
+    // The message waits for the ring buffer, and only goes to the overflow
+    // buffer if the HLApp doesn't make space in time.
+    uint32_t start  = GPT_GetRunningTime(socket->clock, GPT_UNITS_MICROSEC);
+    uint32_t waited = 0;
+    int32_t  error;
+    while ((error = Socket__Write_Flow(socket, recipient, data, size, false))
+        == ERROR_SOCKET_INSUFFICIENT_SPACE) {
+        // Messages which can never fit aren't waited for.
+        if (size > RB_MAX_PAYLOAD_LEN) {
+            break;
+        }
+
+        waited = GPT_GetRunningTime(socket->clock, GPT_UNITS_MICROSEC) - start;
+        if (waited >= timeout) {
+            socket->stats.writeTimeouts++;
+            error = Socket__Write_Flow(socket, recipient, data, size, true);
+            break;
+        }
+    }
+
+    socket->stats.writeWaitTime += waited;
+    if (error == ERROR_SOCKET_INSUFFICIENT_SPACE) {
+        socket->stats.writeDropped++;
+#if SOCKET_RING_STATS
+        socket->ringStats.txRejected++;
+#endif
+    }
+
+    return error;
+}
+
+void Socket_SetClock(Socket *socket, GPT *clock)
+{
+    if (socket) {
+        socket->clock = clock;
+    }
+}
+
+int32_t Socket_SetOverflow(Socket *socket, void *buffer, uint32_t size)
+{
+    if (!socket || (!buffer && (size > 0)) ||
+        (((uintptr_t)buffer % sizeof(uint32_t)) != 0)) {
+        return ERROR_PARAMETER;
+    }
+
+    // Messages can't be dropped from a buffer being replaced.
+    if (socket->overflowUsed > 0) {
+        return ERROR_BUSY;
+    }
+
+    socket->overflow     = buffer;
+    socket->overflowSize = (size & ~3U);
+    return ERROR_NONE;
+}
+
+void Socket_DrainOverflow(Socket *socket)
+{
+    if (socket && (socket->overflowUsed > 0)) {
+        Socket__Overflow_Drain(socket);
+        if (socket->overflowUsed > 0) {
+            socket->spaceWanted = true;
+        }
+    }
+}
+
+uint32_t Socket_OverflowUsed(const Socket *socket)
+{
+    return (socket ? socket->overflowUsed : 0);
+}
+
+void Socket_SetSpaceCallback(Socket *socket, void (*space_cb)(Socket*))
+{
+    if (socket) {
+        socket->space_cb = space_cb;
+    }
+}
+
+void Socket_Cork(Socket *socket)
+{
+    if (socket) {
+        socket->corked = true;
+    }
+}
+
+void Socket_Uncork(Socket *socket)
+{
+    if (!socket) {
+        return;
+    }
+
+    socket->corked = false;
+    Socket_Flush(socket);
+}
+
+void Socket_Flush(Socket *socket)
+{
+    if (!socket) {
+        return;
+    }
+
+    uint32_t prevBasePri = NVIC_BlockIRQs();
+    Socket__Flush(socket);
+    NVIC_RestoreIRQs(prevBasePri);
+}
+
+int32_t Socket_SetCoalescing(
+    Socket   *socket,
+    uint32_t  bytes,
+    GPT      *timer,
+    uint32_t  timeout)
+{
+    if (!socket || (timer && (timeout == 0))) {
+        return ERROR_PARAMETER;
+    }
+
+    if (timer) {
+        int32_t error = GPT_SetMode(timer, GPT_MODE_ONE_SHOT);
+        if (error != ERROR_NONE) {
+            return error;
+        }
+    }
+
+    // Anything held back under the old limits is published first.
+    uint32_t prevBasePri = NVIC_BlockIRQs();
+    Socket__Flush(socket);
+    socket->coalesceBytes   = bytes;
+    socket->coalesceTimer   = timer;
+    socket->coalesceTimeout = timeout;
+    NVIC_RestoreIRQs(prevBasePri);
+
+    return ERROR_NONE;
+}
+
+int32_t Socket_SetNegotiateTimer(Socket *socket, GPT *timer)
+{
+    if (!socket) {
+        return ERROR_PARAMETER;
+    }
+
+    if (socket->state == SOCKET_STATE_NEGOTIATING) {
+        return ERROR_BUSY;
+    }
+
+    if (timer) {
+        int32_t error = GPT_SetMode(timer, GPT_MODE_ONE_SHOT);
+        if (error != ERROR_NONE) {
+            return error;
+        }
+    }
+
+    socket->negotiateTimer = timer;
+    return ERROR_NONE;
+}
+
+// Helper function for the reads. Reads data from the remote ring buffer,
+// and wraps around to start of buffer if required. Returns updated read position.
+static uint32_t Socket__Read_RB(
+    const Socket_Ringbuffer *rb, uint32_t startPos, void *dest, size_t size)
+{
+    uint32_t availToEnd = rb->capacity - startPos;
+
+    uint32_t readFromEnd = size;
+    // If the available data wraps around the end of the buffer then only read
+    // availToEnd bytes before subsequently reading from the start of the buffer.
+    if (size > availToEnd) {
+        readFromEnd = availToEnd;
+    }
+
+    uint8_t *dest8 = (uint8_t *)dest;
+    Socket__Copy(dest, &(rb->sharedData->data[startPos]), readFromEnd);
+
+    // If block wrapped around the end of the buffer, then read remainder from start.
+    Socket__Copy(dest8 + readFromEnd, &(rb->sharedData->data[0]), size - readFromEnd);
+
+    uint32_t finalPos = startPos + size;
+    if (finalPos > rb->capacity) {
+        finalPos -= rb->capacity;
+    }
+    return finalPos;
+}
+
+#if SOCKET_RING_STATS
+// Counts a message read from the remote ring buffer, with the data waiting
+// in it at the time.
+static void Socket__Stats_Read(
+    Socket   *socket,
+    uint32_t  remoteWritePosition,
+    uint32_t  localReadPosition,
+    uint32_t  nextReadPosition,
+    uint32_t  size)
+{
+    uint32_t used = remoteWritePosition - localReadPosition;
+    if (remoteWritePosition < localReadPosition) {
+        used += socket->ringRemote.capacity;
+    }
+
+    uint32_t prevBasePri = NVIC_BlockIRQs();
+    socket->ringStats.rxBytes += size;
+    socket->ringStats.rxMessages++;
+    if (nextReadPosition <= localReadPosition) {
+        socket->ringStats.rxWraps++;
+    }
+    if (used > socket->ringStats.rxPeak) {
+        socket->ringStats.rxPeak = used;
+    }
+    NVIC_RestoreIRQs(prevBasePri);
+}
+#endif
+
+// Uses up the stamps of messages the HLApp has read from the local ring buffer
+// since the last call, measuring how long each waited since it was committed.
+// This must be called from an interrupt, or with them blocked.
+static void Socket__Stats_Dequeued(Socket *socket)
+{
+#if SOCKET_RING_STATS
+    if ((socket->state != SOCKET_STATE_CONNECTED) || !socket->ringLocal.sharedData) {
+        return;
+    }
+
+    uint32_t remoteReadPosition;
+    __atomic_load(&(RB_READ_INDEX(socket->ringRemote)),
+        &remoteReadPosition, __ATOMIC_ACQUIRE);
+    uint32_t capacity = socket->ringLocal.capacity;
+    if ((remoteReadPosition >= capacity) ||
+        ((remoteReadPosition % RB_ALIGNMENT) != 0)) {
+        return;
+    }
+
+    // Every stamp ends between the last position checked and the write
+    // position, as this is called before each new one is taken, so distances
+    // from the last position checked tell which the HLApp has passed.
+    uint32_t now = (socket->clock ?
+        GPT_GetRunningTime(socket->clock, GPT_UNITS_MICROSEC) : 0);
+    uint32_t read = ((remoteReadPosition + capacity - socket->ringStatsPosition) % capacity);
+    while (socket->latencyStamped > 0) {
+        uint32_t end  = socket->latencyStamps[socket->latencyFirst].end;
+        uint32_t time = socket->latencyStamps[socket->latencyFirst].time;
+        if (((end + capacity - socket->ringStatsPosition) % capacity) > read) {
+            break;
+        }
+
+        // Without a clock now, the stamp is dropped unmeasured.
+        if (socket->clock) {
+            uint32_t latency = now - time;
+            Socket_RingStats *stats = &(socket->ringStats);
+            if ((stats->latencyCount == 0) || (latency < stats->latencyMin)) {
+                stats->latencyMin = latency;
+            }
+            if (latency > stats->latencyMax) {
+                stats->latencyMax = latency;
+            }
+            stats->latencyTotal += latency;
+            stats->latencyCount++;
+        }
+
+        socket->latencyFirst = ((socket->latencyFirst + 1) % SOCKET_LATENCY_STAMPS);
+        socket->latencyStamped--;
+    }
+
+    socket->ringStatsPosition = remoteReadPosition;
+#else
+    (void)socket;
+#endif
+}
+
+// Helper function for the reads. Finds the block at localReadPosition, if
+// it's complete before remoteWritePosition, and returns where the next one
+// starts in nextPosition.
+static int32_t Socket__Peek(
+    Socket         *socket,
+    uint32_t        remoteWritePosition,
+    uint32_t        localReadPosition,
+    Component_Id   *sender,
+    Socket_Payload *payload,
+    uint32_t       *nextPosition)
+{
+    // Sanity check read and write positions.
+    if ((remoteWritePosition >= socket->ringRemote.capacity) ||
+        ((remoteWritePosition % RB_ALIGNMENT) != 0) ||
+        (localReadPosition >= socket->ringRemote.capacity) ||
+        ((localReadPosition % RB_ALIGNMENT) != 0)) {
+        return ERROR_SOCKET_INSUFFICIENT_SPACE;
+    }
+
+    // Get the maximum amount of available data. The actual block size may be
+    // smaller than this.
+
+    uint32_t availData;
+    // If data is contiguous in buffer then difference between write and read positions...
+    if (remoteWritePosition >= localReadPosition) {
+        availData = remoteWritePosition - localReadPosition;
+    }
+    // ...else data wraps around end and resumes at start of buffer
+    else {
         availData = remoteWritePosition - localReadPosition + socket->ringRemote.capacity;
     }
 
@@ -417,7 +1331,7 @@ int32_t Socket_Read(
 
     // The block size followed by the actual block can be no longer than the available data.
     uint32_t blockSize;
-    localReadPosition = Socket__Read_RB(
+    uint32_t position = Socket__Read_RB(
         &(socket->ringRemote), localReadPosition, &blockSize, sizeof(blockSize));
     uint32_t totalBlockSize;
 
@@ -430,33 +1344,170 @@ int32_t Socket_Read(
         return ERROR_SOCKET_INSUFFICIENT_SPACE;
     }
 
+    // Read the sender. The header may wraparound to the start of the buffer.
+    Socket__Read_RB(&(socket->ringRemote), position, sender, sizeof(Component_Id));
+    position = Socket__Advance_RB(
+        &(socket->ringRemote), position, sizeof(Socket_Msg_Header));
+
+    // The payload excludes the component ID and reserved word.
+    Socket__Payload_RB(&(socket->ringRemote), position,
+        blockSize - sizeof(Socket_Msg_Header), payload);
+
+    // Align read position to next possible location for next buffer.
+    // This may wrap around.
+    uint32_t nextReadPosition = RoundUp(localReadPosition + totalBlockSize, RB_ALIGNMENT);
+    if (nextReadPosition >= socket->ringRemote.capacity) {
+        nextReadPosition -= socket->ringRemote.capacity;
+    }
+    *nextPosition = nextReadPosition;
+
+    return ERROR_NONE;
+}
+
+int32_t Socket_ReadPeek(
+    Socket         *socket,
+    Component_Id   *sender,
+    Socket_Payload *payload)
+{
+    if (!socket || !sender || !payload) {
+        return ERROR_PARAMETER;
+    }
+    if (socket->state != SOCKET_STATE_CONNECTED) {
+        return ERROR_SOCKET_INSUFFICIENT_SPACE;
+    }
+
+    // Don't read message content until have seen that remote write position has been updated.
+    // Corresponding release occurs on high-level core.
+    uint32_t remoteWritePosition;
+    __atomic_load(&(RB_WRITE_INDEX(socket->ringRemote)), &remoteWritePosition, __ATOMIC_ACQUIRE);
+    // Last position read from by this RTApp.
+    uint32_t localReadPosition = RB_READ_INDEX(socket->ringLocal);
+
+    int32_t error = Socket__Peek(socket, remoteWritePosition, localReadPosition,
+        sender, payload, &(socket->readReleasePosition));
+    if (error != ERROR_NONE) {
+        return error;
+    }
+
+    socket->readPeeked = true;
+#if SOCKET_RING_STATS
+    socket->readPeekSize = payload->size[0] + payload->size[1];
+#endif
+
+    return ERROR_NONE;
+}
+
+int32_t Socket_ReadRelease(Socket *socket)
+{
+    if (!socket || !socket->readPeeked) {
+        return ERROR_PARAMETER;
+    }
+
+    socket->readPeeked = false;
+
+#if SOCKET_RING_STATS
+    uint32_t remoteWritePosition;
+    __atomic_load(&(RB_WRITE_INDEX(socket->ringRemote)), &remoteWritePosition, __ATOMIC_ACQUIRE);
+    Socket__Stats_Read(socket, remoteWritePosition, RB_READ_INDEX(socket->ringLocal),
+        socket->readReleasePosition, socket->readPeekSize);
+#endif
+
+    // The message content must have been retrieved before the high-level core
+    // sees the read position has been updated. Corresponding acquire occurs
+    // on high-level core.
+    __atomic_store(
+        &(RB_READ_INDEX(socket->ringLocal)),
+        &(socket->readReleasePosition), __ATOMIC_RELEASE);
+
+    Socket__Signal(socket, SOCKET_PORT_MSG_RECV);
+
+    return ERROR_NONE;
+}
+
+int32_t Socket_Read(
+    Socket       *socket,
+    Component_Id *sender,
+    void         *data,
+    uint32_t     *size)
+{
+    if (!socket || !sender || !data || !size) {
+        return ERROR_PARAMETER;
+    }
+
+    Socket_Payload payload;
+    int32_t error = Socket_ReadPeek(socket, sender, &payload);
+    if (error != ERROR_NONE) {
+        return error;
+    }
+
     // The caller-supplied buffer must be large enough to contain the
-    // payload in the buffer, excluding component ID and reserved word.
-    size_t senderPayloadSize = blockSize - sizeof(Socket_Msg_Header);
+    // payload, the message is left in the ring buffer if it isn't.
+    uint32_t senderPayloadSize = payload.size[0] + payload.size[1];
     if (senderPayloadSize > *size) {
+        socket->readPeeked = false;
         return ERROR_SOCKET_INSUFFICIENT_SPACE;
     }
 
     // Tell the caller the actual block size.
     *size = senderPayloadSize;
 
-    // Read the sender header. This may wraparound to the start of the buffer.
-    localReadPosition = Socket__Read_RB(
-        &(socket->ringRemote), localReadPosition,
-        sender, sizeof(Socket_Msg_Header));
-
     // Read data
-    localReadPosition = Socket__Read_RB(
-        &(socket->ringRemote),
-        localReadPosition, data, senderPayloadSize);
+    uint8_t *dest8 = (uint8_t *)data;
+    Socket__Copy(dest8, payload.data[0], payload.size[0]);
+    Socket__Copy(dest8 + payload.size[0], payload.data[1], payload.size[1]);
 
-    // Align read position to next possible location for next buffer.
-    // This may wrap around.
-    localReadPosition = RoundUp(localReadPosition, RB_ALIGNMENT);
-    if (localReadPosition >= socket->ringRemote.capacity) {
-        localReadPosition -= socket->ringRemote.capacity;
+    return Socket_ReadRelease(socket);
+}
+
+
+int32_t Socket_ForEachMessage(
+    Socket    *socket,
+    void     (*cb)(Socket*, const Component_Id*, const Socket_Payload*, void*),
+    void      *user_data,
+    uint32_t  *count)
+{
+    if (!socket || !cb) {
+        return ERROR_PARAMETER;
+    }
+
+    if (socket->state != SOCKET_STATE_CONNECTED) {
+        if (count) {
+            *count = 0;
+        }
+        return ERROR_NONE;
+    }
+
+    // Only messages already published when called are read, so that a fast
+    // sender can't keep this from returning.
+    uint32_t remoteWritePosition;
+    __atomic_load(&(RB_WRITE_INDEX(socket->ringRemote)), &remoteWritePosition, __ATOMIC_ACQUIRE);
+    uint32_t localReadPosition = RB_READ_INDEX(socket->ringLocal);
+
+    uint32_t       messages = 0;
+    Component_Id   sender;
+    Socket_Payload payload;
+    uint32_t       nextReadPosition;
+    while (Socket__Peek(socket, remoteWritePosition, localReadPosition,
+        &sender, &payload, &nextReadPosition) == ERROR_NONE) {
+#if SOCKET_RING_STATS
+        Socket__Stats_Read(socket, remoteWritePosition, localReadPosition,
+            nextReadPosition, payload.size[0] + payload.size[1]);
+#endif
+        cb(socket, &sender, &payload, user_data);
+        localReadPosition = nextReadPosition;
+        messages++;
     }
 
+    if (count) {
+        *count = messages;
+    }
+
+    if (messages == 0) {
+        return ERROR_NONE;
+    }
+
+    socket->readPeeked = false;
+
     // The message content must have been retrieved before the high-level core
     // sees the read position has been updated. Corresponding acquire occurs
     // on high-level core.
@@ -468,3 +1519,124 @@ int32_t Socket_Read(
 
     return ERROR_NONE;
 }
+
+void Socket_GetStats(const Socket *socket, Socket_Stats *stats)
+{
+    if (socket && stats) {
+        *stats = socket->stats;
+    }
+}
+
+void Socket_ResetStats(Socket *socket)
+{
+    if (socket) {
+        uint32_t prevBasePri = NVIC_BlockIRQs();
+        __builtin_memset(&socket->stats, 0, sizeof(socket->stats));
+        NVIC_RestoreIRQs(prevBasePri);
+    }
+}
+
+int32_t Socket_GetRingStats(const Socket *socket, Socket_RingStats *stats)
+{
+    if (!socket || !stats) {
+        return ERROR_PARAMETER;
+    }
+
+#if SOCKET_RING_STATS
+    // The latency is measured from the mailbox interrupt.
+    uint32_t prevBasePri = NVIC_BlockIRQs();
+    *stats = socket->ringStats;
+    NVIC_RestoreIRQs(prevBasePri);
+
+    stats->txCapacity = socket->ringLocal.capacity;
+    stats->rxCapacity = socket->ringRemote.capacity;
+    return ERROR_NONE;
+#else
+    return ERROR_UNSUPPORTED;
+#endif
+}
+
+void Socket_ResetRingStats(Socket *socket)
+{
+#if SOCKET_RING_STATS
+    if (socket) {
+        uint32_t prevBasePri = NVIC_BlockIRQs();
+        __builtin_memset(&socket->ringStats, 0, sizeof(socket->ringStats));
+        NVIC_RestoreIRQs(prevBasePri);
+    }
+#else
+    (void)socket;
+#endif
+}
+
+
+
+void Socket_PayloadWrite(
+    const Socket_Payload *payload, uint32_t offset, const void *src, uint32_t size)
+{
+    if (!payload || !src) {
+        return;
+    }
+
+    const uint8_t *src8 = (const uint8_t *)src;
+    for (unsigned i = 0; (i < 2) && (size > 0); i++) {
+        if (offset >= payload->size[i]) {
+            offset -= payload->size[i];
+            continue;
+        }
+
+        uint32_t len = payload->size[i] - offset;
+        if (len > size) {
+            len = size;
+        }
+        Socket__Copy(&payload->data[i][offset], src8, len);
+        src8  += len;
+        size  -= len;
+        offset = 0;
+    }
+}
+
+void Socket_PayloadRead(
+    const Socket_Payload *payload, uint32_t offset, void *dest, uint32_t size)
+{
+    if (!payload || !dest) {
+        return;
+    }
+
+    uint8_t *dest8 = (uint8_t *)dest;
+    for (unsigned i = 0; (i < 2) && (size > 0); i++) {
+        if (offset >= payload->size[i]) {
+            offset -= payload->size[i];
+            continue;
+        }
+
+        uint32_t len = payload->size[i] - offset;
+        if (len > size) {
+            len = size;
+        }
+        Socket__Copy(dest8, &payload->data[i][offset], len);
+        dest8 += len;
+        size  -= len;
+        offset = 0;
+    }
+}
+
+void Socket_PayloadSkip(Socket_Payload *payload, uint32_t offset)
+{
+    if (!payload) {
+        return;
+    }
+
+    if (offset >= payload->size[0]) {
+        offset -= payload->size[0];
+        if (offset > payload->size[1]) {
+            offset = payload->size[1];
+        }
+        payload->data[0] = payload->data[1] + offset;
+        payload->size[0] = payload->size[1] - offset;
+        payload->size[1] = 0;
+    } else {
+        payload->data[0] += offset;
+        payload->size[0] -= offset;
+    }
+}
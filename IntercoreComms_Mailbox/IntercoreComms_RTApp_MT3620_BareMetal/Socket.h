@@ -7,6 +7,7 @@
 
 #include "lib/Common.h"
 #include "lib/Platform.h"
+#include "lib/GPT.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -29,6 +30,9 @@ extern "C" {
 /// Returned when negotiation fails.</summary>
 #define ERROR_SOCKET_NEGOTIATION        (ERROR_SPECIFIC - 2)
 
+/// Largest payload which can be sent in one message.
+#define SOCKET_MAX_PAYLOAD_LEN 1040
+
 typedef struct Socket Socket;
 
 /// When sending a message, this is the recipient HLApp's component ID.
@@ -44,11 +48,98 @@ typedef struct {
     uint8_t  seg_3_4[8];
 } Component_Id;
 
+/// A payload in place in a ring buffer. It's split in two where it wraps
+/// around the end of the buffer, otherwise the second part is empty.
+typedef struct {
+    uint8_t  *data[2];
+    uint32_t  size[2];
+} Socket_Payload;
+
+typedef struct {
+    /// Messages committed to the local ring buffer, and the MSG_SENT
+    /// interrupts raised to publish them to the HLApp.
+    uint32_t writeMessages;
+    uint32_t writeSignals;
+    /// Writes refused for lack of space, so dropped unless the caller
+    /// retries, and messages which waited in the overflow buffer instead.
+    uint32_t writeDropped;
+    uint32_t writeOverflowed;
+    /// Calls to Socket_WriteWait which timed out, and the total time spent
+    /// waiting in it in microseconds.
+    uint32_t writeTimeouts;
+    uint32_t writeWaitTime;
+} Socket_Stats;
+
+/// Set to 0 to leave out the ring buffer statistics, which take a little
+/// time for each message.
+#ifndef SOCKET_RING_STATS
+#define SOCKET_RING_STATS 1
+#endif
+
+/// Most messages waiting to be read at once whose latency can be measured,
+/// each takes 8 bytes in the socket.
+#ifndef SOCKET_LATENCY_STAMPS
+#define SOCKET_LATENCY_STAMPS 32
+#endif
+
+typedef struct {
+    /// Payload bytes and messages written to the local ring buffer, and
+    /// read from the HLApp's.
+    uint32_t txBytes;
+    uint32_t txMessages;
+    uint32_t rxBytes;
+    uint32_t rxMessages;
+    /// Most bytes in use at once in each ring buffer, out of its capacity.
+    uint32_t txPeak;
+    uint32_t txCapacity;
+    uint32_t rxPeak;
+    uint32_t rxCapacity;
+    /// Messages after which the position wrapped back to the start.
+    uint32_t txWraps;
+    uint32_t rxWraps;
+    /// Messages Socket_Write or Socket_WriteWait refused for lack of space,
+    /// once per message however often Socket_WriteWait retried it. Messages
+    /// held in the overflow buffer aren't counted.
+    uint32_t txRejected;
+    /// Time in microseconds from a message being committed to the HLApp
+    /// reading it, for messages committed while a clock was set and fewer
+    /// than SOCKET_LATENCY_STAMPS others were waiting to be read. It's
+    /// measured on the interrupt the HLApp raises after reading, or the next
+    /// commit if that comes first.
+    uint32_t latencyCount;
+    uint32_t latencyMin;
+    uint32_t latencyMax;
+    uint64_t latencyTotal;
+} Socket_RingStats;
+
 Socket* Socket_Open(void (*rx_cb)(Socket*));
 int32_t Socket_Close(Socket *socket);
 
+/// Opens a socket which reads back what it writes, through a ring buffer in
+/// the given memory rather than one shared with the HLApp. This exercises the
+/// ring buffer protocol without a partner core. The buffer must be 16-byte
+/// aligned, and rx_cb is optional and called on each publish.
+Socket* Socket_OpenLoopback(void *buffer, uint32_t size, void (*rx_cb)(Socket*));
+
 bool    Socket_NegotiationPending(Socket *socket);
 int32_t Socket_Negotiate(Socket *socket);
+/// Renegotiates without blocking, for use once Socket_NegotiationPending.
+/// This completes from the mailbox FIFO interrupt once the HLApp's ring
+/// buffer descriptors arrive, or fails after timeout microseconds unless it's
+/// zero. That's from the negotiation timer's interrupt if one is set, or else
+/// when next checked if there's a clock. Meanwhile nothing is read, messages
+/// written wait in the overflow buffer or else are refused, and once it's
+/// over the space callback is called. After it fails, writes are refused
+/// with ERROR_SOCKET_NEGOTIATION until the next negotiation succeeds.
+/// Returns as Socket_NegotiateStatus.
+int32_t Socket_NegotiateStart(Socket *socket, uint32_t timeout);
+/// Returns ERROR_BUSY while negotiating, ERROR_SOCKET_NEGOTIATION if the
+/// last negotiation failed, otherwise ERROR_NONE.
+int32_t Socket_NegotiateStatus(Socket *socket);
+/// Sets an optional timer for Socket_NegotiateStart's timeout, used in
+/// one-shot mode. It may be the coalescing timer, which isn't needed while
+/// negotiating.
+int32_t Socket_SetNegotiateTimer(Socket *socket, GPT *timer);
 
 void Socket_Reset(Socket *socket);
 
@@ -57,12 +148,109 @@ int32_t Socket_Write(
     const Component_Id *recipient,
     const void         *data,
     uint32_t            size);
+
+/// As Socket_Write, but waits up to timeout microseconds for the HLApp to
+/// make space in the ring buffer, and only then falls back to the overflow
+/// buffer. This needs a clock to be set.
+int32_t Socket_WriteWait(
+    Socket             *socket,
+    const Component_Id *recipient,
+    const void         *data,
+    uint32_t            size,
+    uint32_t            timeout);
+
+/// Sets a free running timer used to measure time.
+void    Socket_SetClock(Socket *socket, GPT *clock);
+
+/// Gives Socket_Write a word aligned buffer to hold messages which don't fit
+/// in the ring buffer, rather than refusing them. They're written in order
+/// ahead of later messages by the next Socket_Write or Socket_DrainOverflow.
+int32_t  Socket_SetOverflow(Socket *socket, void *buffer, uint32_t size);
+void     Socket_DrainOverflow(Socket *socket);
+uint32_t Socket_OverflowUsed(const Socket *socket);
+
+/// Sets a callback to be told, from the mailbox interrupt, when the HLApp may
+/// have made space after a write was refused or overflowed.
+void    Socket_SetSpaceCallback(Socket *socket, void (*space_cb)(Socket*));
+
+/// Returns the room for payload left in the ring buffer, though a single
+/// message is still limited to SOCKET_MAX_PAYLOAD_LEN.
+uint32_t Socket_WriteSpace(const Socket *socket);
+
+/// While corked, written messages are held back in the ring buffer and
+/// Socket_Uncork publishes them all with a single interrupt to the HLApp.
+/// Socket_Flush publishes held messages without uncorking.
+void    Socket_Cork(Socket *socket);
+void    Socket_Uncork(Socket *socket);
+void    Socket_Flush(Socket *socket);
+
+/// Holds back written messages until bytes of payload are waiting, or until
+/// timeout microseconds after the first of them was written. Either limit can
+/// be zero to disable it, the timer is optional and is used in one-shot mode.
+/// Neither limit applies while the socket is corked, held messages are then
+/// only published by Socket_Uncork, Socket_Flush or the ring filling up.
+int32_t Socket_SetCoalescing(
+    Socket   *socket,
+    uint32_t  bytes,
+    GPT      *timer,
+    uint32_t  timeout);
+
+/// Reserves room for a payload of up to size bytes in the local ring buffer,
+/// so that it can be built in place rather than copied in by Socket_Write.
+/// Only one message can be reserved at a time, and nothing else can be
+/// written until it's committed. Committing a smaller size than was reserved
+/// shortens the message, and committing zero bytes abandons it. Messages in
+/// the overflow buffer are written first, and while any are left there the
+/// reservation is refused with ERROR_SOCKET_INSUFFICIENT_SPACE.
+int32_t Socket_WriteReserve(
+    Socket             *socket,
+    const Component_Id *recipient,
+    uint32_t            size,
+    Socket_Payload     *payload);
+int32_t Socket_WriteCommit(Socket *socket, uint32_t size);
+
 int32_t Socket_Read(
     Socket       *socket,
     Component_Id *sender,
     void         *data,
     uint32_t     *size);
 
+/// Finds the next message in the remote ring buffer without copying it out,
+/// the payload must only be read and stays valid until Socket_ReadRelease
+/// hands its space back to the HLApp. Peeking again before releasing returns
+/// the same message.
+int32_t Socket_ReadPeek(
+    Socket         *socket,
+    Component_Id   *sender,
+    Socket_Payload *payload);
+int32_t Socket_ReadRelease(Socket *socket);
+
+/// Calls cb on every message waiting in the remote ring buffer when called,
+/// in place as with Socket_ReadPeek, then hands all their space back to the
+/// HLApp at once with a single interrupt. Messages arriving meanwhile are
+/// left for the next call. The number of messages read is returned in count,
+/// which is optional.
+int32_t Socket_ForEachMessage(
+    Socket    *socket,
+    void     (*cb)(Socket*, const Component_Id*, const Socket_Payload*, void*),
+    void      *user_data,
+    uint32_t  *count);
+
+/// Helpers to copy to or from a payload from offset onwards, dealing with the
+/// split where it wraps, and to drop the first offset bytes of a payload.
+void Socket_PayloadWrite(
+    const Socket_Payload *payload, uint32_t offset, const void *src, uint32_t size);
+void Socket_PayloadRead(
+    const Socket_Payload *payload, uint32_t offset, void *dest, uint32_t size);
+void Socket_PayloadSkip(Socket_Payload *payload, uint32_t offset);
+
+void Socket_GetStats(const Socket *socket, Socket_Stats *stats);
+void Socket_ResetStats(Socket *socket);
+
+/// Returns ERROR_UNSUPPORTED when built without SOCKET_RING_STATS.
+int32_t Socket_GetRingStats(const Socket *socket, Socket_RingStats *stats);
+void    Socket_ResetRingStats(Socket *socket);
+
 #ifdef __cplusplus
 }
 #endif
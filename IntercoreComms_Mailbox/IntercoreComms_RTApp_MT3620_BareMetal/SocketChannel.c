@@ -0,0 +1,296 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "SocketChannel.h"
+
+// This is the maximum number of channels which can be opened at once.
+#define SOCKET_CHANNEL_MAX      4
+// Bytes of the ring buffer each priority level leaves free for those above.
+#define SOCKET_CHANNEL_HEADROOM 256
+// Marks where the queue wraps back to the start.
+#define SOCKET_CHANNEL_WRAP     0xFFFFFFFF
+
+struct SocketChannel {
+    Socket              *socket;
+    uint8_t              id;
+    uint8_t              priority;
+    Component_Id         recipient;
+    void               (*rx_cb)(SocketChannel*, const Component_Id*, const Socket_Payload*);
+
+    // Each queued message is its size followed by its data, padded to a
+    // word, and messages don't wrap.
+    uint8_t             *queue;
+    uint32_t             queueSize;
+    uint32_t             head;
+    uint32_t             tail;
+    uint32_t             count;
+
+    SocketChannel_Stats  stats;
+};
+
+static SocketChannel SocketChannels[SOCKET_CHANNEL_MAX] = {0};
+
+static uint32_t SocketChannel__RecordLen(uint32_t size)
+{
+    return (sizeof(uint32_t) + size + 3) & ~3U;
+}
+
+static bool SocketChannel__Push(SocketChannel *channel, const void *data, uint32_t size)
+{
+    uint32_t need = SocketChannel__RecordLen(size);
+    if (channel->count == 0) {
+        channel->head = 0;
+        channel->tail = 0;
+    }
+
+    uint32_t pos = channel->tail;
+    if ((channel->count > 0) && (channel->tail <= channel->head)) {
+        // The queue has wrapped, so the free space lies between tail and head.
+        if ((channel->head - channel->tail) < need) {
+            return false;
+        }
+    } else if ((channel->queueSize - channel->tail) < need) {
+        if (channel->head < need) {
+            return false;
+        }
+        if ((channel->queueSize - channel->tail) >= sizeof(uint32_t)) {
+            uint32_t wrap = SOCKET_CHANNEL_WRAP;
+            __builtin_memcpy(&channel->queue[channel->tail], &wrap, sizeof(wrap));
+        }
+        pos = 0;
+    }
+
+    __builtin_memcpy(&channel->queue[pos], &size, sizeof(size));
+    __builtin_memcpy(&channel->queue[pos + sizeof(size)], data, size);
+    channel->tail = pos + need;
+    channel->count++;
+    return true;
+}
+
+static const uint8_t *SocketChannel__Front(SocketChannel *channel, uint32_t *size)
+{
+    if (channel->count == 0) {
+        return NULL;
+    }
+
+    if ((channel->queueSize - channel->head) >= sizeof(uint32_t)) {
+        __builtin_memcpy(size, &channel->queue[channel->head], sizeof(*size));
+    }
+    if (((channel->queueSize - channel->head) < sizeof(uint32_t))
+        || (*size == SOCKET_CHANNEL_WRAP)) {
+        channel->head = 0;
+        __builtin_memcpy(size, &channel->queue[0], sizeof(*size));
+    }
+
+    return &channel->queue[channel->head + sizeof(uint32_t)];
+}
+
+static void SocketChannel__Pop(SocketChannel *channel, uint32_t size)
+{
+    channel->head += SocketChannel__RecordLen(size);
+    channel->count--;
+}
+
+static int32_t SocketChannel__Send(SocketChannel *channel, const void *data, uint32_t size)
+{
+    // Lower priority channels leave room for the ones above them.
+    uint32_t headroom = (channel->priority * SOCKET_CHANNEL_HEADROOM);
+    if (Socket_WriteSpace(channel->socket) < (sizeof(SocketChannel_Header) + size + headroom)) {
+        return ERROR_SOCKET_INSUFFICIENT_SPACE;
+    }
+
+    Socket_Payload payload;
+    int32_t error = Socket_WriteReserve(channel->socket, &channel->recipient,
+        (sizeof(SocketChannel_Header) + size), &payload);
+    if (error != ERROR_NONE) {
+        return error;
+    }
+
+    SocketChannel_Header header = {
+        .magic    = SOCKET_CHANNEL_MAGIC,
+        .channel  = channel->id,
+        .priority = channel->priority,
+    };
+    Socket_PayloadWrite(&payload, 0, &header, sizeof(header));
+    Socket_PayloadWrite(&payload, sizeof(header), data, size);
+
+    error = Socket_WriteCommit(channel->socket, (sizeof(SocketChannel_Header) + size));
+    if (error == ERROR_NONE) {
+        channel->stats.sent++;
+    }
+    return error;
+}
+
+
+SocketChannel *SocketChannel_Open(
+    Socket             *socket,
+    uint8_t             id,
+    uint8_t             priority,
+    const Component_Id *recipient,
+    void               *queue,
+    uint32_t            queueSize,
+    void              (*rx_cb)(SocketChannel*, const Component_Id*, const Socket_Payload*))
+{
+    if (!socket || !recipient || (!queue && (queueSize > 0))
+        || (((uintptr_t)queue % sizeof(uint32_t)) != 0)) {
+        return NULL;
+    }
+
+    SocketChannel *channel = NULL;
+    unsigned i;
+    for (i = 0; i < SOCKET_CHANNEL_MAX; i++) {
+        if (!SocketChannels[i].socket) {
+            if (!channel) {
+                channel = &SocketChannels[i];
+            }
+        } else if ((SocketChannels[i].socket == socket) && (SocketChannels[i].id == id)) {
+            return NULL;
+        }
+    }
+    if (!channel) {
+        return NULL;
+    }
+
+    __builtin_memset(channel, 0, sizeof(*channel));
+    channel->socket    = socket;
+    channel->id        = id;
+    channel->priority  = priority;
+    channel->recipient = *recipient;
+    channel->rx_cb     = rx_cb;
+    channel->queue     = queue;
+    channel->queueSize = (queueSize & ~3U);
+    return channel;
+}
+
+
+void SocketChannel_Close(SocketChannel *channel)
+{
+    if (channel) {
+        channel->socket = NULL;
+    }
+}
+
+
+int32_t SocketChannel_Write(SocketChannel *channel, const void *data, uint32_t size)
+{
+    if (!channel || !channel->socket || !data || (size == 0)) {
+        return ERROR_PARAMETER;
+    }
+
+    if (size > SOCKET_CHANNEL_PAYLOAD_LEN) {
+        return ERROR_SOCKET_INSUFFICIENT_SPACE;
+    }
+
+    // Queued messages go first, which keeps each channel in order.
+    SocketChannel_Pump(channel->socket);
+    if ((channel->count == 0)
+        && (SocketChannel__Send(channel, data, size) == ERROR_NONE)) {
+        return ERROR_NONE;
+    }
+
+    if (!channel->queue || !SocketChannel__Push(channel, data, size)) {
+        channel->stats.rejected++;
+        return ERROR_SOCKET_INSUFFICIENT_SPACE;
+    }
+
+    return ERROR_NONE;
+}
+
+
+void SocketChannel_Pump(Socket *socket)
+{
+    bool visited[SOCKET_CHANNEL_MAX] = {false};
+
+    // There are few channels, so they're found in priority order each time.
+    unsigned n;
+    for (n = 0; n < SOCKET_CHANNEL_MAX; n++) {
+        SocketChannel *channel = NULL;
+        unsigned i, next = 0;
+        for (i = 0; i < SOCKET_CHANNEL_MAX; i++) {
+            if (visited[i] || (SocketChannels[i].socket != socket)) {
+                continue;
+            }
+            if (!channel || (SocketChannels[i].priority < channel->priority)) {
+                channel = &SocketChannels[i];
+                next    = i;
+            }
+        }
+        if (!channel) {
+            return;
+        }
+        visited[next] = true;
+
+        const uint8_t *data;
+        uint32_t       size;
+        while ((data = SocketChannel__Front(channel, &size))) {
+            // Lower priority channels wait until this one's queue is empty.
+            if (SocketChannel__Send(channel, data, size) != ERROR_NONE) {
+                return;
+            }
+            SocketChannel__Pop(channel, size);
+            channel->stats.queued++;
+        }
+    }
+}
+
+
+uint32_t SocketChannel_Queued(const SocketChannel *channel)
+{
+    return (channel ? channel->count : 0);
+}
+
+
+bool SocketChannel_Receive(
+    Socket               *socket,
+    const Component_Id   *sender,
+    const Socket_Payload *payload)
+{
+    if (!socket || !sender || !payload) {
+        return false;
+    }
+
+    SocketChannel_Header header;
+    if ((payload->size[0] + payload->size[1]) < sizeof(header)) {
+        return false;
+    }
+
+    Socket_PayloadRead(payload, 0, &header, sizeof(header));
+    if (header.magic != SOCKET_CHANNEL_MAGIC) {
+        return false;
+    }
+
+    // Messages for channels which aren't open are dropped.
+    unsigned i;
+    for (i = 0; i < SOCKET_CHANNEL_MAX; i++) {
+        SocketChannel *channel = &SocketChannels[i];
+        if ((channel->socket != socket) || (channel->id != header.channel)) {
+            continue;
+        }
+
+        channel->stats.received++;
+        if (channel->rx_cb) {
+            Socket_Payload body = *payload;
+            Socket_PayloadSkip(&body, sizeof(header));
+            channel->rx_cb(channel, sender, &body);
+        }
+        break;
+    }
+
+    return true;
+}
+
+
+void SocketChannel_GetStats(const SocketChannel *channel, SocketChannel_Stats *stats)
+{
+    if (channel && stats) {
+        *stats = channel->stats;
+    }
+}
+
+
+void SocketChannel_ResetStats(SocketChannel *channel)
+{
+    if (channel) {
+        __builtin_memset(&channel->stats, 0, sizeof(channel->stats));
+    }
+}
@@ -0,0 +1,77 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef SOCKET_CHANNEL_H_
+#define SOCKET_CHANNEL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "Socket.h"
+
+// Carries several logical channels over one Socket, each message starting
+// with a SocketChannel_Header giving its channel. Each channel has its own
+// receive callback, and its own queue for messages which can't be written
+// to the ring buffer yet, which when full refuses further writes on that
+// channel only.
+//
+// Channels have a priority, 0 being the highest. Queued messages are written
+// highest priority first, and lower priority channels leave room in the ring
+// buffer for higher ones, so that control messages aren't held up behind
+// bulk data waiting to be sent.
+
+#define SOCKET_CHANNEL_MAGIC 0x4c4e4843 // "CHNL"
+
+typedef struct {
+    uint32_t magic;
+    uint8_t  channel;
+    uint8_t  priority;
+    uint16_t reserved;
+} SocketChannel_Header;
+
+#define SOCKET_CHANNEL_PAYLOAD_LEN (SOCKET_MAX_PAYLOAD_LEN - sizeof(SocketChannel_Header))
+
+typedef struct SocketChannel SocketChannel;
+
+typedef struct {
+    // Messages written to the ring buffer, and of those the ones which had
+    // to wait in the channel's queue first.
+    uint32_t sent;
+    uint32_t queued;
+    // Writes refused as the channel's queue was full.
+    uint32_t rejected;
+    uint32_t received;
+} SocketChannel_Stats;
+
+// The queue holds messages waiting to be written, it's optional and must be
+// word aligned. Messages are sent to recipient.
+SocketChannel *SocketChannel_Open(
+    Socket             *socket,
+    uint8_t             id,
+    uint8_t             priority,
+    const Component_Id *recipient,
+    void               *queue,
+    uint32_t            queueSize,
+    void              (*rx_cb)(SocketChannel*, const Component_Id*, const Socket_Payload*));
+void           SocketChannel_Close(SocketChannel *channel);
+
+// Writes a message, or queues it if the ring buffer is too full. Returns
+// ERROR_SOCKET_INSUFFICIENT_SPACE if it could do neither.
+int32_t        SocketChannel_Write(SocketChannel *channel, const void *data, uint32_t size);
+// Writes as many queued messages as fit, this should be called whenever the
+// HLApp may have made room in the ring buffer.
+void           SocketChannel_Pump(Socket *socket);
+// Returns the number of messages waiting in the channel's queue.
+uint32_t       SocketChannel_Queued(const SocketChannel *channel);
+
+// Takes a message read from the socket and passes it to its channel, returns
+// false if it isn't a channel message and so should be handled by the caller.
+bool           SocketChannel_Receive(
+    Socket               *socket,
+    const Component_Id   *sender,
+    const Socket_Payload *payload);
+
+void           SocketChannel_GetStats(const SocketChannel *channel, SocketChannel_Stats *stats);
+void           SocketChannel_ResetStats(SocketChannel *channel);
+
+#endif // #ifndef SOCKET_CHANNEL_H_
@@ -0,0 +1,263 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "SocketStream.h"
+
+// This is the maximum number of streams which can be opened at once.
+#define SOCKET_STREAM_MAX 1
+
+struct SocketStream {
+    Socket             *socket;
+    void              (*rx_cb)(SocketStream*, const Component_Id*, const void*, uint32_t);
+
+    // Payload being sent.
+    bool                sending;
+    Component_Id        sendRecipient;
+    const uint8_t      *sendData;
+    uint32_t            sendSize;
+    uint32_t            sendOffset;
+    uint32_t            sendSeq;
+
+    // Payload being reassembled.
+    uint8_t            *recvBuffer;
+    uint32_t            recvBufferSize;
+    bool                recvActive;
+    Component_Id        recvSender;
+    uint32_t            recvLength;
+    uint32_t            recvOffset;
+    uint32_t            recvSeq;
+
+    SocketStream_Stats  stats;
+};
+
+// Throws away the payload being reassembled, if any.
+static void SocketStream__Drop(SocketStream *stream)
+{
+    if (stream->recvActive) {
+        stream->stats.recvDropped++;
+        stream->recvActive = false;
+    }
+}
+
+
+SocketStream *SocketStream_Open(
+    Socket   *socket,
+    void     *buffer,
+    uint32_t  size,
+    void    (*rx_cb)(SocketStream*, const Component_Id*, const void*, uint32_t))
+{
+    static SocketStream SocketStreams[SOCKET_STREAM_MAX] = {0};
+
+    if (!socket || (!buffer && (size > 0))) {
+        return NULL;
+    }
+
+    SocketStream *stream = NULL;
+    unsigned i;
+    for (i = 0; i < SOCKET_STREAM_MAX; i++) {
+        if (!SocketStreams[i].socket) {
+            stream = &SocketStreams[i];
+            break;
+        }
+    }
+    if (!stream) {
+        return NULL;
+    }
+
+    __builtin_memset(stream, 0, sizeof(*stream));
+    stream->socket         = socket;
+    stream->rx_cb          = rx_cb;
+    stream->recvBuffer     = buffer;
+    stream->recvBufferSize = size;
+    return stream;
+}
+
+
+void SocketStream_Close(SocketStream *stream)
+{
+    if (stream) {
+        stream->socket = NULL;
+    }
+}
+
+
+int32_t SocketStream_Send(
+    SocketStream       *stream,
+    const Component_Id *recipient,
+    const void         *data,
+    uint32_t            size)
+{
+    if (!stream || !recipient || !data || (size == 0)) {
+        return ERROR_PARAMETER;
+    }
+
+    if (stream->sending) {
+        return ERROR_BUSY;
+    }
+
+    stream->sending       = true;
+    stream->sendRecipient = *recipient;
+    stream->sendData      = data;
+    stream->sendSize      = size;
+    stream->sendOffset    = 0;
+
+    return SocketStream_Pump(stream);
+}
+
+
+int32_t SocketStream_Pump(SocketStream *stream)
+{
+    if (!stream) {
+        return ERROR_PARAMETER;
+    }
+
+    while (stream->sending) {
+        uint32_t len = stream->sendSize - stream->sendOffset;
+        if (len > SOCKET_STREAM_FRAGMENT_LEN) {
+            len = SOCKET_STREAM_FRAGMENT_LEN;
+        }
+
+        Socket_Payload payload;
+        int32_t error = Socket_WriteReserve(stream->socket, &stream->sendRecipient,
+            (sizeof(SocketStream_Header) + len), &payload);
+        if (error == ERROR_SOCKET_INSUFFICIENT_SPACE) {
+            stream->stats.sentFull++;
+            return error;
+        }
+        if (error != ERROR_NONE) {
+            // The rest of the payload can't be sent, but may be retried if
+            // another write was only part way through.
+            if (error != ERROR_BUSY) {
+                stream->sending = false;
+            }
+            return error;
+        }
+
+        SocketStream_Header header = {
+            .magic  = SOCKET_STREAM_MAGIC,
+            .seq    = stream->sendSeq,
+            .length = stream->sendSize,
+            .offset = stream->sendOffset,
+        };
+        Socket_PayloadWrite(&payload, 0, &header, sizeof(header));
+        Socket_PayloadWrite(&payload, sizeof(header),
+            &stream->sendData[stream->sendOffset], len);
+
+        error = Socket_WriteCommit(stream->socket, (sizeof(SocketStream_Header) + len));
+        if (error != ERROR_NONE) {
+            stream->sending = false;
+            return error;
+        }
+
+        stream->sendSeq++;
+        stream->sendOffset += len;
+        stream->stats.sentFragments++;
+
+        if (stream->sendOffset >= stream->sendSize) {
+            stream->sending = false;
+            stream->stats.sentPayloads++;
+        }
+    }
+
+    return ERROR_NONE;
+}
+
+
+bool SocketStream_Sending(const SocketStream *stream)
+{
+    return (stream && stream->sending);
+}
+
+
+void SocketStream_Cancel(SocketStream *stream)
+{
+    if (stream) {
+        stream->sending = false;
+    }
+}
+
+
+bool SocketStream_Receive(
+    SocketStream         *stream,
+    const Component_Id   *sender,
+    const Socket_Payload *payload)
+{
+    if (!stream || !sender || !payload) {
+        return false;
+    }
+
+    uint32_t size = payload->size[0] + payload->size[1];
+    if (size <= sizeof(SocketStream_Header)) {
+        return false;
+    }
+
+    SocketStream_Header header;
+    Socket_PayloadRead(payload, 0, &header, sizeof(header));
+    if (header.magic != SOCKET_STREAM_MAGIC) {
+        return false;
+    }
+
+    stream->stats.recvFragments++;
+    uint32_t len = size - sizeof(SocketStream_Header);
+
+    bool inOrder = (stream->recvActive
+        && (header.seq    == stream->recvSeq)
+        && (header.length == stream->recvLength)
+        && (header.offset == stream->recvOffset)
+        && (__builtin_memcmp(sender, &stream->recvSender, sizeof(*sender)) == 0));
+    stream->recvSeq = header.seq + 1;
+
+    if (!inOrder) {
+        SocketStream__Drop(stream);
+
+        // A payload can only be picked up from its first fragment.
+        if (header.offset != 0) {
+            return true;
+        }
+        if (header.length > stream->recvBufferSize) {
+            stream->stats.recvDropped++;
+            return true;
+        }
+
+        stream->recvActive = true;
+        stream->recvSender = *sender;
+        stream->recvLength = header.length;
+        stream->recvOffset = 0;
+    }
+
+    if (len > (stream->recvLength - stream->recvOffset)) {
+        SocketStream__Drop(stream);
+        return true;
+    }
+
+    Socket_PayloadRead(payload, sizeof(header),
+        &stream->recvBuffer[stream->recvOffset], len);
+    stream->recvOffset += len;
+
+    if (stream->recvOffset == stream->recvLength) {
+        stream->recvActive = false;
+        stream->stats.recvPayloads++;
+        if (stream->rx_cb) {
+            stream->rx_cb(stream, &stream->recvSender,
+                stream->recvBuffer, stream->recvLength);
+        }
+    }
+
+    return true;
+}
+
+
+void SocketStream_GetStats(const SocketStream *stream, SocketStream_Stats *stats)
+{
+    if (stream && stats) {
+        *stats = stream->stats;
+    }
+}
+
+
+void SocketStream_ResetStats(SocketStream *stream)
+{
+    if (stream) {
+        __builtin_memset(&stream->stats, 0, sizeof(stream->stats));
+    }
+}
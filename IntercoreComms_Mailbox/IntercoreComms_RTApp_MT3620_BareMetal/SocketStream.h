@@ -0,0 +1,80 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef SOCKET_STREAM_H_
+#define SOCKET_STREAM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "Socket.h"
+
+// Sends and receives payloads too large for a single Socket message, by
+// splitting them into fragments which each start with a SocketStream_Header.
+// The HLApp's socket_stream.c implements the same format. Fragments are
+// numbered in order across the stream, so that if one goes missing the
+// payload it belonged to is thrown away rather than delivered corrupt.
+
+#define SOCKET_STREAM_MAGIC 0x5354524d // "STRM"
+
+typedef struct {
+    uint32_t magic;
+    // Counts fragments sent on the stream.
+    uint32_t seq;
+    // Length of the whole payload, and where this fragment lies within it.
+    uint32_t length;
+    uint32_t offset;
+} SocketStream_Header;
+
+#define SOCKET_STREAM_FRAGMENT_LEN (SOCKET_MAX_PAYLOAD_LEN - sizeof(SocketStream_Header))
+
+typedef struct SocketStream SocketStream;
+
+typedef struct {
+    uint32_t sentPayloads;
+    uint32_t sentFragments;
+    // Times SocketStream_Pump stopped because the ring buffer was full.
+    uint32_t sentFull;
+    uint32_t recvPayloads;
+    uint32_t recvFragments;
+    // Payloads thrown away as fragments were missing or didn't fit.
+    uint32_t recvDropped;
+} SocketStream_Stats;
+
+// The buffer holds payloads being reassembled, so limits the size which can
+// be received. The callback is called with each payload once complete.
+SocketStream *SocketStream_Open(
+    Socket   *socket,
+    void     *buffer,
+    uint32_t  size,
+    void    (*rx_cb)(SocketStream*, const Component_Id*, const void*, uint32_t));
+void          SocketStream_Close(SocketStream *stream);
+
+// Starts sending a payload, which must stay untouched until it's been sent.
+// Only one payload is sent at a time, the return value is as for
+// SocketStream_Pump.
+int32_t       SocketStream_Send(
+    SocketStream       *stream,
+    const Component_Id *recipient,
+    const void         *data,
+    uint32_t            size);
+// Writes as many fragments of the payload as fit in the ring buffer. Returns
+// ERROR_SOCKET_INSUFFICIENT_SPACE if it filled up before the end, in which
+// case this should be called again once the HLApp has had time to read.
+int32_t       SocketStream_Pump(SocketStream *stream);
+bool          SocketStream_Sending(const SocketStream *stream);
+// Gives up on the payload being sent, so another can be sent. The HLApp
+// throws away the fragments it already has when the next payload starts.
+void          SocketStream_Cancel(SocketStream *stream);
+
+// Takes a message read from the socket, returns false if it isn't a stream
+// fragment and so should be handled by the caller.
+bool          SocketStream_Receive(
+    SocketStream         *stream,
+    const Component_Id   *sender,
+    const Socket_Payload *payload);
+
+void          SocketStream_GetStats(const SocketStream *stream, SocketStream_Stats *stats);
+void          SocketStream_ResetStats(SocketStream *stream);
+
+#endif // #ifndef SOCKET_STREAM_H_
@@ -28,28 +28,103 @@
 #include "lib/GPT.h"
 
 #include "Socket.h"
+#include "SocketStream.h"
+#include "SocketChannel.h"
 
 #define NUM_BUTTONS    2
 #define COUNTDOWN_INIT 5
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+/* Set below to 1 to compare Socket_Write with building messages in place */
+#define BENCH_WRITE       0
+#define BENCH_WRITE_MSGS  32
+#define BENCH_WRITE_LEN   1024
+
+/* Set below to 1 to compare writing small messages one by one and corked */
+#define BENCH_BATCH       0
+#define BENCH_BATCH_MSGS  16
+
+/* Set below to 1 to time streaming large payloads to the HLApp */
+#define BENCH_STREAM        0
+#define BENCH_STREAM_LEN    8192
+#define BENCH_STREAM_COUNT  16
+
+/* Set below to 1 to compare copying payloads with memcpy and the socket's
+   word aligned copy */
+#define BENCH_COPY          0
+#define BENCH_COPY_LEN      1024
+#define BENCH_COPY_RUNS     64
+
+/* Set below to 1 to check the ring buffer protocol against itself at startup */
+#define SELFTEST_LOOPBACK   0
+#define LOOPBACK_RING_LEN   4096
+#define LOOPBACK_MSGS       1024
+
+/* Set below to 1 to time a control message sent while bulk data is waiting,
+   through a loopback socket */
+#define BENCH_CHANNEL         0
+#define BENCH_CHANNEL_BACKLOG 16
+#define BENCH_CHANNEL_BULK    512
+#define BENCH_CHANNEL_QUEUE   (12 * 1024)
+
+/* Set below to the largest payload which can be streamed from the HLApp */
+#define STREAM_RECV_LEN     4096
+
+/* Set below to hold back messages until this many bytes are waiting, or for
+   up to this long [us], zero disables either */
+#define COALESCE_BYTES    256
+#define COALESCE_TIMEOUT  1000
+
+/* Set below to hold messages the ring buffer can't take in a buffer this
+   size [bytes], and to wait up to this long [us] to write the reboot message */
+#define OVERFLOW_LEN      2048
+#define WRITE_TIMEOUT     10000
+
+/* Set below to give up renegotiating after this long [us] */
+#define NEGOTIATE_TIMEOUT 500000
+
+/* Set below to print the ring buffer statistics every this many messages sent,
+   zero disables it */
+#define STATS_PERIOD      10
+
+#define CPU_FREQ          197600000 // [Hz]
+
+// Cortex-M4 DWT cycle counter
+#define DEMCR       (*(volatile uint32_t*)0xE000EDFC)
+#define DWT_CTRL    (*(volatile uint32_t*)0xE0001000)
+#define DWT_CYCCNT  (*(volatile uint32_t*)0xE0001004)
+
 typedef enum {
     TIMER_BUTTONS,
     TIMER_SEND_MSG,
+    TIMER_COALESCE,
     TIMER_COUNT
 } appTimers;
 
 // Drivers
 static UART   *debug              = NULL;
 static GPT    *timer[TIMER_COUNT] = {NULL};
+static GPT    *timeBase           = NULL;
+
+static Socket       *socket       = NULL;
+static SocketStream *stream       = NULL;
 
-static Socket *socket             = NULL;
+static uint8_t  streamRecvBuff[STREAM_RECV_LEN];
+static uint32_t overflowBuff[OVERFLOW_LEN / sizeof(uint32_t)];
 
 static unsigned gpioOut[2] = {0, 1};
 
 static volatile unsigned countdown = COUNTDOWN_INIT;
 
+static const Component_Id A7ID =
+{
+    .seg_0   = 0x25025d2c,
+    .seg_1   = 0x66da,
+    .seg_2   = 0x4448,
+    .seg_3_4 = {0xba, 0xe1, 0xac, 0x26, 0xfc, 0xdd, 0x36, 0x27}
+};
+
 // Callbacks
 typedef struct CallbackNode {
     bool enqueued;
@@ -79,16 +154,29 @@ static void printComponentId(const Component_Id *compId)
     UART_Print(debug, "\r\n");
 }
 
-static void handleSendMsgTimer(void* data)
+#if STATS_PERIOD
+static void printRingStats(void)
 {
-    static const Component_Id A7ID =
-    {
-        .seg_0   = 0x25025d2c,
-        .seg_1   = 0x66da,
-        .seg_2   = 0x4448,
-        .seg_3_4 = {0xba, 0xe1, 0xac, 0x26, 0xfc, 0xdd, 0x36, 0x27}
-    };
+    Socket_RingStats stats;
+    if (Socket_GetRingStats(socket, &stats) != ERROR_NONE) {
+        return;
+    }
 
+    UART_Printf(debug, "Ring tx: %lu msgs, %lu bytes, peak %lu/%lu, %lu wraps, %lu rejected\r\n",
+        stats.txMessages, stats.txBytes, stats.txPeak, stats.txCapacity,
+        stats.txWraps, stats.txRejected);
+    UART_Printf(debug, "Ring rx: %lu msgs, %lu bytes, peak %lu/%lu, %lu wraps\r\n",
+        stats.rxMessages, stats.rxBytes, stats.rxPeak, stats.rxCapacity, stats.rxWraps);
+    if (stats.latencyCount > 0) {
+        UART_Printf(debug, "Ring latency: %lu us min, %lu us mean, %lu us max\r\n",
+            stats.latencyMin, (uint32_t)(stats.latencyTotal / stats.latencyCount),
+            stats.latencyMax);
+    }
+}
+#endif
+
+static void handleSendMsgTimer(void* data)
+{
     static char msg[]    = "count-00";
     static char reboot[] = "reboot!!";
     const uintptr_t msgLen    = sizeof(msg);
@@ -100,7 +188,7 @@ static void handleSendMsgTimer(void* data)
     int32_t error = ERROR_NONE;
     if (countdown == 0) {
         UART_Printf(debug, "sending msg %s\r\n", reboot);
-        error = Socket_Write(socket, &A7ID, reboot, rebootLen);
+        error = Socket_WriteWait(socket, &A7ID, reboot, rebootLen, WRITE_TIMEOUT);
         countdown = COUNTDOWN_INIT;
     }
     else {
@@ -113,6 +201,61 @@ static void handleSendMsgTimer(void* data)
     if (error != ERROR_NONE) {
         UART_Printf(debug, "ERROR: sending msg %s - %ld\r\n", msg, error);
     }
+
+#if STATS_PERIOD
+    static unsigned sent = 0;
+    if (++sent >= STATS_PERIOD) {
+        printRingStats();
+        sent = 0;
+    }
+#endif
+}
+
+// Reports flow control whenever messages have been dropped or held up.
+static void printBackpressure(void)
+{
+    static Socket_Stats last = {0};
+
+    Socket_Stats stats;
+    Socket_GetStats(socket, &stats);
+    if ((stats.writeDropped    != last.writeDropped) ||
+        (stats.writeOverflowed != last.writeOverflowed) ||
+        (stats.writeWaitTime   != last.writeWaitTime)) {
+        UART_Printf(debug, "Backpressure: %lu dropped, %lu overflowed, "
+            "%lu timeouts, %lu us waiting\r\n",
+            stats.writeDropped, stats.writeOverflowed,
+            stats.writeTimeouts, stats.writeWaitTime);
+        last = stats;
+    }
+}
+
+static void handleSpace(void *handle)
+{
+    static int32_t lastNegotiation = ERROR_NONE;
+
+    int32_t negotiation = Socket_NegotiateStatus((Socket*)handle);
+    if (negotiation != lastNegotiation) {
+        if (negotiation == ERROR_SOCKET_NEGOTIATION) {
+            UART_Printf(debug, "ERROR: renegotiating socket connection\r\n");
+        } else if (negotiation == ERROR_NONE) {
+            UART_Printf(debug, "Renegotiated socket connection\r\n");
+        }
+        lastNegotiation = negotiation;
+    }
+
+    Socket_DrainOverflow((Socket*)handle);
+    printBackpressure();
+}
+
+static void handleSpaceWrapper(Socket *handle)
+{
+    static CallbackNode cbn = {.enqueued = false, .cb = handleSpace, .data = NULL};
+
+    if (!cbn.data) {
+        cbn.data = handle;
+    }
+
+    EnqueueCallback(&cbn);
 }
 
 static void handleSendMsgTimerWrapper(GPT *timer)
@@ -123,32 +266,66 @@ static void handleSendMsgTimerWrapper(GPT *timer)
     EnqueueCallback(&cbn);
 }
 
+static void printMsg(Socket *socket, const Component_Id *senderId,
+                     const Socket_Payload *payload, void *data)
+{
+    (void)socket;
+    (void)data;
+
+    if (SocketStream_Receive(stream, senderId, payload)) {
+        return;
+    }
+
+    // The message is printed straight from the ring buffer, however long it is.
+    UART_Print(debug, "Message received: ");
+    UART_Write(debug, payload->data[0], payload->size[0]);
+    if (payload->size[1] > 0) {
+        UART_Write(debug, payload->data[1], payload->size[1]);
+    }
+    UART_Print(debug, "\r\nSender: ");
+    printComponentId(senderId);
+}
+
+static void printStream(SocketStream *stream, const Component_Id *senderId,
+                        const void *data, uint32_t size)
+{
+    (void)stream;
+    (void)data;
+
+    UART_Printf(debug, "Stream received: %lu bytes\r\nSender: ", size);
+    printComponentId(senderId);
+}
+
+#if SELFTEST_LOOPBACK
+static void ignoreMsg(Socket *socket, const Component_Id *senderId,
+                         const Socket_Payload *payload, void *data)
+{
+    (void)socket;
+    (void)senderId;
+    (void)payload;
+    (void)data;
+}
+#endif
+
 static void handleRecvMsg(void *handle)
 {
     Socket *socket = (Socket*)handle;
 
-    Component_Id senderId;
-    static char msg[32];
-    uint32_t msg_size = sizeof(msg);
-
     if (Socket_NegotiationPending(socket)) {
         UART_Printf(debug, "Negotiation pending, attempting renegotiation\n");
-        // NB: this is blocking, if you want to protect against hanging,
-        //     add a timeout
-        if (Socket_Negotiate(socket) != ERROR_NONE) {
+        // This completes from the mailbox interrupt, and handleSpace is
+        // enqueued once it's over.
+        if (Socket_NegotiateStart(socket, NEGOTIATE_TIMEOUT) == ERROR_SOCKET_NEGOTIATION) {
             UART_Printf(debug, "ERROR: renegotiating socket connection\n");
         }
     }
 
-    int32_t error = Socket_Read(socket, &senderId, msg, &msg_size);
+    // Several messages may have arrived before this callback ran.
+    int32_t error = Socket_ForEachMessage(socket, printMsg, NULL, NULL);
 
     if (error != ERROR_NONE) {
-        UART_Printf(debug, "ERROR: receiving msg %s - %ld\r\n", msg, error);
+        UART_Printf(debug, "ERROR: receiving msg - %ld\r\n", error);
     }
-
-    msg[msg_size] = '\0';
-    UART_Printf(debug, "Message received: %s\r\nSender: ", msg);
-    printComponentId(&senderId);
 }
 
 static void handleRecvMsgWrapper(Socket *handle)
@@ -244,10 +421,339 @@ static void InvokeCallbacks(void)
     } while (node);
 }
 
+#if BENCH_WRITE || BENCH_BATCH || BENCH_STREAM || SELFTEST_LOOPBACK || BENCH_CHANNEL || BENCH_COPY
+// Stands in for a producer of telemetry, the data is printable so that the
+// HLApp can log it.
+static void benchFill(uint8_t *data, uint32_t offset, uint32_t size, uint32_t seq)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        data[i] = 'a' + ((seq + offset + i) % 26);
+    }
+}
+#endif
+
+#if BENCH_WRITE
+// Both ways include producing the data, so the difference between them is
+// the copy Socket_Write makes from the private buffer.
+static int32_t benchWriteMsg(bool inPlace, uint32_t seq, uint32_t *cycles)
+{
+    static uint8_t msg[BENCH_WRITE_LEN];
+
+    uint32_t start = DWT_CYCCNT;
+    int32_t  error;
+    if (inPlace) {
+        Socket_Payload payload;
+        error = Socket_WriteReserve(socket, &A7ID, sizeof(msg), &payload);
+        if (error == ERROR_NONE) {
+            benchFill(payload.data[0], 0, payload.size[0], seq);
+            benchFill(payload.data[1], payload.size[0], payload.size[1], seq);
+            error = Socket_WriteCommit(socket, sizeof(msg));
+        }
+    } else {
+        benchFill(msg, 0, sizeof(msg), seq);
+        error = Socket_Write(socket, &A7ID, msg, sizeof(msg));
+    }
+    *cycles = DWT_CYCCNT - start;
+
+    return error;
+}
+
+// Only successful writes are timed, when the ring is full the HLApp is given
+// up to a second to catch up.
+static void benchmarkWrite(const char *name, bool inPlace)
+{
+    uint32_t msgs, total = 0;
+    for (msgs = 0; msgs < BENCH_WRITE_MSGS; msgs++) {
+        uint32_t waitStart = DWT_CYCCNT;
+        uint32_t cycles;
+        int32_t  error;
+        while (((error = benchWriteMsg(inPlace, msgs, &cycles)) == ERROR_SOCKET_INSUFFICIENT_SPACE)
+            && ((DWT_CYCCNT - waitStart) < CPU_FREQ));
+
+        if (error != ERROR_NONE) {
+            UART_Printf(debug, "ERROR: %s benchmark failed - %ld\r\n", name, error);
+            break;
+        }
+        total += cycles;
+    }
+
+    uint32_t bytes = (msgs * BENCH_WRITE_LEN);
+    UART_Printf(debug, "%s: %lu bytes in %lu cycles (%lu KB/s)\r\n", name, bytes, total,
+        (total ? (uint32_t)(((uint64_t)bytes * (CPU_FREQ / 1024)) / total) : 0));
+}
+#endif
+
+#if BENCH_COPY
+// Copies between a 16-byte aligned buffer, standing in for a ring buffer, and
+// a private one, each starting offset bytes past a word boundary. Prints the
+// cycles per KB for memcpy, and for the socket's own copy through
+// Socket_PayloadWrite and Socket_PayloadRead.
+static void benchmarkCopy(const char *name, uint32_t ringOffset, uint32_t dataOffset)
+{
+    static uint8_t ring[BENCH_COPY_LEN + 16] __attribute__((aligned(16)));
+    static uint8_t data[BENCH_COPY_LEN + 16] __attribute__((aligned(16)));
+    benchFill(data, 0, sizeof(data), 0);
+
+    Socket_Payload payload = {
+        .data = {&ring[ringOffset], ring},
+        .size = {BENCH_COPY_LEN, 0},
+    };
+
+    uint32_t cycles[3] = {0};
+    for (unsigned run = 0; run < BENCH_COPY_RUNS; run++) {
+        uint32_t start = DWT_CYCCNT;
+        __builtin_memcpy(&ring[ringOffset], &data[dataOffset], BENCH_COPY_LEN);
+        // Keeps the compiler from merging the copies between runs.
+        __asm__ volatile("" ::: "memory");
+        cycles[0] += DWT_CYCCNT - start;
+
+        start = DWT_CYCCNT;
+        Socket_PayloadWrite(&payload, 0, &data[dataOffset], BENCH_COPY_LEN);
+        __asm__ volatile("" ::: "memory");
+        cycles[1] += DWT_CYCCNT - start;
+
+        start = DWT_CYCCNT;
+        Socket_PayloadRead(&payload, 0, &data[dataOffset], BENCH_COPY_LEN);
+        __asm__ volatile("" ::: "memory");
+        cycles[2] += DWT_CYCCNT - start;
+    }
+
+    for (unsigned i = 0; i < 3; i++) {
+        cycles[i] = (uint32_t)(((uint64_t)cycles[i] * 1024) / (BENCH_COPY_RUNS * BENCH_COPY_LEN));
+    }
+    UART_Printf(debug, "%s: memcpy %lu, write %lu, read %lu cycles per KB\r\n",
+        name, cycles[0], cycles[1], cycles[2]);
+}
+#endif
+
+#if BENCH_BATCH
+// Sends a burst of small messages, as a sensor might each tick, and reports
+// how many interrupts the HLApp took to be told of them.
+static void benchmarkBatch(const char *name, bool corked)
+{
+    Socket_ResetStats(socket);
+
+    uint32_t start = DWT_CYCCNT;
+    if (corked) {
+        Socket_Cork(socket);
+    }
+
+    uint32_t msgs;
+    for (msgs = 0; msgs < BENCH_BATCH_MSGS; msgs++) {
+        char msg[] = "sensor-a";
+        benchFill((uint8_t*)&msg[sizeof(msg) - 2], 0, 1, msgs);
+
+        int32_t error = Socket_Write(socket, &A7ID, msg, sizeof(msg));
+        if (error != ERROR_NONE) {
+            UART_Printf(debug, "ERROR: %s benchmark failed - %ld\r\n", name, error);
+            break;
+        }
+    }
+
+    if (corked) {
+        Socket_Uncork(socket);
+    }
+    uint32_t cycles = DWT_CYCCNT - start;
+
+    Socket_Stats stats;
+    Socket_GetStats(socket, &stats);
+    UART_Printf(debug, "%s: %lu msgs in %lu cycles, %lu interrupts (%lu msgs per interrupt)\r\n",
+        name, stats.writeMessages, cycles, stats.writeSignals,
+        (stats.writeSignals ? (stats.writeMessages / stats.writeSignals) : 0));
+}
+#endif
+
+#if BENCH_STREAM
+// The time includes waiting for the HLApp to make room in the ring buffer,
+// so this is the rate sustained between the cores.
+static void benchmarkStream(void)
+{
+    static uint8_t data[BENCH_STREAM_LEN];
+    benchFill(data, 0, sizeof(data), 0);
+
+    SocketStream_ResetStats(stream);
+
+    uint32_t count, cycles = 0;
+    for (count = 0; count < BENCH_STREAM_COUNT; count++) {
+        uint32_t start = DWT_CYCCNT;
+        int32_t  error = SocketStream_Send(stream, &A7ID, data, sizeof(data));
+
+        // Give up if the HLApp hasn't read anything for a second.
+        uint32_t waitStart = DWT_CYCCNT;
+        while (error == ERROR_SOCKET_INSUFFICIENT_SPACE) {
+            SocketStream_Stats before, after;
+            SocketStream_GetStats(stream, &before);
+            error = SocketStream_Pump(stream);
+            SocketStream_GetStats(stream, &after);
+
+            if (after.sentFragments != before.sentFragments) {
+                waitStart = DWT_CYCCNT;
+            } else if ((DWT_CYCCNT - waitStart) >= CPU_FREQ) {
+                break;
+            }
+        }
+        cycles += (DWT_CYCCNT - start);
+
+        if (error != ERROR_NONE) {
+            UART_Printf(debug, "ERROR: stream benchmark failed - %ld\r\n", error);
+            // Otherwise later sends would keep failing with ERROR_BUSY.
+            SocketStream_Cancel(stream);
+            break;
+        }
+    }
+
+    SocketStream_Stats stats;
+    SocketStream_GetStats(stream, &stats);
+
+    uint32_t bytes = (count * BENCH_STREAM_LEN);
+    UART_Printf(debug, "SocketStream: %lu bytes in %lu cycles (%lu KB/s), %lu fragments, %lu full\r\n",
+        bytes, cycles,
+        (cycles ? (uint32_t)(((uint64_t)bytes * (CPU_FREQ / 1024)) / cycles) : 0),
+        stats.sentFragments, stats.sentFull);
+}
+#endif
+
+#if SELFTEST_LOOPBACK
+// Writes messages through a loopback socket and reads them back, checking
+// they arrive intact. Payload sizes step by a prime so that blocks start,
+// end and wrap at every position in the ring.
+static void selftestLoopback(void)
+{
+    static uint8_t ring[LOOPBACK_RING_LEN] __attribute__((aligned(16)));
+    static uint8_t msg[SOCKET_MAX_PAYLOAD_LEN];
+    static uint8_t back[SOCKET_MAX_PAYLOAD_LEN];
+
+    Socket *lb = Socket_OpenLoopback(ring, sizeof(ring), NULL);
+    if (!lb) {
+        UART_Print(debug, "ERROR: Socket_OpenLoopback failed\r\n");
+        return;
+    }
+
+    uint32_t i, size = 0, errors = 0, bytes = 0, cycles = 0;
+    for (i = 0; i < LOOPBACK_MSGS; i++) {
+        size = ((size + 37) % SOCKET_MAX_PAYLOAD_LEN) + 1;
+        benchFill(msg, 0, size, i);
+
+        Component_Id sender;
+        uint32_t     backSize = sizeof(back);
+
+        uint32_t start = DWT_CYCCNT;
+        int32_t  error = Socket_Write(lb, &A7ID, msg, size);
+        if (error == ERROR_NONE) {
+            error = Socket_Read(lb, &sender, back, &backSize);
+        }
+        cycles += (DWT_CYCCNT - start);
+
+        if ((error != ERROR_NONE) || (backSize != size)
+            || (__builtin_memcmp(back, msg, size) != 0)
+            || (__builtin_memcmp(&sender, &A7ID, sizeof(sender)) != 0)) {
+            errors++;
+            continue;
+        }
+        bytes += size;
+    }
+
+    // Fill the ring with small messages, then check they can all be drained
+    // at once.
+    uint32_t filled;
+    for (filled = 0; Socket_Write(lb, &A7ID, msg, 1) == ERROR_NONE; filled++);
+    uint32_t drained = 0;
+    if ((Socket_ForEachMessage(lb, ignoreMsg, NULL, &drained) != ERROR_NONE)
+        || (drained != filled) || (filled == 0)) {
+        errors++;
+    }
+
+    Socket_Close(lb);
+
+    UART_Printf(debug, "Loopback: %lu msgs, %lu errors, %lu bytes in %lu cycles (%lu KB/s), %lu msgs fill the ring\r\n",
+        i, errors, bytes, cycles,
+        (cycles ? (uint32_t)(((uint64_t)bytes * (CPU_FREQ / 1024)) / cycles) : 0),
+        filled);
+}
+#endif
+
+#if BENCH_CHANNEL
+static uint32_t benchControlEnd;
+static uint32_t benchBulkRecv;
+
+static void benchChannelRecv(SocketChannel *channel, const Component_Id *senderId,
+                             const Socket_Payload *payload)
+{
+    (void)channel;
+    (void)senderId;
+
+    uint8_t kind = 0;
+    Socket_PayloadRead(payload, 0, &kind, sizeof(kind));
+    if (kind == 'C') {
+        benchControlEnd = DWT_CYCCNT;
+    } else {
+        benchBulkRecv++;
+    }
+}
+
+// Queues a backlog of bulk data, then sends a control message either on its
+// own channel or behind the bulk data on the same channel. The loopback
+// socket's reader takes one message at a time, making room for more as the
+// HLApp would, until the control message arrives.
+static void benchmarkChannel(const char *name, bool ownChannel)
+{
+    static uint8_t  ring[LOOPBACK_RING_LEN] __attribute__((aligned(16)));
+    static uint32_t queue[BENCH_CHANNEL_QUEUE / sizeof(uint32_t)];
+    static uint8_t  bulk[BENCH_CHANNEL_BULK];
+
+    Socket        *lb      = Socket_OpenLoopback(ring, sizeof(ring), NULL);
+    SocketChannel *control = SocketChannel_Open(lb, 0, 0, &A7ID, NULL, 0, benchChannelRecv);
+    SocketChannel *data    = SocketChannel_Open(lb, 1, 1, &A7ID, queue, sizeof(queue), benchChannelRecv);
+    if (!lb || !control || !data) {
+        UART_Print(debug, "ERROR: channel benchmark setup failed\r\n");
+        goto close;
+    }
+
+    __builtin_memset(bulk, 'B', sizeof(bulk));
+    unsigned i;
+    for (i = 0; i < BENCH_CHANNEL_BACKLOG; i++) {
+        if (SocketChannel_Write(data, bulk, sizeof(bulk)) != ERROR_NONE) {
+            UART_Print(debug, "ERROR: channel benchmark backlog failed\r\n");
+            goto close;
+        }
+    }
+
+    benchControlEnd = 0;
+    benchBulkRecv   = 0;
+
+    static const uint8_t cmd[] = "C";
+    uint32_t start = DWT_CYCCNT;
+    if (SocketChannel_Write((ownChannel ? control : data), cmd, sizeof(cmd)) != ERROR_NONE) {
+        UART_Print(debug, "ERROR: channel benchmark control write failed\r\n");
+        goto close;
+    }
+
+    Component_Id   senderId;
+    Socket_Payload payload;
+    while (!benchControlEnd && (Socket_ReadPeek(lb, &senderId, &payload) == ERROR_NONE)) {
+        SocketChannel_Receive(lb, &senderId, &payload);
+        Socket_ReadRelease(lb);
+        SocketChannel_Pump(lb);
+    }
+
+    if (benchControlEnd) {
+        UART_Printf(debug, "%s: control latency %lu cycles, behind %lu bulk msgs\r\n",
+            name, (benchControlEnd - start), benchBulkRecv);
+    } else {
+        UART_Printf(debug, "ERROR: %s control message lost\r\n", name);
+    }
+
+close:
+    SocketChannel_Close(data);
+    SocketChannel_Close(control);
+    Socket_Close(lb);
+}
+#endif
+
 _Noreturn void RTCoreMain(void)
 {
     VectorTableInit();
-    CPUFreq_Set(197600000);
+    CPUFreq_Set(CPU_FREQ);
 
     debug = UART_Open(MT3620_UNIT_UART_DEBUG, 115200, UART_PARITY_NONE, 1, NULL);
     UART_Print(debug, "--------------------------------\r\n");
@@ -263,10 +769,70 @@ _Noreturn void RTCoreMain(void)
         }
     }
 
+    // Free running clock used by the socket to time writes
+    timeBase = GPT_Open(MT3620_UNIT_GPT3, MT3620_GPT_3_LOW_SPEED, GPT_MODE_NONE);
+    if (!timeBase || (GPT_Start_Freerun(timeBase) != ERROR_NONE)) {
+        UART_Print(debug, "ERROR: GPT3 initialisation failed\r\n");
+        timeBase = NULL;
+    }
+
+    int32_t error;
+
+    DEMCR    |= (1U << 24);
+    DWT_CTRL |= 1U;
+
+#if BENCH_COPY
+    benchmarkCopy("Aligned copy   ", 0, 0);
+    benchmarkCopy("Unaligned head ", 3, 3);
+    benchmarkCopy("Mismatched copy", 0, 1);
+#endif
+#if SELFTEST_LOOPBACK
+    selftestLoopback();
+#endif
+#if BENCH_CHANNEL
+    benchmarkChannel("Bulk channel   ", false);
+    benchmarkChannel("Control channel", true);
+#endif
+
     // Setup socket
     socket = Socket_Open(handleRecvMsgWrapper);
     if (!socket) {
         UART_Printf(debug, "ERROR: socket initialisation failed\r\n");
+    } else {
+        stream = SocketStream_Open(socket, streamRecvBuff, sizeof(streamRecvBuff), printStream);
+    }
+
+    if (socket) {
+#if BENCH_WRITE
+        benchmarkWrite("Socket_Write       ", false);
+        benchmarkWrite("Socket_WriteReserve", true);
+#endif
+#if BENCH_BATCH
+        benchmarkBatch("Uncorked", false);
+        benchmarkBatch("Corked  ", true);
+#endif
+#if BENCH_STREAM
+        benchmarkStream();
+#endif
+
+        if ((error = Socket_SetCoalescing(
+            socket, COALESCE_BYTES, timer[TIMER_COALESCE], COALESCE_TIMEOUT)) != ERROR_NONE) {
+            UART_Printf(debug, "ERROR: Socket_SetCoalescing failed %ld\r\n", error);
+        }
+
+        // Nothing is coalesced while renegotiating, so the timer is shared
+        if ((error = Socket_SetNegotiateTimer(
+            socket, timer[TIMER_COALESCE])) != ERROR_NONE) {
+            UART_Printf(debug, "ERROR: Socket_SetNegotiateTimer failed %ld\r\n", error);
+        }
+
+        // Flow control, started after the benchmarks so they see a full ring
+        Socket_SetClock(socket, timeBase);
+        if ((error = Socket_SetOverflow(
+            socket, overflowBuff, sizeof(overflowBuff))) != ERROR_NONE) {
+            UART_Printf(debug, "ERROR: Socket_SetOverflow failed %ld\r\n", error);
+        }
+        Socket_SetSpaceCallback(socket, handleSpaceWrapper);
     }
 
     GPIO_ConfigurePinForInput(buttons[0].gpioPin);
@@ -275,7 +841,6 @@ _Noreturn void RTCoreMain(void)
     GPIO_ConfigurePinForOutput(gpioOut[1]);
 
     // Setup buttons
-    int32_t error;
     if ((error = GPT_SetMode(timer[TIMER_BUTTONS], GPT_MODE_REPEAT)) != ERROR_NONE) {
         UART_Printf(debug, "ERROR: Button GPT_SetMode failed %ld\r\n", error);
     }
@@ -0,0 +1,293 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "A7.h"
+#include "Host.h"
+
+// As in Socket.c, which these mustn't share code with so that the two can
+// be checked against each other.
+#define A7_CMD_LOCAL_BUFFER_DESC  0xba5e0001
+#define A7_CMD_REMOTE_BUFFER_DESC 0xba5e0002
+#define A7_CMD_END_OF_SETUP       0xba5e0003
+
+#define A7_PORT_READ    0
+#define A7_PORT_WRITTEN 1
+
+#define A7_HEADER_LEN    64
+#define A7_MSG_HEADER    20
+#define A7_ALIGNMENT     16
+#define A7_PAYLOAD_MAX   SOCKET_MAX_PAYLOAD_LEN
+#define A7_BUFFERS_MAX   8
+
+typedef struct {
+    uint32_t writeIndex;
+    uint32_t readIndex;
+} A7_Indices;
+
+typedef struct {
+    A7_Indices *indices;
+    uint8_t    *data;
+    uint32_t    capacity;
+} A7_Ring;
+
+struct A7 {
+    Component_Id id;
+    // The ring buffer the RTApp writes to, and the one the A7 writes to,
+    // whose header holds the A7's read index in rx.
+    A7_Ring      rx;
+    A7_Ring      tx;
+
+    void        *buffers[A7_BUFFERS_MAX];
+    size_t       bufferSizes[A7_BUFFERS_MAX];
+    unsigned     bufferCount;
+
+    A7_Stats     stats;
+};
+
+static void *A7__Alloc(size_t size)
+{
+    void *buffer = MAP_FAILED;
+#ifdef MAP_32BIT
+    buffer = mmap(NULL, size, (PROT_READ | PROT_WRITE),
+                  (MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT), -1, 0);
+#else
+    // Asks for somewhere low, but the kernel may put it anywhere.
+    buffer = mmap((void *)0x40000000, size, (PROT_READ | PROT_WRITE),
+                  (MAP_PRIVATE | MAP_ANONYMOUS), -1, 0);
+#endif
+    if (buffer == MAP_FAILED) {
+        return NULL;
+    }
+    if (((uintptr_t)buffer + size) > UINT32_MAX) {
+        munmap(buffer, size);
+        return NULL;
+    }
+    return buffer;
+}
+
+static bool A7__Ring(A7 *a7, unsigned order, uint32_t offset, A7_Ring *ring, uint32_t *desc)
+{
+    size_t size = ((size_t)1 << order);
+    if ((order < 7) || (order > 24) || (a7->bufferCount >= A7_BUFFERS_MAX)
+        || ((offset % A7_ALIGNMENT) != 0) || (offset >= (size - A7_HEADER_LEN))) {
+        return false;
+    }
+
+    uint8_t *buffer = A7__Alloc(size);
+    if (!buffer) {
+        return false;
+    }
+    a7->buffers[a7->bufferCount]     = buffer;
+    a7->bufferSizes[a7->bufferCount] = size;
+    a7->bufferCount++;
+
+    ring->indices  = (A7_Indices *)buffer;
+    ring->data     = &buffer[A7_HEADER_LEN];
+    ring->capacity = (size - A7_HEADER_LEN);
+    ring->indices->writeIndex = offset;
+    ring->indices->readIndex  = offset;
+
+    *desc = ((uint32_t)(uintptr_t)buffer | order);
+    return true;
+}
+
+static bool A7__Negotiate(A7 *a7, unsigned rxOrder, unsigned txOrder, uint32_t offset)
+{
+    A7_Ring  rx, tx;
+    uint32_t data[3] = {0};
+    if (!A7__Ring(a7, rxOrder, offset, &rx, &data[0])
+        || !A7__Ring(a7, txOrder, offset, &tx, &data[1])) {
+        return false;
+    }
+    a7->rx = rx;
+    a7->tx = tx;
+
+    // Local and remote as seen from the RTApp.
+    static const uint32_t cmd[3] = {
+        A7_CMD_LOCAL_BUFFER_DESC, A7_CMD_REMOTE_BUFFER_DESC, A7_CMD_END_OF_SETUP };
+    return (Host_A7_FIFO_Write(cmd, data, 3) == ERROR_NONE);
+}
+
+static uint32_t A7__Used(const A7_Ring *ring, uint32_t write, uint32_t read)
+{
+    return ((write >= read) ? (write - read) : (write + ring->capacity - read));
+}
+
+static void A7__Copy(const A7_Ring *ring, uint32_t pos, void *dest, const void *src, uint32_t size,
+                     bool toRing)
+{
+    uint32_t first = ring->capacity - pos;
+    if (first > size) {
+        first = size;
+    }
+
+    if (toRing) {
+        memcpy(&ring->data[pos], src, first);
+        memcpy(ring->data, (const uint8_t *)src + first, (size - first));
+    } else {
+        memcpy(dest, &ring->data[pos], first);
+        memcpy((uint8_t *)dest + first, ring->data, (size - first));
+    }
+}
+
+static uint32_t A7__Advance(const A7_Ring *ring, uint32_t pos, uint32_t size)
+{
+    return ((pos + size) % ring->capacity);
+}
+
+
+A7 *A7_Open(const Component_Id *id, unsigned rxOrder, unsigned txOrder, uint32_t offset)
+{
+    if (!id) {
+        return NULL;
+    }
+
+    A7 *a7 = calloc(1, sizeof(A7));
+    if (!a7) {
+        return NULL;
+    }
+    a7->id = *id;
+
+    if (!A7__Negotiate(a7, rxOrder, txOrder, offset)) {
+        A7_Close(a7);
+        return NULL;
+    }
+    return a7;
+}
+
+bool A7_Renegotiate(A7 *a7, unsigned rxOrder, unsigned txOrder, uint32_t offset)
+{
+    return (a7 && A7__Negotiate(a7, rxOrder, txOrder, offset));
+}
+
+void A7_Close(A7 *a7)
+{
+    if (!a7) {
+        return;
+    }
+
+    unsigned i;
+    for (i = 0; i < a7->bufferCount; i++) {
+        munmap(a7->buffers[i], a7->bufferSizes[i]);
+    }
+    free(a7);
+}
+
+
+int32_t A7_Write(A7 *a7, const void *data, uint32_t size)
+{
+    if (!a7 || !data || (size == 0) || (size > A7_PAYLOAD_MAX)) {
+        return ERROR_PARAMETER;
+    }
+
+    const A7_Ring *tx = &a7->tx;
+    uint32_t write = tx->indices->writeIndex;
+    uint32_t read;
+    // Pairs with the RTApp's release of its read index after reading.
+    __atomic_load(&a7->rx.indices->readIndex, &read, __ATOMIC_ACQUIRE);
+
+    // As the RTApp does, a block is only written if a gap is left after it,
+    // so that a full buffer can't look empty.
+    uint32_t space = (tx->capacity - A7__Used(tx, write, read));
+    uint32_t block = (sizeof(uint32_t) + A7_MSG_HEADER + size);
+    if (space < (block + A7_ALIGNMENT)) {
+        a7->stats.writeFull++;
+        return ERROR_SOCKET_INSUFFICIENT_SPACE;
+    }
+
+    uint32_t blockSize = (A7_MSG_HEADER + size);
+    uint8_t  header[A7_MSG_HEADER] = {0};
+    memcpy(header, &a7->id, sizeof(a7->id));
+
+    uint32_t pos = write;
+    A7__Copy(tx, pos, NULL, &blockSize, sizeof(blockSize), true);
+    pos = A7__Advance(tx, pos, sizeof(blockSize));
+    A7__Copy(tx, pos, NULL, header, sizeof(header), true);
+    pos = A7__Advance(tx, pos, sizeof(header));
+    A7__Copy(tx, pos, NULL, data, size, true);
+
+    uint32_t next = A7__Advance(tx, write,
+        ((block + (A7_ALIGNMENT - 1)) & ~(A7_ALIGNMENT - 1)));
+    // Pairs with the RTApp's acquire of the write index before reading.
+    __atomic_store(&tx->indices->writeIndex, &next, __ATOMIC_RELEASE);
+
+    a7->stats.writeMessages++;
+    Host_A7_Trigger(A7_PORT_WRITTEN);
+    return ERROR_NONE;
+}
+
+int32_t A7_Read(A7 *a7, Component_Id *recipient, void *data, uint32_t *size)
+{
+    if (!a7 || !recipient || !data || !size) {
+        return ERROR_PARAMETER;
+    }
+
+    const A7_Ring *rx = &a7->rx;
+    uint32_t read = a7->tx.indices->readIndex;
+    uint32_t write;
+    __atomic_load(&rx->indices->writeIndex, &write, __ATOMIC_ACQUIRE);
+
+    if ((write >= rx->capacity) || ((write % A7_ALIGNMENT) != 0)) {
+        return ERROR;
+    }
+    if (write == read) {
+        return ERROR_SOCKET_INSUFFICIENT_SPACE;
+    }
+
+    // Published blocks must be whole, and hold a header and a payload.
+    uint32_t used = A7__Used(rx, write, read);
+    uint32_t blockSize;
+    A7__Copy(rx, read, &blockSize, NULL, sizeof(blockSize), false);
+    if ((blockSize <= A7_MSG_HEADER) || ((blockSize - A7_MSG_HEADER) > A7_PAYLOAD_MAX)
+        || ((sizeof(blockSize) + blockSize) > used)) {
+        return ERROR;
+    }
+
+    uint32_t payload = (blockSize - A7_MSG_HEADER);
+    if (payload > *size) {
+        return ERROR_SOCKET_INSUFFICIENT_SPACE;
+    }
+
+    uint32_t pos = A7__Advance(rx, read, sizeof(blockSize));
+    A7__Copy(rx, pos, recipient, NULL, sizeof(*recipient), false);
+    pos = A7__Advance(rx, pos, A7_MSG_HEADER);
+    A7__Copy(rx, pos, data, NULL, payload, false);
+    *size = payload;
+
+    uint32_t next = A7__Advance(rx, read,
+        ((sizeof(blockSize) + blockSize + (A7_ALIGNMENT - 1)) & ~(A7_ALIGNMENT - 1)));
+    // The payload must have been copied out before the RTApp may reuse it.
+    __atomic_store(&a7->tx.indices->readIndex, &next, __ATOMIC_RELEASE);
+
+    a7->stats.readMessages++;
+    a7->stats.readBytes += payload;
+    Host_A7_Trigger(A7_PORT_READ);
+    return ERROR_NONE;
+}
+
+uint32_t A7_ReadPending(const A7 *a7)
+{
+    if (!a7) {
+        return 0;
+    }
+
+    uint32_t write;
+    __atomic_load(&a7->rx.indices->writeIndex, &write, __ATOMIC_ACQUIRE);
+    return A7__Used(&a7->rx, write, a7->tx.indices->readIndex);
+}
+
+bool A7_Wait(A7 *a7, uint64_t timeout)
+{
+    return (a7 && (Host_A7_Wait(timeout) != 0));
+}
+
+void A7_GetStats(const A7 *a7, A7_Stats *stats)
+{
+    if (a7 && stats) {
+        *stats = a7->stats;
+    }
+}
@@ -0,0 +1,63 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef A7_H_
+#define A7_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "Socket.h"
+
+// The A7 end of the socket, implementing the shared memory protocol as the
+// Azure Sphere OS does for the HLApp, independently of Socket.c. It's meant
+// to be driven from its own thread, against Socket.c on the RTApp's thread.
+//
+// Each side writes to its own ring buffer: a header holding the owner's write
+// index and the owner's read index in the other side's buffer, followed by
+// blocks starting 16-byte aligned. A block is its size (excluding the size
+// itself), a Socket_Msg_Header naming the other end, then the payload, and
+// may wrap around the end of the buffer. The RTApp is given the buffers as
+// descriptors through the mailbox FIFO, and each side raises a mailbox
+// interrupt after writing or reading. The A7 checks everything the RTApp
+// writes, and fails a read if it's out of line.
+
+typedef struct A7 A7;
+
+typedef struct {
+    uint32_t writeMessages;
+    // Writes refused as the ring buffer to the RTApp was full.
+    uint32_t writeFull;
+    uint32_t readMessages;
+    uint32_t readBytes;
+} A7_Stats;
+
+// Allocates ring buffers of 2^rxOrder bytes for the RTApp to write to and
+// 2^txOrder bytes for the A7 to write to, headers included, and sends their
+// descriptors to the RTApp. Both start with their indices at offset, which
+// must be 16-byte aligned. The buffers are placed in the low 4GB so that
+// their address fits in a descriptor.
+A7     *A7_Open(const Component_Id *id, unsigned rxOrder, unsigned txOrder, uint32_t offset);
+// As A7_Open on an open A7, as the HLApp does when it restarts. The old
+// buffers are kept until A7_Close, as the RTApp uses them until it's
+// negotiated again.
+bool    A7_Renegotiate(A7 *a7, unsigned rxOrder, unsigned txOrder, uint32_t offset);
+void    A7_Close(A7 *a7);
+
+// Writes a message to the RTApp, returns ERROR_SOCKET_INSUFFICIENT_SPACE when
+// there isn't room for it.
+int32_t A7_Write(A7 *a7, const void *data, uint32_t size);
+// Reads the next message from the RTApp, along with the recipient it was
+// addressed to. Returns ERROR_SOCKET_INSUFFICIENT_SPACE when there are none,
+// or size is too small, and ERROR if the RTApp broke the protocol.
+int32_t A7_Read(A7 *a7, Component_Id *recipient, void *data, uint32_t *size);
+// Bytes of the RTApp's ring buffer published but not yet read.
+uint32_t A7_ReadPending(const A7 *a7);
+
+// Waits up to timeout nanoseconds for an interrupt from the RTApp, returns
+// false if none came.
+bool    A7_Wait(A7 *a7, uint64_t timeout);
+
+void    A7_GetStats(const A7 *a7, A7_Stats *stats);
+
+#endif // #ifndef A7_H_
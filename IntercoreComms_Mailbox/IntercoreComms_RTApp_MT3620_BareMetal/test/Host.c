@@ -0,0 +1,228 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Host.h"
+#include "lib/GPT.h"
+
+struct GPT {
+    bool       open;
+    GPT_Mode   mode;
+    bool       enabled;
+    bool       freerun;
+    uint64_t   start;    // [ns]
+    uint64_t   deadline; // [ns]
+    uint64_t   period;   // [ns]
+    void     (*callback)(GPT *);
+};
+
+static GPT timers[MT3620_UNIT_GPT_COUNT] = {0};
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static uint64_t       epoch;
+static int            wake = -1;
+
+static uint64_t Host__Clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec);
+}
+
+static void Host__Init(void)
+{
+    epoch = Host__Clock();
+    wake  = eventfd(0, EFD_NONBLOCK);
+    if (wake < 0) {
+        perror("Host: eventfd");
+        abort();
+    }
+}
+
+uint64_t Host_Now(void)
+{
+    pthread_once(&once, Host__Init);
+    return (Host__Clock() - epoch);
+}
+
+void Host_Wake(void)
+{
+    pthread_once(&once, Host__Init);
+    uint64_t one = 1;
+    if (write(wake, &one, sizeof(one)) != sizeof(one)) {
+        perror("Host: eventfd write");
+        abort();
+    }
+}
+
+// Fires expired timers, returns the time of the next one or UINT64_MAX.
+static uint64_t Host__Timers(bool *fired)
+{
+    uint64_t next = UINT64_MAX;
+    unsigned i;
+    for (i = 0; i < MT3620_UNIT_GPT_COUNT; i++) {
+        GPT *timer = &timers[i];
+        if (!timer->open || !timer->enabled || timer->freerun) {
+            continue;
+        }
+
+        if (timer->deadline <= Host_Now()) {
+            if (timer->mode == GPT_MODE_REPEAT) {
+                timer->deadline += timer->period;
+            } else {
+                timer->enabled = false;
+            }
+            *fired = true;
+            if (timer->callback) {
+                timer->callback(timer);
+            }
+        }
+        if (timer->enabled && (timer->deadline < next)) {
+            next = timer->deadline;
+        }
+    }
+    return next;
+}
+
+bool Host_PollInterrupts(void)
+{
+    pthread_once(&once, Host__Init);
+
+    // Cleared before looking, so anything raised from here on wakes the
+    // next wait.
+    uint64_t count;
+    (void)!read(wake, &count, sizeof(count));
+
+    bool fired = false;
+    Host__Timers(&fired);
+    if (Host_MBox_Deliver()) {
+        fired = true;
+    }
+    return fired;
+}
+
+void Host_WaitForInterrupt(void)
+{
+    uint64_t limit = Host_Now() + HOST_WAIT_LIMIT;
+    while (!Host_PollInterrupts()) {
+        bool     fired = false;
+        uint64_t next  = Host__Timers(&fired);
+        if (fired) {
+            return;
+        }
+
+        uint64_t now = Host_Now();
+        if (now >= limit) {
+            fprintf(stderr, "Host: no interrupt for %llu ms\n",
+                    (unsigned long long)(HOST_WAIT_LIMIT / 1000000));
+            abort();
+        }
+        if (next > limit) {
+            next = limit;
+        }
+
+        uint64_t wait = (next > now) ? (next - now) : 0;
+        struct timespec ts = {
+            .tv_sec  = (wait / 1000000000ULL),
+            .tv_nsec = (wait % 1000000000ULL),
+        };
+        struct pollfd fd = { .fd = wake, .events = POLLIN };
+        ppoll(&fd, 1, &ts, NULL);
+    }
+}
+
+
+GPT *GPT_Open(int32_t id, float speedHz, GPT_Mode mode)
+{
+    if ((id < 0) || (id >= MT3620_UNIT_GPT_COUNT) || timers[id].open) {
+        return NULL;
+    }
+
+    GPT *timer = &timers[id];
+    *timer = (GPT){ .open = true, .mode = mode };
+    return timer;
+}
+
+void GPT_Close(GPT *handle)
+{
+    if (handle) {
+        handle->open = false;
+    }
+}
+
+int32_t GPT_SetMode(GPT *handle, GPT_Mode mode)
+{
+    if (!handle || !handle->open) {
+        return ERROR_PARAMETER;
+    }
+    if (handle->enabled) {
+        return ERROR_BUSY;
+    }
+    handle->mode = mode;
+    return ERROR_NONE;
+}
+
+int32_t GPT_Stop(GPT *handle)
+{
+    if (!handle || !handle->open) {
+        return ERROR_PARAMETER;
+    }
+    handle->enabled = false;
+    handle->freerun = false;
+    return ERROR_NONE;
+}
+
+bool GPT_IsEnabled(GPT *handle)
+{
+    return (handle && handle->enabled);
+}
+
+int32_t GPT_StartTimeout(GPT *handle, uint32_t timeout, GPT_Units units,
+                         void (*callback)(GPT *))
+{
+    if (!handle || !handle->open || (timeout == 0)) {
+        return ERROR_PARAMETER;
+    }
+    if (handle->enabled) {
+        return ERROR_BUSY;
+    }
+
+    handle->period   = (((uint64_t)timeout * 1000000000ULL) / units);
+    handle->deadline = Host_Now() + handle->period;
+    handle->callback = callback;
+    handle->freerun  = false;
+    handle->enabled  = true;
+    return ERROR_NONE;
+}
+
+int32_t GPT_Start_Freerun(GPT *handle)
+{
+    if (!handle || !handle->open) {
+        return ERROR_PARAMETER;
+    }
+    if (handle->enabled) {
+        return ERROR_BUSY;
+    }
+
+    handle->start   = Host_Now();
+    handle->freerun = true;
+    handle->enabled = true;
+    return ERROR_NONE;
+}
+
+uint32_t GPT_GetRunningTime(GPT *handle, GPT_Units units)
+{
+    if (!handle || !handle->enabled || !handle->freerun) {
+        return 0;
+    }
+    return (uint32_t)((Host_Now() - handle->start) / (1000000000ULL / units));
+}
@@ -0,0 +1,42 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef HOST_H_
+#define HOST_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Time and interrupts for the host build.
+//
+// The RTApp code runs on one thread and the A7 peer (A7.c) on another, and
+// they share the ring buffers just as the cores do. Interrupts for the RTApp,
+// from the mailbox and the timers, are only delivered when its thread waits
+// for one, so the RTApp code never races its own handlers, only the other
+// core. The mailbox wakes each side through an eventfd.
+
+// Give up on a wait which has seen nothing for this long, the test has hung.
+#define HOST_WAIT_LIMIT 5000000000ULL // [ns]
+
+// Time since the start of the process, from the monotonic clock. [ns]
+uint64_t Host_Now(void);
+
+// Stand-in for wfi, delivers pending interrupts, waiting for one if there are
+// none. Aborts after HOST_WAIT_LIMIT.
+void     Host_WaitForInterrupt(void);
+// Delivers any pending interrupts, returns false if there were none.
+bool     Host_PollInterrupts(void);
+
+// The A7 end of the mailbox, for the peer in A7.c. These are thread safe.
+int32_t  Host_A7_FIFO_Write(const uint32_t *cmd, const uint32_t *data, uintptr_t length);
+void     Host_A7_Trigger(uint8_t port);
+// Waits up to timeout nanoseconds for the RTApp to raise a mailbox interrupt,
+// returns a mask of the ports raised since the last call or 0 on timeout.
+uint8_t  Host_A7_Wait(uint64_t timeout);
+
+// Between Host.c and MBox.c, wakes the RTApp thread, and delivers the mailbox
+// interrupts on it.
+void     Host_Wake(void);
+bool     Host_MBox_Deliver(void);
+
+#endif // #ifndef HOST_H_
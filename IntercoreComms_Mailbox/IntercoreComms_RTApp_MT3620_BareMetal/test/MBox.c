@@ -0,0 +1,339 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Host.h"
+#include "lib/MBox.h"
+
+// One mailbox between the RTApp (M4) and the A7. The FIFO entries from the
+// A7 and the software interrupts raised by each side are held here until
+// delivered, as the hardware latches them, and the side they're for is woken
+// through an eventfd.
+
+struct MBox {
+    bool     open;
+    void   (*rx_cb)(void*);
+    void    *user_data;
+    void   (*sw_int_cb)(void*, uint8_t);
+    uint8_t  sw_int_flags;
+};
+
+typedef struct {
+    uint32_t cmd[MBOX_FIFO_COUNT_MAX];
+    uint32_t data[MBOX_FIFO_COUNT_MAX];
+    unsigned head;
+    unsigned count;
+} MBox_Queue;
+
+static MBox mbox = {0};
+
+static pthread_mutex_t lock    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  arrived = PTHREAD_COND_INITIALIZER;
+static MBox_Queue      toM4    = {0};
+static MBox_Queue      toA7    = {0};
+// Set when entries arrive from the A7, until rx_cb is called.
+static bool            toM4Arrived = false;
+
+// Software interrupt ports raised for each side, as a mask.
+static uint8_t m4Ports = 0;
+static uint8_t a7Ports = 0;
+
+static pthread_once_t once   = PTHREAD_ONCE_INIT;
+static int            a7Wake = -1;
+
+static void MBox__Init(void)
+{
+    a7Wake = eventfd(0, EFD_NONBLOCK);
+    if (a7Wake < 0) {
+        perror("MBox: eventfd");
+        abort();
+    }
+}
+
+static bool MBox__Push(MBox_Queue *queue, const uint32_t *cmd, const uint32_t *data,
+                       uintptr_t length)
+{
+    if (length > (MBOX_FIFO_COUNT_MAX - queue->count)) {
+        return false;
+    }
+
+    uintptr_t i;
+    for (i = 0; i < length; i++) {
+        unsigned slot = ((queue->head + queue->count) % MBOX_FIFO_COUNT_MAX);
+        queue->cmd[slot]  = cmd[i];
+        queue->data[slot] = data[i];
+        queue->count++;
+    }
+    return true;
+}
+
+static bool MBox__Pop(MBox_Queue *queue, uint32_t *cmd, uint32_t *data, uintptr_t length)
+{
+    if (length > queue->count) {
+        return false;
+    }
+
+    uintptr_t i;
+    for (i = 0; i < length; i++) {
+        cmd[i]  = queue->cmd[queue->head];
+        data[i] = queue->data[queue->head];
+        queue->head = ((queue->head + 1) % MBOX_FIFO_COUNT_MAX);
+        queue->count--;
+    }
+    return true;
+}
+
+
+MBox *MBox_FIFO_Open(
+    Platform_Unit unit,
+    void        (*rx_cb)(void*),
+    void        (*tx_confirmed_cb)(void*),
+    void        (*fifo_state_change_cb)(void*, MBox_FIFO_State),
+    void         *user_data,
+    int8_t        non_full_threshold,
+    int8_t        non_empty_threshold)
+{
+    if ((unit != MT3620_UNIT_MBOX_CA7) || mbox.open) {
+        return NULL;
+    }
+
+    mbox = (MBox){
+        .open      = true,
+        .rx_cb     = rx_cb,
+        .user_data = user_data,
+    };
+    return &mbox;
+}
+
+void MBox_FIFO_Close(MBox *handle)
+{
+    if (handle) {
+        MBox_SW_Interrupt_Teardown(handle);
+        handle->open = false;
+    }
+}
+
+void MBox_FIFO_Reset(MBox *handle, bool both)
+{
+    if (!handle) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    toM4.count = 0;
+    if (both) {
+        toA7.count = 0;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int32_t MBox_FIFO_Write(MBox *handle, const uint32_t *cmd, const uint32_t *data, uintptr_t length)
+{
+    if (!handle || !handle->open || !cmd || !data) {
+        return ERROR_PARAMETER;
+    }
+
+    pthread_mutex_lock(&lock);
+    bool pushed = MBox__Push(&toA7, cmd, data, length);
+    pthread_mutex_unlock(&lock);
+    return (pushed ? ERROR_NONE : ERROR_BUSY);
+}
+
+int32_t MBox_FIFO_Read(MBox *handle, uint32_t *cmd, uint32_t *data, uintptr_t length)
+{
+    if (!handle || !handle->open || !cmd || !data) {
+        return ERROR_PARAMETER;
+    }
+
+    pthread_mutex_lock(&lock);
+    bool popped = MBox__Pop(&toM4, cmd, data, length);
+    pthread_mutex_unlock(&lock);
+    return (popped ? ERROR_NONE : ERROR_BUSY);
+}
+
+int32_t MBox_FIFO_ReadSync(MBox *handle, uint32_t *cmd, uint32_t *data, uintptr_t length)
+{
+    if (!handle || !handle->open || !cmd || !data || (length > MBOX_FIFO_COUNT_MAX)) {
+        return ERROR_PARAMETER;
+    }
+
+    struct timespec limit;
+    clock_gettime(CLOCK_REALTIME, &limit);
+    limit.tv_sec += (HOST_WAIT_LIMIT / 1000000000ULL);
+
+    int32_t error = ERROR_NONE;
+    pthread_mutex_lock(&lock);
+    while (toM4.count < length) {
+        if (pthread_cond_timedwait(&arrived, &lock, &limit) == ETIMEDOUT) {
+            error = ERROR_TIMEOUT;
+            break;
+        }
+    }
+    if (error == ERROR_NONE) {
+        MBox__Pop(&toM4, cmd, data, length);
+    }
+    pthread_mutex_unlock(&lock);
+    return error;
+}
+
+int32_t MBox_FIFO_Reads_Available(MBox *handle)
+{
+    if (!handle) {
+        return ERROR_PARAMETER;
+    }
+
+    pthread_mutex_lock(&lock);
+    int32_t count = toM4.count;
+    pthread_mutex_unlock(&lock);
+    return count;
+}
+
+int32_t MBox_FIFO_Writes_Available(MBox *handle)
+{
+    if (!handle) {
+        return ERROR_PARAMETER;
+    }
+
+    pthread_mutex_lock(&lock);
+    int32_t count = (MBOX_FIFO_COUNT_MAX - toA7.count);
+    pthread_mutex_unlock(&lock);
+    return count;
+}
+
+
+int32_t MBox_SW_Interrupt_Setup(
+    MBox     *handle,
+    uint8_t   int_enable_flags,
+    void    (*sw_int_cb)(void*, uint8_t))
+{
+    if (!handle || !handle->open || !sw_int_cb) {
+        return ERROR_PARAMETER;
+    }
+
+    handle->sw_int_cb    = sw_int_cb;
+    handle->sw_int_flags = int_enable_flags;
+    return ERROR_NONE;
+}
+
+void MBox_SW_Interrupt_Teardown(MBox *handle)
+{
+    if (handle) {
+        handle->sw_int_cb    = NULL;
+        handle->sw_int_flags = 0;
+    }
+}
+
+int32_t MBox_SW_Interrupt_Trigger(MBox *handle, uint8_t port)
+{
+    if (!handle || !handle->open || (port >= MBOX_SW_INT_PORT_COUNT)) {
+        return ERROR_PARAMETER;
+    }
+
+    pthread_once(&once, MBox__Init);
+    __atomic_fetch_or(&a7Ports, (1U << port), __ATOMIC_SEQ_CST);
+    uint64_t one = 1;
+    if (write(a7Wake, &one, sizeof(one)) != sizeof(one)) {
+        perror("MBox: eventfd write");
+        abort();
+    }
+    return ERROR_NONE;
+}
+
+
+bool Host_MBox_Deliver(void)
+{
+    if (!mbox.open) {
+        return false;
+    }
+
+    bool delivered = false;
+
+    pthread_mutex_lock(&lock);
+    bool fifo = (toM4Arrived && (toM4.count > 0));
+    toM4Arrived = false;
+    pthread_mutex_unlock(&lock);
+    if (fifo && mbox.rx_cb) {
+        mbox.rx_cb(mbox.user_data);
+        delivered = true;
+    }
+
+    // Ports which aren't enabled stay pending.
+    uint8_t enabled = (mbox.sw_int_cb ? mbox.sw_int_flags : 0);
+    uint8_t ports   = (__atomic_fetch_and(&m4Ports, (uint8_t)~enabled, __ATOMIC_SEQ_CST)
+        & enabled);
+    uint8_t port;
+    for (port = 0; port < MBOX_SW_INT_PORT_COUNT; port++) {
+        if ((ports & (1U << port)) && mbox.sw_int_cb) {
+            mbox.sw_int_cb(mbox.user_data, port);
+            delivered = true;
+        }
+    }
+
+    return delivered;
+}
+
+int32_t Host_A7_FIFO_Write(const uint32_t *cmd, const uint32_t *data, uintptr_t length)
+{
+    if (!cmd || !data) {
+        return ERROR_PARAMETER;
+    }
+
+    pthread_mutex_lock(&lock);
+    bool pushed = MBox__Push(&toM4, cmd, data, length);
+    if (pushed) {
+        toM4Arrived = true;
+        pthread_cond_broadcast(&arrived);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (!pushed) {
+        return ERROR_BUSY;
+    }
+    Host_Wake();
+    return ERROR_NONE;
+}
+
+void Host_A7_Trigger(uint8_t port)
+{
+    if (port < MBOX_SW_INT_PORT_COUNT) {
+        __atomic_fetch_or(&m4Ports, (1U << port), __ATOMIC_SEQ_CST);
+        Host_Wake();
+    }
+}
+
+uint8_t Host_A7_Wait(uint64_t timeout)
+{
+    pthread_once(&once, MBox__Init);
+
+    // The eventfd may be left set by interrupts already seen, so this waits
+    // again until a port is raised or the time is up.
+    uint64_t limit = Host_Now() + timeout;
+    for (;;) {
+        uint8_t ports = __atomic_exchange_n(&a7Ports, 0, __ATOMIC_SEQ_CST);
+        uint64_t now  = Host_Now();
+        if ((ports != 0) || (now >= limit)) {
+            return ports;
+        }
+
+        uint64_t wait = (limit - now);
+        struct timespec ts = {
+            .tv_sec  = (wait / 1000000000ULL),
+            .tv_nsec = (wait % 1000000000ULL),
+        };
+        struct pollfd fd = { .fd = a7Wake, .events = POLLIN };
+        ppoll(&fd, 1, &ts, NULL);
+
+        uint64_t count;
+        (void)!read(a7Wake, &count, sizeof(count));
+    }
+}
@@ -0,0 +1,517 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "A7.h"
+#include "Host.h"
+#include "Socket.h"
+#include "SocketChannel.h"
+#include "SocketStream.h"
+#include "Test.h"
+#include "lib/GPT.h"
+
+// Measures the socket between two host threads, usage: SocketBench [count]
+//
+// The host's cores, caches and scheduler are nothing like the MT3620's, so
+// the figures are for comparing changes to Socket.c against each other, not
+// for predicting the device. Interrupts per message are the same on both.
+
+static const Component_Id A7ID = {
+    .seg_0   = 0x25025d2c,
+    .seg_1   = 0x66da,
+    .seg_2   = 0x4448,
+    .seg_3_4 = {0xba, 0xe1, 0xac, 0x26, 0xfc, 0xdd, 0x36, 0x27}
+};
+
+#define BENCH_RING_ORDER 14
+#define BENCH_BATCH      16
+
+// The channel benchmark sends a control message after every so many bulk
+// messages, with a queue of bulk messages big enough to keep the ring full.
+#define BENCH_CHANNEL_BULK   512
+#define BENCH_CHANNEL_PERIOD 64
+#define BENCH_CHANNEL_QUEUE  (16 * 1024)
+
+// The copy benchmark copies this much to and from a payload on each run.
+#define BENCH_COPY_LEN 4096
+
+static A7     *a7      = NULL;
+static Socket *sock    = NULL;
+static GPT    *freerun = NULL;
+
+typedef enum {
+    PEER_SINK,
+    PEER_SOURCE,
+    PEER_ECHO,
+    PEER_CHANNEL,
+} Peer_Mode;
+
+typedef enum {
+    WRITE_COPY,
+    WRITE_CORKED,
+    WRITE_IN_PLACE,
+} Write_Mode;
+
+static const char *const writeNames[] = {
+    [WRITE_COPY]     = "write",
+    [WRITE_CORKED]   = "write, corked",
+    [WRITE_IN_PLACE] = "write, in place",
+};
+
+static struct {
+    pthread_t thread;
+    Peer_Mode mode;
+    uint32_t  count;
+    uint32_t  size;
+    // Written by the A7 thread.
+    bool      failed;
+    uint64_t  latencyMin;
+    uint64_t  latencyMax;
+    uint64_t  latencyTotal;
+    uint32_t  latencyCount;
+} peer;
+
+// Control messages are only their send time, anything longer is bulk data.
+static void peerLatency(const uint8_t *data, uint32_t size)
+{
+    uint64_t stamp;
+    if (size != (sizeof(SocketChannel_Header) + sizeof(stamp))) {
+        return;
+    }
+    memcpy(&stamp, &data[sizeof(SocketChannel_Header)], sizeof(stamp));
+
+    uint64_t latency = (Host_Now() - stamp);
+    peer.latencyTotal += latency;
+    peer.latencyCount++;
+    if (latency < peer.latencyMin) {
+        peer.latencyMin = latency;
+    }
+    if (latency > peer.latencyMax) {
+        peer.latencyMax = latency;
+    }
+}
+
+static void *peerMain(void *arg)
+{
+    static uint8_t data[SOCKET_MAX_PAYLOAD_LEN];
+    memset(data, 0x5a, sizeof(data));
+
+    uint32_t done = 0;
+    while (done < peer.count) {
+        int32_t error;
+        if (peer.mode == PEER_SOURCE) {
+            error = A7_Write(a7, data, peer.size);
+        } else {
+            Component_Id recipient;
+            uint32_t     size = sizeof(data);
+            error = A7_Read(a7, &recipient, data, &size);
+            if ((error == ERROR_NONE) && (peer.mode == PEER_CHANNEL)) {
+                peerLatency(data, size);
+            }
+            if ((error == ERROR_NONE) && (peer.mode == PEER_ECHO)) {
+                while ((error = A7_Write(a7, data, size)) == ERROR_SOCKET_INSUFFICIENT_SPACE) {
+                    A7_Wait(a7, HOST_WAIT_LIMIT);
+                }
+            }
+        }
+
+        if (error == ERROR_NONE) {
+            done++;
+        } else if (error != ERROR_SOCKET_INSUFFICIENT_SPACE) {
+            __atomic_store_n(&peer.failed, true, __ATOMIC_RELEASE);
+            break;
+        } else if (!A7_Wait(a7, HOST_WAIT_LIMIT)) {
+            __atomic_store_n(&peer.failed, true, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void peerStart(Peer_Mode mode, uint32_t count, uint32_t size)
+{
+    peer.mode   = mode;
+    peer.count  = count;
+    peer.size   = size;
+    peer.failed = false;
+    peer.latencyMin   = UINT64_MAX;
+    peer.latencyMax   = 0;
+    peer.latencyTotal = 0;
+    peer.latencyCount = 0;
+    CHECK(pthread_create(&peer.thread, NULL, peerMain, NULL) == 0);
+}
+
+static void peerStop(void)
+{
+    CHECK(pthread_join(peer.thread, NULL) == 0);
+    CHECK(!peer.failed);
+}
+
+static void noCallback(Socket *socket)
+{
+}
+
+static void openSocket(void)
+{
+    a7 = A7_Open(&A7ID, BENCH_RING_ORDER, BENCH_RING_ORDER, 0);
+    CHECK(a7);
+    sock = Socket_Open(noCallback);
+    CHECK(sock);
+    Socket_SetClock(sock, freerun);
+}
+
+static void closeSocket(void)
+{
+    CHECK_EQ(Socket_Close(sock), ERROR_NONE);
+    A7_Close(a7);
+}
+
+static void printRate(const char *name, uint32_t size, uint32_t count, uint64_t time)
+{
+    double seconds = ((double)time / 1e9);
+    printf("%-24s %5u B  %10.0f msg/s  %8.1f MB/s", name, (unsigned)size,
+           (count / seconds), ((double)count * size / seconds / 1e6));
+}
+
+// Both ways of writing produce the payload, so the difference between them
+// is the copy Socket_Write makes from the caller's buffer.
+static int32_t writeMessage(uint32_t size, bool inPlace, uint8_t seq)
+{
+    static uint8_t data[SOCKET_MAX_PAYLOAD_LEN];
+
+    if (!inPlace) {
+        memset(data, seq, size);
+        return Socket_Write(sock, &A7ID, data, size);
+    }
+
+    Socket_Payload payload;
+    int32_t error = Socket_WriteReserve(sock, &A7ID, size, &payload);
+    if (error != ERROR_NONE) {
+        return error;
+    }
+    memset(payload.data[0], seq, payload.size[0]);
+    if (payload.size[1] > 0) {
+        memset(payload.data[1], seq, payload.size[1]);
+    }
+    return Socket_WriteCommit(sock, size);
+}
+
+// RTApp to A7, a message at a time, corked into batches or built in place.
+static void benchWrite(uint32_t count, uint32_t size, Write_Mode mode)
+{
+    bool batched = (mode == WRITE_CORKED);
+
+    openSocket();
+    Socket_ResetStats(sock);
+    Socket_ResetRingStats(sock);
+    peerStart(PEER_SINK, count, size);
+
+    uint64_t start = Host_Now();
+    uint32_t sent  = 0;
+    while (sent < count) {
+        if (batched) {
+            Socket_Cork(sock);
+        }
+        uint32_t batch = (batched ? BENCH_BATCH : 1);
+        for (; (batch > 0) && (sent < count); batch--) {
+            if (writeMessage(size, (mode == WRITE_IN_PLACE), (uint8_t)sent) != ERROR_NONE) {
+                break;
+            }
+            sent++;
+        }
+        if (batched) {
+            Socket_Uncork(sock);
+        }
+        if (batch > 0) {
+            Host_WaitForInterrupt();
+        }
+    }
+    // The A7 thread finishes once it's read them all.
+    peerStop();
+    uint64_t time = (Host_Now() - start);
+
+    Socket_Stats     stats;
+    Socket_RingStats ringStats;
+    Socket_GetStats(sock, &stats);
+    Socket_GetRingStats(sock, &ringStats);
+    printRate(writeNames[mode], size, count, time);
+    printf("  %5.3f irq/msg", ((double)stats.writeSignals / count));
+    if (ringStats.latencyCount > 0) {
+        printf("  latency %u/%.1f/%u us", (unsigned)ringStats.latencyMin,
+               ((double)ringStats.latencyTotal / ringStats.latencyCount),
+               (unsigned)ringStats.latencyMax);
+    }
+    printf("\n");
+
+    closeSocket();
+}
+
+static void countMessage(Socket *socket, const Component_Id *sender,
+                         const Socket_Payload *payload, void *user_data)
+{
+    static uint8_t data[SOCKET_MAX_PAYLOAD_LEN];
+    Socket_PayloadRead(payload, 0, data, (payload->size[0] + payload->size[1]));
+}
+
+// RTApp to A7, payloads larger than the ring streamed in fragments for as
+// long as the A7 keeps reading, as the sample's BENCH_STREAM does.
+static void benchStream(uint32_t count, uint32_t size)
+{
+    static uint8_t data[65536];
+    memset(data, 0xa5, size);
+
+    uint32_t fragments = ((size + SOCKET_STREAM_FRAGMENT_LEN - 1) / SOCKET_STREAM_FRAGMENT_LEN);
+    uint32_t payloads  = ((count / fragments) + 1);
+
+    openSocket();
+    SocketStream *stream = SocketStream_Open(sock, NULL, 0, NULL);
+    CHECK(stream);
+    Socket_ResetStats(sock);
+    peerStart(PEER_SINK, (payloads * fragments), 0);
+
+    uint64_t start = Host_Now();
+    uint32_t i;
+    for (i = 0; i < payloads; i++) {
+        int32_t error = SocketStream_Send(stream, &A7ID, data, size);
+        while (error == ERROR_SOCKET_INSUFFICIENT_SPACE) {
+            Host_WaitForInterrupt();
+            error = SocketStream_Pump(stream);
+        }
+        CHECK_EQ(error, ERROR_NONE);
+    }
+    peerStop();
+    uint64_t time = (Host_Now() - start);
+
+    Socket_Stats       stats;
+    SocketStream_Stats streamStats;
+    Socket_GetStats(sock, &stats);
+    SocketStream_GetStats(stream, &streamStats);
+    CHECK_EQ(streamStats.sentFragments, (payloads * fragments));
+    printRate("stream", size, payloads, time);
+    printf("  %5.3f irq/fragment  %u ring full\n",
+           ((double)stats.writeSignals / streamStats.sentFragments),
+           (unsigned)streamStats.sentFull);
+
+    SocketStream_Close(stream);
+    closeSocket();
+}
+
+// RTApp to A7, a control message sent every so often while the bulk channel
+// keeps the ring full, either on its own channel or queued behind the bulk
+// data, timed from writing it to the A7 reading it.
+static void benchChannel(uint32_t count, bool ownChannel)
+{
+    static uint32_t bulkQueue[BENCH_CHANNEL_QUEUE / sizeof(uint32_t)];
+    static uint32_t controlQueue[256];
+    static uint8_t  data[BENCH_CHANNEL_BULK];
+    memset(data, 0x42, sizeof(data));
+
+    openSocket();
+    SocketChannel *control = SocketChannel_Open(sock, 0, 0, &A7ID,
+        controlQueue, sizeof(controlQueue), NULL);
+    SocketChannel *bulk = SocketChannel_Open(sock, 1, 1, &A7ID,
+        bulkQueue, sizeof(bulkQueue), NULL);
+    CHECK(control && bulk);
+
+    uint32_t total = (count + (count / BENCH_CHANNEL_PERIOD));
+    peerStart(PEER_CHANNEL, total, 0);
+
+    uint64_t start = Host_Now();
+    uint32_t i;
+    for (i = 0; i < total; i++) {
+        bool isControl = ((i % (BENCH_CHANNEL_PERIOD + 1)) == BENCH_CHANNEL_PERIOD);
+        uint64_t stamp = Host_Now();
+        int32_t  error;
+        while ((error = (isControl
+                ? SocketChannel_Write((ownChannel ? control : bulk), &stamp, sizeof(stamp))
+                : SocketChannel_Write(bulk, data, sizeof(data))))
+               == ERROR_SOCKET_INSUFFICIENT_SPACE) {
+            Host_WaitForInterrupt();
+            SocketChannel_Pump(sock);
+        }
+        CHECK_EQ(error, ERROR_NONE);
+    }
+    while ((SocketChannel_Queued(bulk) > 0) || (SocketChannel_Queued(control) > 0)) {
+        Host_WaitForInterrupt();
+        SocketChannel_Pump(sock);
+    }
+    peerStop();
+    uint64_t time = (Host_Now() - start);
+
+    CHECK(peer.latencyCount > 0);
+    printRate((ownChannel ? "channel, control" : "channel, behind bulk"), BENCH_CHANNEL_BULK,
+              (total - peer.latencyCount), time);
+    printf("  control latency %.1f/%.1f/%.1f us\n", (peer.latencyMin / 1e3),
+           ((double)peer.latencyTotal / peer.latencyCount / 1e3), (peer.latencyMax / 1e3));
+
+    SocketChannel_Close(bulk);
+    SocketChannel_Close(control);
+    closeSocket();
+}
+
+// A7 to RTApp, copied out a message at a time or read in place all at once.
+static void benchRead(uint32_t count, uint32_t size, bool inPlace)
+{
+    static uint8_t data[SOCKET_MAX_PAYLOAD_LEN];
+
+    openSocket();
+    peerStart(PEER_SOURCE, count, size);
+
+    uint64_t start    = Host_Now();
+    uint32_t received = 0;
+    while (received < count) {
+        uint32_t got = 0;
+        if (inPlace) {
+            CHECK_EQ(Socket_ForEachMessage(sock, countMessage, NULL, &got), ERROR_NONE);
+        } else {
+            Component_Id sender;
+            uint32_t     length = sizeof(data);
+            got = (Socket_Read(sock, &sender, data, &length) == ERROR_NONE) ? 1 : 0;
+        }
+        received += got;
+        if (got == 0) {
+            Host_WaitForInterrupt();
+        }
+    }
+    uint64_t time = (Host_Now() - start);
+    peerStop();
+
+    printRate((inPlace ? "read, for each" : "read"), size, count, time);
+    printf("\n");
+
+    closeSocket();
+}
+
+// Round trips of single messages through the A7.
+static void benchRoundTrip(uint32_t count, uint32_t size)
+{
+    static uint8_t data[SOCKET_MAX_PAYLOAD_LEN];
+    memset(data, 0x3c, sizeof(data));
+
+    openSocket();
+    peerStart(PEER_ECHO, count, size);
+
+    uint64_t min = UINT64_MAX, max = 0, total = 0;
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        uint64_t start = Host_Now();
+        CHECK_EQ(Socket_Write(sock, &A7ID, data, size), ERROR_NONE);
+
+        Component_Id sender;
+        uint32_t     length = sizeof(data);
+        while (Socket_Read(sock, &sender, data, &length) != ERROR_NONE) {
+            Host_WaitForInterrupt();
+        }
+        CHECK_EQ(length, size);
+
+        uint64_t time = (Host_Now() - start);
+        total += time;
+        if (time < min) {
+            min = time;
+        }
+        if (time > max) {
+            max = time;
+        }
+    }
+    peerStop();
+
+    printf("%-24s %5u B  round trip %.1f/%.1f/%.1f us (min/mean/max)\n", "echo",
+           (unsigned)size, (min / 1e3), ((double)total / count / 1e3), (max / 1e3));
+
+    closeSocket();
+}
+
+// Socket_PayloadWrite and Socket_PayloadRead against memcpy, as BENCH_COPY in
+// main.c, with the payload where a ring buffer block would start.
+static void benchCopy(uint32_t count, const char *name, uint32_t ringOffset, uint32_t dataOffset)
+{
+    static uint8_t ring[BENCH_COPY_LEN + 16] __attribute__((aligned(16)));
+    static uint8_t data[BENCH_COPY_LEN + 16] __attribute__((aligned(16)));
+    uint32_t i;
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 13);
+    }
+
+    Socket_Payload payload = {
+        .data = {&ring[ringOffset], ring},
+        .size = {BENCH_COPY_LEN, 0},
+    };
+
+    // Called through a pointer, the compiler can't inline memcpy as it can't
+    // inline it in the socket's fallback.
+    static void *(*volatile copy)(void *, const void *, size_t) = memcpy;
+
+    // Each is timed over all its runs, as reading the clock takes about as
+    // long as a copy.
+    uint64_t time[3];
+    uint64_t start = Host_Now();
+    for (i = 0; i < count; i++) {
+        copy(&ring[ringOffset], &data[dataOffset], BENCH_COPY_LEN);
+        // Keeps the compiler from merging the copies between runs.
+        __asm__ volatile("" ::: "memory");
+    }
+    time[0] = (Host_Now() - start);
+
+    start = Host_Now();
+    for (i = 0; i < count; i++) {
+        Socket_PayloadWrite(&payload, 0, &data[dataOffset], BENCH_COPY_LEN);
+        __asm__ volatile("" ::: "memory");
+    }
+    time[1] = (Host_Now() - start);
+
+    start = Host_Now();
+    for (i = 0; i < count; i++) {
+        Socket_PayloadRead(&payload, 0, &data[dataOffset], BENCH_COPY_LEN);
+        __asm__ volatile("" ::: "memory");
+    }
+    time[2] = (Host_Now() - start);
+    CHECK(memcmp(&ring[ringOffset], &data[dataOffset], BENCH_COPY_LEN) == 0);
+
+    double kb = ((double)count * BENCH_COPY_LEN / 1024);
+    printf("%-24s %5u B  memcpy %.1f, write %.1f, read %.1f ns per KB\n", name,
+           (unsigned)BENCH_COPY_LEN, (time[0] / kb), (time[1] / kb), (time[2] / kb));
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t count = 100000;
+    if (argc > 1) {
+        count = (uint32_t)strtoul(argv[1], NULL, 0);
+    }
+    CHECK(count > 0);
+
+    freerun = GPT_Open(MT3620_UNIT_GPT3, 1000000, GPT_MODE_NONE);
+    CHECK(freerun);
+    CHECK_EQ(GPT_Start_Freerun(freerun), ERROR_NONE);
+
+    static const uint32_t sizes[] = { 16, 64, 256, SOCKET_MAX_PAYLOAD_LEN };
+    const unsigned sizeCount = (sizeof(sizes) / sizeof(sizes[0]));
+    unsigned s;
+
+    printf("%u messages, %u byte rings\n", (unsigned)count, (1U << BENCH_RING_ORDER));
+    for (s = 0; s < sizeCount; s++) {
+        benchWrite(count, sizes[s], WRITE_COPY);
+        benchWrite(count, sizes[s], WRITE_CORKED);
+        benchWrite(count, sizes[s], WRITE_IN_PLACE);
+    }
+    benchStream(count, 8192);
+    benchStream(count, 65536);
+    benchChannel(count, true);
+    benchChannel(count, false);
+    for (s = 0; s < sizeCount; s++) {
+        benchRead(count, sizes[s], false);
+        benchRead(count, sizes[s], true);
+    }
+    for (s = 0; s < sizeCount; s++) {
+        benchRoundTrip(((count / 10) + 1), sizes[s]);
+    }
+    benchCopy(count, "copy, aligned", 0, 0);
+    benchCopy(count, "copy, unaligned head", 3, 3);
+    benchCopy(count, "copy, mismatched", 0, 1);
+
+    GPT_Close(freerun);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1177 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "A7.h"
+#include "Host.h"
+#include "Socket.h"
+#include "SocketChannel.h"
+#include "SocketStream.h"
+#include "Test.h"
+#include "lib/GPT.h"
+
+static const Component_Id A7ID = {
+    .seg_0   = 0x25025d2c,
+    .seg_1   = 0x66da,
+    .seg_2   = 0x4448,
+    .seg_3_4 = {0xba, 0xe1, 0xac, 0x26, 0xfc, 0xdd, 0x36, 0x27}
+};
+
+// Message overhead in the ring: block size, header, and the gap the writer
+// always leaves.
+#define RING_OVERHEAD (4 + 20 + 16)
+
+static A7     *a7      = NULL;
+static Socket *sock    = NULL;
+static GPT    *freerun = NULL;
+
+static uint32_t rxInterrupts = 0;
+static uint32_t spaceCalls   = 0;
+static bool     renegotiate  = false;
+
+// The A7 thread, and what it's been told to do.
+static struct {
+    pthread_t thread;
+    bool      stop;
+    bool      reading;
+    uint64_t  resumeAt;
+    uint32_t  max;
+    // Written by the A7 thread.
+    uint32_t  received;
+    uint32_t  errors;
+} peer;
+
+static void sleepMicrosec(uint32_t time)
+{
+    struct timespec ts = { .tv_sec = (time / 1000000), .tv_nsec = ((time % 1000000) * 1000) };
+    nanosleep(&ts, NULL);
+}
+
+// Rounded up, as the socket's clock counts whole microseconds.
+static uint64_t elapsedMicrosec(uint64_t start)
+{
+    return ((Host_Now() - start + 999) / 1000);
+}
+
+static bool peerFlag(const bool *flag)
+{
+    return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+}
+
+static void peerSet(bool *flag, bool value)
+{
+    __atomic_store_n(flag, value, __ATOMIC_RELEASE);
+}
+
+static uint32_t peerCount(const uint32_t *count)
+{
+    return __atomic_load_n(count, __ATOMIC_ACQUIRE);
+}
+
+// The A7 thread interrupts the RTApp before counting what it's read, so it's
+// polled rather than waited for.
+static void peerWaitFor(const uint32_t *count, uint32_t value)
+{
+    uint64_t start = Host_Now();
+    while (peerCount(count) < value) {
+        CHECK((Host_Now() - start) < HOST_WAIT_LIMIT);
+        sleepMicrosec(100);
+    }
+}
+
+static void peerStart(void *(*body)(void *), bool reading, uint32_t max)
+{
+    peer.stop     = false;
+    peer.reading  = reading;
+    peer.resumeAt = 0;
+    peer.max      = max;
+    peer.received = 0;
+    peer.errors   = 0;
+    CHECK(pthread_create(&peer.thread, NULL, body, NULL) == 0);
+}
+
+static void peerStop(void)
+{
+    peerSet(&peer.stop, true);
+    CHECK(pthread_join(peer.thread, NULL) == 0);
+    CHECK_EQ(peer.errors, 0);
+}
+
+// Messages carry their sequence number, and their size and content follow
+// from it. Sizes step by a prime so that blocks start, end and wrap at every
+// position in the ring.
+static uint32_t msgSize(uint32_t seq, uint32_t max)
+{
+    return (4 + ((seq * 37) % (max - 3)));
+}
+
+static void msgFill(uint8_t *data, uint32_t seq, uint32_t size)
+{
+    memcpy(data, &seq, sizeof(seq));
+    uint32_t i;
+    for (i = sizeof(seq); i < size; i++) {
+        data[i] = (uint8_t)(seq + (i * 7));
+    }
+}
+
+static bool msgCheck(const uint8_t *data, uint32_t size, uint32_t seq, uint32_t max)
+{
+    uint32_t got;
+    memcpy(&got, data, sizeof(got));
+    if ((size != msgSize(seq, max)) || (got != seq)) {
+        return false;
+    }
+
+    uint32_t i;
+    for (i = sizeof(seq); i < size; i++) {
+        if (data[i] != (uint8_t)(seq + (i * 7))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void rxCallback(Socket *socket)
+{
+    rxInterrupts++;
+    if (renegotiate && Socket_NegotiationPending(socket)) {
+        Socket_NegotiateStart(socket, 100000);
+    }
+}
+
+static void spaceCallback(Socket *socket)
+{
+    spaceCalls++;
+    Socket_DrainOverflow(socket);
+}
+
+static void openSocket(unsigned rxOrder, unsigned txOrder, uint32_t offset)
+{
+    a7 = A7_Open(&A7ID, rxOrder, txOrder, offset);
+    CHECK(a7);
+    sock = Socket_Open(rxCallback);
+    CHECK(sock);
+    Socket_SetClock(sock, freerun);
+    Socket_ResetStats(sock);
+    Socket_ResetRingStats(sock);
+}
+
+static void closeSocket(void)
+{
+    CHECK_EQ(Socket_Close(sock), ERROR_NONE);
+    A7_Close(a7);
+    sock = NULL;
+    a7   = NULL;
+}
+
+// Reads everything waiting from the RTApp, checking messages arrive in order.
+static void *peerSink(void *arg)
+{
+    static uint8_t data[SOCKET_MAX_PAYLOAD_LEN];
+    while (!peerFlag(&peer.stop)) {
+        if (!peerFlag(&peer.reading)) {
+            uint64_t resumeAt = __atomic_load_n(&peer.resumeAt, __ATOMIC_ACQUIRE);
+            if ((resumeAt == 0) || (Host_Now() < resumeAt)) {
+                sleepMicrosec(100);
+                continue;
+            }
+            peerSet(&peer.reading, true);
+        }
+
+        Component_Id recipient;
+        uint32_t     size = sizeof(data);
+        int32_t      error = A7_Read(a7, &recipient, data, &size);
+        if (error == ERROR_NONE) {
+            uint32_t seq = peerCount(&peer.received);
+            if ((memcmp(&recipient, &A7ID, sizeof(A7ID)) != 0)
+                || !msgCheck(data, size, seq, peer.max)) {
+                __atomic_fetch_add(&peer.errors, 1, __ATOMIC_RELEASE);
+            }
+            __atomic_fetch_add(&peer.received, 1, __ATOMIC_RELEASE);
+        } else if (error == ERROR_SOCKET_INSUFFICIENT_SPACE) {
+            A7_Wait(a7, 1000000);
+        } else {
+            __atomic_fetch_add(&peer.errors, 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Writes each message from the RTApp back to it.
+static void *peerEcho(void *arg)
+{
+    static uint8_t data[SOCKET_MAX_PAYLOAD_LEN];
+    while (!peerFlag(&peer.stop)) {
+        Component_Id recipient;
+        uint32_t     size = sizeof(data);
+        int32_t      error = A7_Read(a7, &recipient, data, &size);
+        if (error == ERROR_SOCKET_INSUFFICIENT_SPACE) {
+            A7_Wait(a7, 1000000);
+            continue;
+        }
+        if ((error != ERROR_NONE) || (memcmp(&recipient, &A7ID, sizeof(A7ID)) != 0)) {
+            __atomic_fetch_add(&peer.errors, 1, __ATOMIC_RELEASE);
+            break;
+        }
+        __atomic_fetch_add(&peer.received, 1, __ATOMIC_RELEASE);
+
+        while (((error = A7_Write(a7, data, size)) == ERROR_SOCKET_INSUFFICIENT_SPACE)
+            && !peerFlag(&peer.stop)) {
+            A7_Wait(a7, 1000000);
+        }
+        if ((error != ERROR_NONE) && !peerFlag(&peer.stop)) {
+            __atomic_fetch_add(&peer.errors, 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *peerOpen(void *arg)
+{
+    // Late, so that the RTApp is left waiting for the descriptors.
+    sleepMicrosec(20000);
+    A7 *opened = A7_Open(&A7ID, 12, 12, 0);
+    __atomic_store_n(&a7, opened, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void testOpen(void)
+{
+    peerStart(peerOpen, false, 0);
+    sock = Socket_Open(rxCallback);
+    CHECK(pthread_join(peer.thread, NULL) == 0);
+    CHECK(sock);
+    a7 = __atomic_load_n(&a7, __ATOMIC_ACQUIRE);
+    CHECK(a7);
+
+    // Rings of 4096 bytes, less their header.
+    CHECK_EQ(Socket_WriteSpace(sock), (4096 - 64 - RING_OVERHEAD));
+    Socket_RingStats ringStats;
+    CHECK_EQ(Socket_GetRingStats(sock, &ringStats), ERROR_NONE);
+    CHECK_EQ(ringStats.txCapacity, (4096 - 64));
+    CHECK_EQ(ringStats.rxCapacity, (4096 - 64));
+
+    static const char hello[] = "hello";
+    CHECK_EQ(Socket_Write(sock, &A7ID, hello, sizeof(hello)), ERROR_NONE);
+    char         text[16];
+    uint32_t     size = sizeof(text);
+    Component_Id id;
+    CHECK_EQ(A7_Read(a7, &id, text, &size), ERROR_NONE);
+    CHECK_EQ(size, sizeof(hello));
+    CHECK(strcmp(text, hello) == 0);
+    CHECK(memcmp(&id, &A7ID, sizeof(id)) == 0);
+
+    static const char world[] = "world";
+    uint32_t interrupts = rxInterrupts;
+    CHECK_EQ(A7_Write(a7, world, sizeof(world)), ERROR_NONE);
+    Host_WaitForInterrupt();
+    CHECK(rxInterrupts > interrupts);
+    size = sizeof(text);
+    CHECK_EQ(Socket_Read(sock, &id, text, &size), ERROR_NONE);
+    CHECK_EQ(size, sizeof(world));
+    CHECK(strcmp(text, world) == 0);
+    CHECK(memcmp(&id, &A7ID, sizeof(id)) == 0);
+    CHECK_EQ(Socket_Read(sock, &id, text, &size), ERROR_SOCKET_INSUFFICIENT_SPACE);
+
+    // Too big for any ring.
+    static uint8_t big[SOCKET_MAX_PAYLOAD_LEN + 1];
+    CHECK_EQ(Socket_Write(sock, &A7ID, big, sizeof(big)), ERROR_SOCKET_INSUFFICIENT_SPACE);
+
+    closeSocket();
+}
+
+typedef struct {
+    uint32_t *received;
+    uint32_t  max;
+} EchoCheck;
+
+static void echoMessage(Socket *socket, const Component_Id *sender,
+                        const Socket_Payload *payload, void *user_data)
+{
+    static uint8_t data[SOCKET_MAX_PAYLOAD_LEN];
+    EchoCheck *check = user_data;
+    uint32_t   size  = (payload->size[0] + payload->size[1]);
+    CHECK(size <= sizeof(data));
+    Socket_PayloadRead(payload, 0, data, size);
+    CHECK(memcmp(sender, &A7ID, sizeof(A7ID)) == 0);
+    CHECK(msgCheck(data, size, *check->received, check->max));
+    (*check->received)++;
+}
+
+// Writes a message, in turn with Socket_Write and built in place with a
+// reservation larger than it.
+static bool echoWrite(uint32_t seq, uint32_t max)
+{
+    static uint8_t data[SOCKET_MAX_PAYLOAD_LEN];
+    uint32_t size = msgSize(seq, max);
+    msgFill(data, seq, size);
+
+    int32_t error;
+    if ((seq % 2) == 0) {
+        error = Socket_Write(sock, &A7ID, data, size);
+    } else {
+        Socket_Payload payload;
+        uint32_t reserve = ((size + 100) > max) ? max : (size + 100);
+        error = Socket_WriteReserve(sock, &A7ID, reserve, &payload);
+        if (error == ERROR_NONE) {
+            Socket_PayloadWrite(&payload, 0, data, size);
+            CHECK_EQ(Socket_WriteCommit(sock, size), ERROR_NONE);
+        }
+    }
+
+    CHECK((error == ERROR_NONE) || (error == ERROR_SOCKET_INSUFFICIENT_SPACE));
+    return (error == ERROR_NONE);
+}
+
+// Reads messages, in turn with Socket_Read, peeking, and all at once.
+static bool echoRead(uint32_t *received, uint32_t max)
+{
+    static uint8_t data[SOCKET_MAX_PAYLOAD_LEN];
+    Component_Id   sender;
+
+    switch (*received % 3) {
+    case 0: {
+        uint32_t size  = sizeof(data);
+        int32_t  error = Socket_Read(sock, &sender, data, &size);
+        if (error != ERROR_NONE) {
+            CHECK_EQ(error, ERROR_SOCKET_INSUFFICIENT_SPACE);
+            return false;
+        }
+        CHECK(memcmp(&sender, &A7ID, sizeof(A7ID)) == 0);
+        CHECK(msgCheck(data, size, *received, max));
+        (*received)++;
+        return true;
+    }
+
+    case 1: {
+        Socket_Payload payload;
+        if (Socket_ReadPeek(sock, &sender, &payload) != ERROR_NONE) {
+            return false;
+        }
+        echoMessage(sock, &sender, &payload, &(EchoCheck){ received, max });
+        CHECK_EQ(Socket_ReadRelease(sock), ERROR_NONE);
+        return true;
+    }
+
+    default: {
+        uint32_t count;
+        EchoCheck check = { received, max };
+        CHECK_EQ(Socket_ForEachMessage(sock, echoMessage, &check, &count), ERROR_NONE);
+        return (count > 0);
+    }
+    }
+}
+
+// Messages go round through the A7 and back, with both threads running flat
+// out, on rings of various sizes whose indices start anywhere.
+static void testEcho(void)
+{
+    static const struct {
+        unsigned rxOrder;
+        unsigned txOrder;
+        uint32_t offset;
+    } configs[] = {
+        { 10, 10, (1024 - 64 - 16) },
+        { 12, 10, 512 },
+        { 11, 13, 1008 },
+        { 16, 16, 0 },
+    };
+
+    unsigned c;
+    for (c = 0; c < (sizeof(configs) / sizeof(configs[0])); c++) {
+        openSocket(configs[c].rxOrder, configs[c].txOrder, configs[c].offset);
+
+        // Only messages which fit in an empty ring can be sent.
+        unsigned order = ((configs[c].rxOrder < configs[c].txOrder)
+            ? configs[c].rxOrder : configs[c].txOrder);
+        uint32_t max = ((1U << order) - 64 - RING_OVERHEAD);
+        if (max > SOCKET_MAX_PAYLOAD_LEN) {
+            max = SOCKET_MAX_PAYLOAD_LEN;
+        }
+
+        peerStart(peerEcho, true, max);
+
+        const uint32_t count = 3000;
+        uint32_t sent = 0, received = 0;
+        while (received < count) {
+            bool progress = false;
+            if ((sent < count) && echoWrite(sent, max)) {
+                sent++;
+                progress = true;
+            }
+            if (echoRead(&received, max)) {
+                progress = true;
+            }
+            if (!progress) {
+                Host_WaitForInterrupt();
+            }
+        }
+        peerStop();
+        CHECK_EQ(received, count);
+
+        A7_Stats stats;
+        A7_GetStats(a7, &stats);
+        CHECK_EQ(stats.readMessages, count);
+        CHECK_EQ(stats.writeMessages, count);
+
+        Socket_RingStats ringStats;
+        CHECK_EQ(Socket_GetRingStats(sock, &ringStats), ERROR_NONE);
+        CHECK_EQ(ringStats.txMessages, count);
+        CHECK_EQ(ringStats.rxMessages, count);
+        CHECK(ringStats.txWraps > 0);
+        CHECK(ringStats.rxWraps > 0);
+        CHECK(ringStats.txPeak <= ringStats.txCapacity);
+
+        closeSocket();
+    }
+}
+
+// Fills the ring with the A7 not reading, returns the number of messages.
+static uint32_t fillRing(uint32_t seq, uint32_t max)
+{
+    static uint8_t data[SOCKET_MAX_PAYLOAD_LEN];
+    uint32_t count = 0;
+    for (;;) {
+        uint32_t size = msgSize(seq + count, max);
+        msgFill(data, (seq + count), size);
+        if (Socket_Write(sock, &A7ID, data, size) != ERROR_NONE) {
+            return count;
+        }
+        count++;
+    }
+}
+
+static void testFlowControl(void)
+{
+    const uint32_t max = 100;
+    openSocket(12, 12, 0);
+    Socket_SetSpaceCallback(sock, spaceCallback);
+    peerStart(peerSink, false, max);
+
+    // A full ring refuses a message once per write, however many times it
+    // was tried.
+    uint32_t seq = fillRing(0, max);
+    CHECK(seq > 0);
+    static uint8_t data[SOCKET_MAX_PAYLOAD_LEN];
+    uint32_t size = msgSize(seq, max);
+    msgFill(data, seq, size);
+    CHECK_EQ(Socket_Write(sock, &A7ID, data, size), ERROR_SOCKET_INSUFFICIENT_SPACE);
+
+    Socket_Stats     stats;
+    Socket_RingStats ringStats;
+    Socket_GetStats(sock, &stats);
+    Socket_GetRingStats(sock, &ringStats);
+    CHECK_EQ(stats.writeDropped, 2);
+    CHECK_EQ(ringStats.txRejected, 2);
+    CHECK_EQ(stats.writeTimeouts, 0);
+
+    // Waiting spins on the ring until the timeout.
+    uint64_t start = Host_Now();
+    CHECK_EQ(Socket_WriteWait(sock, &A7ID, data, size, 20000), ERROR_SOCKET_INSUFFICIENT_SPACE);
+    CHECK(elapsedMicrosec(start) >= 20000);
+    Socket_GetStats(sock, &stats);
+    Socket_GetRingStats(sock, &ringStats);
+    CHECK_EQ(stats.writeTimeouts, 1);
+    CHECK(stats.writeWaitTime >= 20000);
+    CHECK_EQ(stats.writeDropped, 3);
+    CHECK_EQ(ringStats.txRejected, 3);
+
+    // Given an overflow buffer, it's only used once the wait times out.
+    static uint32_t overflow[256];
+    CHECK_EQ(Socket_SetOverflow(sock, overflow, sizeof(overflow)), ERROR_NONE);
+    start = Host_Now();
+    CHECK_EQ(Socket_WriteWait(sock, &A7ID, data, size, 10000), ERROR_NONE);
+    CHECK(elapsedMicrosec(start) >= 10000);
+    seq++;
+    size = msgSize(seq, max);
+    msgFill(data, seq, size);
+    CHECK_EQ(Socket_Write(sock, &A7ID, data, size), ERROR_NONE);
+    seq++;
+
+    Socket_GetStats(sock, &stats);
+    Socket_GetRingStats(sock, &ringStats);
+    CHECK_EQ(stats.writeTimeouts, 2);
+    CHECK_EQ(stats.writeOverflowed, 2);
+    CHECK_EQ(stats.writeDropped, 3);
+    CHECK_EQ(ringStats.txRejected, 3);
+    CHECK(Socket_OverflowUsed(sock) > 0);
+
+    // Once the A7 reads, the space callback drains the overflow buffer and
+    // everything arrives in order.
+    peerSet(&peer.reading, true);
+    while (Socket_OverflowUsed(sock) > 0) {
+        Host_WaitForInterrupt();
+    }
+    peerWaitFor(&peer.received, seq);
+    CHECK(spaceCalls > 0);
+    CHECK_EQ(peerCount(&peer.received), seq);
+
+    // Reservations don't overtake messages in the overflow buffer. Without
+    // the space callback, the overflow buffer is left for the reservation to
+    // drain once the A7 has emptied the ring.
+    Socket_SetSpaceCallback(sock, NULL);
+    peerSet(&peer.reading, false);
+    sleepMicrosec(10000);
+    CHECK_EQ(Socket_SetOverflow(sock, NULL, 0), ERROR_NONE);
+    seq += fillRing(seq, max);
+    CHECK_EQ(Socket_SetOverflow(sock, overflow, sizeof(overflow)), ERROR_NONE);
+    uint32_t i;
+    for (i = 0; i < 2; i++, seq++) {
+        size = msgSize(seq, max);
+        msgFill(data, seq, size);
+        CHECK_EQ(Socket_Write(sock, &A7ID, data, size), ERROR_NONE);
+    }
+    Socket_Payload payload;
+    CHECK_EQ(Socket_WriteReserve(sock, &A7ID, 4, &payload), ERROR_SOCKET_INSUFFICIENT_SPACE);
+
+    peerSet(&peer.reading, true);
+    peerWaitFor(&peer.received, (seq - 2));
+    CHECK(Socket_OverflowUsed(sock) > 0);
+    size = msgSize(seq, max);
+    msgFill(data, seq, size);
+    CHECK_EQ(Socket_WriteReserve(sock, &A7ID, size, &payload), ERROR_NONE);
+    CHECK_EQ(Socket_OverflowUsed(sock), 0);
+    Socket_PayloadWrite(&payload, 0, data, size);
+    CHECK_EQ(Socket_WriteCommit(sock, size), ERROR_NONE);
+    seq++;
+    peerWaitFor(&peer.received, seq);
+    Socket_SetSpaceCallback(sock, spaceCallback);
+    CHECK_EQ(Socket_SetOverflow(sock, NULL, 0), ERROR_NONE);
+
+    // A wait which the A7 makes space for in time doesn't time out.
+    peerSet(&peer.reading, false);
+    sleepMicrosec(10000);
+    seq += fillRing(seq, max);
+    __atomic_store_n(&peer.resumeAt, (Host_Now() + 5000000), __ATOMIC_RELEASE);
+    size = msgSize(seq, max);
+    msgFill(data, seq, size);
+    Socket_ResetStats(sock);
+    CHECK_EQ(Socket_WriteWait(sock, &A7ID, data, size, 1000000), ERROR_NONE);
+    seq++;
+    Socket_GetStats(sock, &stats);
+    CHECK_EQ(stats.writeTimeouts, 0);
+    CHECK_EQ(stats.writeOverflowed, 0);
+    CHECK_EQ(stats.writeDropped, 0);
+    CHECK(stats.writeWaitTime > 0);
+    peerWaitFor(&peer.received, seq);
+
+    // Latency covers the whole time the A7 holds messages back, even once
+    // their space has been reused before the RTApp hears they were read.
+    __atomic_store_n(&peer.resumeAt, 0, __ATOMIC_RELEASE);
+    peerSet(&peer.reading, false);
+    sleepMicrosec(10000);
+    Host_PollInterrupts();
+    Socket_ResetRingStats(sock);
+    uint32_t held = fillRing(seq, max);
+    seq += held;
+    __atomic_store_n(&peer.resumeAt, (Host_Now() + 20000000), __ATOMIC_RELEASE);
+    peerWaitFor(&peer.received, seq);
+    size = msgSize(seq, max);
+    msgFill(data, seq, size);
+    CHECK_EQ(Socket_Write(sock, &A7ID, data, size), ERROR_NONE);
+    seq++;
+    Socket_GetRingStats(sock, &ringStats);
+    CHECK_EQ(ringStats.latencyCount,
+             (held < SOCKET_LATENCY_STAMPS ? held : SOCKET_LATENCY_STAMPS));
+    CHECK(ringStats.latencyMin >= 20000);
+
+    peerWaitFor(&peer.received, seq);
+    peerStop();
+    Socket_SetSpaceCallback(sock, NULL);
+    closeSocket();
+}
+
+static void testBatching(void)
+{
+    const uint32_t max = 100;
+    openSocket(12, 12, 0);
+    peer.max = max;
+
+    // Corked messages aren't published until uncorked, with one interrupt.
+    static uint8_t data[SOCKET_MAX_PAYLOAD_LEN];
+    uint32_t seq;
+    Socket_Cork(sock);
+    for (seq = 0; seq < 5; seq++) {
+        msgFill(data, seq, msgSize(seq, max));
+        CHECK_EQ(Socket_Write(sock, &A7ID, data, msgSize(seq, max)), ERROR_NONE);
+    }
+    CHECK_EQ(A7_ReadPending(a7), 0);
+    Socket_Uncork(sock);
+    CHECK(A7_ReadPending(a7) > 0);
+
+    Socket_Stats stats;
+    Socket_GetStats(sock, &stats);
+    CHECK_EQ(stats.writeMessages, 5);
+    CHECK_EQ(stats.writeSignals, 1);
+
+    uint32_t     received;
+    Component_Id id;
+    for (received = 0; received < 5; received++) {
+        uint32_t size = sizeof(data);
+        CHECK_EQ(A7_Read(a7, &id, data, &size), ERROR_NONE);
+        CHECK(msgCheck(data, size, received, max));
+    }
+
+    // Held back by size until enough bytes are waiting.
+    uint32_t bytes = (msgSize(seq, max) + msgSize(seq + 1, max));
+    CHECK_EQ(Socket_SetCoalescing(sock, bytes, NULL, 0), ERROR_NONE);
+    msgFill(data, seq, msgSize(seq, max));
+    CHECK_EQ(Socket_Write(sock, &A7ID, data, msgSize(seq, max)), ERROR_NONE);
+    seq++;
+    CHECK_EQ(A7_ReadPending(a7), 0);
+    msgFill(data, seq, msgSize(seq, max));
+    CHECK_EQ(Socket_Write(sock, &A7ID, data, msgSize(seq, max)), ERROR_NONE);
+    seq++;
+    CHECK(A7_ReadPending(a7) > 0);
+
+    // Held back by time, until the timer's interrupt.
+    GPT *timer = GPT_Open(MT3620_UNIT_GPT1, 1000000, GPT_MODE_ONE_SHOT);
+    CHECK(timer);
+    CHECK_EQ(Socket_SetCoalescing(sock, 0, timer, 2000), ERROR_NONE);
+    uint64_t start = Host_Now();
+    msgFill(data, seq, msgSize(seq, max));
+    CHECK_EQ(Socket_Write(sock, &A7ID, data, msgSize(seq, max)), ERROR_NONE);
+    seq++;
+    uint32_t pending = A7_ReadPending(a7);
+    while (A7_ReadPending(a7) == pending) {
+        Host_WaitForInterrupt();
+    }
+    CHECK(elapsedMicrosec(start) >= 2000);
+
+    // Corking overrides both limits, including a timer already running.
+    CHECK_EQ(Socket_SetCoalescing(sock, bytes, timer, 2000), ERROR_NONE);
+    pending = A7_ReadPending(a7);
+    msgFill(data, seq, msgSize(seq, max));
+    CHECK_EQ(Socket_Write(sock, &A7ID, data, msgSize(seq, max)), ERROR_NONE);
+    seq++;
+    Socket_Cork(sock);
+    uint32_t corked;
+    for (corked = 0; corked < 4; corked++, seq++) {
+        msgFill(data, seq, msgSize(seq, max));
+        CHECK_EQ(Socket_Write(sock, &A7ID, data, msgSize(seq, max)), ERROR_NONE);
+    }
+    sleepMicrosec(4000);
+    Host_PollInterrupts();
+    CHECK_EQ(A7_ReadPending(a7), pending);
+
+    Socket_GetStats(sock, &stats);
+    uint32_t signals = stats.writeSignals;
+    Socket_Uncork(sock);
+    CHECK(A7_ReadPending(a7) > pending);
+    Socket_GetStats(sock, &stats);
+    CHECK_EQ(stats.writeSignals, (signals + 1));
+    CHECK_EQ(Socket_SetCoalescing(sock, 0, NULL, 0), ERROR_NONE);
+    GPT_Close(timer);
+
+    for (; received < seq; received++) {
+        uint32_t size = sizeof(data);
+        CHECK_EQ(A7_Read(a7, &id, data, &size), ERROR_NONE);
+        CHECK(msgCheck(data, size, received, max));
+    }
+
+    // A refused write hands over what's held back, but only blocks to do so
+    // when there's something to hand over.
+    Socket_Cork(sock);
+    seq += fillRing(seq, max);
+    CHECK(A7_ReadPending(a7) > 0);
+    Socket_GetStats(sock, &stats);
+    signals = stats.writeSignals;
+    msgFill(data, seq, msgSize(seq, max));
+    CHECK_EQ(Socket_Write(sock, &A7ID, data, msgSize(seq, max)), ERROR_SOCKET_INSUFFICIENT_SPACE);
+    Socket_GetStats(sock, &stats);
+    CHECK_EQ(stats.writeSignals, signals);
+    Socket_Uncork(sock);
+
+    for (; received < seq; received++) {
+        uint32_t size = sizeof(data);
+        CHECK_EQ(A7_Read(a7, &id, data, &size), ERROR_NONE);
+        CHECK(msgCheck(data, size, received, max));
+    }
+    CHECK_EQ(A7_ReadPending(a7), 0);
+
+    closeSocket();
+}
+
+static void *peerRenegotiate(void *arg)
+{
+    sleepMicrosec(10000);
+    if (!A7_Renegotiate(a7, 11, 13, 64)) {
+        __atomic_fetch_add(&peer.errors, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void testRenegotiate(void)
+{
+    openSocket(12, 12, 0);
+    renegotiate = true;
+
+    // The HLApp restarts with new buffers, which the RTApp picks up from the
+    // FIFO interrupt without blocking.
+    peerStart(peerRenegotiate, false, 0);
+    CHECK(pthread_join(peer.thread, NULL) == 0);
+    CHECK_EQ(peer.errors, 0);
+    do {
+        Host_WaitForInterrupt();
+    } while (Socket_NegotiateStatus(sock) != ERROR_NONE);
+
+    Socket_RingStats ringStats;
+    CHECK_EQ(Socket_GetRingStats(sock, &ringStats), ERROR_NONE);
+    CHECK_EQ(ringStats.txCapacity, (2048 - 64));
+    CHECK_EQ(ringStats.rxCapacity, (8192 - 64));
+
+    static const char hello[] = "hello again";
+    CHECK_EQ(Socket_Write(sock, &A7ID, hello, sizeof(hello)), ERROR_NONE);
+    char         text[16];
+    uint32_t     size = sizeof(text);
+    Component_Id id;
+    CHECK_EQ(A7_Read(a7, &id, text, &size), ERROR_NONE);
+    CHECK(strcmp(text, hello) == 0);
+
+    // With nothing from the HLApp the negotiation times out, and nothing can
+    // be written until it sends descriptors, not even to the overflow buffer.
+    static uint32_t overflow[64];
+    CHECK_EQ(Socket_SetOverflow(sock, overflow, sizeof(overflow)), ERROR_NONE);
+    CHECK_EQ(Socket_NegotiateStart(sock, 5000), ERROR_BUSY);
+    while (Socket_NegotiateStatus(sock) == ERROR_BUSY) {
+        sleepMicrosec(1000);
+    }
+    CHECK_EQ(Socket_NegotiateStatus(sock), ERROR_SOCKET_NEGOTIATION);
+    CHECK_EQ(Socket_Write(sock, &A7ID, hello, sizeof(hello)), ERROR_SOCKET_NEGOTIATION);
+    CHECK_EQ(Socket_OverflowUsed(sock), 0);
+    Socket_Payload payload;
+    CHECK_EQ(Socket_WriteReserve(sock, &A7ID, sizeof(hello), &payload),
+             ERROR_SOCKET_NEGOTIATION);
+
+    CHECK(A7_Renegotiate(a7, 12, 12, 0));
+    while (Socket_NegotiateStatus(sock) != ERROR_NONE) {
+        Host_WaitForInterrupt();
+    }
+    CHECK_EQ(Socket_Write(sock, &A7ID, hello, sizeof(hello)), ERROR_NONE);
+    size = sizeof(text);
+    CHECK_EQ(A7_Read(a7, &id, text, &size), ERROR_NONE);
+    CHECK(strcmp(text, hello) == 0);
+    CHECK_EQ(Socket_SetOverflow(sock, NULL, 0), ERROR_NONE);
+
+    // Given a timer, the timeout fires from its interrupt without a clock or
+    // anything checking the status, and a negotiation which completes first
+    // stops it.
+    GPT *timer = GPT_Open(MT3620_UNIT_GPT1, 1000000, GPT_MODE_NONE);
+    CHECK(timer);
+    CHECK_EQ(Socket_SetNegotiateTimer(sock, timer), ERROR_NONE);
+    Socket_SetClock(sock, NULL);
+    Socket_SetSpaceCallback(sock, spaceCallback);
+    Host_PollInterrupts();
+    uint32_t calls = spaceCalls;
+    uint64_t start = Host_Now();
+    CHECK_EQ(Socket_NegotiateStart(sock, 5000), ERROR_BUSY);
+    CHECK_EQ(Socket_SetNegotiateTimer(sock, timer), ERROR_BUSY);
+    while (spaceCalls == calls) {
+        Host_WaitForInterrupt();
+    }
+    CHECK(elapsedMicrosec(start) >= 5000);
+    CHECK_EQ(spaceCalls, (calls + 1));
+    CHECK_EQ(Socket_NegotiateStatus(sock), ERROR_SOCKET_NEGOTIATION);
+
+    CHECK_EQ(Socket_NegotiateStart(sock, 1000000), ERROR_BUSY);
+    CHECK(GPT_IsEnabled(timer));
+    CHECK(A7_Renegotiate(a7, 12, 12, 0));
+    while (Socket_NegotiateStatus(sock) != ERROR_NONE) {
+        Host_WaitForInterrupt();
+    }
+    CHECK(!GPT_IsEnabled(timer));
+    CHECK_EQ(Socket_SetNegotiateTimer(sock, NULL), ERROR_NONE);
+    Socket_SetSpaceCallback(sock, NULL);
+    Socket_SetClock(sock, freerun);
+    GPT_Close(timer);
+
+    renegotiate = false;
+    closeSocket();
+}
+
+// Reassembles streamed payloads, as socket_stream.c does in the HLApp.
+static struct {
+    uint8_t  buffer[16384];
+    bool     active;
+    uint32_t seq;
+    uint32_t length;
+    uint32_t offset;
+    uint32_t payloads;
+    uint32_t dropped;
+} stream;
+
+static void *peerStream(void *arg)
+{
+    static uint8_t data[SOCKET_MAX_PAYLOAD_LEN];
+    while (!peerFlag(&peer.stop)) {
+        if (!peerFlag(&peer.reading)) {
+            sleepMicrosec(100);
+            continue;
+        }
+
+        Component_Id recipient;
+        uint32_t     size  = sizeof(data);
+        int32_t      error = A7_Read(a7, &recipient, data, &size);
+        if (error == ERROR_SOCKET_INSUFFICIENT_SPACE) {
+            A7_Wait(a7, 1000000);
+            continue;
+        }
+
+        SocketStream_Header header;
+        memcpy(&header, data, sizeof(header));
+        if ((error != ERROR_NONE) || (size <= sizeof(header))
+            || (header.magic != SOCKET_STREAM_MAGIC)
+            || (header.length > sizeof(stream.buffer))) {
+            __atomic_fetch_add(&peer.errors, 1, __ATOMIC_RELEASE);
+            break;
+        }
+
+        uint32_t len = (size - sizeof(header));
+        if (!stream.active || (header.seq != stream.seq) || (header.offset != stream.offset)
+            || (header.length != stream.length)) {
+            if (stream.active) {
+                __atomic_fetch_add(&stream.dropped, 1, __ATOMIC_RELEASE);
+            }
+            stream.active = (header.offset == 0);
+            stream.length = header.length;
+            stream.offset = 0;
+        }
+        stream.seq = (header.seq + 1);
+        if (!stream.active || (len > (stream.length - stream.offset))) {
+            stream.active = false;
+            continue;
+        }
+
+        memcpy(&stream.buffer[stream.offset], &data[sizeof(header)], len);
+        stream.offset += len;
+        if (stream.offset == stream.length) {
+            stream.active = false;
+            uint32_t i;
+            for (i = 0; i < stream.length; i++) {
+                if (stream.buffer[i] != (uint8_t)(i * 13)) {
+                    __atomic_fetch_add(&peer.errors, 1, __ATOMIC_RELEASE);
+                    break;
+                }
+            }
+            __atomic_fetch_add(&stream.payloads, 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+static void streamSend(SocketStream *socketStream, const uint8_t *data, uint32_t size)
+{
+    int32_t error = SocketStream_Send(socketStream, &A7ID, data, size);
+    while (error == ERROR_SOCKET_INSUFFICIENT_SPACE) {
+        Host_WaitForInterrupt();
+        error = SocketStream_Pump(socketStream);
+    }
+    CHECK_EQ(error, ERROR_NONE);
+}
+
+static void testStream(void)
+{
+    static uint8_t data[12000];
+    uint32_t i;
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 13);
+    }
+
+    openSocket(12, 12, 0);
+    memset(&stream, 0, sizeof(stream));
+    SocketStream *socketStream = SocketStream_Open(sock, NULL, 0, NULL);
+    CHECK(socketStream);
+    peerStart(peerStream, true, 0);
+
+    // Payloads larger than the ring go through as the A7 makes space.
+    const uint32_t count = 5;
+    for (i = 0; i < count; i++) {
+        streamSend(socketStream, data, sizeof(data));
+    }
+    peerWaitFor(&stream.payloads, count);
+
+    // A payload abandoned part way lets the next one be sent, and the A7
+    // drops the fragments it had.
+    peerSet(&peer.reading, false);
+    sleepMicrosec(10000);
+    CHECK_EQ(SocketStream_Send(socketStream, &A7ID, data, sizeof(data)),
+             ERROR_SOCKET_INSUFFICIENT_SPACE);
+    CHECK_EQ(SocketStream_Send(socketStream, &A7ID, data, sizeof(data)), ERROR_BUSY);
+    SocketStream_Cancel(socketStream);
+    CHECK(!SocketStream_Sending(socketStream));
+    peerSet(&peer.reading, true);
+    streamSend(socketStream, data, 2000);
+    peerWaitFor(&stream.payloads, (count + 1));
+    CHECK_EQ(__atomic_load_n(&stream.dropped, __ATOMIC_ACQUIRE), 1);
+
+    peerStop();
+    SocketStream_Close(socketStream);
+    closeSocket();
+}
+
+// Channel messages carry their sequence number within the channel, sized as
+// msgSize gives.
+#define CHANNEL_MAX 100
+
+static int32_t channelWrite(SocketChannel *channel, uint32_t seq)
+{
+    static uint8_t data[CHANNEL_MAX];
+    msgFill(data, seq, msgSize(seq, CHANNEL_MAX));
+    return SocketChannel_Write(channel, data, msgSize(seq, CHANNEL_MAX));
+}
+
+// Reads the next message on the A7, checking which channel it's on.
+static void channelRead(uint8_t id, uint32_t seq)
+{
+    static uint8_t data[SOCKET_MAX_PAYLOAD_LEN];
+    Component_Id recipient;
+    uint32_t     size = sizeof(data);
+    CHECK_EQ(A7_Read(a7, &recipient, data, &size), ERROR_NONE);
+
+    SocketChannel_Header header;
+    CHECK(size > sizeof(header));
+    memcpy(&header, data, sizeof(header));
+    CHECK_EQ(header.magic, SOCKET_CHANNEL_MAGIC);
+    CHECK_EQ(header.channel, id);
+    CHECK(msgCheck(&data[sizeof(header)], (size - sizeof(header)), seq, CHANNEL_MAX));
+}
+
+// Fills the ring with single byte messages, leaving room for at most the
+// number of bytes given.
+static uint32_t fillBytes(uint32_t space)
+{
+    static const uint8_t byte = 0x42;
+    uint32_t count = 0;
+    while (Socket_WriteSpace(sock) > space) {
+        CHECK_EQ(Socket_Write(sock, &A7ID, &byte, sizeof(byte)), ERROR_NONE);
+        count++;
+    }
+    return count;
+}
+
+static void readBytes(uint32_t count)
+{
+    uint8_t      data[SOCKET_MAX_PAYLOAD_LEN];
+    Component_Id recipient;
+    for (; count > 0; count--) {
+        uint32_t size = sizeof(data);
+        CHECK_EQ(A7_Read(a7, &recipient, data, &size), ERROR_NONE);
+        CHECK_EQ(size, 1);
+    }
+}
+
+static void testChannelQueue(void)
+{
+    openSocket(12, 12, 0);
+
+    // A queue which only holds a few messages, so that it wraps often.
+    static uint32_t queue[64];
+    memset(queue, 0, sizeof(queue));
+    SocketChannel *channel = SocketChannel_Open(sock, 1, 0, &A7ID, queue, sizeof(queue), NULL);
+    CHECK(channel);
+
+    // Each round writes until the queue is full, then the A7 reads a few and
+    // the queue is pumped into the space freed. The sizes step so that the
+    // queue wraps at every position, both exactly at its end and short of
+    // it, and every message still arrives once and in order.
+    uint32_t written = 0, read = 0, refused = 0;
+    unsigned round;
+    for (round = 0; round < 200; round++) {
+        while (channelWrite(channel, written) == ERROR_NONE) {
+            written++;
+        }
+        refused++;
+        CHECK(SocketChannel_Queued(channel) > 0);
+
+        unsigned i;
+        for (i = 0; i < 3; i++) {
+            channelRead(1, read++);
+        }
+        SocketChannel_Pump(sock);
+    }
+    while (read < written) {
+        channelRead(1, read++);
+        SocketChannel_Pump(sock);
+    }
+    CHECK_EQ(SocketChannel_Queued(channel), 0);
+    CHECK_EQ(A7_ReadPending(a7), 0);
+
+    SocketChannel_Stats stats;
+    SocketChannel_GetStats(channel, &stats);
+    CHECK_EQ(stats.sent, written);
+    CHECK_EQ(stats.rejected, refused);
+    CHECK(stats.queued > (3 * sizeof(queue) / (CHANNEL_MAX + 4)));
+
+    // Wrapping short of the end leaves a marker where the next record would
+    // have started.
+    bool marked = false;
+    unsigned i;
+    for (i = 0; i < (sizeof(queue) / sizeof(queue[0])); i++) {
+        marked |= (queue[i] == 0xFFFFFFFF);
+    }
+    CHECK(marked);
+
+    // Without a queue, a message the ring can't take is refused.
+    SocketChannel_Close(channel);
+    channel = SocketChannel_Open(sock, 1, 0, &A7ID, NULL, 0, NULL);
+    CHECK(channel);
+    uint32_t bytes = fillBytes(0);
+    CHECK_EQ(channelWrite(channel, 0), ERROR_SOCKET_INSUFFICIENT_SPACE);
+    readBytes(bytes);
+    CHECK_EQ(channelWrite(channel, 0), ERROR_NONE);
+    channelRead(1, 0);
+
+    SocketChannel_Close(channel);
+    closeSocket();
+}
+
+static void testChannelPriority(void)
+{
+    openSocket(12, 12, 0);
+
+    // Opened out of priority order, and each numbered by its priority.
+    static uint32_t queues[3][64];
+    SocketChannel *bulk    = SocketChannel_Open(sock, 2, 2, &A7ID, queues[0], sizeof(queues[0]), NULL);
+    SocketChannel *control = SocketChannel_Open(sock, 0, 0, &A7ID, queues[1], sizeof(queues[1]), NULL);
+    SocketChannel *status  = SocketChannel_Open(sock, 1, 1, &A7ID, queues[2], sizeof(queues[2]), NULL);
+    CHECK(bulk && control && status);
+
+    // With the ring full everything is queued, then pumped highest priority
+    // first once the A7 has made room.
+    uint32_t bytes = fillBytes(0);
+    uint32_t seq;
+    for (seq = 0; seq < 2; seq++) {
+        CHECK_EQ(channelWrite(bulk, seq), ERROR_NONE);
+        CHECK_EQ(channelWrite(status, seq), ERROR_NONE);
+        CHECK_EQ(channelWrite(control, seq), ERROR_NONE);
+    }
+    CHECK_EQ(SocketChannel_Queued(bulk), 2);
+    CHECK_EQ(SocketChannel_Queued(status), 2);
+    CHECK_EQ(SocketChannel_Queued(control), 2);
+
+    readBytes(bytes);
+    SocketChannel_Pump(sock);
+    uint8_t id;
+    for (id = 0; id < 3; id++) {
+        channelRead(id, 0);
+        channelRead(id, 1);
+    }
+    CHECK_EQ(A7_ReadPending(a7), 0);
+
+    // With less free than a priority's headroom, lower priorities queue
+    // while control messages still go straight to the ring.
+    bytes = fillBytes(200);
+    CHECK_EQ(channelWrite(status, 2), ERROR_NONE);
+    CHECK_EQ(channelWrite(control, 2), ERROR_NONE);
+    CHECK_EQ(channelWrite(bulk, 2), ERROR_NONE);
+    CHECK_EQ(SocketChannel_Queued(status), 1);
+    CHECK_EQ(SocketChannel_Queued(control), 0);
+    CHECK_EQ(SocketChannel_Queued(bulk), 1);
+
+    readBytes(bytes);
+    channelRead(0, 2);
+    CHECK_EQ(A7_ReadPending(a7), 0);
+    SocketChannel_Pump(sock);
+    channelRead(1, 2);
+    channelRead(2, 2);
+
+    SocketChannel_Stats stats;
+    SocketChannel_GetStats(control, &stats);
+    CHECK_EQ(stats.sent, 3);
+    CHECK_EQ(stats.queued, 2);
+    SocketChannel_GetStats(bulk, &stats);
+    CHECK_EQ(stats.sent, 3);
+    CHECK_EQ(stats.queued, 3);
+
+    SocketChannel_Close(status);
+    SocketChannel_Close(control);
+    SocketChannel_Close(bulk);
+    closeSocket();
+}
+
+static uint32_t channelReceived[4];
+static uint32_t channelCount = 0;
+
+static void channelCallback(SocketChannel *channel, const Component_Id *sender,
+                            const Socket_Payload *payload)
+{
+    uint8_t  data[CHANNEL_MAX];
+    uint32_t size = (payload->size[0] + payload->size[1]);
+    CHECK((size >= sizeof(uint32_t)) && (size <= sizeof(data)));
+    CHECK(memcmp(sender, &A7ID, sizeof(A7ID)) == 0);
+    Socket_PayloadRead(payload, 0, data, size);
+
+    uint32_t seq;
+    memcpy(&seq, data, sizeof(seq));
+    CHECK(msgCheck(data, size, seq, CHANNEL_MAX));
+    CHECK(channelCount < 4);
+    channelReceived[channelCount++] = seq;
+}
+
+static void testChannelReceive(void)
+{
+    openSocket(12, 12, 0);
+    SocketChannel *channel = SocketChannel_Open(sock, 3, 0, &A7ID, NULL, 0, channelCallback);
+    CHECK(channel);
+
+    // Channel messages go to their channel's callback without the header,
+    // others are left for the caller, and those for other channels dropped.
+    uint8_t data[sizeof(SocketChannel_Header) + CHANNEL_MAX];
+    SocketChannel_Header header = { .magic = SOCKET_CHANNEL_MAGIC };
+    uint32_t seq;
+    for (seq = 0; seq < 4; seq++) {
+        header.channel = ((seq == 2) ? 4 : 3);
+        memcpy(data, &header, sizeof(header));
+        msgFill(&data[sizeof(header)], seq, msgSize(seq, CHANNEL_MAX));
+        CHECK_EQ(A7_Write(a7, data, (sizeof(header) + msgSize(seq, CHANNEL_MAX))), ERROR_NONE);
+    }
+    static const char hello[] = "hello";
+    CHECK_EQ(A7_Write(a7, hello, sizeof(hello)), ERROR_NONE);
+
+    uint32_t others = 0;
+    Component_Id   sender;
+    Socket_Payload payload;
+    while (Socket_ReadPeek(sock, &sender, &payload) == ERROR_NONE) {
+        if (!SocketChannel_Receive(sock, &sender, &payload)) {
+            others++;
+        }
+        CHECK_EQ(Socket_ReadRelease(sock), ERROR_NONE);
+    }
+    CHECK_EQ(others, 1);
+    CHECK_EQ(channelCount, 3);
+    CHECK_EQ(channelReceived[0], 0);
+    CHECK_EQ(channelReceived[1], 1);
+    CHECK_EQ(channelReceived[2], 3);
+
+    SocketChannel_Stats stats;
+    SocketChannel_GetStats(channel, &stats);
+    CHECK_EQ(stats.received, 3);
+
+    SocketChannel_Close(channel);
+    closeSocket();
+}
+
+int main(void)
+{
+    freerun = GPT_Open(MT3620_UNIT_GPT3, 1000000, GPT_MODE_NONE);
+    CHECK(freerun);
+    CHECK_EQ(GPT_Start_Freerun(freerun), ERROR_NONE);
+
+    testOpen();
+    testEcho();
+    testFlowControl();
+    testBatching();
+    testRenegotiate();
+    testStream();
+    testChannelQueue();
+    testChannelPriority();
+    testChannelReceive();
+
+    GPT_Close(freerun);
+    return EXIT_SUCCESS;
+}
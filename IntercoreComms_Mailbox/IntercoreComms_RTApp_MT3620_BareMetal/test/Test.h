@@ -0,0 +1,32 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef TEST_H_
+#define TEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Minimal checks for the host tests, a failed check prints where it failed
+// and aborts, so ctest reports the test as failed.
+#define CHECK(cond)                                                       \
+    do {                                                                  \
+        if (!(cond)) {                                                    \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n",                  \
+                    __FILE__, __LINE__, #cond);                           \
+            abort();                                                      \
+        }                                                                 \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                    \
+    do {                                                                  \
+        unsigned long long a_ = (unsigned long long)(a);                  \
+        unsigned long long b_ = (unsigned long long)(b);                  \
+        if (a_ != b_) {                                                   \
+            fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: 0x%llx != 0x%llx\n", \
+                    __FILE__, __LINE__, #a, #b, a_, b_);                  \
+            abort();                                                      \
+        }                                                                 \
+    } while (0)
+
+#endif // #ifndef TEST_H_
@@ -0,0 +1,36 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef MT3620_HOST_GPT_H_
+#define MT3620_HOST_GPT_H_
+
+#include "Platform.h"
+
+// Timers run on the host's monotonic clock, their callbacks are called from
+// Host_WaitForInterrupt.
+
+typedef struct GPT GPT;
+
+typedef enum {
+    GPT_MODE_ONE_SHOT,
+    GPT_MODE_REPEAT,
+    GPT_MODE_NONE,
+} GPT_Mode;
+
+typedef enum {
+    GPT_UNITS_SECOND   = 1,
+    GPT_UNITS_MILLISEC = 1000,
+    GPT_UNITS_MICROSEC = 1000000,
+} GPT_Units;
+
+GPT     *GPT_Open(int32_t id, float speedHz, GPT_Mode mode);
+void     GPT_Close(GPT *handle);
+int32_t  GPT_SetMode(GPT *handle, GPT_Mode mode);
+int32_t  GPT_Stop(GPT *handle);
+bool     GPT_IsEnabled(GPT *handle);
+int32_t  GPT_StartTimeout(GPT *handle, uint32_t timeout, GPT_Units units,
+                          void (*callback)(GPT *));
+int32_t  GPT_Start_Freerun(GPT *handle);
+uint32_t GPT_GetRunningTime(GPT *handle, GPT_Units units);
+
+#endif // #ifndef MT3620_HOST_GPT_H_
@@ -0,0 +1,49 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef MT3620_HOST_MBOX_H_
+#define MT3620_HOST_MBOX_H_
+
+#include "Platform.h"
+
+// The M4 end of the mailbox to the A7. The A7 end, used by the peer thread
+// in A7.c, is declared in Host.h.
+
+typedef struct MBox MBox;
+
+#define MBOX_FIFO_COUNT_MAX    16
+#define MBOX_SW_INT_PORT_COUNT 8
+
+typedef enum {
+    MBOX_FIFO_STATE_NOT_FULL,
+    MBOX_FIFO_STATE_NOT_EMPTY,
+} MBox_FIFO_State;
+
+// Callbacks are called from Host_WaitForInterrupt, rx_cb whenever entries
+// arrive in the FIFO from the A7. The thresholds are accepted but unused.
+MBox   *MBox_FIFO_Open(
+    Platform_Unit unit,
+    void        (*rx_cb)(void*),
+    void        (*tx_confirmed_cb)(void*),
+    void        (*fifo_state_change_cb)(void*, MBox_FIFO_State),
+    void         *user_data,
+    int8_t        non_full_threshold,
+    int8_t        non_empty_threshold);
+void    MBox_FIFO_Close(MBox *handle);
+void    MBox_FIFO_Reset(MBox *handle, bool both);
+
+int32_t MBox_FIFO_Write(MBox *handle, const uint32_t *cmd, const uint32_t *data, uintptr_t length);
+int32_t MBox_FIFO_Read(MBox *handle, uint32_t *cmd, uint32_t *data, uintptr_t length);
+// Blocks until length entries have arrived.
+int32_t MBox_FIFO_ReadSync(MBox *handle, uint32_t *cmd, uint32_t *data, uintptr_t length);
+int32_t MBox_FIFO_Reads_Available(MBox *handle);
+int32_t MBox_FIFO_Writes_Available(MBox *handle);
+
+int32_t MBox_SW_Interrupt_Setup(
+    MBox     *handle,
+    uint8_t   int_enable_flags,
+    void    (*sw_int_cb)(void*, uint8_t));
+void    MBox_SW_Interrupt_Teardown(MBox *handle);
+int32_t MBox_SW_Interrupt_Trigger(MBox *handle, uint8_t port);
+
+#endif // #ifndef MT3620_HOST_MBOX_H_
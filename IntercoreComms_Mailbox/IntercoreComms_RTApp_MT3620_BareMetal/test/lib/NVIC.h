@@ -0,0 +1,21 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef MT3620_HOST_NVIC_H_
+#define MT3620_HOST_NVIC_H_
+
+#include <stdint.h>
+
+// Interrupts are only delivered from Host_WaitForInterrupt on the thread
+// running the RTApp code, so there is nothing to block.
+static inline uint32_t NVIC_BlockIRQs(void)
+{
+    return 0;
+}
+
+static inline void NVIC_RestoreIRQs(uint32_t prevBasePri)
+{
+    (void)prevBasePri;
+}
+
+#endif // #ifndef MT3620_HOST_NVIC_H_
@@ -0,0 +1,20 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef MT3620_HOST_PLATFORM_H_
+#define MT3620_HOST_PLATFORM_H_
+
+#include "Common.h"
+
+typedef enum {
+    MT3620_UNIT_GPT0,
+    MT3620_UNIT_GPT1,
+    MT3620_UNIT_GPT2,
+    MT3620_UNIT_GPT3,
+    MT3620_UNIT_GPT4,
+    MT3620_UNIT_GPT_COUNT,
+
+    MT3620_UNIT_MBOX_CA7,
+} Platform_Unit;
+
+#endif // #ifndef MT3620_HOST_PLATFORM_H_
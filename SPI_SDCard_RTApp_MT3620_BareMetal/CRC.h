@@ -0,0 +1,21 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef CRC_H_
+#define CRC_H_
+
+#include <stdint.h>
+
+// Table driven CRCs used by the SD card protocol. These have no hardware
+// dependencies, so can also be built for the host.
+
+// CRC-ITU16 (polynomial 0x1021, MSB first) as used for SD data packets,
+// pass 0 as crc for the first call or the previous result to continue.
+uint16_t CRC_ITU16(const void *data, uintptr_t size, uint16_t crc);
+
+// CRC7 (polynomial 0x09) as used for SD commands, the result is shifted
+// left by one so it can be used directly as the last byte of a command
+// once the end bit is set.
+uint8_t  CRC_7(const void *data, uintptr_t size, uint8_t crc);
+
+#endif // #ifndef CRC_H_
@@ -0,0 +1,620 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "FAT.h"
+
+// This is the maximum number of filesystems which can be mounted at once.
+#define FAT_MAX           1
+// This is the maximum number of files which can be open at once.
+#define FAT_FILE_MAX      4
+// Number of FAT sectors cached per filesystem.
+#define FAT_CACHE_SECTORS 4
+
+#define FAT_SECTOR_LEN    512
+#define FAT_DIR_ENTRY_LEN 32
+// FAT32 directories hold at most this many entries.
+#define FAT_DIR_ENTRY_MAX 65536
+#define FAT_LFN_MAX       255
+
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_LFN       0x0F
+
+#define FAT_CLUSTER_MASK   0x0FFFFFFF
+#define FAT_CLUSTER_FIRST  2
+
+typedef struct {
+    bool     valid;
+    uint32_t addr;
+    uint32_t lastUse;
+} FAT_CacheEntry;
+
+struct FAT {
+    SDCard        *card;
+    uint32_t       fatStart;
+    uint32_t       dataStart;
+    uint32_t       sectorsPerCluster;
+    uint32_t       clusterCount;
+    uint32_t       rootCluster;
+
+    FAT_CacheEntry cache[FAT_CACHE_SECTORS];
+    uint32_t       useCounter;
+
+    // Last data sector read for a partial sector access.
+    bool           blockValid;
+    uint32_t       blockAddr;
+
+    FAT_Stats      stats;
+};
+
+struct FAT_File {
+    FAT      *fs;
+    uint32_t  firstCluster;
+    uint32_t  size;
+    uint32_t  position;
+
+    // Clusters [runIndex, runIndex + runLength) of the file are contiguous
+    // on the card starting from runCluster.
+    uint32_t  runIndex;
+    uint32_t  runCluster;
+    uint32_t  runLength;
+};
+
+// Sector buffers are read into by DMA, so live in sysram.
+static uint8_t FAT_CacheData[FAT_MAX][FAT_CACHE_SECTORS][FAT_SECTOR_LEN]
+    __attribute__((section(".sysram")));
+static uint8_t FAT_BlockData[FAT_MAX][FAT_SECTOR_LEN]
+    __attribute__((section(".sysram")));
+
+static FAT      FAT_Filesystems[FAT_MAX] = {0};
+static FAT_File FAT_Files[FAT_FILE_MAX]  = {0};
+
+static uint16_t FAT__U16(const uint8_t *data)
+{
+    return (data[0] | (data[1] << 8));
+}
+
+static uint32_t FAT__U32(const uint8_t *data)
+{
+    return (FAT__U16(data) | ((uint32_t)FAT__U16(&data[2]) << 16));
+}
+
+static unsigned FAT__Index(const FAT *fs)
+{
+    return (fs - FAT_Filesystems);
+}
+
+static bool FAT__ReadBlocks(FAT *fs, uint32_t addr, uint32_t count, void *data)
+{
+    fs->stats.dataReads++;
+    fs->stats.dataBlocks += count;
+    return SD_ReadBlocks(fs->card, addr, count, data);
+}
+
+// Returns the data sector buffer holding addr.
+static const uint8_t *FAT__ReadSector(FAT *fs, uint32_t addr)
+{
+    uint8_t *data = FAT_BlockData[FAT__Index(fs)];
+    if (!fs->blockValid || (fs->blockAddr != addr)) {
+        fs->blockValid = false;
+        if (!FAT__ReadBlocks(fs, addr, 1, data)) {
+            return NULL;
+        }
+        fs->blockValid = true;
+        fs->blockAddr  = addr;
+    }
+    return data;
+}
+
+// Returns the cached FAT sector holding addr, reading it into the least
+// recently used entry on a miss.
+static const uint8_t *FAT__ReadFATSector(FAT *fs, uint32_t addr)
+{
+    FAT_CacheEntry *victim = NULL;
+    unsigned i;
+    for (i = 0; i < FAT_CACHE_SECTORS; i++) {
+        FAT_CacheEntry *entry = &fs->cache[i];
+        if (entry->valid && (entry->addr == addr)) {
+            fs->stats.fatHits++;
+            entry->lastUse = ++fs->useCounter;
+            return FAT_CacheData[FAT__Index(fs)][i];
+        }
+        if (!victim || !entry->valid
+            || (victim->valid && (entry->lastUse < victim->lastUse))) {
+            victim = entry;
+        }
+    }
+
+    fs->stats.fatMisses++;
+    unsigned v = (victim - fs->cache);
+    victim->valid = false;
+    if (!SD_ReadBlock(fs->card, addr, FAT_CacheData[FAT__Index(fs)][v])) {
+        return NULL;
+    }
+    victim->valid   = true;
+    victim->addr    = addr;
+    victim->lastUse = ++fs->useCounter;
+    return FAT_CacheData[FAT__Index(fs)][v];
+}
+
+static bool FAT__ValidCluster(const FAT *fs, uint32_t cluster)
+{
+    return ((cluster >= FAT_CLUSTER_FIRST)
+        && ((cluster - FAT_CLUSTER_FIRST) < fs->clusterCount));
+}
+
+// Follows the chain from cluster, fails at the end of the chain or on a
+// free or bad cluster.
+static bool FAT__Next(FAT *fs, uint32_t cluster, uint32_t *next)
+{
+    uint32_t offset = (cluster * sizeof(uint32_t));
+    const uint8_t *sector = FAT__ReadFATSector(fs, (fs->fatStart + (offset / FAT_SECTOR_LEN)));
+    if (!sector) {
+        return false;
+    }
+
+    *next = (FAT__U32(&sector[offset % FAT_SECTOR_LEN]) & FAT_CLUSTER_MASK);
+    return FAT__ValidCluster(fs, *next);
+}
+
+static uint32_t FAT__ClusterAddr(const FAT *fs, uint32_t cluster)
+{
+    return (fs->dataStart + ((cluster - FAT_CLUSTER_FIRST) * fs->sectorsPerCluster));
+}
+
+// Makes the cached run start at cluster index of the file, extending it to
+// cover up to count clusters while they are contiguous.
+static bool FAT__Run(FAT_File *file, uint32_t index, uint32_t count)
+{
+    FAT *fs = file->fs;
+
+    uint32_t cluster;
+    uint32_t i;
+    if ((file->runLength > 0) && (index >= file->runIndex)) {
+        uint32_t offset = (index - file->runIndex);
+        if (offset < file->runLength) {
+            if ((file->runLength - offset) >= count) {
+                return true;
+            }
+            // Rebuild the run from index so it can be extended.
+            i = index;
+            cluster = (file->runCluster + offset);
+        } else {
+            i = (file->runIndex + file->runLength - 1);
+            cluster = (file->runCluster + file->runLength - 1);
+        }
+    } else {
+        i = 0;
+        cluster = file->firstCluster;
+    }
+
+    for (; i < index; i++) {
+        if (!FAT__Next(fs, cluster, &cluster)) {
+            return false;
+        }
+    }
+
+    file->runIndex   = index;
+    file->runCluster = cluster;
+    file->runLength  = 1;
+
+    uint32_t next;
+    while ((file->runLength < count)
+        && FAT__Next(fs, cluster, &next) && (next == (cluster + 1))) {
+        cluster = next;
+        file->runLength++;
+    }
+
+    return true;
+}
+
+static void FAT__OpenCluster(FAT *fs, FAT_File *file, uint32_t cluster, uint32_t size)
+{
+    file->fs           = fs;
+    file->firstCluster = cluster;
+    file->size         = size;
+    file->position     = 0;
+    file->runLength    = 0;
+}
+
+static char FAT__Upper(char c)
+{
+    return (((c >= 'a') && (c <= 'z')) ? (c - 'a' + 'A') : c);
+}
+
+static bool FAT__NameMatch(const char *name, const char *component, uintptr_t len)
+{
+    uintptr_t i;
+    for (i = 0; i < len; i++) {
+        if ((name[i] == '\0') || (FAT__Upper(name[i]) != FAT__Upper(component[i]))) {
+            return false;
+        }
+    }
+    return (name[len] == '\0');
+}
+
+static uint8_t FAT__LFNChecksum(const uint8_t *shortName)
+{
+    uint8_t sum = 0;
+    unsigned i;
+    for (i = 0; i < 11; i++) {
+        sum = (((sum & 1) << 7) + (sum >> 1) + shortName[i]);
+    }
+    return sum;
+}
+
+// Looks up a single path component in the directory starting at cluster,
+// returning its directory entry.
+static bool FAT__Find(FAT *fs, uint32_t cluster, const char *component, uintptr_t len,
+                      uint8_t entry[FAT_DIR_ENTRY_LEN])
+{
+    // Offsets of the 13 UCS-2 characters held by each long name entry.
+    static const uint8_t lfnOffset[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+    // A directory can't be longer than the volume or the entry limit, so a
+    // cluster chain which loops back on itself ends there instead of
+    // being walked for 4 GB.
+    uint64_t dirLen = ((uint64_t)fs->clusterCount * fs->sectorsPerCluster * FAT_SECTOR_LEN);
+    if (dirLen > (FAT_DIR_ENTRY_MAX * FAT_DIR_ENTRY_LEN)) {
+        dirLen = (FAT_DIR_ENTRY_MAX * FAT_DIR_ENTRY_LEN);
+    }
+
+    FAT_File dir;
+    FAT__OpenCluster(fs, &dir, cluster, (uint32_t)dirLen);
+
+    char    lfn[FAT_LFN_MAX + 1];
+    bool    lfnValid    = false;
+    uint8_t lfnChecksum = 0;
+
+    uintptr_t count;
+    while (FAT_Read(&dir, entry, FAT_DIR_ENTRY_LEN, &count)
+        && (count == FAT_DIR_ENTRY_LEN)) {
+        if (entry[0] == 0x00) {
+            break;
+        }
+        if (entry[0] == 0xE5) {
+            lfnValid = false;
+            continue;
+        }
+
+        uint8_t attr = entry[11];
+        if (attr == FAT_ATTR_LFN) {
+            unsigned order = (entry[0] & 0x1F);
+            if ((order == 0) || ((order * 13) > (FAT_LFN_MAX + 13))) {
+                lfnValid = false;
+                continue;
+            }
+            if (entry[0] & 0x40) {
+                __builtin_memset(lfn, 0, sizeof(lfn));
+                lfnValid    = true;
+                lfnChecksum = entry[13];
+            } else if (entry[13] != lfnChecksum) {
+                lfnValid = false;
+            }
+
+            unsigned i;
+            for (i = 0; i < 13; i++) {
+                unsigned pos = (((order - 1) * 13) + i);
+                uint16_t c   = FAT__U16(&entry[lfnOffset[i]]);
+                if ((c == 0x0000) || (c == 0xFFFF) || (pos >= FAT_LFN_MAX)) {
+                    break;
+                }
+                lfn[pos] = (c < 0x80 ? (char)c : '?');
+            }
+            continue;
+        }
+
+        bool useLFN = (lfnValid && (FAT__LFNChecksum(entry) == lfnChecksum));
+        lfnValid = false;
+        if (attr & FAT_ATTR_VOLUME_ID) {
+            continue;
+        }
+
+        if (useLFN && FAT__NameMatch(lfn, component, len)) {
+            return true;
+        }
+
+        // Short names are stored space padded as "NAME    EXT".
+        char shortName[13];
+        unsigned s = 0;
+        unsigned i;
+        for (i = 0; (i < 8) && (entry[i] != ' '); i++) {
+            shortName[s++] = ((i == 0) && (entry[i] == 0x05) ? 0xE5 : entry[i]);
+        }
+        if (entry[8] != ' ') {
+            shortName[s++] = '.';
+            for (i = 8; (i < 11) && (entry[i] != ' '); i++) {
+                shortName[s++] = entry[i];
+            }
+        }
+        shortName[s] = '\0';
+
+        if (FAT__NameMatch(shortName, component, len)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool FAT__MountPartition(FAT *fs, uint32_t start, const uint8_t *vbr)
+{
+    uint16_t bytesPerSector    = FAT__U16(&vbr[11]);
+    uint8_t  sectorsPerCluster = vbr[13];
+    uint16_t reservedSectors   = FAT__U16(&vbr[14]);
+    uint8_t  numFATs           = vbr[16];
+    uint16_t fatSize16         = FAT__U16(&vbr[22]);
+    uint32_t totalSectors      = FAT__U32(&vbr[32]);
+    uint32_t fatSize           = FAT__U32(&vbr[36]);
+
+    if ((FAT__U16(&vbr[510]) != 0xAA55)
+        || (bytesPerSector != FAT_SECTOR_LEN)
+        || (sectorsPerCluster == 0)
+        || ((sectorsPerCluster & (sectorsPerCluster - 1)) != 0)
+        || (numFATs == 0) || (fatSize16 != 0) || (fatSize == 0)) {
+        return false;
+    }
+
+    uint32_t metaSectors = (reservedSectors + (numFATs * fatSize));
+    if (totalSectors <= metaSectors) {
+        return false;
+    }
+
+    fs->fatStart          = (start + reservedSectors);
+    fs->dataStart         = (start + metaSectors);
+    fs->sectorsPerCluster = sectorsPerCluster;
+    fs->clusterCount      = ((totalSectors - metaSectors) / sectorsPerCluster);
+    fs->rootCluster       = (FAT__U32(&vbr[44]) & FAT_CLUSTER_MASK);
+
+    // Volumes with fewer clusters than this are FAT12/16 by definition.
+    return ((fs->clusterCount >= 65525) && FAT__ValidCluster(fs, fs->rootCluster));
+}
+
+
+FAT *FAT_Mount(SDCard *card)
+{
+    if (!card || (SD_GetBlockLen(card) != FAT_SECTOR_LEN)) {
+        return NULL;
+    }
+
+    FAT *fs = NULL;
+    unsigned f;
+    for (f = 0; f < FAT_MAX; f++) {
+        if (!FAT_Filesystems[f].card) {
+            fs = &FAT_Filesystems[f];
+            break;
+        }
+    }
+    if (!fs) {
+        return NULL;
+    }
+
+    __builtin_memset(fs, 0, sizeof(*fs));
+    fs->card = card;
+
+    // Block 0 is either the boot sector of the volume or an MBR, in which
+    // case the first FAT32 partition is used.
+    const uint8_t *sector = FAT__ReadSector(fs, 0);
+    if (sector && !FAT__MountPartition(fs, 0, sector)) {
+        const uint8_t *partition = &sector[446];
+        uint32_t start = 0;
+        unsigned p = 4;
+        if (FAT__U16(&sector[510]) == 0xAA55) {
+            for (p = 0; p < 4; p++, partition += 16) {
+                if ((partition[4] == 0x0B) || (partition[4] == 0x0C)) {
+                    start = FAT__U32(&partition[8]);
+                    break;
+                }
+            }
+        }
+
+        sector = NULL;
+        if ((p < 4) && (start > 0)) {
+            sector = FAT__ReadSector(fs, start);
+        }
+        if (sector && !FAT__MountPartition(fs, start, sector)) {
+            sector = NULL;
+        }
+    }
+
+    if (!sector) {
+        fs->card = NULL;
+        return NULL;
+    }
+
+    return fs;
+}
+
+
+void FAT_Unmount(FAT *fs)
+{
+    if (!fs) {
+        return;
+    }
+
+    unsigned i;
+    for (i = 0; i < FAT_FILE_MAX; i++) {
+        if (FAT_Files[i].fs == fs) {
+            FAT_Files[i].fs = NULL;
+        }
+    }
+
+    fs->card = NULL;
+}
+
+
+FAT_File *FAT_Open(FAT *fs, const char *path)
+{
+    if (!fs || !fs->card || !path) {
+        return NULL;
+    }
+
+    FAT_File *file = NULL;
+    unsigned i;
+    for (i = 0; i < FAT_FILE_MAX; i++) {
+        if (!FAT_Files[i].fs) {
+            file = &FAT_Files[i];
+            break;
+        }
+    }
+    if (!file) {
+        return NULL;
+    }
+
+    uint32_t cluster = fs->rootCluster;
+    uint8_t  entry[FAT_DIR_ENTRY_LEN];
+    bool     found = false;
+    while (*path != '\0') {
+        while (*path == '/') {
+            path++;
+        }
+        uintptr_t len;
+        for (len = 0; (path[len] != '\0') && (path[len] != '/'); len++);
+        if (len == 0) {
+            break;
+        }
+
+        // Only the last component of the path may be a file, and a corrupt
+        // directory entry mustn't point the lookup outside the data area.
+        if ((found && !(entry[11] & FAT_ATTR_DIRECTORY))
+            || !FAT__ValidCluster(fs, cluster)
+            || !FAT__Find(fs, cluster, path, len, entry)) {
+            return NULL;
+        }
+        found   = true;
+        cluster = (((uint32_t)FAT__U16(&entry[20]) << 16) | FAT__U16(&entry[26]));
+        // A ".." entry refers to the root directory as cluster 0.
+        if ((cluster == 0) && (entry[11] & FAT_ATTR_DIRECTORY)
+            && (__builtin_memcmp(entry, "..         ", 11) == 0)) {
+            cluster = fs->rootCluster;
+        }
+        path   += len;
+    }
+
+    if (!found || (entry[11] & FAT_ATTR_DIRECTORY)) {
+        return NULL;
+    }
+
+    uint32_t size = FAT__U32(&entry[28]);
+    if ((size > 0) && !FAT__ValidCluster(fs, cluster)) {
+        return NULL;
+    }
+
+    FAT__OpenCluster(fs, file, cluster, size);
+    return file;
+}
+
+
+void FAT_Close(FAT_File *file)
+{
+    if (file) {
+        file->fs = NULL;
+    }
+}
+
+
+bool FAT_Read(FAT_File *file, void *data, uintptr_t size, uintptr_t *count)
+{
+    if (!file || !file->fs || (!data && (size > 0))) {
+        return false;
+    }
+
+    FAT *fs = file->fs;
+    uint32_t clusterLen = (fs->sectorsPerCluster * FAT_SECTOR_LEN);
+
+    if (file->position >= file->size) {
+        size = 0;
+    } else if (size > (file->size - file->position)) {
+        size = (file->size - file->position);
+    }
+
+    uint8_t  *data_byte = data;
+    uintptr_t done      = 0;
+    bool      success   = true;
+    while (done < size) {
+        uint32_t index = (file->position / clusterLen);
+        uint32_t last  = ((file->position + (size - done) - 1) / clusterLen);
+        if (!FAT__Run(file, index, (last - index + 1))) {
+            success = false;
+            break;
+        }
+
+        uint32_t runOffset = (((index - file->runIndex) * clusterLen)
+            + (file->position % clusterLen));
+        uint32_t addr = (FAT__ClusterAddr(fs, file->runCluster) + (runOffset / FAT_SECTOR_LEN));
+        uint32_t sectorOffset = (runOffset % FAT_SECTOR_LEN);
+
+        uintptr_t chunk = ((file->runLength * clusterLen) - runOffset);
+        if (chunk > (size - done)) {
+            chunk = (size - done);
+        }
+
+        if ((sectorOffset == 0) && (chunk >= FAT_SECTOR_LEN)) {
+            // Whole sectors of the run are read straight into the caller's
+            // buffer in one go.
+            chunk -= (chunk % FAT_SECTOR_LEN);
+            if (!FAT__ReadBlocks(fs, addr, (chunk / FAT_SECTOR_LEN), &data_byte[done])) {
+                success = false;
+                break;
+            }
+        } else {
+            if (chunk > (FAT_SECTOR_LEN - sectorOffset)) {
+                chunk = (FAT_SECTOR_LEN - sectorOffset);
+            }
+            const uint8_t *sector = FAT__ReadSector(fs, addr);
+            if (!sector) {
+                success = false;
+                break;
+            }
+            __builtin_memcpy(&data_byte[done], &sector[sectorOffset], chunk);
+        }
+
+        done           += chunk;
+        file->position += chunk;
+    }
+
+    if (count) {
+        *count = done;
+    }
+    return success;
+}
+
+
+bool FAT_Seek(FAT_File *file, uint32_t offset)
+{
+    if (!file || !file->fs || (offset > file->size)) {
+        return false;
+    }
+
+    // The cluster run is kept, it is still valid after a seek.
+    file->position = offset;
+    return true;
+}
+
+
+uint32_t FAT_Tell(const FAT_File *file)
+{
+    return (file ? file->position : 0);
+}
+
+
+uint32_t FAT_Size(const FAT_File *file)
+{
+    return (file ? file->size : 0);
+}
+
+
+void FAT_GetStats(const FAT *fs, FAT_Stats *stats)
+{
+    if (fs && stats) {
+        *stats = fs->stats;
+    }
+}
+
+
+void FAT_ResetStats(FAT *fs)
+{
+    if (fs) {
+        __builtin_memset(&fs->stats, 0, sizeof(fs->stats));
+    }
+}
@@ -0,0 +1,52 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef FAT_H_
+#define FAT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "SD.h"
+
+// Read-only FAT32 reader which sits on top of SD.h. The filesystem may be
+// the first FAT32 partition of an MBR or start at block 0. Sectors of the FAT
+// are cached, and each open file remembers the contiguous run of clusters it
+// is reading from so that sequential reads become as few multi-block reads as
+// possible. It calls SD.h, which pulls in the SPIMaster and GPT headers, so
+// the host tests (test/FATTest.c) run it on SD.c against a simulated card
+// holding a FAT32 image.
+
+typedef struct FAT FAT;
+typedef struct FAT_File FAT_File;
+
+typedef struct {
+    // FAT sector lookups served from the cache and read from the card.
+    uint32_t fatHits;
+    uint32_t fatMisses;
+    // Data reads issued to the card and the blocks they covered.
+    uint32_t dataReads;
+    uint32_t dataBlocks;
+} FAT_Stats;
+
+FAT      *FAT_Mount(SDCard *card);
+void      FAT_Unmount(FAT *fs);
+
+// Paths are separated by '/' and matched case insensitively against both
+// long (ASCII only) and 8.3 names, e.g. "/config/device.txt".
+FAT_File *FAT_Open(FAT *fs, const char *path);
+void      FAT_Close(FAT_File *file);
+
+// Reads up to size bytes from the current position, count is set to the
+// number of bytes read which is less than size at the end of the file.
+// Whole blocks are read in place, so the data must be in sysram when DMA
+// is enabled.
+bool      FAT_Read(FAT_File *file, void *data, uintptr_t size, uintptr_t *count);
+bool      FAT_Seek(FAT_File *file, uint32_t offset);
+uint32_t  FAT_Tell(const FAT_File *file);
+uint32_t  FAT_Size(const FAT_File *file);
+
+void      FAT_GetStats(const FAT *fs, FAT_Stats *stats);
+void      FAT_ResetStats(FAT *fs);
+
+#endif // #ifndef FAT_H_
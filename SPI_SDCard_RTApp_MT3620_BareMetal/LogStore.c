@@ -0,0 +1,390 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <stddef.h>
+
+#include "CRC.h"
+#include "LogStore.h"
+
+// This is the maximum number of logs which can be opened at once.
+#define LOG_STORE_MAX   1
+#define LOG_STORE_MAGIC 0x474F4C53 // "SLOG"
+
+typedef struct __attribute__((__packed__)) {
+    uint32_t magic;
+    uint32_t sequence;
+    // Segment length, so a log opened with a different layout isn't valid.
+    uint16_t blocks;
+    // Bytes of records following the header.
+    uint16_t used;
+    uint16_t payloadCrc;
+    uint16_t headerCrc;
+} LogStore_Header;
+
+struct LogStore {
+    SDCard        *card;
+    uint32_t       addr;
+    uint32_t       segments;
+    uint32_t       segmentBlocks;
+    uint32_t       blockLen;
+    uint8_t       *buffer;
+    uint32_t       used;
+
+    // Oldest segment and number of segments in the log, the next segment to
+    // write and its sequence number.
+    uint32_t       tail;
+    uint32_t       count;
+    uint32_t       next;
+    uint32_t       sequence;
+
+    LogStore_Stats stats;
+};
+
+static uint32_t LogStore__PayloadMax(const LogStore *store)
+{
+    return ((store->segmentBlocks * store->blockLen) - sizeof(LogStore_Header));
+}
+
+static uint32_t LogStore__SegmentAddr(const LogStore *store, uint32_t segment)
+{
+    return (store->addr + (segment * store->segmentBlocks));
+}
+
+static uint16_t LogStore__HeaderCrc(const LogStore_Header *header)
+{
+    return CRC_ITU16(header, offsetof(LogStore_Header, headerCrc), 0x0000);
+}
+
+static bool LogStore__HeaderValid(const LogStore *store, const LogStore_Header *header)
+{
+    return ((header->magic == LOG_STORE_MAGIC)
+        && (header->blocks == store->segmentBlocks)
+        && (header->used <= LogStore__PayloadMax(store))
+        && (header->headerCrc == LogStore__HeaderCrc(header)));
+}
+
+// Reads just the header of a segment, returns false if the read failed.
+static bool LogStore__ReadHeader(LogStore *store, uint32_t segment,
+                                 LogStore_Header *header, bool *valid)
+{
+    store->stats.recoveryReads++;
+    if (!SD_ReadBlock(store->card, LogStore__SegmentAddr(store, segment), store->buffer)) {
+        return false;
+    }
+
+    __builtin_memcpy(header, store->buffer, sizeof(*header));
+    *valid = LogStore__HeaderValid(store, header);
+    return true;
+}
+
+// Reads a segment into buffer and checks it's the expected one and intact.
+static bool LogStore__ReadSegment(LogStore *store, uint32_t segment, uint32_t sequence,
+                                  uint8_t *buffer, uint32_t *used)
+{
+    if (!SD_ReadBlocks(store->card, LogStore__SegmentAddr(store, segment),
+                       store->segmentBlocks, buffer)) {
+        return false;
+    }
+
+    LogStore_Header header;
+    __builtin_memcpy(&header, buffer, sizeof(header));
+    if (!LogStore__HeaderValid(store, &header)
+        || (header.sequence != sequence)
+        || (header.payloadCrc != CRC_ITU16(
+            &buffer[sizeof(header)], header.used, 0x0000))) {
+        return false;
+    }
+
+    if (used) {
+        *used = header.used;
+    }
+    return true;
+}
+
+// Segments from 0 up to the newest were written in the current pass over the
+// range, so have consecutive sequence numbers from that of segment 0. The
+// newest is the last segment for which that holds, which is found with a
+// binary search.
+static bool LogStore__Recover(LogStore *store)
+{
+    store->tail     = 0;
+    store->count    = 0;
+    store->next     = 0;
+    store->sequence = 1;
+
+    LogStore_Header first;
+    bool valid;
+    if (!LogStore__ReadHeader(store, 0, &first, &valid)) {
+        return false;
+    }
+    if (!valid) {
+        return true;
+    }
+
+    uint32_t lo = 0;
+    uint32_t hi = (store->segments - 1);
+    while (lo < hi) {
+        uint32_t mid = (lo + ((hi - lo + 1) / 2));
+
+        LogStore_Header header;
+        if (!LogStore__ReadHeader(store, mid, &header, &valid)) {
+            return false;
+        }
+        if (valid && (header.sequence == (first.sequence + mid))) {
+            lo = mid;
+        } else {
+            hi = (mid - 1);
+        }
+    }
+
+    uint32_t head     = lo;
+    uint32_t sequence = (first.sequence + head);
+
+    // The header is written with the first block of a segment, so check all
+    // of the newest segment made it to the card. If not it's discarded and
+    // the one before is the newest.
+    bool torn = !LogStore__ReadSegment(store, head, sequence, store->buffer, NULL);
+    if (torn && (head == 0)) {
+        // The newest intact segment, if any, is the last of the previous pass
+        // which leaves segment 0 to be rewritten.
+        LogStore_Header last;
+        if ((store->segments > 1)
+            && !LogStore__ReadHeader(store, (store->segments - 1), &last, &valid)) {
+            return false;
+        }
+        if ((store->segments > 1) && valid && (last.sequence == (sequence - 1))) {
+            store->tail     = 1;
+            store->count    = (store->segments - 1);
+            store->sequence = sequence;
+        } else {
+            // Carry on past any sequence number in use.
+            store->sequence = (sequence + store->segments);
+        }
+        return true;
+    }
+    if (torn) {
+        head--;
+        sequence--;
+    }
+
+    store->count    = (head + 1);
+    store->next     = ((head + 1) % store->segments);
+    store->sequence = (sequence + 1);
+
+    // If the log has wrapped, the oldest segment follows the newest (or the
+    // torn one) and is from the previous pass.
+    uint32_t skip = (torn ? 1 : 0);
+    uint32_t older = (store->segments - store->count - skip);
+    if (older > 0) {
+        uint32_t tail = ((store->next + skip) % store->segments);
+        LogStore_Header header;
+        if (!LogStore__ReadHeader(store, tail, &header, &valid)) {
+            return false;
+        }
+        if (valid && (header.sequence == (sequence + 1 + skip - store->segments))) {
+            store->tail   = tail;
+            store->count += older;
+        }
+    }
+
+    return true;
+}
+
+
+LogStore *LogStore_Open(SDCard *card, uint32_t addr, uint32_t segments,
+                        void *buffer, uintptr_t size)
+{
+    static LogStore LogStores[LOG_STORE_MAX] = {0};
+
+    uint32_t blockLen = SD_GetBlockLen(card);
+    if (!card || !buffer || (segments == 0) || (blockLen == 0)
+        || (size < blockLen)) {
+        return NULL;
+    }
+
+    LogStore *store = NULL;
+    unsigned i;
+    for (i = 0; i < LOG_STORE_MAX; i++) {
+        if (!LogStores[i].card) {
+            store = &LogStores[i];
+            break;
+        }
+    }
+    if (!store) {
+        return NULL;
+    }
+
+    __builtin_memset(store, 0, sizeof(*store));
+    store->card          = card;
+    store->addr          = addr;
+    store->segments      = segments;
+    store->segmentBlocks = (size / blockLen);
+    store->blockLen      = blockLen;
+    store->buffer        = buffer;
+
+    if ((LogStore__PayloadMax(store) > UINT16_MAX)
+        || !LogStore__Recover(store)) {
+        store->card = NULL;
+        return NULL;
+    }
+
+    return store;
+}
+
+
+bool LogStore_Close(LogStore *store)
+{
+    if (!store) {
+        return false;
+    }
+
+    bool success = LogStore_Flush(store);
+    store->card = NULL;
+    return success;
+}
+
+
+bool LogStore_Append(LogStore *store, const void *record, uint16_t len)
+{
+    if (!store || (!record && (len > 0))) {
+        return false;
+    }
+
+    uint32_t need = (sizeof(uint16_t) + len);
+    if (need > LogStore__PayloadMax(store)) {
+        return false;
+    }
+
+    if (((store->used + need) > LogStore__PayloadMax(store))
+        && !LogStore_Flush(store)) {
+        return false;
+    }
+
+    // Records are stored as a little endian length followed by the data.
+    uint8_t *data = &store->buffer[sizeof(LogStore_Header) + store->used];
+    data[0] = (len & 0xFF);
+    data[1] = (len >> 8);
+    __builtin_memcpy(&data[sizeof(uint16_t)], record, len);
+
+    store->used += need;
+    store->stats.records++;
+    return true;
+}
+
+
+bool LogStore_Flush(LogStore *store)
+{
+    if (!store) {
+        return false;
+    }
+
+    if (store->used == 0) {
+        return true;
+    }
+
+    LogStore_Header header = {
+        .magic      = LOG_STORE_MAGIC,
+        .sequence   = store->sequence,
+        .blocks     = store->segmentBlocks,
+        .used       = store->used,
+        .payloadCrc = CRC_ITU16(&store->buffer[sizeof(header)], store->used, 0x0000),
+    };
+    header.headerCrc = LogStore__HeaderCrc(&header);
+    __builtin_memcpy(store->buffer, &header, sizeof(header));
+
+    // Only the blocks holding records need to be written.
+    uint32_t blocks = (((sizeof(header) + store->used) + (store->blockLen - 1)) / store->blockLen);
+    if (!SD_WriteBlocks(store->card, LogStore__SegmentAddr(store, store->next),
+                        blocks, store->buffer, NULL)) {
+        return false;
+    }
+    store->stats.segmentsWritten++;
+
+    // Once full, each segment written replaces the oldest.
+    if (store->count < store->segments) {
+        store->count++;
+    } else {
+        store->tail = ((store->tail + 1) % store->segments);
+    }
+    store->next = ((store->next + 1) % store->segments);
+    store->sequence++;
+    store->used = 0;
+    return true;
+}
+
+
+bool LogStore_Iterate(LogStore *store, LogStore_Iterator *iterator,
+                      void *buffer, uintptr_t size)
+{
+    if (!store || !iterator || !buffer
+        || (size < (store->segmentBlocks * store->blockLen))) {
+        return false;
+    }
+
+    iterator->store    = store;
+    iterator->buffer   = buffer;
+    iterator->size     = size;
+    iterator->remain   = store->count;
+    iterator->segment  = store->tail;
+    iterator->sequence = (store->sequence - store->count);
+    iterator->data     = NULL;
+    iterator->offset   = 0;
+    iterator->used     = 0;
+    return true;
+}
+
+
+bool LogStore_Next(LogStore_Iterator *iterator, void *record, uint16_t size,
+                   uint16_t *len)
+{
+    if (!iterator || !iterator->store) {
+        return false;
+    }
+
+    LogStore *store   = iterator->store;
+    uint8_t  *pending = &store->buffer[sizeof(LogStore_Header)];
+
+    while (!iterator->data || (iterator->offset >= iterator->used)) {
+        if (iterator->remain > 0) {
+            if (!LogStore__ReadSegment(store, iterator->segment, iterator->sequence,
+                                       iterator->buffer, &iterator->used)) {
+                return false;
+            }
+            iterator->data     = &iterator->buffer[sizeof(LogStore_Header)];
+            iterator->segment  = ((iterator->segment + 1) % store->segments);
+            iterator->sequence++;
+            iterator->remain--;
+        } else if (iterator->data != pending) {
+            // Finish with the records which haven't been flushed yet.
+            iterator->data = pending;
+            iterator->used = store->used;
+        } else {
+            return false;
+        }
+        iterator->offset = 0;
+    }
+
+    const uint8_t *data = &iterator->data[iterator->offset];
+    uint16_t length = (data[0] | (data[1] << 8));
+    if ((iterator->offset + sizeof(uint16_t) + length) > iterator->used) {
+        return false;
+    }
+
+    if (record) {
+        __builtin_memcpy(record, &data[sizeof(uint16_t)], (length < size ? length : size));
+    }
+    if (len) {
+        *len = length;
+    }
+
+    iterator->offset += (sizeof(uint16_t) + length);
+    return true;
+}
+
+
+void LogStore_GetStats(const LogStore *store, LogStore_Stats *stats)
+{
+    if (store && stats) {
+        *stats = store->stats;
+    }
+}
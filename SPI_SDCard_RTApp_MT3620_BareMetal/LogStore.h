@@ -0,0 +1,64 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef LOG_STORE_H_
+#define LOG_STORE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "SD.h"
+
+// Append-only record log on a raw range of blocks. The range is split into
+// fixed size segments which are filled in memory and written with a single
+// multi-block write, wrapping round to overwrite the oldest segment once the
+// range is full. Each segment starts with a header holding its sequence
+// number and CRCs, so the newest segment can be found on open with a binary
+// search instead of scanning the whole range.
+
+typedef struct LogStore LogStore;
+
+typedef struct {
+    // Records appended and segments written since open.
+    uint32_t records;
+    uint32_t segmentsWritten;
+    // Segment headers read to recover the log on open.
+    uint32_t recoveryReads;
+} LogStore_Stats;
+
+typedef struct {
+    LogStore *store;
+    uint8_t  *buffer;
+    uintptr_t size;
+    uint32_t  remain;   // Segments left to read from the card
+    uint32_t  segment;
+    uint32_t  sequence;
+    uint8_t  *data;     // Segment being read, NULL when not loaded
+    uint32_t  offset;
+    uint32_t  used;
+} LogStore_Iterator;
+
+// Segments are (size / block length) blocks long, the buffer holds the
+// segment being filled and is written by DMA so should be in sysram.
+LogStore *LogStore_Open(SDCard *card, uint32_t addr, uint32_t segments,
+                        void *buffer, uintptr_t size);
+bool      LogStore_Close(LogStore *store);
+
+// Records are at most the segment length less a few bytes of header.
+bool      LogStore_Append(LogStore *store, const void *record, uint16_t len);
+// Writes the segment being filled even if it isn't full, the next record
+// then starts a new segment.
+bool      LogStore_Flush(LogStore *store);
+
+// Iterates records oldest first, including any which haven't been flushed.
+// The buffer must hold a segment and be in sysram.
+bool      LogStore_Iterate(LogStore *store, LogStore_Iterator *iterator,
+                           void *buffer, uintptr_t size);
+// Copies up to size bytes of the next record, len is set to its length.
+// Returns false at the end of the log or if a segment is corrupt.
+bool      LogStore_Next(LogStore_Iterator *iterator, void *record, uint16_t size,
+                        uint16_t *len);
+
+void      LogStore_GetStats(const LogStore *store, LogStore_Stats *stats);
+
+#endif // #ifndef LOG_STORE_H_
@@ -2,7 +2,9 @@
    Licensed under the MIT License. */
 
 #include "lib/mt3620/gpt.h"
+#include "lib/NVIC.h"
 
+#include "CRC.h"
 #include "SD.h"
 
 // This is the maximum number of SD cards which can be opened at once.
@@ -10,8 +12,63 @@
 #define SPI_SD_TIMEOUT    200 // [ms]
 #define NUM_RETRIES       65536
 #define NUM_WRITE_RETRIES 3
+#define NUM_CRC_RETRIES   3
+
+// Maximum number of requests queued per card.
+#define SD_QUEUE_LEN 8
+// Number of blocks erased per NUM_RETRIES busy polls allowed.
+#define SD_ERASE_BLOCKS_PER_TIMEOUT 8192
+
+// Clock speeds are verified by reading the first blocks of the card a few
+// times and comparing them against a read at the initial speed.
+#define SD_SPEED_INITIAL       400000 // [Hz]
+#define SD_SPEED_VERIFY_BLOCKS 2
+#define SD_SPEED_VERIFY_READS  4
+// Number of link errors, without an error free request in between, after
+// which the clock is lowered.
+#define SD_DOWNSHIFT_ERRORS    3
+
+// Polls for a data token or the end of busy start with pollMin bytes and
+// double while the card isn't ready, up to pollMax.
+#define SD_POLL_MIN_DEFAULT 8
+
+// Largest transaction the ISU SPI buffer can hold in half duplex.
+#define SPI_SD_PACKET_LEN       32
+// Number of transactions queued with the driver in one go, enough for a
+// whole 1024 byte block.
+#define SPI_SD_PACKET_TRANSFERS 32
+
+// One GPT is shared by all cards as a tick counting down the timeout of each
+// transfer in flight, it only runs while a timeout is armed.
+#define SD_TIMER_TICK    10 // [ms]
+#define SD_TIMEOUT_TICKS ((SPI_SD_TIMEOUT / SD_TIMER_TICK) + 1)
+
+// Interrupt masking and waiting. A host build (see test/) has no core to
+// sleep, instead its stand-ins for the drivers deliver simulated interrupts
+// while waiting, so there's nothing to mask.
+#ifdef __arm__
+#define SD__DisableIRQs()      __asm__ volatile ("cpsid i")
+#define SD__EnableIRQs()       __asm__ volatile ("cpsie i\n\tisb")
+#define SD__WaitForInterrupt() __asm__ volatile ("wfi")
+#else
+void Host_WaitForInterrupt(void);
+#define SD__DisableIRQs()
+#define SD__EnableIRQs()
+#define SD__WaitForInterrupt() Host_WaitForInterrupt()
+#endif
 
 static GPT *timer = NULL;
+// Ticks left before the blocking transfer in flight times out.
+static volatile unsigned syncTimeout = 0;
+
+static SD_TransferStats transferStats = {0};
+
+// SPI clocks tried, fastest first.
+static const uint32_t SD_Speeds[] = {
+    50000000, 40000000, 33000000, 25000000, 20000000, 16000000, 12500000,
+    10000000,  8000000,  4000000,  2000000,  1000000, SD_SPEED_INITIAL,
+};
+#define SD_SPEED_COUNT (sizeof(SD_Speeds) / sizeof(SD_Speeds[0]))
 
 typedef enum {
     GO_IDLE_STATE        =  0,
@@ -109,14 +166,183 @@ typedef struct __attribute__((__packed__)) {
     };
 } SD_R7;
 
+// Scratch space for small transfers, kept in sysram so it's accessible to DMA.
+static struct {
+    uint8_t         bounce[SPI_SD_PACKET_LEN];
+    uint16_t        crc;
+    uint8_t         switchStatus[64];
+} transferBuffers __attribute__((section(".sysram")));
+
+// Scratch space for each card's requests, so cards can run concurrently.
+typedef struct {
+    uint16_t        crc;
+    SD_CommandFrame frame;
+    uint8_t         byte;
+    uint8_t         token;
+    uint8_t         burst[4];
+    uint32_t        wellWritten;
+    uint8_t         poll[SD_POLL_LEN_MAX];
+} SD_EngineBuffers;
+
+static SD_EngineBuffers engineBuffers[SD_CARD_MAX]
+    __attribute__((section(".sysram")));
+
+static uint8_t verifyBuffers[2][SD_SPEED_VERIFY_BLOCKS * 512]
+    __attribute__((section(".sysram")));
+
+typedef enum {
+    SD_STEP_COMMAND,       // Command frame and the byte following it.
+    SD_STEP_RESPONSE,      // Polling for R1.
+    SD_STEP_TOKEN,         // Polling for a data token.
+    SD_STEP_READ,          // Data packet and CRC.
+    SD_STEP_WRITE,         // Gap byte, data token, data packet and CRC.
+    SD_STEP_DATA_RESPONSE, // Polling for the data response.
+    SD_STEP_STOP_TOKEN,    // Gap byte and multi-block write stop token.
+    SD_STEP_BUSY,          // Polling while the card holds MISO low.
+    SD_STEP_BURST,         // Clock burst with chip select released.
+} SD_Step;
+
+typedef enum {
+    SD_PHASE_APP_CMD,        // APP_CMD before ACMD23.
+    SD_PHASE_ERASE_COUNT,    // ACMD23 pre-erase hint.
+    SD_PHASE_TRANSFER_CMD,   // Read or write command.
+    SD_PHASE_BLOCK,          // Data blocks.
+    SD_PHASE_STOP,           // Stop token or STOP_TRANSMISSION, then busy.
+    SD_PHASE_NUM_WR_APP_CMD, // APP_CMD before ACMD22 after a failed write.
+    SD_PHASE_NUM_WR_BLOCKS,  // ACMD22 and its data packet.
+    SD_PHASE_ERASE_START,
+    SD_PHASE_ERASE_END,
+    SD_PHASE_ERASE,
+    SD_PHASE_FINISH,         // Final clock burst.
+} SD_Phase;
+
+typedef struct {
+    SD_Request *queue[SD_QUEUE_LEN];
+    unsigned    queueHead;
+    unsigned    queueCount;
+
+    SD_Request *current;
+    SD_Phase    phase;
+    SD_Step     step;
+    unsigned    retries;
+    // Length of the poll in flight, and bytes of data received after the
+    // token in the last one.
+    uint32_t    pollLen;
+    uint32_t    pollOffset;
+    uint32_t    pollLeft;
+    bool        complete;
+    uint8_t     r1;
+    bool        multi;
+    // Blocks of the request done, and where the current command started.
+    uint32_t    block;
+    uint32_t    start;
+    unsigned    crcRetries;
+    bool        crcError;
+    bool        restart;
+    bool        failed;
+    // Timer ticks left before the transfer in flight times out.
+    volatile unsigned timeout;
+    // Link errors (CRC, timeout or garbled token) seen by the request.
+    unsigned    errors;
+    void       *readData;
+    uintptr_t   readSize;
+
+    // Data token, packet and CRC of a whole block at most.
+    SPITransfer transfer[SPI_SD_PACKET_TRANSFERS + 3];
+} SD_Engine;
 
 struct SDCard {
-    SPIMaster *interface;
-    uint32_t   blockLen;
-    uint32_t   tranSpeed;
-    uint32_t   maxTranSpeed;
+    SPIMaster    *interface;
+    uint32_t      blockLen;
+    uint32_t      tranSpeed;
+    uint32_t      maxTranSpeed;
+    bool          crcEnabled;
+    uint32_t      pollMin;
+    uint32_t      pollMax;
+    bool          highSpeed;
+    // Index of tranSpeed in SD_Speeds, and link errors since the last error
+    // free request.
+    unsigned      speedIndex;
+    unsigned      errorRun;
+    bool          negotiating;
+    SD_ErrorStats errors;
+    SD_Engine     engine;
 };
 
+static SDCard SD_Cards[SD_CARD_MAX] = {0};
+
+static SD_EngineBuffers *SD__Buffers(const SDCard *card)
+{
+    return &engineBuffers[card - SD_Cards];
+}
+
+static void SD__TransferTimeout(SDCard *card);
+
+static bool SD__TimerArmed(void)
+{
+    if (syncTimeout > 0) {
+        return true;
+    }
+
+    unsigned c;
+    for (c = 0; c < SD_CARD_MAX; c++) {
+        if (SD_Cards[c].interface && (SD_Cards[c].engine.timeout > 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void SD__TimerTick(GPT *handle)
+{
+    if (syncTimeout > 0) {
+        syncTimeout--;
+    }
+
+    unsigned c;
+    for (c = 0; c < SD_CARD_MAX; c++) {
+        SDCard *card = &SD_Cards[c];
+        if (card->interface && (card->engine.timeout > 0)
+            && (--card->engine.timeout == 0)) {
+            SD__TransferTimeout(card);
+        }
+    }
+
+    // A timed out card may already have armed its next transfer.
+    if (!SD__TimerArmed()) {
+        GPT_Stop(handle);
+    }
+}
+
+// Arms a timeout, starting the tick if it isn't running.
+static bool SD__TimerArm(volatile unsigned *timeout)
+{
+    uint32_t prevBlock = NVIC_BlockIRQs();
+    *timeout = SD_TIMEOUT_TICKS;
+    bool armed = (GPT_IsEnabled(timer)
+        || (GPT_StartTimeout(timer, SD_TIMER_TICK, GPT_UNITS_MILLISEC,
+                             SD__TimerTick) == ERROR_NONE));
+    if (!armed) {
+        *timeout = 0;
+    }
+    NVIC_RestoreIRQs(prevBlock);
+    return armed;
+}
+
+// Closes the timer once no cards are left open.
+static void SD__TimerRelease(void)
+{
+    unsigned c;
+    for (c = 0; c < SD_CARD_MAX; c++) {
+        if (SD_Cards[c].interface) {
+            return;
+        }
+    }
+
+    GPT_Close(timer);
+    timer = NULL;
+}
+
 typedef struct {
     bool    done;
     int32_t status;
@@ -145,23 +371,7 @@ static void transferStateReset()
 
 static uint8_t SD_Crc7(void *data, uintptr_t size)
 {
-    uint8_t* data_byte = data;
-    uint8_t crc = 0x00;
-    uintptr_t byte;
-    for (byte = 0; byte < size; byte++) {
-        uint8_t c = data_byte[byte];
-        unsigned bit;
-        for (bit = 0; bit < 8; bit++) {
-            crc <<= 1;
-            if ((c ^ crc) & 0x80) {
-                crc ^= 0x09;
-            }
-            c <<= 1;
-        }
-        crc &= 0x7F;
-    }
-
-    return (crc << 1) | 0x01;
+    return CRC_7(data, size, 0x00) | 0x01;
 }
 
 typedef enum {
@@ -169,71 +379,160 @@ typedef enum {
     SPI_WRITE = 1
 } SPI_TRANSFER_TYPE;
 
+static void SPITransfer__Count(const SPITransfer *transfer, uint32_t count)
+{
+    transferStats.sequences++;
+    transferStats.transfers += count;
+
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        transferStats.bytes += transfer[i].length;
+    }
+}
+
+static bool SPITransfer__SyncTimeoutSequential(
+    SPIMaster   *interface,
+    SPITransfer *transfer,
+    uint32_t     count)
+{
+    if (!interface) {
+        return false;
+    }
+
+    SPITransfer__Count(transfer, count);
+
+    if (!SD__TimerArm(&syncTimeout)) {
+        return false;
+    }
+
+    int32_t status = SPIMaster_TransferSequentialAsync(
+        interface, transfer, count, transferDoneCallback);
+    if (status != ERROR_NONE) {
+        syncTimeout = 0;
+        return false;
+    }
+
+    while (!transferState.done) {
+        SD__WaitForInterrupt();
+        if (syncTimeout == 0) {
+            // Timed out, so cancel
+            SPIMaster_TransferCancel(interface);
+            transferState.status = ERROR_TIMEOUT;
+            break;
+        }
+    }
+    syncTimeout = 0;
+
+    status = transferState.status;
+    transferStateReset();
+
+    if (status != ERROR_NONE) {
+        return false;
+    }
+
+    return true;
+}
+
 static bool SPITransfer__SyncTimeout(
     SPIMaster         *interface,
     void              *data,
     uintptr_t          length,
     SPI_TRANSFER_TYPE  transferType)
 {
-    if (!interface) {
-        return false;
-    }
-
     SPITransfer transfer = {
         .writeData = NULL,
         .readData  = NULL,
         .length    = length,
     };
 
-    int32_t status;
+    // Short transfers are bounced through sysram so that they can always
+    // be reached by the ISU DMA.
+    uint8_t *buffer = data;
+    if (length <= sizeof(transferBuffers.bounce)) {
+        buffer = transferBuffers.bounce;
+    }
+
     switch (transferType) {
     case SPI_READ:
-        transfer.readData = data;
-        status = SPIMaster_TransferSequentialAsync(interface, &transfer, 1, transferDoneCallback);
+        transfer.readData = buffer;
         break;
 
     case SPI_WRITE:
-        transfer.writeData = data;
-        status = SPIMaster_TransferSequentialAsync(interface, &transfer, 1, transferDoneCallback);
+        if (buffer != data) {
+            __builtin_memcpy(buffer, data, length);
+        }
+        transfer.writeData = buffer;
         break;
 
     default:
         return false;
     }
 
-    if (status != ERROR_NONE) {
+    if (!SPITransfer__SyncTimeoutSequential(interface, &transfer, 1)) {
         return false;
     }
 
-    if (GPT_IsEnabled(timer)) {
-        GPT_Stop(timer);
-    }
-    unsigned retries = NUM_RETRIES;
-    while ((retries-- > 0) && (GPT_StartTimeout(
-        timer, SPI_SD_TIMEOUT, GPT_UNITS_MILLISEC, NULL) == ERROR_NONE))
-        ;
-    if (retries == 0) {
-        transferStateReset();
-        return false;
+    if ((transferType == SPI_READ) && (buffer != data)) {
+        __builtin_memcpy(data, buffer, length);
     }
 
-    while (!transferState.done) {
-        __asm__("wfi");
-        if (!GPT_IsEnabled(timer)) {
-            // Timed out, so cancel
-            SPIMaster_TransferCancel(interface);
-            transferState.status = ERROR_TIMEOUT;
-            break;
+    return true;
+}
+
+// Transfers a data packet and its CRC using as few transfer calls as possible,
+// every SPI_SD_PACKET_LEN bytes of data still needs its own SPI transaction.
+// When DMA is enabled the data must be in sysram.
+static bool SPITransfer__SyncTimeoutPacket(
+    SPIMaster         *interface,
+    void              *data,
+    uintptr_t          length,
+    uint16_t          *crc,
+    SPI_TRANSFER_TYPE  transferType)
+{
+    SPITransfer transfer[SPI_SD_PACKET_TRANSFERS + 1];
+
+    // Short packets (i.e. registers) are likely to be on the stack.
+    uint8_t *data_byte = data;
+    bool bounce = (length <= sizeof(transferBuffers.bounce));
+    if (bounce) {
+        data_byte = transferBuffers.bounce;
+        if (transferType == SPI_WRITE) {
+            __builtin_memcpy(data_byte, data, length);
         }
     }
 
-    status = transferState.status;
-    transferStateReset();
+    uintptr_t remain = length;
+    while (remain > 0) {
+        uint32_t count;
+        for (count = 0; (count < SPI_SD_PACKET_TRANSFERS) && (remain > 0); count++) {
+            uintptr_t packet = (remain < SPI_SD_PACKET_LEN ? remain : SPI_SD_PACKET_LEN);
+            transfer[count].writeData = (transferType == SPI_WRITE ? data_byte : NULL);
+            transfer[count].readData  = (transferType == SPI_READ  ? data_byte : NULL);
+            transfer[count].length    = packet;
+
+            data_byte += packet;
+            remain    -= packet;
+        }
 
-    if (status != ERROR_NONE) {
-        return false;
+        // The CRC is appended to the last run of the packet.
+        if (remain == 0) {
+            transferBuffers.crc = *crc;
+            transfer[count].writeData = (transferType == SPI_WRITE ? &transferBuffers.crc : NULL);
+            transfer[count].readData  = (transferType == SPI_READ  ? &transferBuffers.crc : NULL);
+            transfer[count].length    = sizeof(transferBuffers.crc);
+            count++;
+        }
+
+        if (!SPITransfer__SyncTimeoutSequential(interface, transfer, count)) {
+            return false;
+        }
+    }
+
+    if (bounce && (transferType == SPI_READ)) {
+        __builtin_memcpy(data, transferBuffers.bounce, length);
     }
 
+    *crc = transferBuffers.crc;
     return true;
 }
 
@@ -271,12 +570,15 @@ static bool SD_ClockBurst(SPIMaster* interface, unsigned cycles, bool select)
 
 static bool SD_AwaitResponse(SPIMaster *interface, uintptr_t size, void *response, unsigned retries)
 {
+    // An R1 always has bit 7 clear.
     uint8_t byte = 0xFF;
     unsigned i;
-    for (i = 0; (i < retries) && (byte == 0xFF); i++) {
+    for (i = 0; (i < retries) && ((byte & 0x80) != 0); i++) {
         if (!SPITransfer__SyncTimeout(interface, &byte, 1, SPI_READ)) {
             return false;
         }
+        transferStats.polls++;
+        transferStats.pollBytes++;
     }
 
     uint8_t* r = response;
@@ -300,7 +602,7 @@ static bool SD_CommandIncomplete(SPIMaster *interface, SD_CMD cmd, uint32_t argu
     frame.index    = (0b01 << 6) | cmd;
     frame.argument = __builtin_bswap32(argument);
     frame.crc      = SD_Crc7(&frame, (sizeof(frame.index) + sizeof(frame.argument)));
-
+    transferStats.commands++;
 
     if (!SPITransfer__SyncTimeout(interface, &frame, sizeof(frame), SPI_WRITE)) {
         return false;
@@ -335,108 +637,73 @@ static bool SD_Command(SPIMaster *interface, SD_CMD cmd, uint32_t argument,
     return true;
 }
 
-static bool SD_ReadDataPacket(const SDCard *card, uintptr_t size, void *data)
+static bool SD_ReadDataPacketIncomplete(
+    const SDCard *card, SD_DATA_TOKEN token, uintptr_t size, void *data,
+    bool *crcError)
 {
+    // Poll in chunks no longer than the packet, so any data following the
+    // token in a chunk is only ever part of the packet.
+    uint8_t   poll[SPI_SD_PACKET_LEN];
+    uintptr_t limit = (size < sizeof(poll) ? size : sizeof(poll));
+    uintptr_t len   = (card->pollMin < limit ? card->pollMin : limit);
+
     unsigned retries = NUM_RETRIES;
     uint8_t byte = 0xFF;
+    uintptr_t found = 0;
     unsigned i;
     for (i = 0; (i < retries) && (byte == 0xFF); i++) {
-        if (!SPITransfer__SyncTimeout(card->interface, &byte, 1, SPI_READ)) {
+        if (!SPITransfer__SyncTimeout(card->interface, poll, len, SPI_READ)) {
             return false;
         }
-    }
-    if (byte != DATA_TOKEN_READ_SINGLE) {
-        return false;
-    }
+        transferStats.polls++;
+        transferStats.pollBytes += len;
 
-    uint8_t *data_byte = data;
-    uintptr_t packet = 16;
-    uintptr_t remain = size;
-    for (remain = size; remain; remain -= packet, data_byte += packet) {
-        if (packet > remain) {
-            packet = remain;
+        for (found = 0; (found < len) && (poll[found] == 0xFF); found++);
+        if (found < len) {
+            byte = poll[found++];
+            break;
         }
 
-        if (!SPITransfer__SyncTimeout(card->interface, data_byte, packet, SPI_READ)) {
-            return false;
+        len *= 2;
+        if (len > limit) {
+            len = limit;
         }
     }
-
-    uint16_t crc;
-    if (!SPITransfer__SyncTimeout(card->interface, &crc, sizeof(crc), SPI_READ)) {
-        return false;
-    }
-
-    // TODO: Verify the CRC.
-
-    // Clock burst is required here to give the card time to recover?
-    SD_ClockBurst(card->interface, 32, false);
-
-    return true;
-}
-
-static bool SD_WriteDataPacket(SDCard *card, uintptr_t size, const void *data)
-{
-    // Clock burst for >= 1 byte
-    SD_ClockBurst(card->interface, 16, false);
-
-    // Write data token
-    static uint8_t write_token = DATA_TOKEN_WRITE_SINGLE;
-    if (!SPITransfer__SyncTimeout(card->interface, &write_token, 1, SPI_WRITE)) {
+    if (byte != token) {
         return false;
     }
 
-    // Write data
-    uint8_t *data_byte = (uint8_t*)data;
-    uintptr_t packet = 16;
-    uintptr_t remain = size;
-    for (remain = size; remain; remain -= packet, data_byte += packet) {
-        if (packet > remain) {
-            packet = remain;
-        }
-
-        if (!SPITransfer__SyncTimeout(
-            card->interface, data_byte, packet, SPI_WRITE))
-        {
-            return false;
-        }
-    }
+    uintptr_t left = (len - found);
+    __builtin_memcpy(data, &poll[found], left);
 
-    // Write crc
-    // TODO: implement 16 bit crc calc (SPI mode SD cards ignore CRC)
-    static uint16_t blank_crc = 0xFFFF;
-    if (!SPITransfer__SyncTimeout(
-        card->interface, &blank_crc, sizeof(blank_crc), SPI_WRITE))
-    {
+    uint16_t crc;
+    if (!SPITransfer__SyncTimeoutPacket(card->interface, &((uint8_t*)data)[left],
+                                        (size - left), &crc, SPI_READ)) {
         return false;
     }
 
-    // Read data response
-    unsigned retries = NUM_RETRIES;
-    uint8_t byte = 0xFF;
-    unsigned i;
-    for (i = 0; (i < retries) && (byte == 0xFF); i++) {
-        if (!SPITransfer__SyncTimeout(card->interface, &byte, 1, SPI_READ)) {
-            return false;
+    // The CRC is sent MSB first.
+    if (card->crcEnabled
+        && (CRC_ITU16(data, size, 0x0000) != __builtin_bswap16(crc))) {
+        if (crcError) {
+            *crcError = true;
         }
-    }
-    if ((byte & 0xF) != DATA_RESP_ACCEPTED) {
         return false;
     }
 
-    // Wait while card holds MISO low (busy)
-    unsigned busy_waits = NUM_RETRIES;
-    byte = 0x00;
-    for (i = 0; (i < busy_waits) && (byte == 0x00); i++) {
-        if (!SPITransfer__SyncTimeout(card->interface, &byte, 1, SPI_READ)) {
-            return false;
-        }
-    }
+    return true;
+}
 
-    if (byte == 0x00) {
+static bool SD_ReadDataPacket(const SDCard *card, uintptr_t size, void *data)
+{
+    if (!SD_ReadDataPacketIncomplete(
+        card, DATA_TOKEN_READ_SINGLE, size, data, NULL)) {
         return false;
     }
 
+    // Clock burst is required here to give the card time to recover?
+    SD_ClockBurst(card->interface, 32, false);
+
     return true;
 }
 
@@ -522,14 +789,14 @@ static bool SD_SendOpCond(SPIMaster *interface, unsigned retries)
     }
 
     if (response.mask == 0x01) {
-        if (!SD_Command(interface, APP_SEND_OP_COND, 0x40000000, sizeof(response), &response)) {
+        if (!SD_Command(interface, (SD_CMD)APP_SEND_OP_COND, 0x40000000, sizeof(response), &response)) {
             return false;
         }
 
         unsigned i;
         for (i = 1; (i < retries) && (response.mask == 0x01); i++) {
             if (!SD_Command(interface, APP_CMD, 0, sizeof(response), &response)
-                || !SD_Command(interface, APP_SEND_OP_COND, 0x40000000, sizeof(response), &response)) {
+                || !SD_Command(interface, (SD_CMD)APP_SEND_OP_COND, 0x40000000, sizeof(response), &response)) {
                 return false;
             }
         }
@@ -554,30 +821,118 @@ static bool SD_Initialize(SPIMaster *interface)
         && SD_SendOpCond(interface, 256));
 }
 
+// Sends CMD6 to check (set = false) or switch to (set = true) a function of
+// function group 1, the 64 byte status is left in transferBuffers.
+static bool SD_SwitchFunction(SDCard *card, bool set, unsigned function)
+{
+    // Other function groups are left unchanged (0xF).
+    uint32_t argument = ((set ? 0x80000000 : 0) | 0x00FFFFF0 | (function & 0xF));
+
+    SD_R1 response;
+    if (!SD_CommandIncomplete(card->interface, SWITCH_FUNC, argument,
+                              sizeof(response), &response)
+        || (response.mask != 0x00)) {
+        // Cards before version 1.10 don't support CMD6.
+        SD_ClockBurst(card->interface, 32, false);
+        return false;
+    }
+
+    return SD_ReadDataPacket(card, sizeof(transferBuffers.switchStatus),
+                             transferBuffers.switchStatus);
+}
+
+static bool SD_SetHighSpeed(SDCard *card)
+{
+    const uint8_t *status = transferBuffers.switchStatus;
+
+    // Bits 415:400 of the status hold the functions supported by group 1,
+    // and bits 379:376 the function selected.
+    if (!SD_SwitchFunction(card, false, 1)
+        || ((status[13] & 0x02) == 0)
+        || ((status[16] & 0x0F) != 1)) {
+        return false;
+    }
+
+    return (SD_SwitchFunction(card, true, 1)
+        && ((status[16] & 0x0F) == 1));
+}
+
+// Reads the same blocks a few times at the given speed, returns true if
+// every read matches the reference.
+static bool SD_VerifySpeed(SDCard *card, uint32_t speed)
+{
+    if (SPIMaster_Configure(card->interface, 0, 0, speed) != ERROR_NONE) {
+        return false;
+    }
+
+    unsigned i;
+    for (i = 0; i < SD_SPEED_VERIFY_READS; i++) {
+        __builtin_memset(verifyBuffers[1], 0x00, sizeof(verifyBuffers[1]));
+        if (!SD_ReadBlocks(card, 0, SD_SPEED_VERIFY_BLOCKS, verifyBuffers[1])
+            || (__builtin_memcmp(verifyBuffers[0], verifyBuffers[1],
+                                 sizeof(verifyBuffers[0])) != 0)) {
+            card->errors.verifyErrors++;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Picks the fastest speed, up to the card's maximum, at which reads are
+// stable. The card stays at the current speed if none are.
+static void SD_NegotiateSpeed(SDCard *card)
+{
+    card->negotiating = true;
+
+    if (SD_ReadBlocks(card, 0, SD_SPEED_VERIFY_BLOCKS, verifyBuffers[0])) {
+        unsigned i;
+        for (i = 0; i < card->speedIndex; i++) {
+            if (SD_Speeds[i] > card->maxTranSpeed) {
+                continue;
+            }
+            if (SD_VerifySpeed(card, SD_Speeds[i])) {
+                card->speedIndex = i;
+                card->tranSpeed  = SD_Speeds[i];
+                break;
+            }
+        }
+    }
+
+    SPIMaster_Configure(card->interface, 0, 0, card->tranSpeed);
+    card->negotiating = false;
+    card->errorRun    = 0;
+}
+
 
 SDCard *SD_Open(SPIMaster *interface)
 {
-    static SDCard SD_Cards[SD_CARD_MAX] = {0};
+    if (!interface) {
+        return NULL;
+    }
+
+    // Each card needs its own interface so their transfers can overlap.
     SDCard *card = NULL;
     unsigned c;
     for (c = 0; c < SD_CARD_MAX; c++) {
-        if (!SD_Cards[c].interface) {
+        if (SD_Cards[c].interface == interface) {
+            return NULL;
+        }
+        if (!card && !SD_Cards[c].interface) {
             card = &SD_Cards[c];
-            break;
         }
     }
     if (!card) {
         return NULL;
     }
 
-    if (!(timer = GPT_Open(
-        MT3620_UNIT_GPT3, MT3620_GPT_3_LOW_SPEED, GPT_MODE_ONE_SHOT))) {
+    if (!timer && !(timer = GPT_Open(
+        MT3620_UNIT_GPT3, MT3620_GPT_3_LOW_SPEED, GPT_MODE_REPEAT))) {
         return NULL;
     }
 
-
     // Configure SPI Master to 400 kHz.
-    SPIMaster_Configure(interface, 0, 0, 400000);
+    SPIMaster_Configure(interface, 0, 0, SD_SPEED_INITIAL);
 
     unsigned retries = 5;
     unsigned i;
@@ -587,28 +942,49 @@ SDCard *SD_Open(SPIMaster *interface)
         }
     }
     if (i >= retries) {
+        SD__TimerRelease();
         return NULL;
     }
 
     card->interface    = interface;
     card->blockLen     = 512;
-    card->maxTranSpeed = 400000;
-    card->tranSpeed    = 400000;
-
-    if (SD_ReadCSD(card) && (card->maxTranSpeed != card->tranSpeed)) {
-        if (SPIMaster_Configure(card->interface, 0, 0, card->maxTranSpeed) == ERROR_NONE) {
-            card->tranSpeed = card->maxTranSpeed;
+    card->maxTranSpeed = SD_SPEED_INITIAL;
+    card->tranSpeed    = SD_SPEED_INITIAL;
+    card->crcEnabled   = false;
+    card->pollMin      = SD_POLL_MIN_DEFAULT;
+    card->pollMax      = SD_POLL_LEN_MAX;
+    card->highSpeed    = false;
+    card->speedIndex   = (SD_SPEED_COUNT - 1);
+    card->errorRun     = 0;
+    card->negotiating  = false;
+    __builtin_memset(&card->errors, 0, sizeof(card->errors));
+    __builtin_memset(&card->engine, 0, sizeof(card->engine));
+
+    if (SD_ReadCSD(card)) {
+        // High-speed mode raises TRAN_SPEED, so the CSD is read again.
+        if (SD_SetHighSpeed(card)) {
+            card->highSpeed = true;
+            SD_ReadCSD(card);
         }
+        SD_NegotiateSpeed(card);
     }
 
     return card;
 }
 
 
-void SD_Close(SDCard *card)
+bool SD_Close(SDCard *card)
 {
-    card->interface = NULL;
-    GPT_Close(timer);
+    // Outstanding requests still reference the card and its interface, and
+    // their callbacks are yet to run.
+    if (!card || !SD_Idle(card)) {
+        return false;
+    }
+
+    card->engine.timeout = 0;
+    card->interface      = NULL;
+    SD__TimerRelease();
+    return true;
 }
 
 
@@ -618,34 +994,49 @@ uint32_t SD_GetBlockLen(const SDCard *card)
 }
 
 
-bool SD_SetBlockLen(SDCard *card, uint32_t len)
+uint32_t SD_GetTranSpeed(const SDCard *card)
 {
-    if (!card || (len == 0)) {
-        return false;
-    }
+    return (card ? card->tranSpeed : 0);
+}
 
-    SD_R1 response;
-    if (!SD_Command(card->interface, SET_BLOCKLEN, len, sizeof(response), &response)) {
-        return false;
+
+bool SD_IsHighSpeed(const SDCard *card)
+{
+    return (card && card->highSpeed);
+}
+
+
+void SD_GetErrorStats(const SDCard *card, SD_ErrorStats *stats)
+{
+    if (card && stats) {
+        *stats = card->errors;
     }
+}
 
-    if (response.mask != 0x00) {
-        return false;
+
+void SD_GetTransferStats(SD_TransferStats *stats)
+{
+    if (stats) {
+        *stats = transferStats;
     }
+}
 
-    card->blockLen = len;
-    return true;
+
+void SD_ResetTransferStats(void)
+{
+    __builtin_memset(&transferStats, 0, sizeof(transferStats));
 }
 
 
-bool SD_ReadBlock(const SDCard *card, uint32_t addr, void *data)
+bool SD_SetBlockLen(SDCard *card, uint32_t len)
 {
-    if (!card || !data) {
+    if (!card || (len == 0) || !SD_Idle(card)
+        || (len > (SPI_SD_PACKET_TRANSFERS * SPI_SD_PACKET_LEN))) {
         return false;
     }
 
     SD_R1 response;
-    if (!SD_CommandIncomplete(card->interface, READ_SINGLE_BLOCK, addr, sizeof(response), &response)) {
+    if (!SD_Command(card->interface, SET_BLOCKLEN, len, sizeof(response), &response)) {
         return false;
     }
 
@@ -653,38 +1044,1026 @@ bool SD_ReadBlock(const SDCard *card, uint32_t addr, void *data)
         return false;
     }
 
-    return SD_ReadDataPacket(card, card->blockLen, data);
+    card->blockLen = len;
+    return true;
 }
 
 
-bool SD_WriteBlock(SDCard *card, uint32_t addr, const void *data)
+// Asynchronous request engine.
+//
+// Requests are queued per card and processed one at a time. Each SPI
+// transaction is started asynchronously and the state machine is advanced from
+// the transfer callback, so the core is free while the card is working. A
+// timeout is armed for every transaction in case the card hangs. Cards on
+// different interfaces run independently.
+
+static void SD__Advance(SDCard *card, int32_t status);
+
+static void SD__TransferDone(SDCard *card, int32_t status)
 {
-    if (!card || !data) {
+    card->engine.timeout = 0;
+    if (card->engine.current) {
+        SD__Advance(card, status);
+    }
+}
+
+// The SPI callback has no user data, so there's one per entry of SD_Cards.
+#define SD_TRANSFER_DONE(n)                                         \
+    static void SD__TransferDone##n(int32_t status, uintptr_t dataCount) \
+    {                                                               \
+        (void)dataCount;                                            \
+        SD__TransferDone(&SD_Cards[n], status);                     \
+    }
+
+SD_TRANSFER_DONE(0)
+SD_TRANSFER_DONE(1)
+SD_TRANSFER_DONE(2)
+SD_TRANSFER_DONE(3)
+
+static void (* const SD__TransferDoneCallbacks[])(int32_t, uintptr_t) = {
+    SD__TransferDone0, SD__TransferDone1, SD__TransferDone2, SD__TransferDone3,
+};
+_Static_assert((sizeof(SD__TransferDoneCallbacks) / sizeof(SD__TransferDoneCallbacks[0]))
+    == SD_CARD_MAX, "Need a transfer callback per card");
+
+static void SD__TransferTimeout(SDCard *card)
+{
+    if (!card->engine.current) {
+        return;
+    }
+
+    SPIMaster_TransferCancel(card->interface);
+    SD__Advance(card, ERROR_TIMEOUT);
+}
+
+static void SD__Transfer(SPITransfer *transfer, const void *writeData, void *readData,
+                         uintptr_t length)
+{
+    transfer->writeData = writeData;
+    transfer->readData  = readData;
+    transfer->length    = length;
+}
+
+// Splits a data packet into SPI_SD_PACKET_LEN transactions, returns the
+// number of transfers used.
+static uint32_t SD__TransferPacket(SPITransfer *transfer, const void *writeData, void *readData,
+                                   uintptr_t length)
+{
+    const uint8_t *write_byte = writeData;
+    uint8_t       *read_byte  = readData;
+
+    uint32_t count;
+    for (count = 0; length > 0; count++) {
+        uintptr_t packet = (length < SPI_SD_PACKET_LEN ? length : SPI_SD_PACKET_LEN);
+        SD__Transfer(&transfer[count], write_byte, read_byte, packet);
+
+        if (write_byte) {
+            write_byte += packet;
+        }
+        if (read_byte) {
+            read_byte += packet;
+        }
+        length -= packet;
+    }
+
+    return count;
+}
+
+static bool SD__Start(SDCard *card, SD_Step step, uint32_t count)
+{
+    card->engine.step     = step;
+    card->engine.pollLeft = 0;
+
+    // The timeout is armed first as the transfer may complete at any point
+    // after it's started.
+    if (!SD__TimerArm(&card->engine.timeout)) {
         return false;
     }
 
-    static unsigned num_retries = NUM_WRITE_RETRIES;
+    SPITransfer__Count(card->engine.transfer, count);
+    if (SPIMaster_TransferSequentialAsync(
+        card->interface, card->engine.transfer, count,
+        SD__TransferDoneCallbacks[card - SD_Cards]) != ERROR_NONE) {
+        card->engine.timeout = 0;
+        return false;
+    }
 
-    SD_R1 response;
-    if (!SD_CommandIncomplete(card->interface, WRITE_BLOCK, addr, sizeof(response), &response)) {
+    return true;
+}
+
+// Longest poll for a step, responses are taken a byte at a time as what
+// follows them matters. Data following a token is part of the packet, so a
+// poll mustn't run past the end of it.
+static uint32_t SD__PollLimit(const SDCard *card, SD_Step step)
+{
+    uint32_t limit = 1;
+    switch (step) {
+    case SD_STEP_TOKEN:
+        limit = ((card->engine.phase == SD_PHASE_NUM_WR_BLOCKS)
+            ? sizeof(uint32_t) : card->blockLen);
+        break;
+
+    case SD_STEP_BUSY:
+        limit = card->pollMax;
+        break;
+
+    default:
+        break;
+    }
+
+    return (limit < card->pollMax ? limit : card->pollMax);
+}
+
+static bool SD__Poll(SDCard *card)
+{
+    SD_Engine *engine = &card->engine;
+    transferStats.polls++;
+    transferStats.pollBytes += engine->pollLen;
+
+    uint32_t count = SD__TransferPacket(
+        engine->transfer, NULL, SD__Buffers(card)->poll, engine->pollLen);
+    return SD__Start(card, engine->step, count);
+}
+
+static bool SD__StartPoll(SDCard *card, SD_Step step, unsigned retries)
+{
+    SD_Engine *engine = &card->engine;
+    uint32_t limit = SD__PollLimit(card, step);
+
+    engine->step    = step;
+    engine->retries = retries;
+    engine->pollLen = (card->pollMin < limit ? card->pollMin : limit);
+    return SD__Poll(card);
+}
+
+// Backs off to longer polls while the card isn't ready.
+static bool SD__Repoll(SDCard *card)
+{
+    SD_Engine *engine = &card->engine;
+    uint32_t limit = SD__PollLimit(card, engine->step);
+
+    engine->pollLen *= 2;
+    if (engine->pollLen > limit) {
+        engine->pollLen = limit;
+    }
+    return SD__Poll(card);
+}
+
+static bool SD__StartCommand(SDCard *card, SD_CMD cmd, uint32_t argument, bool complete)
+{
+    SD_CommandFrame *frame = &SD__Buffers(card)->frame;
+    frame->index    = (0b01 << 6) | cmd;
+    frame->argument = __builtin_bswap32(argument);
+    frame->crc      = SD_Crc7(frame, (sizeof(frame->index) + sizeof(frame->argument)));
+
+    card->engine.complete = complete;
+    transferStats.commands++;
+
+    // Ignore first byte of response.
+    SPITransfer *transfer = card->engine.transfer;
+    SD__Transfer(&transfer[0], frame, NULL, sizeof(*frame));
+    SD__Transfer(&transfer[1], NULL, &SD__Buffers(card)->byte, 1);
+    return SD__Start(card, SD_STEP_COMMAND, 2);
+}
+
+static bool SD__StartBurst(SDCard *card)
+{
+    if (SPIMaster_SelectEnable(card->interface, false) != ERROR_NONE) {
         return false;
     }
 
-    if (response.mask != 0x00) {
+    SD_EngineBuffers *buffers = SD__Buffers(card);
+    SD__Transfer(&card->engine.transfer[0], NULL,
+                 buffers->burst, sizeof(buffers->burst));
+    if (!SD__Start(card, SD_STEP_BURST, 1)) {
+        SPIMaster_SelectEnable(card->interface, true);
         return false;
     }
 
-    if (!SD_WriteDataPacket(card, card->blockLen, data)) {
-        if (num_retries > 0) {
-            num_retries--;
-            return SD_WriteBlock(card, addr, data);
+    return true;
+}
+
+static bool SD__StartRead(SDCard *card, void *data, uintptr_t size)
+{
+    SD_Engine *engine = &card->engine;
+    engine->readData = data;
+    engine->readSize = size;
+
+    // The start of the packet may have arrived with the token.
+    SD_EngineBuffers *buffers = SD__Buffers(card);
+    uint8_t *data_byte = data;
+    __builtin_memcpy(data_byte, &buffers->poll[engine->pollOffset], engine->pollLeft);
+    data_byte += engine->pollLeft;
+    size      -= engine->pollLeft;
+
+    uint32_t count = SD__TransferPacket(engine->transfer, NULL, data_byte, size);
+    SD__Transfer(&engine->transfer[count++], NULL,
+                 &buffers->crc, sizeof(buffers->crc));
+    return SD__Start(card, SD_STEP_READ, count);
+}
+
+static bool SD__StartWrite(SDCard *card, SD_DATA_TOKEN token, const void *data, uintptr_t size)
+{
+    // The CRC is only checked when enabled with CRC_ON_OFF (SPI mode SD cards
+    // ignore CRC by default).
+    SD_EngineBuffers *buffers = SD__Buffers(card);
+    buffers->token = token;
+    buffers->crc   = 0xFFFF;
+    if (card->crcEnabled) {
+        buffers->crc = __builtin_bswap16(CRC_ITU16(data, size, 0x0000));
+    }
+
+    // At least one byte must separate the response or busy signal from the
+    // data token.
+    SPITransfer *transfer = card->engine.transfer;
+    SD__Transfer(&transfer[0], NULL, &buffers->byte, 1);
+    SD__Transfer(&transfer[1], &buffers->token, NULL, 1);
+    uint32_t count = 2 + SD__TransferPacket(&transfer[2], data, NULL, size);
+    SD__Transfer(&transfer[count++], &buffers->crc, NULL, sizeof(buffers->crc));
+    return SD__Start(card, SD_STEP_WRITE, count);
+}
+
+static bool SD__StartStopToken(SDCard *card)
+{
+    SD_EngineBuffers *buffers = SD__Buffers(card);
+    buffers->token = DATA_TOKEN_WRITE_MULT_STOP;
+
+    SPITransfer *transfer = card->engine.transfer;
+    SD__Transfer(&transfer[0], NULL, &buffers->byte, 1);
+    SD__Transfer(&transfer[1], &buffers->token, NULL, 1);
+    SD__Transfer(&transfer[2], NULL, &buffers->byte, 1);
+    return SD__Start(card, SD_STEP_STOP_TOKEN, 3);
+}
+
+static uint8_t *SD__BlockData(const SDCard *card, const SD_Request *request, uint32_t block)
+{
+    if (request->blocks) {
+        return (uint8_t*)request->blocks[block];
+    }
+    return &((uint8_t*)request->data)[block * card->blockLen];
+}
+
+// Erasing may take a while, so allow the card to stay busy for longer when
+// erasing more blocks.
+static unsigned SD__EraseRetries(uint32_t count)
+{
+    uint64_t retries = (uint64_t)NUM_RETRIES * (1 + (count / SD_ERASE_BLOCKS_PER_TIMEOUT));
+    return (retries > UINT32_MAX ? UINT32_MAX : retries);
+}
+
+// (Re)starts the current request from engine->block.
+static bool SD__Begin(SDCard *card)
+{
+    SD_Engine  *engine  = &card->engine;
+    SD_Request *request = engine->current;
+
+    engine->start    = engine->block;
+    engine->multi    = ((request->count - engine->block) > 1);
+    engine->crcError = false;
+    engine->restart  = false;
+
+    uint32_t addr = (request->addr + engine->block);
+    switch (request->type) {
+    case SD_REQUEST_READ:
+        engine->phase = SD_PHASE_TRANSFER_CMD;
+        return SD__StartCommand(card,
+            (engine->multi ? READ_MULTIPLE_BLOCK : READ_SINGLE_BLOCK), addr, false);
+
+    case SD_REQUEST_WRITE:
+        if (engine->multi) {
+            engine->phase = SD_PHASE_APP_CMD;
+            return SD__StartCommand(card, APP_CMD, 0, true);
         }
-        else {
+        engine->phase = SD_PHASE_TRANSFER_CMD;
+        return SD__StartCommand(card, WRITE_BLOCK, addr, false);
+
+    case SD_REQUEST_ERASE:
+        engine->phase = SD_PHASE_ERASE_START;
+        return SD__StartCommand(card, ERASE_WR_BLK_START, addr, true);
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
+// Moves to the next slower clock the interface supports.
+static bool SD__Downshift(SDCard *card)
+{
+    unsigned i;
+    for (i = (card->speedIndex + 1); i < SD_SPEED_COUNT; i++) {
+        if (SPIMaster_Configure(card->interface, 0, 0, SD_Speeds[i]) == ERROR_NONE) {
+            card->speedIndex = i;
+            card->tranSpeed  = SD_Speeds[i];
+            card->errors.downshifts++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void SD__LinkError(SDCard *card, uint32_t *counter)
+{
+    (*counter)++;
+    card->engine.errors++;
+}
+
+static void SD__Next(SDCard *card);
+
+static void SD__Complete(SDCard *card)
+{
+    SD_Engine  *engine  = &card->engine;
+    SD_Request *request = engine->current;
+
+    engine->timeout = 0;
+
+    if (engine->failed || engine->restart) {
+        card->errors.failedRequests++;
+    }
+
+    // Lower the clock if link errors keep turning up, this is done between
+    // requests so no transfer is running.
+    if (engine->errors == 0) {
+        card->errorRun = 0;
+    } else if (!card->negotiating
+        && ((card->errorRun += engine->errors) >= SD_DOWNSHIFT_ERRORS)) {
+        card->errorRun = 0;
+        SD__Downshift(card);
+    }
+
+    engine->current = NULL;
+    request->status = ((engine->failed || engine->restart)
+        ? SD_REQUEST_FAILED : SD_REQUEST_DONE);
+    if (request->callback) {
+        request->callback(request);
+    }
+}
+
+static void SD__Finish(SDCard *card)
+{
+    SD_Engine  *engine  = &card->engine;
+    SD_Request *request = engine->current;
+
+    // Resume after blocks corrupted in transfer.
+    if (engine->restart && !engine->failed) {
+        engine->block = request->done;
+        if (SD__Begin(card)) {
+            return;
+        }
+        engine->failed = true;
+    }
+
+    SD__Complete(card);
+    SD__Next(card);
+}
+
+static void SD__Next(SDCard *card)
+{
+    SD_Engine *engine = &card->engine;
+
+    while (true) {
+        uint32_t prevBasePri = NVIC_BlockIRQs();
+        SD_Request *request = NULL;
+        if (!engine->current && (engine->queueCount > 0)) {
+            request = engine->queue[engine->queueHead];
+            engine->queueHead = ((engine->queueHead + 1) % SD_QUEUE_LEN);
+            engine->queueCount--;
+            engine->current = request;
+        }
+        NVIC_RestoreIRQs(prevBasePri);
+
+        if (!request) {
+            return;
+        }
+
+        engine->block        = 0;
+        engine->crcRetries   = NUM_CRC_RETRIES;
+        engine->failed       = false;
+        engine->errors       = 0;
+        request->done         = 0;
+        request->dataResponse = DATA_RESP_ACCEPTED;
+        request->status       = SD_REQUEST_ACTIVE;
+
+        if (SD__Begin(card)) {
+            return;
+        }
+
+        engine->failed = true;
+        SD__Complete(card);
+    }
+}
+
+// Ends a data transfer, a multi-block transfer needs a stop token or
+// STOP_TRANSMISSION while a single block only needs the final clock burst.
+static bool SD__Stop(SDCard *card)
+{
+    SD_Engine  *engine  = &card->engine;
+    SD_Request *request = engine->current;
+
+    if (!engine->multi) {
+        engine->phase = SD_PHASE_FINISH;
+        return SD__StartBurst(card);
+    }
+
+    engine->phase = SD_PHASE_STOP;
+    if ((request->type == SD_REQUEST_WRITE) && !engine->failed && !engine->restart) {
+        return SD__StartStopToken(card);
+    }
+
+    // The R1 returned here may carry bits from the interrupted data stream,
+    // so it is only used to find the start of the busy signal.
+    return SD__StartCommand(card, STOP_TRANSMISSION, 0, false);
+}
+
+static void SD__Fail(SDCard *card)
+{
+    SD_Engine *engine = &card->engine;
+    engine->failed = true;
+
+    // Try to leave the card ready for the next request.
+    bool started;
+    switch (engine->phase) {
+    case SD_PHASE_BLOCK:
+        started = SD__Stop(card);
+        break;
+
+    case SD_PHASE_FINISH:
+        started = false;
+        break;
+
+    default:
+        engine->phase = SD_PHASE_FINISH;
+        started = SD__StartBurst(card);
+        break;
+    }
+
+    if (!started) {
+        SD__Complete(card);
+        SD__Next(card);
+    }
+}
+
+static bool SD__PhaseReadBlock(SDCard *card)
+{
+    SD_Engine  *engine  = &card->engine;
+    SD_Request *request = engine->current;
+
+    if (engine->step == SD_STEP_TOKEN) {
+        return SD__StartRead(card, SD__BlockData(card, request, engine->block), card->blockLen);
+    }
+
+    // Restart the stream from a corrupted block.
+    if (engine->crcError) {
+        if (engine->crcRetries-- == 0) {
+            engine->failed = true;
+        } else {
+            engine->restart = true;
+        }
+        return SD__Stop(card);
+    }
+
+    // Blocks follow each other without a recovery burst, the card keeps
+    // streaming until it sees STOP_TRANSMISSION.
+    request->done = ++engine->block;
+    if (engine->block < request->count) {
+        return SD__StartPoll(card, SD_STEP_TOKEN, NUM_RETRIES);
+    }
+    return SD__Stop(card);
+}
+
+static bool SD__PhaseWriteBlock(SDCard *card)
+{
+    SD_Engine  *engine  = &card->engine;
+    SD_Request *request = engine->current;
+
+    // Data packet rejected.
+    if (engine->step == SD_STEP_DATA_RESPONSE) {
+        if ((request->dataResponse == DATA_RESP_CRC_ERROR)
+            && (engine->crcRetries-- > 0)) {
+            engine->restart = true;
+        } else {
+            engine->failed = true;
+        }
+        return SD__Stop(card);
+    }
+
+    request->done = ++engine->block;
+    if (engine->block < request->count) {
+        return SD__StartWrite(card, DATA_TOKEN_WRITE_MULT,
+            SD__BlockData(card, request, engine->block), card->blockLen);
+    }
+    return SD__Stop(card);
+}
+
+static bool SD__PhaseStop(SDCard *card)
+{
+    SD_Engine  *engine  = &card->engine;
+    SD_Request *request = engine->current;
+
+    switch (engine->step) {
+    case SD_STEP_RESPONSE:
+        return SD__StartPoll(card, SD_STEP_BUSY, NUM_RETRIES);
+
+    case SD_STEP_BUSY:
+        return SD__StartBurst(card);
+
+    default:
+        break;
+    }
+
+    // After an error the card can tell us how many blocks made it so we
+    // can resume from there.
+    if ((request->type == SD_REQUEST_WRITE) && (engine->failed || engine->restart)) {
+        engine->phase = SD_PHASE_NUM_WR_APP_CMD;
+        return SD__StartCommand(card, APP_CMD, 0, true);
+    }
+
+    SD__Finish(card);
+    return true;
+}
+
+// Called when a step of the current phase is done, starts the next step.
+static bool SD__Phase(SDCard *card)
+{
+    SD_Engine  *engine  = &card->engine;
+    SD_Request *request = engine->current;
+
+    switch (engine->phase) {
+    case SD_PHASE_APP_CMD:
+        if ((engine->r1 & 0xFE) != 0) {
+            return false;
+        }
+        engine->phase = SD_PHASE_ERASE_COUNT;
+        return SD__StartCommand(card, (SD_CMD)APP_SET_WR_BLK_ERASE_COUNT,
+                                (request->count - engine->block), true);
+
+    case SD_PHASE_ERASE_COUNT:
+        // Tells the card how many blocks are coming so it can pre-erase them,
+        // this is only a hint so a rejection here isn't an error.
+        engine->phase = SD_PHASE_TRANSFER_CMD;
+        return SD__StartCommand(card, WRITE_MULTIPLE_BLOCK,
+                                (request->addr + engine->block), false);
+
+    case SD_PHASE_TRANSFER_CMD:
+        if (engine->r1 != 0x00) {
             return false;
         }
+        engine->phase = SD_PHASE_BLOCK;
+        if (request->type == SD_REQUEST_READ) {
+            return SD__StartPoll(card, SD_STEP_TOKEN, NUM_RETRIES);
+        }
+        return SD__StartWrite(card,
+            (engine->multi ? DATA_TOKEN_WRITE_MULT : DATA_TOKEN_WRITE_SINGLE),
+            SD__BlockData(card, request, engine->block), card->blockLen);
+
+    case SD_PHASE_BLOCK:
+        if (request->type == SD_REQUEST_READ) {
+            return SD__PhaseReadBlock(card);
+        }
+        return SD__PhaseWriteBlock(card);
+
+    case SD_PHASE_STOP:
+        return SD__PhaseStop(card);
+
+    case SD_PHASE_NUM_WR_APP_CMD:
+        if ((engine->r1 & 0xFE) != 0) {
+            return false;
+        }
+        engine->phase = SD_PHASE_NUM_WR_BLOCKS;
+        return SD__StartCommand(card, (SD_CMD)APP_SEND_NUM_WR_BLOCKS, 0, false);
+
+    case SD_PHASE_NUM_WR_BLOCKS:
+        switch (engine->step) {
+        case SD_STEP_RESPONSE:
+            if (engine->r1 != 0x00) {
+                return false;
+            }
+            return SD__StartPoll(card, SD_STEP_TOKEN, NUM_RETRIES);
+
+        case SD_STEP_TOKEN:
+            return SD__StartRead(card, &SD__Buffers(card)->wellWritten,
+                                 sizeof(uint32_t));
+
+        default:
+            break;
+        }
+
+        if (!engine->crcError) {
+            uint32_t written = __builtin_bswap32(SD__Buffers(card)->wellWritten);
+            if (written < (engine->block - engine->start)) {
+                request->done = (engine->start + written);
+            }
+        }
+        engine->phase = SD_PHASE_FINISH;
+        return SD__StartBurst(card);
+
+    case SD_PHASE_ERASE_START:
+        if (engine->r1 != 0x00) {
+            return false;
+        }
+        engine->phase = SD_PHASE_ERASE_END;
+        return SD__StartCommand(card, ERASE_WR_BLK_END,
+                                (request->addr + request->count - 1), true);
+
+    case SD_PHASE_ERASE_END:
+        if (engine->r1 != 0x00) {
+            return false;
+        }
+        engine->phase = SD_PHASE_ERASE;
+        return SD__StartCommand(card, ERASE, 0, false);
+
+    case SD_PHASE_ERASE:
+        if (engine->step == SD_STEP_RESPONSE) {
+            if (engine->r1 != 0x00) {
+                return false;
+            }
+            return SD__StartPoll(card, SD_STEP_BUSY, SD__EraseRetries(request->count));
+        }
+        request->done = request->count;
+        engine->phase = SD_PHASE_FINISH;
+        return SD__StartBurst(card);
+
+    case SD_PHASE_FINISH:
+        SD__Finish(card);
+        return true;
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
+static bool SD__PollStep(SD_Step step)
+{
+    return ((step == SD_STEP_RESPONSE) || (step == SD_STEP_TOKEN)
+        || (step == SD_STEP_DATA_RESPONSE) || (step == SD_STEP_BUSY));
+}
+
+static bool SD__Polling(SD_Step step, uint8_t byte)
+{
+    switch (step) {
+    case SD_STEP_RESPONSE:
+        // An R1 always has bit 7 clear, so this also skips the stuff byte
+        // after STOP_TRANSMISSION, which may be left over read data.
+        return ((byte & 0x80) != 0);
+
+    case SD_STEP_TOKEN:
+    case SD_STEP_DATA_RESPONSE:
+        return (byte == 0xFF);
+
+    case SD_STEP_BUSY:
+        // Card holds MISO low while busy.
+        return (byte == 0x00);
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
+static void SD__Advance(SDCard *card, int32_t status)
+{
+    SD_Engine  *engine  = &card->engine;
+    SD_Request *request = engine->current;
+    if (!request) {
+        return;
+    }
+
+    if (engine->step == SD_STEP_BURST) {
+        SPIMaster_SelectEnable(card->interface, true);
+    }
+
+    if (status != ERROR_NONE) {
+        SD__LinkError(card, (status == ERROR_TIMEOUT
+            ? &card->errors.timeouts : &card->errors.transferErrors));
+        SD__Fail(card);
+        return;
+    }
+
+    SD_EngineBuffers *buffers = SD__Buffers(card);
+    uint8_t byte = buffers->byte;
+    if (SD__PollStep(engine->step)) {
+        // Scan the poll for the first byte which ends it.
+        uint32_t i;
+        for (i = 0; (i < engine->pollLen)
+            && SD__Polling(engine->step, buffers->poll[i]); i++);
+
+        if (i >= engine->pollLen) {
+            if (--engine->retries == 0) {
+                SD__LinkError(card, &card->errors.timeouts);
+                SD__Fail(card);
+            } else if (!SD__Repoll(card)) {
+                SD__Fail(card);
+            }
+            return;
+        }
+
+        byte = buffers->poll[i++];
+        engine->pollOffset = i;
+        engine->pollLeft   = (engine->pollLen - i);
+    }
+
+    bool started;
+    switch (engine->step) {
+    case SD_STEP_COMMAND:
+        started = SD__StartPoll(card, SD_STEP_RESPONSE, 32);
+        break;
+
+    case SD_STEP_RESPONSE:
+        engine->r1 = byte;
+        if (engine->complete) {
+            // Burst the clock for a bit to allow command to process
+            started = SD__StartBurst(card);
+        } else {
+            started = SD__Phase(card);
+        }
+        break;
+
+    case SD_STEP_TOKEN:
+        // Error tokens have the top nibble clear, anything else is garbled.
+        if ((byte != DATA_TOKEN_READ_SINGLE) && ((byte & 0xF0) != 0)) {
+            SD__LinkError(card, &card->errors.transferErrors);
+        }
+        started = ((byte == DATA_TOKEN_READ_SINGLE) && SD__Phase(card));
+        break;
+
+    case SD_STEP_READ:
+        // The CRC is sent MSB first.
+        engine->crcError = (card->crcEnabled
+            && (CRC_ITU16(engine->readData, engine->readSize, 0x0000)
+                != __builtin_bswap16(SD__Buffers(card)->crc)));
+        if (engine->crcError) {
+            SD__LinkError(card, &card->errors.crcErrors);
+        }
+        started = SD__Phase(card);
+        break;
+
+    case SD_STEP_WRITE:
+        started = SD__StartPoll(card, SD_STEP_DATA_RESPONSE, NUM_RETRIES);
+        break;
+
+    case SD_STEP_DATA_RESPONSE:
+        request->dataResponse = (byte & 0x1F);
+        if (request->dataResponse == DATA_RESP_CRC_ERROR) {
+            SD__LinkError(card, &card->errors.crcErrors);
+        }
+        if ((byte & 0xF) == DATA_RESP_ACCEPTED) {
+            started = SD__StartPoll(card, SD_STEP_BUSY, NUM_RETRIES);
+        } else {
+            started = SD__Phase(card);
+        }
+        break;
+
+    case SD_STEP_STOP_TOKEN:
+        started = SD__StartPoll(card, SD_STEP_BUSY, NUM_RETRIES);
+        break;
+
+    default:
+        started = SD__Phase(card);
+        break;
+    }
+
+    if (!started) {
+        SD__Fail(card);
+    }
+}
+
+
+bool SD_Submit(SDCard *card, SD_Request *request)
+{
+    if (!card || !request || (request->count == 0)) {
+        return false;
+    }
+
+    switch (request->type) {
+    case SD_REQUEST_READ:
+        if (!request->data) {
+            return false;
+        }
+        break;
+
+    case SD_REQUEST_WRITE:
+        if (!request->data && !request->blocks) {
+            return false;
+        }
+        break;
+
+    case SD_REQUEST_ERASE:
+        break;
+
+    default:
+        return false;
+    }
+
+    SD_Engine *engine = &card->engine;
+
+    uint32_t prevBasePri = NVIC_BlockIRQs();
+    bool queued = (engine->queueCount < SD_QUEUE_LEN);
+    if (queued) {
+        request->status = SD_REQUEST_QUEUED;
+        engine->queue[(engine->queueHead + engine->queueCount) % SD_QUEUE_LEN] = request;
+        engine->queueCount++;
+    }
+    bool idle = !engine->current;
+    NVIC_RestoreIRQs(prevBasePri);
+
+    if (queued && idle) {
+        SD__Next(card);
+    }
+
+    return queued;
+}
+
+
+bool SD_Idle(const SDCard *card)
+{
+    return (!card || (!card->engine.current && (card->engine.queueCount == 0)));
+}
+
+
+bool SD_Wait(SD_Request *request)
+{
+    if (!request || (request->status == SD_REQUEST_IDLE)) {
+        return false;
+    }
+
+    // Interrupts are masked around the check so the completion can't slip in
+    // between it and wfi, which still wakes on the pending interrupt.
+    SD__DisableIRQs();
+    while ((request->status == SD_REQUEST_QUEUED)
+        || (request->status == SD_REQUEST_ACTIVE)) {
+        SD__WaitForInterrupt();
+        SD__EnableIRQs();
+        SD__DisableIRQs();
+    }
+    SD__EnableIRQs();
+
+    return (request->status == SD_REQUEST_DONE);
+}
+
+
+static bool SD__SubmitSync(SDCard *card, SD_Request *request)
+{
+    request->callback = NULL;
+    request->done     = 0;
+
+    // Wait for space in the queue.
+    while (!SD_Submit(card, request)) {
+        if (SD_Idle(card)) {
+            return false;
+        }
+        SD__WaitForInterrupt();
     }
-    else {
-        num_retries = NUM_WRITE_RETRIES;
+
+    return SD_Wait(request);
+}
+
+
+bool SD_ReadBlock(SDCard *card, uint32_t addr, void *data)
+{
+    return SD_ReadBlocks(card, addr, 1, data);
+}
+
+
+bool SD_ReadBlocks(SDCard *card, uint32_t addr, uint32_t count, void *data)
+{
+    if (!card || !data) {
+        return false;
+    }
+
+    if (count == 0) {
         return true;
     }
+
+    SD_Request request = {
+        .type  = SD_REQUEST_READ,
+        .addr  = addr,
+        .count = count,
+        .data  = data,
+    };
+    return SD__SubmitSync(card, &request);
+}
+
+
+bool SD_WriteBlock(SDCard *card, uint32_t addr, const void *data)
+{
+    if (!card || !data) {
+        return false;
+    }
+
+    unsigned retries;
+    for (retries = 0; retries <= NUM_WRITE_RETRIES; retries++) {
+        if (SD_WriteBlocks(card, addr, 1, data, NULL)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+// Blocks are taken from blocks[] when given, otherwise from data.
+static bool SD__WriteBlocks(SDCard *card, uint32_t addr, uint32_t count,
+                            const void *data, const void * const *blocks,
+                            SD_WriteStatus *status)
+{
+    SD_WriteStatus dummy;
+    if (!status) {
+        status = &dummy;
+    }
+
+    status->written      = 0;
+    status->failed       = false;
+    status->dataResponse = DATA_RESP_ACCEPTED;
+
+    if (!card || (!data && !blocks)) {
+        status->failed = true;
+        return false;
+    }
+
+    if (count == 0) {
+        return true;
+    }
+
+    // Blocks rejected due to a CRC error are resent by the engine.
+    SD_Request request = {
+        .type   = SD_REQUEST_WRITE,
+        .addr   = addr,
+        .count  = count,
+        .data   = (void*)data,
+        .blocks = blocks,
+        .dataResponse = DATA_RESP_ACCEPTED,
+    };
+    bool success = SD__SubmitSync(card, &request);
+
+    status->written      = request.done;
+    status->failed       = !success;
+    status->dataResponse = request.dataResponse;
+    return success;
+}
+
+
+bool SD_WriteBlocks(SDCard *card, uint32_t addr, uint32_t count, const void *data,
+                    SD_WriteStatus *status)
+{
+    return SD__WriteBlocks(card, addr, count, data, NULL, status);
+}
+
+
+bool SD_WriteBlocksGather(SDCard *card, uint32_t addr, uint32_t count,
+                          const void * const *blocks, SD_WriteStatus *status)
+{
+    return SD__WriteBlocks(card, addr, count, NULL, blocks, status);
+}
+
+
+bool SD_EraseBlocks(SDCard *card, uint32_t first, uint32_t last)
+{
+    if (!card || (last < first) || ((last - first) == UINT32_MAX)) {
+        return false;
+    }
+
+    // The busy wait allowed grows with the size of the range.
+    SD_Request request = {
+        .type  = SD_REQUEST_ERASE,
+        .addr  = first,
+        .count = (last - first + 1),
+    };
+    return SD__SubmitSync(card, &request);
+}
+
+
+bool SD_SetPolling(SDCard *card, uint32_t minLen, uint32_t maxLen)
+{
+    if (!card || !SD_Idle(card) || (minLen == 0)
+        || (minLen > maxLen) || (maxLen > SD_POLL_LEN_MAX)) {
+        return false;
+    }
+
+    card->pollMin = minLen;
+    card->pollMax = maxLen;
+    return true;
+}
+
+
+bool SD_SetCRC(SDCard *card, bool enable)
+{
+    if (!card || !SD_Idle(card)) {
+        return false;
+    }
+
+    SD_R1 response;
+    if (!SD_Command(card->interface, CRC_ON_OFF, (enable ? 1 : 0), sizeof(response), &response)) {
+        return false;
+    }
+
+    if (response.mask != 0x00) {
+        return false;
+    }
+
+    card->crcEnabled = enable;
+    return true;
 }
@@ -13,13 +13,140 @@
 
 typedef struct SDCard SDCard;
 
+// Longest poll for a data token or the end of busy, see SD_SetPolling.
+#define SD_POLL_LEN_MAX 512
+
+typedef struct {
+    // Number of blocks from the start of the request known to be written.
+    uint32_t written;
+    // Whether a data packet was rejected or the transfer failed part way.
+    bool     failed;
+    // Data response token of the last block sent (0x05 when accepted).
+    uint8_t  dataResponse;
+} SD_WriteStatus;
+
+typedef struct {
+    // Link errors seen by requests: corrupted packets, transfers which failed
+    // or timed out, and garbled tokens.
+    uint32_t crcErrors;
+    uint32_t timeouts;
+    uint32_t transferErrors;
+    // Requests which completed with SD_REQUEST_FAILED.
+    uint32_t failedRequests;
+    // Mismatched read-verify passes while choosing the clock in SD_Open.
+    uint32_t verifyErrors;
+    // Times the clock was lowered after repeated link errors.
+    uint32_t downshifts;
+} SD_ErrorStats;
+
+typedef struct {
+    // Commands sent, calls into the SPI driver (each ending in an interrupt),
+    // the transfers they were made of and the bytes clocked over SPI.
+    uint32_t commands;
+    uint32_t sequences;
+    uint32_t transfers;
+    uint32_t bytes;
+    // Polls for a response, data token or the end of busy, and the bytes they
+    // clocked (included in the totals above).
+    uint32_t polls;
+    uint32_t pollBytes;
+} SD_TransferStats;
+
+typedef enum {
+    SD_REQUEST_READ,
+    SD_REQUEST_WRITE,
+    SD_REQUEST_ERASE,
+} SD_RequestType;
+
+typedef enum {
+    SD_REQUEST_IDLE,
+    SD_REQUEST_QUEUED,
+    SD_REQUEST_ACTIVE,
+    SD_REQUEST_DONE,
+    SD_REQUEST_FAILED,
+} SD_RequestStatus;
+
+typedef struct SD_Request SD_Request;
+
+struct SD_Request {
+    SD_RequestType type;
+    // First block and number of blocks, an erase covers the whole range.
+    uint32_t       addr;
+    uint32_t       count;
+    // Block data, a write may give a pointer per block in blocks[] instead.
+    void               *data;
+    const void * const *blocks;
+
+    // Called from interrupt context once the request completes.
+    void (*callback)(SD_Request *request);
+    void  *userData;
+
+    // Updated by the driver, status changes before the callback is called.
+    volatile SD_RequestStatus status;
+    // Number of blocks from the start of the request known to be done.
+    uint32_t done;
+    // Data response token of the last block written (0x05 when accepted).
+    uint8_t  dataResponse;
+};
+
+// SPI traffic of all cards since the last reset, so the cost of an operation
+// can be measured by resetting before it and reading after.
+void     SD_GetTransferStats(SD_TransferStats *stats);
+void     SD_ResetTransferStats(void);
+
+// Up to SD_CARD_MAX (4) cards can be open, each on its own SPIMaster, and
+// requests to different cards are processed concurrently.
+//
+// Opening a card switches it to high-speed mode where supported, then picks
+// the fastest SPI clock at which blocks read back consistently. If requests
+// keep hitting link errors after that the clock is lowered a step at a time.
 SDCard  *SD_Open(SPIMaster *interface);
-void     SD_Close(SDCard *card);
+// Fails, leaving the card open, while requests are outstanding.
+bool     SD_Close(SDCard *card);
 
 uint32_t SD_GetBlockLen(const SDCard *card);
+uint32_t SD_GetTranSpeed(const SDCard *card);
+// Whether the card was switched to high-speed mode (CMD6) on open.
+bool     SD_IsHighSpeed(const SDCard *card);
+void     SD_GetErrorStats(const SDCard *card, SD_ErrorStats *stats);
+
+// Enables CRC checking (CRC_ON_OFF) of commands and data. Once enabled,
+// data packets carry a CRC16 and corrupted blocks are retried.
+// These fail while requests are outstanding (see SD_Idle).
+bool     SD_SetCRC(SDCard *card, bool enable);
 bool     SD_SetBlockLen(SDCard *card, uint32_t len);
+// Sets how many bytes are clocked per poll while waiting for a data token
+// or for the card to finish being busy. Polls start at minLen bytes and
+// double while the card isn't ready, up to maxLen (at most SD_POLL_LEN_MAX).
+// Setting both to 1 polls a byte at a time.
+bool     SD_SetPolling(SDCard *card, uint32_t minLen, uint32_t maxLen);
+
+// Queues a request to be processed asynchronously, returns false when the
+// request is invalid or the queue is full. The request must stay valid until
+// it completes. Requests for a card are processed in order.
+bool     SD_Submit(SDCard *card, SD_Request *request);
+// Returns true when the card has no queued or active requests.
+bool     SD_Idle(const SDCard *card);
+// Waits for a submitted request to complete, returns true if it succeeded.
+// Mustn't be called from interrupt context.
+bool     SD_Wait(SD_Request *request);
 
-bool     SD_ReadBlock (const SDCard *card, uint32_t addr, void *data);
+// Block data is transferred in place, so when DMA is enabled on the
+// SPIMaster the data buffers must be placed in the ".sysram" section.
+//
+// The following calls are built on SD_Submit and wait for the request to
+// complete, so they mustn't be called from interrupt context.
+bool     SD_ReadBlock (SDCard *card, uint32_t addr, void *data);
+bool     SD_ReadBlocks(SDCard *card, uint32_t addr, uint32_t count, void *data);
 bool     SD_WriteBlock(SDCard *card, uint32_t addr, const void *data);
+bool     SD_WriteBlocks(SDCard *card, uint32_t addr, uint32_t count, const void *data,
+                        SD_WriteStatus *status);
+// As SD_WriteBlocks, but the data for each block is taken from blocks[].
+bool     SD_WriteBlocksGather(SDCard *card, uint32_t addr, uint32_t count,
+                              const void * const *blocks, SD_WriteStatus *status);
+// Erases blocks first to last inclusive (CMD32/CMD33/CMD38), so later writes
+// to the range don't pay for the erase. Erased blocks read back as all 0x00
+// or all 0xFF depending on the card.
+bool     SD_EraseBlocks(SDCard *card, uint32_t first, uint32_t last);
 
 #endif // #ifndef SD_H_
@@ -0,0 +1,259 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "SDCache.h"
+
+// This is the maximum number of caches which can be opened at once.
+#define SD_CACHE_MAX       2
+// This is the maximum number of blocks held by a cache.
+#define SD_CACHE_ENTRY_MAX 64
+
+typedef struct {
+    bool     valid;
+    bool     dirty;
+    // Set once SDCache_Flush has tried to write the entry back.
+    bool     attempted;
+    uint32_t addr;
+    uint32_t lastUse;
+    uint8_t *data;
+} SDCache_Entry;
+
+struct SDCache {
+    SDCard        *card;
+    uint32_t       blockLen;
+    unsigned       count;
+    uint32_t       useCounter;
+    SDCache_Entry  entry[SD_CACHE_ENTRY_MAX];
+    SDCache_Stats  stats;
+};
+
+static SDCache_Entry *SDCache__Find(SDCache *cache, uint32_t addr)
+{
+    unsigned i;
+    for (i = 0; i < cache->count; i++) {
+        if (cache->entry[i].valid && (cache->entry[i].addr == addr)) {
+            return &cache->entry[i];
+        }
+    }
+    return NULL;
+}
+
+static void SDCache__Touch(SDCache *cache, SDCache_Entry *entry)
+{
+    entry->lastUse = ++cache->useCounter;
+}
+
+// Writes back the run of dirty blocks with consecutive addresses which
+// contains entry, in a single multi-block write.
+static bool SDCache__WriteBackRun(SDCache *cache, SDCache_Entry *entry)
+{
+    uint32_t first = entry->addr;
+    SDCache_Entry *prev;
+    while ((first > 0)
+        && (prev = SDCache__Find(cache, first - 1))
+        && prev->dirty) {
+        first--;
+    }
+
+    const void    *blocks[SD_CACHE_ENTRY_MAX];
+    SDCache_Entry *run[SD_CACHE_ENTRY_MAX];
+    uint32_t count;
+    SDCache_Entry *next;
+    for (count = 0; (count < cache->count)
+        && (next = SDCache__Find(cache, first + count))
+        && next->dirty; count++) {
+        run[count]    = next;
+        blocks[count] = next->data;
+    }
+
+    SD_WriteStatus status;
+    bool success = SD_WriteBlocksGather(cache->card, first, count, blocks, &status);
+
+    // Blocks the card accepted are clean even if the run failed part way.
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        run[i]->attempted = true;
+        if (i < status.written) {
+            run[i]->dirty = false;
+        }
+    }
+
+    cache->stats.writeBackBlocks += status.written;
+    cache->stats.writeBackRuns++;
+    return success;
+}
+
+// Returns the entry to hold addr, either a free one or the least recently
+// used one which is written back first if dirty.
+static SDCache_Entry *SDCache__Allocate(SDCache *cache, uint32_t addr)
+{
+    SDCache_Entry *victim = NULL;
+    unsigned i;
+    for (i = 0; i < cache->count; i++) {
+        SDCache_Entry *entry = &cache->entry[i];
+        if (!entry->valid) {
+            victim = entry;
+            break;
+        }
+        if (!victim || (entry->lastUse < victim->lastUse)) {
+            victim = entry;
+        }
+    }
+
+    if (victim->valid) {
+        if (victim->dirty && !SDCache__WriteBackRun(cache, victim)) {
+            return NULL;
+        }
+        cache->stats.evictions++;
+    }
+
+    victim->valid = false;
+    victim->dirty = false;
+    victim->addr  = addr;
+    return victim;
+}
+
+SDCache *SDCache_Open(SDCard *card, void *buffer, uintptr_t size)
+{
+    static SDCache SD_Caches[SD_CACHE_MAX] = {0};
+
+    uint32_t blockLen = SD_GetBlockLen(card);
+    if (!card || !buffer || (blockLen == 0) || (size < blockLen)) {
+        return NULL;
+    }
+
+    SDCache *cache = NULL;
+    unsigned c;
+    for (c = 0; c < SD_CACHE_MAX; c++) {
+        if (!SD_Caches[c].card) {
+            cache = &SD_Caches[c];
+            break;
+        }
+    }
+    if (!cache) {
+        return NULL;
+    }
+
+    cache->card       = card;
+    cache->blockLen   = blockLen;
+    cache->count      = size / blockLen;
+    cache->useCounter = 0;
+    if (cache->count > SD_CACHE_ENTRY_MAX) {
+        cache->count = SD_CACHE_ENTRY_MAX;
+    }
+
+    uint8_t *data = buffer;
+    unsigned i;
+    for (i = 0; i < cache->count; i++, data += blockLen) {
+        cache->entry[i].valid   = false;
+        cache->entry[i].dirty   = false;
+        cache->entry[i].lastUse = 0;
+        cache->entry[i].data    = data;
+    }
+
+    SDCache_ResetStats(cache);
+    return cache;
+}
+
+bool SDCache_Close(SDCache *cache)
+{
+    if (!cache) {
+        return false;
+    }
+
+    // Dirty blocks would be lost, so the cache stays open to try again.
+    if (!SDCache_Flush(cache)) {
+        return false;
+    }
+    cache->card = NULL;
+    return true;
+}
+
+bool SDCache_ReadBlock(SDCache *cache, uint32_t addr, void *data)
+{
+    if (!cache || !data) {
+        return false;
+    }
+
+    SDCache_Entry *entry = SDCache__Find(cache, addr);
+    if (entry) {
+        cache->stats.hits++;
+    } else {
+        cache->stats.misses++;
+        if (!(entry = SDCache__Allocate(cache, addr))
+            || !SD_ReadBlock(cache->card, addr, entry->data)) {
+            return false;
+        }
+        entry->valid = true;
+    }
+
+    SDCache__Touch(cache, entry);
+    __builtin_memcpy(data, entry->data, cache->blockLen);
+    return true;
+}
+
+bool SDCache_WriteBlock(SDCache *cache, uint32_t addr, const void *data)
+{
+    if (!cache || !data) {
+        return false;
+    }
+
+    // Whole blocks are written, so a miss doesn't need to read the card.
+    SDCache_Entry *entry = SDCache__Find(cache, addr);
+    if (entry) {
+        cache->stats.hits++;
+    } else {
+        cache->stats.misses++;
+        if (!(entry = SDCache__Allocate(cache, addr))) {
+            return false;
+        }
+        entry->valid = true;
+    }
+
+    __builtin_memcpy(entry->data, data, cache->blockLen);
+    entry->dirty = true;
+    SDCache__Touch(cache, entry);
+    return true;
+}
+
+bool SDCache_Flush(SDCache *cache)
+{
+    if (!cache) {
+        return false;
+    }
+
+    unsigned i;
+    for (i = 0; i < cache->count; i++) {
+        cache->entry[i].attempted = false;
+    }
+
+    // A run which fails isn't tried again for each of its other entries.
+    bool success = true;
+    for (i = 0; i < cache->count; i++) {
+        SDCache_Entry *entry = &cache->entry[i];
+        if (entry->valid && entry->dirty && !entry->attempted
+            && !SDCache__WriteBackRun(cache, entry)) {
+            success = false;
+        }
+    }
+
+    return success;
+}
+
+void SDCache_GetStats(const SDCache *cache, SDCache_Stats *stats)
+{
+    if (!cache || !stats) {
+        return;
+    }
+
+    *stats = cache->stats;
+}
+
+void SDCache_ResetStats(SDCache *cache)
+{
+    if (!cache) {
+        return;
+    }
+
+    cache->stats = (SDCache_Stats){0};
+}
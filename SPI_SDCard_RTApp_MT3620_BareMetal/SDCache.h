@@ -0,0 +1,47 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef SD_CACHE_H_
+#define SD_CACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "SD.h"
+
+// Write-back block cache which sits between an application and SD.h.
+// Blocks are evicted least recently used first, and dirty blocks with
+// adjacent addresses are written back together as a multi-block write.
+// It only calls SD.h, but SD.h itself pulls in the SPIMaster and GPT driver
+// headers, so it isn't a standalone block device interface. The host tests
+// (test/SDCacheTest.c) run the cache on SD.c against a simulated,
+// file-backed card instead.
+
+typedef struct SDCache SDCache;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    // Blocks written back to the card, and the writes used to do so.
+    uint32_t writeBackBlocks;
+    uint32_t writeBackRuns;
+} SDCache_Stats;
+
+// The cache holds (size / block length) blocks of the buffer, up to
+// SD_CACHE_ENTRY_MAX. The buffer is used for DMA so should be in sysram.
+SDCache *SDCache_Open(SDCard *card, void *buffer, uintptr_t size);
+// Writes back dirty blocks and closes the cache. If they can't all be
+// written back, it returns false and the cache stays open.
+bool     SDCache_Close(SDCache *cache);
+
+bool     SDCache_ReadBlock (SDCache *cache, uint32_t addr, void *data);
+bool     SDCache_WriteBlock(SDCache *cache, uint32_t addr, const void *data);
+
+// Writes all dirty blocks back to the card, trying each run of them once.
+bool     SDCache_Flush(SDCache *cache);
+
+void     SDCache_GetStats(const SDCache *cache, SDCache_Stats *stats);
+void     SDCache_ResetStats(SDCache *cache);
+
+#endif // #ifndef SD_CACHE_H_
@@ -0,0 +1,295 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "SDReadAhead.h"
+
+// This is the maximum number of read-aheads which can be opened at once.
+#define SD_READ_AHEAD_MAX      1
+// This is the maximum number of chunks in the ring, all of them may be
+// queued at once so it must fit in the SD.c queue.
+#define SD_READ_AHEAD_SLOT_MAX 8
+
+typedef struct {
+    // The request is left DONE once the chunk has arrived, and is IDLE when
+    // the slot is empty.
+    SD_Request request;
+    uint8_t   *data;
+    bool       prefetched;
+} SDReadAhead_Slot;
+
+struct SDReadAhead {
+    SDCard           *card;
+    GPT              *clock;
+    uint32_t          blockLen;
+    uint32_t          chunkBlocks;
+
+    // Chunks from head onwards hold consecutive blocks, head being the one
+    // currently read from.
+    SDReadAhead_Slot  slot[SD_READ_AHEAD_SLOT_MAX];
+    unsigned          count;
+    unsigned          head;
+    uint32_t          nextAddr;
+
+    bool              streaming;
+    bool              lastValid;
+    uint32_t          lastAddr;
+
+    SDReadAhead_Stats stats;
+};
+
+static bool SDReadAhead__Busy(const SDReadAhead_Slot *slot)
+{
+    return ((slot->request.status == SD_REQUEST_QUEUED)
+        || (slot->request.status == SD_REQUEST_ACTIVE));
+}
+
+static bool SDReadAhead__Holds(const SDReadAhead_Slot *slot, uint32_t addr)
+{
+    return ((slot->request.status != SD_REQUEST_IDLE)
+        && (addr >= slot->request.addr)
+        && ((addr - slot->request.addr) < slot->request.count));
+}
+
+static void SDReadAhead__Empty(SDReadAhead_Slot *slot)
+{
+    if (SDReadAhead__Busy(slot)) {
+        SD_Wait(&slot->request);
+    }
+    slot->request.status = SD_REQUEST_IDLE;
+}
+
+// Waits for every chunk in flight, as they can't be cancelled, and empties
+// the ring.
+static void SDReadAhead__Drain(SDReadAhead *readAhead)
+{
+    unsigned i;
+    for (i = 0; i < readAhead->count; i++) {
+        SDReadAhead_Slot *slot = &readAhead->slot[i];
+        if ((i != readAhead->head) && slot->prefetched
+            && (slot->request.status != SD_REQUEST_IDLE)) {
+            readAhead->stats.discardBlocks += slot->request.count;
+        }
+        SDReadAhead__Empty(slot);
+    }
+    readAhead->head = 0;
+}
+
+static bool SDReadAhead__Submit(SDReadAhead *readAhead, SDReadAhead_Slot *slot,
+                                uint32_t addr, uint32_t count, bool prefetched)
+{
+    slot->request = (SD_Request){
+        .type  = SD_REQUEST_READ,
+        .addr  = addr,
+        .count = count,
+        .data  = slot->data,
+    };
+    slot->prefetched = prefetched;
+
+    if (!SD_Submit(readAhead->card, &slot->request)) {
+        slot->request.status = SD_REQUEST_IDLE;
+        return false;
+    }
+    return true;
+}
+
+// Queues reads of the chunks following the last one into every empty slot.
+static void SDReadAhead__Fill(SDReadAhead *readAhead)
+{
+    unsigned i;
+    for (i = 1; i < readAhead->count; i++) {
+        SDReadAhead_Slot *slot = &readAhead->slot[(readAhead->head + i) % readAhead->count];
+        if (slot->request.status != SD_REQUEST_IDLE) {
+            continue;
+        }
+
+        if (!SDReadAhead__Submit(readAhead, slot, readAhead->nextAddr,
+                                 readAhead->chunkBlocks, true)) {
+            break;
+        }
+        readAhead->nextAddr += readAhead->chunkBlocks;
+        readAhead->stats.prefetchBlocks += readAhead->chunkBlocks;
+    }
+}
+
+// Finds the chunk holding addr if it's the current one or the one after, in
+// which case the ring moves on and the current chunk is freed.
+static SDReadAhead_Slot *SDReadAhead__Find(SDReadAhead *readAhead, uint32_t addr)
+{
+    SDReadAhead_Slot *slot = &readAhead->slot[readAhead->head];
+    if (SDReadAhead__Holds(slot, addr)) {
+        return slot;
+    }
+
+    unsigned next = ((readAhead->head + 1) % readAhead->count);
+    if (!SDReadAhead__Holds(&readAhead->slot[next], addr)) {
+        return NULL;
+    }
+
+    SDReadAhead__Empty(slot);
+    readAhead->head = next;
+    return &readAhead->slot[next];
+}
+
+
+SDReadAhead *SDReadAhead_Open(SDCard *card, void *buffer, uintptr_t size,
+                              uint32_t chunkBlocks, GPT *clock)
+{
+    static SDReadAhead SDReadAheads[SD_READ_AHEAD_MAX] = {0};
+
+    uint32_t blockLen = SD_GetBlockLen(card);
+    if (!card || !buffer || (chunkBlocks == 0) || (blockLen == 0)) {
+        return NULL;
+    }
+
+    uintptr_t chunkLen = (chunkBlocks * blockLen);
+    unsigned count = (size / chunkLen);
+    if (count > SD_READ_AHEAD_SLOT_MAX) {
+        count = SD_READ_AHEAD_SLOT_MAX;
+    }
+    if (count < 2) {
+        return NULL;
+    }
+
+    SDReadAhead *readAhead = NULL;
+    unsigned i;
+    for (i = 0; i < SD_READ_AHEAD_MAX; i++) {
+        if (!SDReadAheads[i].card) {
+            readAhead = &SDReadAheads[i];
+            break;
+        }
+    }
+    if (!readAhead) {
+        return NULL;
+    }
+
+    __builtin_memset(readAhead, 0, sizeof(*readAhead));
+    readAhead->card        = card;
+    readAhead->clock       = clock;
+    readAhead->blockLen    = blockLen;
+    readAhead->chunkBlocks = chunkBlocks;
+    readAhead->count       = count;
+
+    uint8_t *data = buffer;
+    for (i = 0; i < count; i++) {
+        readAhead->slot[i].data = &data[i * chunkLen];
+    }
+
+    return readAhead;
+}
+
+
+void SDReadAhead_Close(SDReadAhead *readAhead)
+{
+    if (!readAhead) {
+        return;
+    }
+
+    SDReadAhead__Drain(readAhead);
+    readAhead->card = NULL;
+}
+
+
+const void *SDReadAhead_GetBlock(SDReadAhead *readAhead, uint32_t addr)
+{
+    if (!readAhead) {
+        return NULL;
+    }
+
+    bool sequential = (readAhead->lastValid && (addr == (readAhead->lastAddr + 1)));
+    readAhead->lastValid = false;
+
+    SDReadAhead_Slot *slot = SDReadAhead__Find(readAhead, addr);
+    if (slot) {
+        // Keep the card busy with the following chunks before waiting.
+        if (readAhead->streaming) {
+            SDReadAhead__Fill(readAhead);
+        }
+
+        if (SDReadAhead__Busy(slot)) {
+            uint32_t start = (readAhead->clock ? GPT_GetCount(readAhead->clock) : 0);
+            if (SD_Wait(&slot->request)) {
+                readAhead->stats.stalls++;
+            }
+            if (readAhead->clock) {
+                readAhead->stats.stallTicks += (GPT_GetCount(readAhead->clock) - start);
+            }
+        } else if (slot->request.status == SD_REQUEST_DONE) {
+            readAhead->stats.hits++;
+        }
+
+        // A chunk which failed is read again on demand.
+        if (slot->request.status != SD_REQUEST_DONE) {
+            slot = NULL;
+        }
+    }
+
+    if (!slot) {
+        // Only read ahead once the application reads in order.
+        readAhead->streaming = sequential;
+        SDReadAhead__Drain(readAhead);
+
+        slot = &readAhead->slot[readAhead->head];
+        uint32_t count = (sequential ? readAhead->chunkBlocks : 1);
+        if (!SDReadAhead__Submit(readAhead, slot, addr, count, false)) {
+            return NULL;
+        }
+        readAhead->nextAddr = (addr + count);
+
+        if (readAhead->streaming) {
+            SDReadAhead__Fill(readAhead);
+        }
+        if (!SD_Wait(&slot->request)) {
+            SDReadAhead__Drain(readAhead);
+            return NULL;
+        }
+        readAhead->stats.misses++;
+    }
+
+    readAhead->lastValid = true;
+    readAhead->lastAddr  = addr;
+    return &slot->data[(addr - slot->request.addr) * readAhead->blockLen];
+}
+
+
+bool SDReadAhead_ReadBlock(SDReadAhead *readAhead, uint32_t addr, void *data)
+{
+    if (!data) {
+        return false;
+    }
+
+    const void *block = SDReadAhead_GetBlock(readAhead, addr);
+    if (!block) {
+        return false;
+    }
+
+    __builtin_memcpy(data, block, readAhead->blockLen);
+    return true;
+}
+
+
+void SDReadAhead_Reset(SDReadAhead *readAhead)
+{
+    if (!readAhead) {
+        return;
+    }
+
+    SDReadAhead__Drain(readAhead);
+    readAhead->streaming = false;
+    readAhead->lastValid = false;
+}
+
+
+void SDReadAhead_GetStats(const SDReadAhead *readAhead, SDReadAhead_Stats *stats)
+{
+    if (readAhead && stats) {
+        *stats = readAhead->stats;
+    }
+}
+
+
+void SDReadAhead_ResetStats(SDReadAhead *readAhead)
+{
+    if (readAhead) {
+        __builtin_memset(&readAhead->stats, 0, sizeof(readAhead->stats));
+    }
+}
@@ -0,0 +1,54 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef SD_READ_AHEAD_H_
+#define SD_READ_AHEAD_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "SD.h"
+
+// Read-ahead for applications which read blocks in order. Once accesses are
+// seen to be sequential, the following blocks are read in chunks with
+// multi-block reads queued through SD_Submit into a ring of buffers, so that
+// they arrive while the application works on the current block. Like
+// SDCache it only relies on SD.h.
+//
+// Blocks already read ahead aren't refreshed if the card is written
+// meanwhile, call SDReadAhead_Reset after writing to a range being read.
+
+typedef struct SDReadAhead SDReadAhead;
+
+typedef struct {
+    // Blocks served from a chunk which had already arrived, from a chunk
+    // still being read (a stall), and read on demand.
+    uint32_t hits;
+    uint32_t stalls;
+    uint32_t misses;
+    // Time spent waiting in stalls, in ticks of the clock given on open.
+    uint32_t stallTicks;
+    // Blocks read ahead, and read ahead but thrown away unused.
+    uint32_t prefetchBlocks;
+    uint32_t discardBlocks;
+} SDReadAhead_Stats;
+
+// The buffer is split into a ring of chunks of chunkBlocks blocks, it needs
+// room for at least two and is used for DMA so should be in sysram. Clock is
+// optional and only used to time stalls.
+SDReadAhead *SDReadAhead_Open(SDCard *card, void *buffer, uintptr_t size,
+                              uint32_t chunkBlocks, GPT *clock);
+void         SDReadAhead_Close(SDReadAhead *readAhead);
+
+// Returns the block's data, which stays valid until the next call, or NULL if
+// it couldn't be read.
+const void  *SDReadAhead_GetBlock(SDReadAhead *readAhead, uint32_t addr);
+bool         SDReadAhead_ReadBlock(SDReadAhead *readAhead, uint32_t addr, void *data);
+
+// Throws away any blocks read ahead.
+void         SDReadAhead_Reset(SDReadAhead *readAhead);
+
+void         SDReadAhead_GetStats(const SDReadAhead *readAhead, SDReadAhead_Stats *stats);
+void         SDReadAhead_ResetStats(SDReadAhead *readAhead);
+
+#endif // #ifndef SD_READ_AHEAD_H_
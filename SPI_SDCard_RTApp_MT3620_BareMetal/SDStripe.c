@@ -0,0 +1,174 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "SDStripe.h"
+
+// This is the maximum number of stripes which can be opened at once.
+#define SD_STRIPE_MAX       1
+// This is the maximum number of cards in a stripe.
+#define SD_STRIPE_CARD_MAX  4
+// Requests kept in flight per card, this must fit in the SD.c queue.
+#define SD_STRIPE_DEPTH     4
+
+struct SDStripe {
+    SDCard        *cards[SD_STRIPE_CARD_MAX];
+    unsigned       count;
+    uint32_t       addr;
+    uint32_t       unitBlocks;
+    uint32_t       blockLen;
+
+    // Each card's requests are reused in turn.
+    SD_Request     requests[SD_STRIPE_CARD_MAX][SD_STRIPE_DEPTH];
+    unsigned       next[SD_STRIPE_CARD_MAX];
+
+    SDStripe_Stats stats;
+};
+
+// Waits for a request to be free to reuse, returns false if its last
+// transfer failed.
+static bool SDStripe__Reclaim(SD_Request *request)
+{
+    bool success = ((request->status == SD_REQUEST_IDLE) || SD_Wait(request));
+    request->status = SD_REQUEST_IDLE;
+    return success;
+}
+
+static bool SDStripe__Transfer(SDStripe *stripe, SD_RequestType type,
+                               uint32_t addr, uint32_t count, uint8_t *data)
+{
+    bool success = true;
+    while (success && (count > 0)) {
+        uint32_t unit   = (addr / stripe->unitBlocks);
+        uint32_t offset = (addr % stripe->unitBlocks);
+        uint32_t blocks = (stripe->unitBlocks - offset);
+        if (blocks > count) {
+            blocks = count;
+        }
+
+        unsigned    c       = (unit % stripe->count);
+        SD_Request *request = &stripe->requests[c][stripe->next[c]];
+        stripe->next[c] = ((stripe->next[c] + 1) % SD_STRIPE_DEPTH);
+
+        if (request->status != SD_REQUEST_IDLE) {
+            stripe->stats.waits++;
+        }
+        success = SDStripe__Reclaim(request);
+
+        *request = (SD_Request){
+            .type  = type,
+            .addr  = (stripe->addr + ((unit / stripe->count) * stripe->unitBlocks) + offset),
+            .count = blocks,
+            .data  = data,
+        };
+        if (success && !SD_Submit(stripe->cards[c], request)) {
+            success = false;
+        }
+
+        stripe->stats.requests++;
+        stripe->stats.blocks += blocks;
+
+        data  += (blocks * stripe->blockLen);
+        addr  += blocks;
+        count -= blocks;
+    }
+
+    // Every request must be finished with before returning, even on failure,
+    // as they point at the caller's data.
+    unsigned c, r;
+    for (c = 0; c < stripe->count; c++) {
+        for (r = 0; r < SD_STRIPE_DEPTH; r++) {
+            if (!SDStripe__Reclaim(&stripe->requests[c][r])) {
+                success = false;
+            }
+        }
+    }
+
+    return success;
+}
+
+
+SDStripe *SDStripe_Open(SDCard * const *cards, unsigned count, uint32_t addr,
+                        uint32_t unitBlocks)
+{
+    static SDStripe SDStripes[SD_STRIPE_MAX] = {0};
+
+    if (!cards || (count == 0) || (count > SD_STRIPE_CARD_MAX)
+        || (unitBlocks == 0)) {
+        return NULL;
+    }
+
+    uint32_t blockLen = SD_GetBlockLen(cards[0]);
+    unsigned c;
+    for (c = 0; c < count; c++) {
+        if (!cards[c] || (SD_GetBlockLen(cards[c]) != blockLen)) {
+            return NULL;
+        }
+    }
+
+    SDStripe *stripe = NULL;
+    unsigned i;
+    for (i = 0; i < SD_STRIPE_MAX; i++) {
+        if (SDStripes[i].count == 0) {
+            stripe = &SDStripes[i];
+            break;
+        }
+    }
+    if (!stripe) {
+        return NULL;
+    }
+
+    __builtin_memset(stripe, 0, sizeof(*stripe));
+    for (c = 0; c < count; c++) {
+        stripe->cards[c] = cards[c];
+    }
+    stripe->count      = count;
+    stripe->addr       = addr;
+    stripe->unitBlocks = unitBlocks;
+    stripe->blockLen   = blockLen;
+    return stripe;
+}
+
+
+void SDStripe_Close(SDStripe *stripe)
+{
+    if (stripe) {
+        stripe->count = 0;
+    }
+}
+
+
+bool SDStripe_ReadBlocks(SDStripe *stripe, uint32_t addr, uint32_t count, void *data)
+{
+    if (!stripe || !data) {
+        return false;
+    }
+
+    return SDStripe__Transfer(stripe, SD_REQUEST_READ, addr, count, data);
+}
+
+
+bool SDStripe_WriteBlocks(SDStripe *stripe, uint32_t addr, uint32_t count,
+                          const void *data)
+{
+    if (!stripe || !data) {
+        return false;
+    }
+
+    return SDStripe__Transfer(stripe, SD_REQUEST_WRITE, addr, count, (uint8_t*)data);
+}
+
+
+void SDStripe_GetStats(const SDStripe *stripe, SDStripe_Stats *stats)
+{
+    if (stripe && stats) {
+        *stats = stripe->stats;
+    }
+}
+
+
+void SDStripe_ResetStats(SDStripe *stripe)
+{
+    if (stripe) {
+        __builtin_memset(&stripe->stats, 0, sizeof(stripe->stats));
+    }
+}
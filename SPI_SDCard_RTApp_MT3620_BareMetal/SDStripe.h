@@ -0,0 +1,42 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef SD_STRIPE_H_
+#define SD_STRIPE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "SD.h"
+
+// Stripes a range of blocks across several cards so that transfers to each
+// card overlap. The range is split into units of unitBlocks blocks which are
+// dealt to the cards in turn, unit n lives on card (n % count) at block
+// addr + ((n / count) * unitBlocks). The cards must each be on their own
+// SPIMaster and use the same block length.
+
+typedef struct SDStripe SDStripe;
+
+typedef struct {
+    // Requests submitted to the cards and the blocks they covered.
+    uint32_t requests;
+    uint32_t blocks;
+    // Times a card already had its share of requests in flight, so had to be
+    // waited on before submitting another.
+    uint32_t waits;
+} SDStripe_Stats;
+
+SDStripe *SDStripe_Open(SDCard * const *cards, unsigned count, uint32_t addr,
+                        uint32_t unitBlocks);
+void      SDStripe_Close(SDStripe *stripe);
+
+// Block addresses are relative to the start of the striped range. Data is
+// transferred in place, so must be in sysram when DMA is enabled.
+bool      SDStripe_ReadBlocks (SDStripe *stripe, uint32_t addr, uint32_t count, void *data);
+bool      SDStripe_WriteBlocks(SDStripe *stripe, uint32_t addr, uint32_t count,
+                               const void *data);
+
+void      SDStripe_GetStats(const SDStripe *stripe, SDStripe_Stats *stats);
+void      SDStripe_ResetStats(SDStripe *stripe);
+
+#endif // #ifndef SD_STRIPE_H_
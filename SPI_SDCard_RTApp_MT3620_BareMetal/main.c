@@ -16,7 +16,13 @@
 #include "lib/Print.h"
 #include "lib/SPIMaster.h"
 
+#include "CRC.h"
 #include "SD.h"
+#include "SDCache.h"
+#include "SDReadAhead.h"
+#include "SDStripe.h"
+#include "FAT.h"
+#include "LogStore.h"
 
 /* Set below to control # of blocks read and written */
 //#define NUM_BLOCKS_WRITE 8388608 // 4GB
@@ -26,10 +32,74 @@
 #define MAX_WRITE_BLOCK_LEN 1024
 #define NUM_BLOCKS_RW_DELTA 1000UL
 
+/* Set below to control the size of the throughput benchmarks */
+#define NUM_BLOCKS_BENCH      1024
+#define NUM_BLOCKS_PER_BURST  16
+#define BENCH_TIMER_SPEED     32768 // [Hz]
+#define NUM_BURST_RETRIES     3
+
+/* Set below to control the chunk size of the read-ahead benchmark */
+#define READ_AHEAD_CHUNK_BLOCKS 4
+
+/* Set below to control the size of the block cache and its working set */
+#define NUM_CACHE_BLOCKS      16
+#define NUM_CACHE_HOT_BLOCKS  4
+
+/* Set below to 1 to also measure CPU cycles per block with the DWT counter */
+#define BENCH_CYCLES          1
+#define NUM_BLOCKS_CYCLES     64
+
+/* Set below to 0 to run the SPI transfers without DMA */
+#define SPI_USE_DMA           1
+
+/* Set below to control how SD.c polls for data tokens and busy */
+#define SD_POLL_MIN           8
+#define SD_POLL_MAX           SD_POLL_LEN_MAX
+
+/* Set below to 1 to enable CRC checking of SD transfers */
+#define SD_USE_CRC            1
+
+/* Set below to the file read from a FAT32 formatted card */
+#define FAT_FILE_PATH         "/config.txt"
+#define FAT_FILE_PRINT_LEN    256
+
+/* Set below to control where the record log lives and its benchmark */
+#define LOG_FIRST_BLOCK       1048576 // 512MB into the card
+#define LOG_SEGMENTS          256
+#define LOG_SEGMENT_BLOCKS    8
+#define LOG_BENCH_RECORDS     8192
+#define LOG_RECORD_LEN        32
+
+/* Set below to control the range written with and without pre-erase */
+#define ERASE_FIRST_BLOCK     3145728 // 1.5GB into the card
+#define ERASE_BENCH_BLOCKS    2048
+
+/* Set below to 1 to stripe writes across a second card on ISU2 */
+#define STRIPE_SECOND_CARD    1
+#define STRIPE_FIRST_BLOCK    2097152 // 1GB into each card
+#define STRIPE_UNIT_BLOCKS    8
+#define STRIPE_BENCH_BLOCKS   2048
+
+#define CPU_FREQ              197600000 // [Hz]
+
+// Cortex-M4 DWT cycle counter
+#define DEMCR       (*(volatile uint32_t*)0xE000EDFC)
+#define DWT_CTRL    (*(volatile uint32_t*)0xE0001000)
+#define DWT_CYCCNT  (*(volatile uint32_t*)0xE0001004)
+
 static GPT       *buttonTimeout = NULL;
+static GPT       *benchTimer    = NULL;
 static UART      *debug         = NULL;
 static SPIMaster *driver        = NULL;
 static SDCard    *card          = NULL;
+#if STRIPE_SECOND_CARD
+static SPIMaster *driver2       = NULL;
+static SDCard    *card2         = NULL;
+#endif
+
+// Block data is transferred in place, so must be reachable by DMA.
+static uint8_t  blockBuff[NUM_BLOCKS_PER_BURST * MAX_WRITE_BLOCK_LEN]
+    __attribute__((section(".sysram")));
 
 static uint8_t  dataMultiplier = 1;
 static uint32_t numBlocksWrite = NUM_BLOCKS_WRITE;
@@ -58,12 +128,369 @@ static void printSDBlock(uint8_t *buff, uintptr_t blocklen, unsigned blockID)
     UART_Print(debug, "\r\n");
 }
 
+static void printThroughput(const char *name, uint32_t blocks, uintptr_t blocklen, uint32_t ticks)
+{
+    if (ticks == 0) {
+        ticks = 1;
+    }
+
+    uint64_t bytes = (uint64_t)blocks * blocklen;
+    UART_Printf(debug, "%s: %lu blocks in %lu ms (%lu KB/s)\r\n", name, blocks,
+        (uint32_t)(((uint64_t)ticks * 1000) / BENCH_TIMER_SPEED),
+        (uint32_t)((bytes * BENCH_TIMER_SPEED) / ((uint64_t)ticks * 1024)));
+}
+
+// SPI traffic per block since the transfer stats were last reset.
+static void printTransferStats(const char *name, uint32_t blocks)
+{
+    SD_TransferStats stats;
+    SD_GetTransferStats(&stats);
+    if (blocks == 0) {
+        return;
+    }
+
+    UART_Printf(debug,
+        "%s: %lu commands, %lu driver calls, %lu transfers, %lu bytes, %lu polls per block\r\n",
+        name, (stats.commands / blocks), (stats.sequences / blocks),
+        (stats.transfers / blocks), (stats.bytes / blocks), (stats.polls / blocks));
+}
+
+// Compare SD_ReadBlock in a loop against SD_ReadBlocks bursts
+static void benchmarkRead(void)
+{
+    uintptr_t blocklen = SD_GetBlockLen(card);
+
+    if (!benchTimer || (blocklen > MAX_WRITE_BLOCK_LEN)) {
+        return;
+    }
+
+    UART_Printf(debug, "Benchmarking reads of %u blocks:\r\n", NUM_BLOCKS_BENCH);
+
+    uint32_t blockID;
+    SD_ResetTransferStats();
+    uint32_t start = GPT_GetCount(benchTimer);
+    for (blockID = 0; blockID < NUM_BLOCKS_BENCH; blockID++) {
+        if (!SD_ReadBlock(card, blockID, blockBuff)) {
+            UART_Printf(debug,
+                "ERROR: Failed to read block %lu of SD card\r\n", blockID);
+            return;
+        }
+    }
+    printThroughput("SD_ReadBlock ", NUM_BLOCKS_BENCH, blocklen,
+        GPT_GetCount(benchTimer) - start);
+    printTransferStats("SD_ReadBlock ", NUM_BLOCKS_BENCH);
+
+    SD_ResetTransferStats();
+    start = GPT_GetCount(benchTimer);
+    for (blockID = 0; blockID < NUM_BLOCKS_BENCH; blockID += NUM_BLOCKS_PER_BURST) {
+        if (!SD_ReadBlocks(card, blockID, NUM_BLOCKS_PER_BURST, blockBuff)) {
+            UART_Printf(debug,
+                "ERROR: Failed to read blocks %lu-%lu of SD card\r\n",
+                blockID, (blockID + NUM_BLOCKS_PER_BURST - 1));
+            return;
+        }
+    }
+    printThroughput("SD_ReadBlocks", NUM_BLOCKS_BENCH, blocklen,
+        GPT_GetCount(benchTimer) - start);
+    printTransferStats("SD_ReadBlocks", NUM_BLOCKS_BENCH);
+
+    // Same bursts queued with SD_Submit, two in flight at once, counting how
+    // often the core gets round the loop while the reads run.
+    uintptr_t burstLen = (NUM_BLOCKS_PER_BURST * blocklen);
+    if ((burstLen * 2) > sizeof(blockBuff)) {
+        return;
+    }
+
+    SD_Request request[2];
+    uint32_t   loops  = 0;
+    bool       failed = false;
+    blockID = 0;
+    start   = GPT_GetCount(benchTimer);
+    unsigned r;
+    for (r = 0; r < 2; r++) {
+        request[r] = (SD_Request){
+            .type  = SD_REQUEST_READ,
+            .addr  = blockID,
+            .count = NUM_BLOCKS_PER_BURST,
+            .data  = &blockBuff[r * burstLen],
+        };
+        if (!SD_Submit(card, &request[r])) {
+            failed = true;
+        }
+        blockID += NUM_BLOCKS_PER_BURST;
+    }
+    while (!failed && ((blockID < NUM_BLOCKS_BENCH) || !SD_Idle(card))) {
+        for (r = 0; r < 2; r++) {
+            if (request[r].status == SD_REQUEST_FAILED) {
+                failed = true;
+            } else if ((request[r].status == SD_REQUEST_DONE)
+                && (blockID < NUM_BLOCKS_BENCH)) {
+                request[r].addr = blockID;
+                failed = !SD_Submit(card, &request[r]);
+                blockID += NUM_BLOCKS_PER_BURST;
+            }
+        }
+        loops++;
+    }
+    while (!SD_Idle(card));
+
+    if (failed) {
+        UART_Print(debug, "ERROR: Failed to read blocks with SD_Submit\r\n");
+        return;
+    }
+    printThroughput("SD_Submit    ", NUM_BLOCKS_BENCH, blocklen,
+        GPT_GetCount(benchTimer) - start);
+    UART_Printf(debug, "SD_Submit left the core free for %lu loops\r\n", loops);
+}
+
+static uint32_t sumBlock(const uint8_t *data, uintptr_t blocklen)
+{
+    uint32_t sum = 0;
+    uintptr_t i;
+    for (i = 0; i < blocklen; i++) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+// Sequential single block reads with and without read-ahead, each block is
+// summed as a stand in for the application using the data.
+static void benchmarkReadAhead(void)
+{
+    uintptr_t blocklen = SD_GetBlockLen(card);
+    if (!benchTimer || (blocklen > MAX_WRITE_BLOCK_LEN)) {
+        return;
+    }
+
+    uint32_t blockID;
+    uint32_t sum   = 0;
+    uint32_t start = GPT_GetCount(benchTimer);
+    for (blockID = 0; blockID < NUM_BLOCKS_BENCH; blockID++) {
+        if (!SD_ReadBlock(card, blockID, blockBuff)) {
+            UART_Printf(debug,
+                "ERROR: Failed to read block %lu of SD card\r\n", blockID);
+            return;
+        }
+        sum += sumBlock(blockBuff, blocklen);
+    }
+    printThroughput("SD_ReadBlock        ", NUM_BLOCKS_BENCH, blocklen,
+        GPT_GetCount(benchTimer) - start);
+
+    SDReadAhead *readAhead = SDReadAhead_Open(
+        card, blockBuff, sizeof(blockBuff), READ_AHEAD_CHUNK_BLOCKS, benchTimer);
+    if (!readAhead) {
+        UART_Print(debug, "ERROR: Failed to open read-ahead\r\n");
+        return;
+    }
+
+    uint32_t sumAhead = 0;
+    start = GPT_GetCount(benchTimer);
+    for (blockID = 0; blockID < NUM_BLOCKS_BENCH; blockID++) {
+        const uint8_t *data = SDReadAhead_GetBlock(readAhead, blockID);
+        if (!data) {
+            UART_Printf(debug,
+                "ERROR: Failed to read ahead block %lu of SD card\r\n", blockID);
+            break;
+        }
+        sumAhead += sumBlock(data, blocklen);
+    }
+    uint32_t ticks = GPT_GetCount(benchTimer) - start;
+
+    SDReadAhead_Stats stats;
+    SDReadAhead_GetStats(readAhead, &stats);
+    SDReadAhead_Close(readAhead);
+
+    if (blockID < NUM_BLOCKS_BENCH) {
+        return;
+    }
+    printThroughput("SDReadAhead_GetBlock", NUM_BLOCKS_BENCH, blocklen, ticks);
+    if (sumAhead != sum) {
+        UART_Print(debug, "ERROR: Read-ahead data doesn't match\r\n");
+    }
+
+    UART_Printf(debug,
+        "SDReadAhead: %lu hits, %lu stalls (%lu ms), %lu misses, %lu blocks read ahead\r\n",
+        stats.hits, stats.stalls,
+        (uint32_t)(((uint64_t)stats.stallTicks * 1000) / BENCH_TIMER_SPEED),
+        stats.misses, stats.prefetchBlocks);
+}
+
+// Filesystem style access through the cache: a few hot "metadata" blocks are
+// read and rewritten (with unchanged content) between sequential data reads.
+static void benchmarkCache(void)
+{
+    static uint8_t cacheBuff[NUM_CACHE_BLOCKS * MAX_WRITE_BLOCK_LEN]
+        __attribute__((section(".sysram")));
+
+    if (!benchTimer) {
+        return;
+    }
+
+    SDCache *cache = SDCache_Open(card, cacheBuff, sizeof(cacheBuff));
+    if (!cache) {
+        UART_Print(debug, "ERROR: Failed to open SD cache\r\n");
+        return;
+    }
+
+    UART_Printf(debug, "Benchmarking cache with %u blocks:\r\n", NUM_CACHE_BLOCKS);
+
+    bool success = true;
+    uint32_t blockID;
+    uint32_t start = GPT_GetCount(benchTimer);
+    for (blockID = 0; success && (blockID < NUM_BLOCKS_BENCH); blockID++) {
+        uint32_t meta = blockID % NUM_CACHE_HOT_BLOCKS;
+        success = SDCache_ReadBlock(cache, meta, blockBuff)
+            && SDCache_WriteBlock(cache, meta, blockBuff)
+            && SDCache_ReadBlock(cache, (NUM_CACHE_HOT_BLOCKS + blockID), blockBuff);
+    }
+    success = success && SDCache_Flush(cache);
+    uint32_t ticks = GPT_GetCount(benchTimer) - start;
+
+    if (!success) {
+        UART_Printf(debug, "ERROR: Cached access failed at block %lu\r\n", blockID);
+    } else {
+        printThroughput("SDCache", (NUM_BLOCKS_BENCH * 3), SD_GetBlockLen(card), ticks);
+    }
+
+    SDCache_Stats stats;
+    SDCache_GetStats(cache, &stats);
+    UART_Printf(debug,
+        "SDCache: %lu hits, %lu misses, %lu evictions, %lu blocks written back in %lu writes\r\n",
+        stats.hits, stats.misses, stats.evictions, stats.writeBackBlocks, stats.writeBackRuns);
+
+    if (!SDCache_Close(cache)) {
+        UART_Print(debug, "ERROR: Failed to write back SD cache, leaving it open\r\n");
+    }
+}
+
+#if BENCH_CYCLES
+static void printCycles(const char *name, uint32_t blocks, uintptr_t blocklen, uint32_t cycles)
+{
+    uint32_t tranSpeed = SD_GetTranSpeed(card);
+    if ((blocks == 0) || (tranSpeed == 0)) {
+        return;
+    }
+
+    // Cycles it would take to clock a block's data over SPI with no overhead.
+    uint32_t ideal = (uint32_t)(((uint64_t)blocklen * 8 * CPU_FREQ) / tranSpeed);
+    uint32_t perBlock = cycles / blocks;
+    UART_Printf(debug, "%s: %lu cycles/block at %lu Hz (ideal %lu, %lu%% of SPI bandwidth)\r\n",
+        name, perBlock, tranSpeed, ideal,
+        (perBlock ? (uint32_t)(((uint64_t)ideal * 100) / perBlock) : 0));
+}
+
+// Measure cycles per block of each access type over a short run, so that the
+// 32-bit cycle counter can't wrap.
+static void benchmarkCycles(void)
+{
+    uintptr_t blocklen = SD_GetBlockLen(card);
+    if (blocklen > MAX_WRITE_BLOCK_LEN) {
+        return;
+    }
+
+    DEMCR    |= (1U << 24);
+    DWT_CTRL |= 1U;
+
+    uint32_t blockID;
+    uint32_t start = DWT_CYCCNT;
+    for (blockID = 0; blockID < NUM_BLOCKS_CYCLES; blockID++) {
+        if (!SD_ReadBlock(card, blockID, blockBuff)) {
+            return;
+        }
+    }
+    printCycles("SD_ReadBlock ", NUM_BLOCKS_CYCLES, blocklen, DWT_CYCCNT - start);
+
+    start = DWT_CYCCNT;
+    for (blockID = 0; blockID < NUM_BLOCKS_CYCLES; blockID += NUM_BLOCKS_PER_BURST) {
+        if (!SD_ReadBlocks(card, blockID, NUM_BLOCKS_PER_BURST, blockBuff)) {
+            return;
+        }
+    }
+    printCycles("SD_ReadBlocks", NUM_BLOCKS_CYCLES, blocklen, DWT_CYCCNT - start);
+
+    // Cost of the CRC16 which is computed for every block when CRC is enabled.
+    start = DWT_CYCCNT;
+    volatile uint16_t crc = CRC_ITU16(blockBuff, sizeof(blockBuff), 0x0000);
+    (void)crc;
+    uint32_t cycles = DWT_CYCCNT - start;
+    UART_Printf(debug, "CRC_ITU16: %lu bytes in %lu cycles (%lu bytes per 1000 cycles)\r\n",
+        sizeof(blockBuff), cycles,
+        (cycles ? (uint32_t)(((uint64_t)sizeof(blockBuff) * 1000) / cycles) : 0));
+}
+#endif
+
+// Print the start of FAT_FILE_PATH and time reading the whole file
+static void readFile(void)
+{
+    FAT *fs = FAT_Mount(card);
+    if (!fs) {
+        UART_Print(debug, "No FAT32 filesystem found on card\r\n");
+        return;
+    }
+
+    FAT_File *file = FAT_Open(fs, FAT_FILE_PATH);
+    if (!file) {
+        UART_Printf(debug, "ERROR: Failed to open %s\r\n", FAT_FILE_PATH);
+        FAT_Unmount(fs);
+        return;
+    }
+
+    UART_Printf(debug, "%s (%lu bytes):\r\n", FAT_FILE_PATH, FAT_Size(file));
+    uintptr_t count;
+    if (FAT_Read(file, blockBuff, FAT_FILE_PRINT_LEN, &count)) {
+        uintptr_t i;
+        for (i = 0; i < count; i++) {
+            char c[2] = { blockBuff[i], '\0' };
+            UART_Print(debug, c);
+        }
+        UART_Print(debug, "\r\n");
+    }
+
+    if (benchTimer && FAT_Seek(file, 0)) {
+        FAT_ResetStats(fs);
+        uint32_t total = 0;
+        uint32_t start = GPT_GetCount(benchTimer);
+        while (FAT_Read(file, blockBuff, sizeof(blockBuff), &count) && (count > 0)) {
+            total += count;
+        }
+        uint32_t ticks = GPT_GetCount(benchTimer) - start;
+
+        FAT_Stats stats;
+        FAT_GetStats(fs, &stats);
+        UART_Printf(debug, "Read %lu bytes in %lu ms using %lu SD reads "
+            "(%lu blocks), FAT cache %lu hits %lu misses\r\n",
+            total, (uint32_t)(((uint64_t)ticks * 1000) / BENCH_TIMER_SPEED),
+            stats.dataReads, stats.dataBlocks, stats.fatHits, stats.fatMisses);
+    }
+
+    FAT_Close(file);
+    FAT_Unmount(fs);
+}
+
+// Print the clock chosen on open and link errors seen since.
+static void printCardStatus(const char *name, SDCard *sd)
+{
+    SD_ErrorStats errors;
+    SD_GetErrorStats(sd, &errors);
+    UART_Printf(debug, "%s clock %lu Hz%s\r\n", name,
+        SD_GetTranSpeed(sd), (SD_IsHighSpeed(sd) ? " (high-speed)" : ""));
+    UART_Printf(debug,
+        "%s errors: %lu CRC, %lu timeouts, %lu transfer, %lu failed requests, "
+        "%lu verify, %lu downshifts\r\n", name,
+        errors.crcErrors, errors.timeouts, errors.transferErrors,
+        errors.failedRequests, errors.verifyErrors, errors.downshifts);
+}
+
 // Read Block
 static void buttonA(void)
 {
     UART_Print(debug, "Reading card:\r\n");
     uintptr_t blocklen = SD_GetBlockLen(card);
-    uint8_t buff[blocklen];
+    if (blocklen > MAX_WRITE_BLOCK_LEN) {
+        UART_Printf(debug, "ERROR: Block length %lu is too long\r\n", blocklen);
+        return;
+    }
+    uint8_t *buff = blockBuff;
 
     bool success = true;
 
@@ -105,6 +532,237 @@ static void buttonA(void)
             debug, "%lu blocks read and are consistent\r\n",
             numBlocksRead);
     }
+
+    benchmarkRead();
+    benchmarkReadAhead();
+    benchmarkCache();
+#if BENCH_CYCLES
+    benchmarkCycles();
+#endif
+
+    readFile();
+    printCardStatus("SD", card);
+}
+
+// Append sensor style records to the log, after timing how long it takes to
+// find the end of the existing log, then read it all back
+static void benchmarkLog(void)
+{
+    uintptr_t segmentLen = (LOG_SEGMENT_BLOCKS * SD_GetBlockLen(card));
+    if (!benchTimer || ((segmentLen * 2) > sizeof(blockBuff))) {
+        return;
+    }
+
+    uint32_t start = GPT_GetCount(benchTimer);
+    LogStore *log = LogStore_Open(card, LOG_FIRST_BLOCK, LOG_SEGMENTS, blockBuff, segmentLen);
+    uint32_t ticks = GPT_GetCount(benchTimer) - start;
+    if (!log) {
+        UART_Print(debug, "ERROR: Failed to open record log\r\n");
+        return;
+    }
+
+    LogStore_Stats stats;
+    LogStore_GetStats(log, &stats);
+    UART_Printf(debug, "Log recovered in %lu ms reading %lu segment headers\r\n",
+        (uint32_t)(((uint64_t)ticks * 1000) / BENCH_TIMER_SPEED), stats.recoveryReads);
+
+    uint32_t record[LOG_RECORD_LEN / sizeof(uint32_t)] = {0};
+    uint32_t i;
+    start = GPT_GetCount(benchTimer);
+    for (i = 0; i < LOG_BENCH_RECORDS; i++) {
+        record[0] = GPT_GetCount(benchTimer);
+        record[1] = i;
+        if (!LogStore_Append(log, record, sizeof(record))) {
+            UART_Printf(debug, "ERROR: Failed to append record %lu to log\r\n", i);
+            break;
+        }
+    }
+    if (LogStore_Flush(log)) {
+        ticks = GPT_GetCount(benchTimer) - start;
+        if (ticks == 0) {
+            ticks = 1;
+        }
+        LogStore_GetStats(log, &stats);
+        UART_Printf(debug, "Log: %lu records in %lu ms (%lu records/s) using %lu segment writes\r\n",
+            i, (uint32_t)(((uint64_t)ticks * 1000) / BENCH_TIMER_SPEED),
+            (uint32_t)(((uint64_t)i * BENCH_TIMER_SPEED) / ticks), stats.segmentsWritten);
+    }
+
+    LogStore_Iterator iterator;
+    uint32_t count = 0;
+    uint16_t len;
+    start = GPT_GetCount(benchTimer);
+    if (LogStore_Iterate(log, &iterator, &blockBuff[segmentLen], segmentLen)) {
+        while (LogStore_Next(&iterator, record, sizeof(record), &len)) {
+            count++;
+        }
+    }
+    UART_Printf(debug, "Log holds %lu records, read back in %lu ms\r\n", count,
+        (uint32_t)(((uint64_t)(GPT_GetCount(benchTimer) - start) * 1000) / BENCH_TIMER_SPEED));
+
+    LogStore_Close(log);
+}
+
+#if STRIPE_SECOND_CARD
+// Time the same writes and reads to one card with SD_WriteBlocks and
+// SD_ReadBlocks, then striped across both cards.
+static void benchmarkStripe(void)
+{
+    uintptr_t blocklen = SD_GetBlockLen(card);
+    if (!benchTimer || !card2 || (blocklen == 0)) {
+        return;
+    }
+
+    SDCard *cards[] = { card, card2 };
+    SDStripe *stripe = SDStripe_Open(cards, 2, STRIPE_FIRST_BLOCK, STRIPE_UNIT_BLOCKS);
+    if (!stripe) {
+        UART_Print(debug, "ERROR: Failed to open stripe\r\n");
+        return;
+    }
+
+    uint32_t chunk = (sizeof(blockBuff) / blocklen);
+    uintptr_t i;
+    for (i = 0; i < sizeof(blockBuff); i++) {
+        blockBuff[i] = (uint8_t)(i * dataMultiplier);
+    }
+
+    UART_Printf(debug, "Benchmarking %u blocks on one card against two:\r\n",
+        STRIPE_BENCH_BLOCKS);
+
+    uint32_t blockID;
+    bool success = true;
+    uint32_t start = GPT_GetCount(benchTimer);
+    for (blockID = 0; success && (blockID < STRIPE_BENCH_BLOCKS); blockID += chunk) {
+        success = SD_WriteBlocks(card, (STRIPE_FIRST_BLOCK + blockID), chunk, blockBuff, NULL);
+    }
+    if (success) {
+        printThroughput("SD_WriteBlocks      ", STRIPE_BENCH_BLOCKS, blocklen,
+            GPT_GetCount(benchTimer) - start);
+    }
+
+    start = GPT_GetCount(benchTimer);
+    for (blockID = 0; success && (blockID < STRIPE_BENCH_BLOCKS); blockID += chunk) {
+        success = SDStripe_WriteBlocks(stripe, blockID, chunk, blockBuff);
+    }
+    if (success) {
+        printThroughput("SDStripe_WriteBlocks", STRIPE_BENCH_BLOCKS, blocklen,
+            GPT_GetCount(benchTimer) - start);
+    }
+
+    start = GPT_GetCount(benchTimer);
+    for (blockID = 0; success && (blockID < STRIPE_BENCH_BLOCKS); blockID += chunk) {
+        success = SD_ReadBlocks(card, (STRIPE_FIRST_BLOCK + blockID), chunk, blockBuff);
+    }
+    if (success) {
+        printThroughput("SD_ReadBlocks       ", STRIPE_BENCH_BLOCKS, blocklen,
+            GPT_GetCount(benchTimer) - start);
+    }
+
+    start = GPT_GetCount(benchTimer);
+    for (blockID = 0; success && (blockID < STRIPE_BENCH_BLOCKS); blockID += chunk) {
+        success = SDStripe_ReadBlocks(stripe, blockID, chunk, blockBuff);
+    }
+    if (success) {
+        printThroughput("SDStripe_ReadBlocks ", STRIPE_BENCH_BLOCKS, blocklen,
+            GPT_GetCount(benchTimer) - start);
+    }
+
+    if (!success) {
+        UART_Printf(debug, "ERROR: Striping benchmark failed at block %lu\r\n", blockID);
+    }
+
+    SDStripe_Stats stats;
+    SDStripe_GetStats(stripe, &stats);
+    UART_Printf(debug, "SDStripe: %lu requests for %lu blocks, waited on a card %lu times\r\n",
+        stats.requests, stats.blocks, stats.waits);
+
+    SDStripe_Close(stripe);
+    printCardStatus("SD2", card2);
+}
+#endif
+
+// Write a range as a logging session would, then erase it up front with
+// SD_EraseBlocks and write it again.
+static void benchmarkErase(void)
+{
+    uintptr_t blocklen = SD_GetBlockLen(card);
+    if (!benchTimer || (blocklen == 0)) {
+        return;
+    }
+
+    uint32_t chunk = (sizeof(blockBuff) / blocklen);
+    unsigned pass;
+    for (pass = 0; pass < 2; pass++) {
+        uint32_t start;
+        if (pass > 0) {
+            start = GPT_GetCount(benchTimer);
+            if (!SD_EraseBlocks(card, ERASE_FIRST_BLOCK,
+                                (ERASE_FIRST_BLOCK + ERASE_BENCH_BLOCKS - 1))) {
+                UART_Print(debug, "ERROR: Failed to erase blocks\r\n");
+                return;
+            }
+            UART_Printf(debug, "SD_EraseBlocks: %u blocks in %lu ms\r\n",
+                ERASE_BENCH_BLOCKS,
+                (uint32_t)(((uint64_t)(GPT_GetCount(benchTimer) - start) * 1000)
+                    / BENCH_TIMER_SPEED));
+        }
+
+        uint32_t blockID;
+        start = GPT_GetCount(benchTimer);
+        for (blockID = 0; blockID < ERASE_BENCH_BLOCKS; blockID += chunk) {
+            if (!SD_WriteBlocks(card, (ERASE_FIRST_BLOCK + blockID), chunk, blockBuff, NULL)) {
+                UART_Printf(debug, "ERROR: Failed to write blocks from %lu\r\n",
+                    (ERASE_FIRST_BLOCK + blockID));
+                return;
+            }
+        }
+        printThroughput((pass > 0 ? "Write pre-erased" : "Write           "),
+            ERASE_BENCH_BLOCKS, blocklen, GPT_GetCount(benchTimer) - start);
+    }
+}
+
+// Time multi-block writes while polling a byte at a time, then with the
+// default backoff, the blocks are rewritten by the main write test.
+static void benchmarkPolling(void)
+{
+    uintptr_t blocklen = SD_GetBlockLen(card);
+    if (!benchTimer || (blocklen > MAX_WRITE_BLOCK_LEN)) {
+        return;
+    }
+
+    static const struct {
+        const char *name;
+        uint32_t    minLen;
+        uint32_t    maxLen;
+    } modes[] = {
+        { "Polling 1 byte ", 1,           1           },
+        { "Polling backoff", SD_POLL_MIN, SD_POLL_MAX },
+    };
+
+    unsigned m;
+    for (m = 0; m < (sizeof(modes) / sizeof(modes[0])); m++) {
+        if (!SD_SetPolling(card, modes[m].minLen, modes[m].maxLen)) {
+            UART_Print(debug, "ERROR: Failed to set SD polling\r\n");
+            break;
+        }
+
+        uint32_t blockID;
+        SD_ResetTransferStats();
+        uint32_t start = GPT_GetCount(benchTimer);
+        for (blockID = 0; blockID < NUM_BLOCKS_BENCH; blockID += NUM_BLOCKS_PER_BURST) {
+            if (!SD_WriteBlocks(card, blockID, NUM_BLOCKS_PER_BURST, blockBuff, NULL)) {
+                UART_Printf(debug, "ERROR: Failed to write blocks from %lu\r\n", blockID);
+                break;
+            }
+        }
+        if (blockID >= NUM_BLOCKS_BENCH) {
+            printThroughput(modes[m].name, NUM_BLOCKS_BENCH, blocklen,
+                GPT_GetCount(benchTimer) - start);
+            printTransferStats(modes[m].name, NUM_BLOCKS_BENCH);
+        }
+    }
+
+    SD_SetPolling(card, SD_POLL_MIN, SD_POLL_MAX);
 }
 
 // Write Block
@@ -112,35 +770,78 @@ static void buttonB(void)
 {
     UART_Print(debug, "Writing to card:\r\n");
 
-    static uint8_t buff[MAX_WRITE_BLOCK_LEN] = {0};
     uintptr_t blocklen = SD_GetBlockLen(card);
+    if (blocklen > MAX_WRITE_BLOCK_LEN) {
+        UART_Printf(debug, "ERROR: Block length %lu is too long\r\n", blocklen);
+        return;
+    }
+
+    benchmarkPolling();
 
     bool success = true;
+    unsigned retries = NUM_BURST_RETRIES;
+    SD_ResetTransferStats();
+    uint32_t start = (benchTimer ? GPT_GetCount(benchTimer) : 0);
+
+    uint32_t blockID = 0;
+    while (blockID < numBlocksWrite) {
+        uint32_t count = numBlocksWrite - blockID;
+        if (count > NUM_BLOCKS_PER_BURST) {
+            count = NUM_BLOCKS_PER_BURST;
+        }
 
-    // update buffers
-    for (uint32_t blockID = 0; blockID < numBlocksWrite; blockID++) {
-        for (uintptr_t i = 0; i < blocklen; i++) {
-            buff[i] = (uint8_t)((i * dataMultiplier * blockID) % 255);
+        // update buffers
+        for (uint32_t b = 0; b < count; b++) {
+            uint8_t *block = &blockBuff[b * blocklen];
+            for (uintptr_t i = 0; i < blocklen; i++) {
+                block[i] = (uint8_t)((i * dataMultiplier * (blockID + b)) % 255);
+            }
         }
-        if (!SD_WriteBlock(card, blockID, buff)) {
+
+        SD_WriteStatus status;
+        if (!SD_WriteBlocks(card, blockID, count, blockBuff, &status)) {
             UART_Printf(debug,
-                "ERROR: Failed to write block %lu of SD card\r\n",
-                blockID);
-            success = false;
-            break;
+                "WARNING: Write of block %lu stopped after %lu blocks (response 0x%x)\r\n",
+                blockID, status.written, status.dataResponse);
+            if (retries-- == 0) {
+                UART_Printf(debug,
+                    "ERROR: Failed to write block %lu of SD card\r\n",
+                    (blockID + status.written));
+                success = false;
+                break;
+            }
+
+            // Resume after the blocks the card reported as written.
+            blockID += status.written;
+            continue;
         }
-        else if ((blockID % 256) == 0) {
+
+        retries = NUM_BURST_RETRIES;
+        if ((blockID % 256) == 0) {
             UART_Printf(
                 debug, "Wrote block %lu successfully (multiplier = %u)\r\n",
                 blockID, dataMultiplier);
         }
+        blockID += count;
     }
 
     if (success) {
         UART_Printf(
             debug, "%lu blocks written successfully\r\n", numBlocksWrite);
+        if (benchTimer) {
+            printThroughput("SD_WriteBlocks", numBlocksWrite, blocklen,
+                GPT_GetCount(benchTimer) - start);
+        }
+        printTransferStats("SD_WriteBlocks", numBlocksWrite);
     }
 
+    benchmarkLog();
+    benchmarkErase();
+#if STRIPE_SECOND_CARD
+    benchmarkStripe();
+#endif
+    printCardStatus("SD", card);
+
     numBlocksWrite += NUM_BLOCKS_RW_DELTA;
     numBlocksRead  += NUM_BLOCKS_RW_DELTA;
     dataMultiplier++;
@@ -214,7 +915,7 @@ static void InvokeCallbacks(void)
 _Noreturn void RTCoreMain(void)
 {
     VectorTableInit();
-    CPUFreq_Set(197600000);
+    CPUFreq_Set(CPU_FREQ);
 
     debug = UART_Open(MT3620_UNIT_UART_DEBUG, 115200, UART_PARITY_NONE, 1, NULL);
     UART_Print(debug, "--------------------------------\r\n");
@@ -226,7 +927,7 @@ _Noreturn void RTCoreMain(void)
         UART_Print(debug,
             "ERROR: SPI initialisation failed\r\n");
     }
-    SPIMaster_DMAEnable(driver, false);
+    SPIMaster_DMAEnable(driver, SPI_USE_DMA);
 
     // Use CSB for chip select.
     SPIMaster_Select(driver, 1);
@@ -235,8 +936,35 @@ _Noreturn void RTCoreMain(void)
     if (!card) {
         UART_Print(debug,
             "ERROR: Failed to open SD card.\r\n");
+    } else {
+        if (SD_USE_CRC && !SD_SetCRC(card, true)) {
+            UART_Print(debug,
+                "ERROR: Failed to enable SD card CRC.\r\n");
+        }
+        SD_SetPolling(card, SD_POLL_MIN, SD_POLL_MAX);
+        printCardStatus("SD", card);
     }
 
+#if STRIPE_SECOND_CARD
+    // A second card is optional, the striping benchmark only runs with one.
+    driver2 = SPIMaster_Open(MT3620_UNIT_ISU2);
+    if (driver2) {
+        SPIMaster_DMAEnable(driver2, SPI_USE_DMA);
+        SPIMaster_Select(driver2, 1);
+        card2 = SD_Open(driver2);
+    }
+    if (!card2) {
+        UART_Print(debug,
+            "No second SD card found, striping benchmark disabled.\r\n");
+    } else {
+        if (SD_USE_CRC && !SD_SetCRC(card2, true)) {
+            UART_Print(debug,
+                "ERROR: Failed to enable second SD card CRC.\r\n");
+        }
+        printCardStatus("SD2", card2);
+    }
+#endif
+
 	UART_Print(debug,
         "Press button A to read block, and B to write block.\r\n"
         "Note that with every press of B, the multiplier on each\r\n"
@@ -252,6 +980,14 @@ _Noreturn void RTCoreMain(void)
     }
     int32_t error;
 
+    // Setup GPT1 as a free running timer for benchmarks
+    if (!(benchTimer = GPT_Open(
+        MT3620_UNIT_GPT1, BENCH_TIMER_SPEED, GPT_MODE_NONE))) {
+        UART_Print(debug, "ERROR: Opening benchmark timer\r\n");
+    } else if ((error = GPT_Start_Freerun(benchTimer)) != ERROR_NONE) {
+        UART_Printf(debug, "ERROR: Starting benchmark timer (%ld)\r\n", error);
+    }
+
     if ((error = GPT_StartTimeout(
         buttonTimeout, 100, GPT_UNITS_MILLISEC, handleButtonCallback)) != ERROR_NONE) {
         UART_Printf(debug, "ERROR: Starting timer (%ld)\r\n", error);
@@ -262,5 +998,8 @@ _Noreturn void RTCoreMain(void)
         InvokeCallbacks();
     }
 
+#if STRIPE_SECOND_CARD
+    SD_Close(card2);
+#endif
     SD_Close(card);
 }
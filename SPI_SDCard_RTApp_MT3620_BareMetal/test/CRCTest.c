@@ -0,0 +1,131 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <string.h>
+
+#include "CRC.h"
+#include "Test.h"
+
+// Bit at a time references for the tables in CRC.c.
+static uint8_t CRC7_Bitwise(const uint8_t *data, uintptr_t size)
+{
+    uint8_t crc = 0;
+    uintptr_t byte;
+    for (byte = 0; byte < size; byte++) {
+        int bit;
+        for (bit = 7; bit >= 0; bit--) {
+            unsigned in  = ((data[byte] >> bit) & 1);
+            unsigned top = ((crc >> 6) & 1);
+            crc = ((crc << 1) & 0x7F);
+            if (in ^ top) {
+                crc ^= 0x09;
+            }
+        }
+    }
+    return (crc << 1);
+}
+
+static uint16_t CRC16_Bitwise(const uint8_t *data, uintptr_t size)
+{
+    uint16_t crc = 0;
+    uintptr_t byte;
+    for (byte = 0; byte < size; byte++) {
+        crc ^= (data[byte] << 8);
+        int bit;
+        for (bit = 0; bit < 8; bit++) {
+            crc = ((crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1));
+        }
+    }
+    return crc;
+}
+
+static void testCommandCRC(void)
+{
+    // CMD0 and CMD8 are the commands which need a valid CRC before
+    // CRC_ON_OFF, their CRCs are given in the SD specification.
+    const uint8_t cmd0[] = { 0x40, 0x00, 0x00, 0x00, 0x00 };
+    CHECK_EQ(CRC_7(cmd0, sizeof(cmd0), 0x00) | 0x01, 0x95);
+
+    const uint8_t cmd8[] = { 0x48, 0x00, 0x00, 0x01, 0xAA };
+    CHECK_EQ(CRC_7(cmd8, sizeof(cmd8), 0x00) | 0x01, 0x87);
+
+    // CMD17 with argument 0, also from the specification.
+    const uint8_t cmd17[] = { 0x51, 0x00, 0x00, 0x00, 0x00 };
+    CHECK_EQ(CRC_7(cmd17, sizeof(cmd17), 0x00) | 0x01, 0x55);
+}
+
+static void testDataCRC(void)
+{
+    // A block of 0xFF, as given in the SD specification.
+    uint8_t block[512];
+    memset(block, 0xFF, sizeof(block));
+    CHECK_EQ(CRC_ITU16(block, sizeof(block), 0x0000), 0x7FA1);
+
+    const char check[] = "123456789";
+    CHECK_EQ(CRC_ITU16(check, (sizeof(check) - 1), 0x0000), 0x31C3);
+}
+
+static void testIncremental(void)
+{
+    uint8_t data[1024];
+    unsigned i;
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)((i * 131) ^ (i >> 3));
+    }
+
+    uint16_t crc16 = CRC_ITU16(data, sizeof(data), 0x0000);
+    uint8_t  crc7  = CRC_7(data, sizeof(data), 0x00);
+
+    // Every split point, including empty halves.
+    for (i = 0; i <= sizeof(data); i++) {
+        CHECK_EQ(CRC_ITU16(&data[i], (sizeof(data) - i),
+                           CRC_ITU16(data, i, 0x0000)), crc16);
+        CHECK_EQ(CRC_7(&data[i], (sizeof(data) - i),
+                       CRC_7(data, i, 0x00)), crc7);
+    }
+
+    // Uneven chunks, as the SD driver gets a packet in SPI sized pieces.
+    uint16_t crc = 0x0000;
+    uintptr_t offset, chunk;
+    for (offset = 0, chunk = 1; offset < sizeof(data); offset += chunk, chunk += 7) {
+        if (chunk > (sizeof(data) - offset)) {
+            chunk = (sizeof(data) - offset);
+        }
+        crc = CRC_ITU16(&data[offset], chunk, crc);
+    }
+    CHECK_EQ(crc, crc16);
+}
+
+static void testTables(void)
+{
+    // Every single byte exercises every table entry.
+    unsigned i;
+    for (i = 0; i < 256; i++) {
+        uint8_t byte = i;
+        CHECK_EQ(CRC_7(&byte, 1, 0x00), CRC7_Bitwise(&byte, 1));
+        CHECK_EQ(CRC_ITU16(&byte, 1, 0x0000), CRC16_Bitwise(&byte, 1));
+    }
+
+    // Longer pseudo-random runs, including command sized ones.
+    uint8_t  data[600];
+    uint32_t state = 0x12345678;
+    for (i = 0; i < sizeof(data); i++) {
+        state = (state * 1103515245) + 12345;
+        data[i] = (state >> 16);
+    }
+
+    uintptr_t size;
+    for (size = 0; size <= sizeof(data); size += ((size < 16) ? 1 : 37)) {
+        CHECK_EQ(CRC_7(data, size, 0x00), CRC7_Bitwise(data, size));
+        CHECK_EQ(CRC_ITU16(data, size, 0x0000), CRC16_Bitwise(data, size));
+    }
+}
+
+int main(void)
+{
+    testCommandCRC();
+    testDataCRC();
+    testIncremental();
+    testTables();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,439 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "FAT.h"
+#include "SD.h"
+#include "SDEmu.h"
+#include "Test.h"
+
+#define SECTOR_LEN 512
+
+// A FAT32 volume with one sector per cluster, in the first partition of an
+// MBR, just big enough to have the 65525 clusters FAT32 needs.
+#define IMAGE_BLOCKS     (69 * 1024)
+#define PART_START       64
+#define PART_SECTORS     (IMAGE_BLOCKS - PART_START)
+#define RESERVED_SECTORS 32
+#define FAT_SECTORS      552
+#define DATA_START       (PART_START + RESERVED_SECTORS + (2 * FAT_SECTORS))
+#define CLUSTER_COUNT    (PART_SECTORS - RESERVED_SECTORS - (2 * FAT_SECTORS))
+
+#define EOC 0x0FFFFFFF
+
+// Directories and files, by first cluster.
+#define ROOT_CLUSTER  2
+#define HELLO_CLUSTER 3
+#define DOCS_CLUSTER  4
+#define SUB_CLUSTER   5
+#define DEEP_CLUSTER  6
+#define CYCLE_CLUSTER 7
+#define DEEP_FILE_CLUSTER 100
+#define DEEP_FILE_SIZE    1500
+
+// The long file is fragmented over three runs of clusters.
+static const uint32_t longRuns[][2] = { { 10, 10 }, { 30, 5 }, { 50, 1 } };
+#define LONG_FILE_SIZE ((16 * SECTOR_LEN) - 100)
+
+static const char hello[] = "Hello, world\n";
+
+static SDEmu  *emu  = NULL;
+static SDCard *card = NULL;
+static FAT    *fs   = NULL;
+
+static uint8_t sector[SECTOR_LEN];
+static uint8_t buffer[32 * SECTOR_LEN];
+
+static void put16(uint8_t *data, uint16_t value)
+{
+    data[0] = value;
+    data[1] = (value >> 8);
+}
+
+static void put32(uint8_t *data, uint32_t value)
+{
+    put16(data, value);
+    put16(&data[2], (value >> 16));
+}
+
+static void writeSector(uint32_t addr, const void *data)
+{
+    CHECK_EQ(pwrite(SDEmu_File(emu), data, SECTOR_LEN, ((off_t)addr * SECTOR_LEN)),
+             SECTOR_LEN);
+}
+
+static uint32_t clusterAddr(uint32_t cluster)
+{
+    return (DATA_START + (cluster - 2));
+}
+
+static void setFAT(uint32_t cluster, uint32_t next)
+{
+    unsigned f;
+    for (f = 0; f < 2; f++) {
+        uint32_t addr = (PART_START + RESERVED_SECTORS + (f * FAT_SECTORS)
+            + ((cluster * 4) / SECTOR_LEN));
+        CHECK_EQ(pread(SDEmu_File(emu), sector, SECTOR_LEN, ((off_t)addr * SECTOR_LEN)),
+                 SECTOR_LEN);
+        put32(&sector[(cluster * 4) % SECTOR_LEN], next);
+        writeSector(addr, sector);
+    }
+}
+
+static uint8_t filePattern(uint32_t offset)
+{
+    return (uint8_t)((offset * 7) + (offset >> 9));
+}
+
+// Short directory entry, name is the space padded 8.3 form.
+static uint8_t *dirEntry(uint8_t *entry, const char name[11], uint8_t attr,
+                         uint32_t cluster, uint32_t size)
+{
+    memset(entry, 0x00, 32);
+    memcpy(entry, name, 11);
+    entry[11] = attr;
+    put16(&entry[20], (cluster >> 16));
+    put16(&entry[26], cluster);
+    put32(&entry[28], size);
+    return &entry[32];
+}
+
+static uint8_t lfnChecksum(const char name[11])
+{
+    uint8_t sum = 0;
+    unsigned i;
+    for (i = 0; i < 11; i++) {
+        sum = (((sum & 1) << 7) + (sum >> 1) + (uint8_t)name[i]);
+    }
+    return sum;
+}
+
+// Long name entries followed by the short entry they belong to.
+static uint8_t *lfnEntries(uint8_t *entry, const char *longName, const char name[11],
+                           uint8_t attr, uint32_t cluster, uint32_t size)
+{
+    static const uint8_t offset[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+    unsigned len   = strlen(longName);
+    unsigned count = ((len + 12) / 13);
+    unsigned order;
+    for (order = count; order > 0; order--, entry += 32) {
+        memset(entry, 0x00, 32);
+        entry[0]  = (order | ((order == count) ? 0x40 : 0x00));
+        entry[11] = 0x0F;
+        entry[13] = lfnChecksum(name);
+
+        unsigned i;
+        for (i = 0; i < 13; i++) {
+            unsigned pos = (((order - 1) * 13) + i);
+            uint16_t c = ((pos < len) ? (uint8_t)longName[pos]
+                : ((pos == len) ? 0x0000 : 0xFFFF));
+            put16(&entry[offset[i]], c);
+        }
+    }
+
+    return dirEntry(entry, name, attr, cluster, size);
+}
+
+static void buildImage(void)
+{
+    // Partition table with a FAT32 (LBA) partition.
+    memset(sector, 0x00, sizeof(sector));
+    sector[446 + 4] = 0x0C;
+    put32(&sector[446 + 8], PART_START);
+    put32(&sector[446 + 12], PART_SECTORS);
+    put16(&sector[510], 0xAA55);
+    writeSector(0, sector);
+
+    memset(sector, 0x00, sizeof(sector));
+    sector[0] = 0xEB;
+    sector[1] = 0x58;
+    sector[2] = 0x90;
+    memcpy(&sector[3], "MSWIN4.1", 8);
+    put16(&sector[11], SECTOR_LEN);
+    sector[13] = 1;
+    put16(&sector[14], RESERVED_SECTORS);
+    sector[16] = 2;
+    sector[21] = 0xF8;
+    put32(&sector[32], PART_SECTORS);
+    put32(&sector[36], FAT_SECTORS);
+    put32(&sector[44], ROOT_CLUSTER);
+    memcpy(&sector[82], "FAT32   ", 8);
+    put16(&sector[510], 0xAA55);
+    writeSector(PART_START, sector);
+
+    setFAT(0, 0x0FFFFFF8);
+    setFAT(1, EOC);
+    uint32_t cluster;
+    for (cluster = ROOT_CLUSTER; cluster <= DEEP_CLUSTER; cluster++) {
+        setFAT(cluster, EOC);
+    }
+    // A directory whose chain links back to its first cluster.
+    setFAT(CYCLE_CLUSTER, (CYCLE_CLUSTER + 1));
+    setFAT((CYCLE_CLUSTER + 1), CYCLE_CLUSTER);
+    setFAT(DEEP_FILE_CLUSTER, (DEEP_FILE_CLUSTER + 1));
+    setFAT((DEEP_FILE_CLUSTER + 1), (DEEP_FILE_CLUSTER + 2));
+    setFAT((DEEP_FILE_CLUSTER + 2), EOC);
+
+    unsigned r;
+    for (r = 0; r < 3; r++) {
+        uint32_t c;
+        for (c = 0; c < longRuns[r][1]; c++) {
+            uint32_t next = (c + 1 < longRuns[r][1]) ? (longRuns[r][0] + c + 1)
+                : ((r < 2) ? longRuns[r + 1][0] : EOC);
+            setFAT((longRuns[r][0] + c), next);
+        }
+    }
+
+    // Root directory, including corrupt directory entries.
+    memset(sector, 0x00, sizeof(sector));
+    uint8_t *entry = sector;
+    entry = dirEntry(entry, "TESTVOL    ", 0x08, 0, 0);
+    entry = dirEntry(entry, "HELLO   TXT", 0x20, HELLO_CLUSTER, (sizeof(hello) - 1));
+    entry = lfnEntries(entry, "Documents", "DOCUME~1   ", 0x10, DOCS_CLUSTER, 0);
+    entry = dirEntry(entry, "SUB        ", 0x10, SUB_CLUSTER, 0);
+    entry = dirEntry(entry, "DELETED TXT", 0x20, HELLO_CLUSTER, 4);
+    entry[-32] = 0xE5;
+    entry = dirEntry(entry, "BAD0       ", 0x10, 0, 0);
+    entry = dirEntry(entry, "BAD1       ", 0x10, 1, 0);
+    entry = dirEntry(entry, "BADFAR     ", 0x10, (CLUSTER_COUNT + 2), 0);
+    entry = dirEntry(entry, "BADFILE BIN", 0x20, 1, 100);
+    entry = dirEntry(entry, "CYCLE      ", 0x10, CYCLE_CLUSTER, 0);
+    writeSector(clusterAddr(ROOT_CLUSTER), sector);
+
+    // Full of entries, so there's no end marker to stop at.
+    entry = sector;
+    while (entry < &sector[SECTOR_LEN]) {
+        entry = dirEntry(entry, "FILLER  BIN", 0x20, HELLO_CLUSTER, 1);
+    }
+    writeSector(clusterAddr(CYCLE_CLUSTER), sector);
+    writeSector(clusterAddr(CYCLE_CLUSTER + 1), sector);
+
+    memset(sector, 0x00, sizeof(sector));
+    memcpy(sector, hello, (sizeof(hello) - 1));
+    writeSector(clusterAddr(HELLO_CLUSTER), sector);
+
+    memset(sector, 0x00, sizeof(sector));
+    entry = sector;
+    entry = dirEntry(entry, ".          ", 0x10, DOCS_CLUSTER, 0);
+    entry = dirEntry(entry, "..         ", 0x10, 0, 0);
+    entry = lfnEntries(entry, "A long file name.bin", "ALONGF~1BIN", 0x20,
+                       longRuns[0][0], LONG_FILE_SIZE);
+    writeSector(clusterAddr(DOCS_CLUSTER), sector);
+
+    memset(sector, 0x00, sizeof(sector));
+    entry = sector;
+    entry = dirEntry(entry, ".          ", 0x10, SUB_CLUSTER, 0);
+    entry = dirEntry(entry, "..         ", 0x10, 0, 0);
+    entry = dirEntry(entry, "DEEP       ", 0x10, DEEP_CLUSTER, 0);
+    writeSector(clusterAddr(SUB_CLUSTER), sector);
+
+    memset(sector, 0x00, sizeof(sector));
+    entry = sector;
+    entry = dirEntry(entry, ".          ", 0x10, DEEP_CLUSTER, 0);
+    entry = dirEntry(entry, "..         ", 0x10, SUB_CLUSTER, 0);
+    entry = dirEntry(entry, "FILE    DAT", 0x20, DEEP_FILE_CLUSTER, DEEP_FILE_SIZE);
+    writeSector(clusterAddr(DEEP_CLUSTER), sector);
+
+    // File contents, the long file's offsets run across its fragments.
+    uint32_t offset = 0;
+    for (r = 0; r < 3; r++) {
+        uint32_t c;
+        for (c = 0; c < longRuns[r][1]; c++) {
+            unsigned i;
+            for (i = 0; i < SECTOR_LEN; i++, offset++) {
+                sector[i] = filePattern(offset);
+            }
+            writeSector(clusterAddr(longRuns[r][0] + c), sector);
+        }
+    }
+    for (offset = 0; offset < (3 * SECTOR_LEN); offset += SECTOR_LEN) {
+        memset(sector, (0xD0 + (offset / SECTOR_LEN)), sizeof(sector));
+        writeSector(clusterAddr(DEEP_FILE_CLUSTER + (offset / SECTOR_LEN)), sector);
+    }
+}
+
+static void checkFile(FAT_File *file, uint32_t offset, uintptr_t size)
+{
+    uintptr_t count;
+    CHECK(FAT_Seek(file, offset));
+    CHECK(FAT_Read(file, buffer, size, &count));
+
+    uintptr_t expect = ((offset + size) > FAT_Size(file))
+        ? (FAT_Size(file) - offset) : size;
+    CHECK_EQ(count, expect);
+    CHECK_EQ(FAT_Tell(file), (offset + count));
+
+    uintptr_t i;
+    for (i = 0; i < count; i++) {
+        CHECK_EQ(buffer[i], filePattern(offset + i));
+    }
+}
+
+static void testMount(void)
+{
+    // An unformatted card isn't mounted.
+    CHECK(!FAT_Mount(card));
+
+    buildImage();
+    fs = FAT_Mount(card);
+    CHECK(fs);
+}
+
+static void testOpen(void)
+{
+    FAT_File *file = FAT_Open(fs, "/hello.txt");
+    CHECK(file);
+    CHECK_EQ(FAT_Size(file), (sizeof(hello) - 1));
+
+    uintptr_t count;
+    char text[32] = {0};
+    CHECK(FAT_Read(file, text, sizeof(text), &count));
+    CHECK_EQ(count, (sizeof(hello) - 1));
+    CHECK(strcmp(text, hello) == 0);
+    CHECK(FAT_Read(file, text, sizeof(text), &count));
+    CHECK_EQ(count, 0);
+    FAT_Close(file);
+
+    // Long and short names, matched case insensitively, and extra slashes.
+    file = FAT_Open(fs, "Documents/A LONG FILE NAME.BIN");
+    CHECK(file);
+    CHECK_EQ(FAT_Size(file), LONG_FILE_SIZE);
+    FAT_Close(file);
+    file = FAT_Open(fs, "//DOCUME~1//alongf~1.bin");
+    CHECK(file);
+    FAT_Close(file);
+
+    file = FAT_Open(fs, "/sub/deep/file.dat");
+    CHECK(file);
+    CHECK_EQ(FAT_Size(file), DEEP_FILE_SIZE);
+    CHECK(FAT_Read(file, buffer, sizeof(buffer), &count));
+    CHECK_EQ(count, DEEP_FILE_SIZE);
+    CHECK_EQ(buffer[0], 0xD0);
+    CHECK_EQ(buffer[SECTOR_LEN], 0xD1);
+    CHECK_EQ(buffer[DEEP_FILE_SIZE - 1], 0xD2);
+    FAT_Close(file);
+
+    // ".." in the root's children is cluster 0.
+    file = FAT_Open(fs, "/SUB/DEEP/../../Documents/../HELLO.TXT");
+    CHECK(file);
+    FAT_Close(file);
+
+    CHECK(!FAT_Open(fs, "/missing.txt"));
+    CHECK(!FAT_Open(fs, "/deleted.txt"));
+    CHECK(!FAT_Open(fs, "/testvol"));
+    CHECK(!FAT_Open(fs, "/SUB"));
+    CHECK(!FAT_Open(fs, "/"));
+    CHECK(!FAT_Open(fs, "/HELLO.TXT/FILE.DAT"));
+    CHECK(!FAT_Open(fs, "/SUB/DEEP/FILE.DAT/X"));
+}
+
+static void testCorrupt(void)
+{
+    // Directory entries pointing outside the data area are refused rather
+    // than read from before or after it.
+    CHECK(!FAT_Open(fs, "/BAD0/HELLO.TXT"));
+    CHECK(!FAT_Open(fs, "/BAD1/HELLO.TXT"));
+    CHECK(!FAT_Open(fs, "/BADFAR/HELLO.TXT"));
+    CHECK(!FAT_Open(fs, "/BADFILE.BIN"));
+
+    // The lookup stops at the entry, the root directory sector it came from
+    // is the last one read.
+    FAT_Stats stats;
+    FAT_ResetStats(fs);
+    CHECK(!FAT_Open(fs, "/BADFAR/X/Y"));
+    FAT_GetStats(fs, &stats);
+    CHECK_EQ(stats.dataReads, 0);
+
+    // A directory whose cluster chain loops is read up to the 65536 entry
+    // limit, rather than round the loop for 4 GB.
+    FAT_ResetStats(fs);
+    CHECK(!FAT_Open(fs, "/CYCLE/HELLO.TXT"));
+    FAT_GetStats(fs, &stats);
+    CHECK_EQ(stats.dataBlocks, ((65536 * 32) / SECTOR_LEN));
+}
+
+static void testRead(void)
+{
+    FAT_File *file = FAT_Open(fs, "/Documents/A long file name.bin");
+    CHECK(file);
+
+    // Each contiguous run is one multi-block read, the partial sector at the
+    // end goes through the sector buffer.
+    FAT_ResetStats(fs);
+    checkFile(file, 0, sizeof(buffer));
+    FAT_Stats stats;
+    FAT_GetStats(fs, &stats);
+    CHECK_EQ(stats.dataReads, 3);
+    CHECK_EQ(stats.dataBlocks, 16);
+
+    // Unaligned reads across sector and fragment boundaries.
+    checkFile(file, 1, 1);
+    checkFile(file, 511, 2);
+    checkFile(file, ((10 * SECTOR_LEN) - 3), 7);
+    checkFile(file, 700, (12 * SECTOR_LEN));
+    checkFile(file, (LONG_FILE_SIZE - 10), 100);
+    checkFile(file, LONG_FILE_SIZE, 1);
+    CHECK(!FAT_Seek(file, (LONG_FILE_SIZE + 1)));
+
+    // Reading in small pieces, the FAT sector stays cached.
+    FAT_ResetStats(fs);
+    CHECK(FAT_Seek(file, 0));
+    uint32_t offset;
+    for (offset = 0; offset < LONG_FILE_SIZE; offset += 100) {
+        uintptr_t count;
+        CHECK(FAT_Read(file, buffer, 100, &count));
+        unsigned i;
+        for (i = 0; i < count; i++) {
+            CHECK_EQ(buffer[i], filePattern(offset + i));
+        }
+    }
+    FAT_GetStats(fs, &stats);
+    CHECK(stats.fatMisses <= 1);
+    FAT_Close(file);
+}
+
+static void testLimits(void)
+{
+    FAT_File *files[5];
+    unsigned i;
+    for (i = 0; i < 4; i++) {
+        files[i] = FAT_Open(fs, "/HELLO.TXT");
+        CHECK(files[i]);
+    }
+    CHECK(!FAT_Open(fs, "/HELLO.TXT"));
+    FAT_Close(files[0]);
+    files[4] = FAT_Open(fs, "/HELLO.TXT");
+    CHECK(files[4]);
+
+    // Unmounting closes the files.
+    FAT_Unmount(fs);
+    uintptr_t count;
+    CHECK(!FAT_Read(files[1], buffer, 1, &count));
+    CHECK(!FAT_Open(fs, "/HELLO.TXT"));
+}
+
+int main(void)
+{
+    SDEmu_Config config;
+    SDEmu_DefaultConfig(&config);
+    config.blocks = IMAGE_BLOCKS;
+
+    unlink("FATTest.img");
+    emu = SDEmu_Open("FATTest.img", &config);
+    CHECK(emu);
+    card = SD_Open(SDEmu_Interface(emu));
+    CHECK(card);
+
+    testMount();
+    testOpen();
+    testCorrupt();
+    testRead();
+    testLimits();
+
+    CHECK(SD_Close(card));
+    SDEmu_Close(emu);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,205 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Host.h"
+#include "lib/GPT.h"
+
+#define HOST_EVENT_MAX 32
+
+static uint64_t    now = 0;
+static Host_Event *events[HOST_EVENT_MAX] = {NULL};
+
+uint64_t Host_Now(void)
+{
+    return now;
+}
+
+void Host_Schedule(Host_Event *event, uint64_t delay)
+{
+    unsigned i, free = HOST_EVENT_MAX;
+    for (i = 0; i < HOST_EVENT_MAX; i++) {
+        if (events[i] == event) {
+            break;
+        }
+        if (!events[i] && (free == HOST_EVENT_MAX)) {
+            free = i;
+        }
+    }
+    if (i == HOST_EVENT_MAX) {
+        if (free == HOST_EVENT_MAX) {
+            fprintf(stderr, "Host: too many events\n");
+            abort();
+        }
+        events[free] = event;
+    }
+
+    event->time    = now + delay;
+    event->pending = true;
+}
+
+void Host_Cancel(Host_Event *event)
+{
+    event->pending = false;
+
+    unsigned i;
+    for (i = 0; i < HOST_EVENT_MAX; i++) {
+        if (events[i] == event) {
+            events[i] = NULL;
+        }
+    }
+}
+
+bool Host_Step(void)
+{
+    Host_Event *next = NULL;
+    unsigned i;
+    for (i = 0; i < HOST_EVENT_MAX; i++) {
+        if (events[i] && events[i]->pending
+            && (!next || (events[i]->time < next->time))) {
+            next = events[i];
+        }
+    }
+    if (!next) {
+        return false;
+    }
+
+    if (next->time > now) {
+        now = next->time;
+    }
+    next->pending = false;
+    next->fire(next->arg);
+    return true;
+}
+
+void Host_WaitForInterrupt(void)
+{
+    if (!Host_Step()) {
+        fprintf(stderr, "Host: waiting for an interrupt with none pending\n");
+        abort();
+    }
+}
+
+
+// GPT
+
+struct GPT {
+    bool        open;
+    bool        enabled;
+    GPT_Mode    mode;
+    float       speed;  // [Hz]
+    uint64_t    period; // [ns]
+    uint64_t    start;  // [ns]
+    void      (*callback)(GPT *);
+    Host_Event  event;
+};
+
+static GPT GPTs[MT3620_UNIT_GPT_COUNT] = {0};
+
+static void GPT__Fire(void *arg)
+{
+    GPT *handle = arg;
+    if (handle->mode != GPT_MODE_REPEAT) {
+        handle->enabled = false;
+    } else {
+        Host_Schedule(&handle->event, handle->period);
+    }
+
+    if (handle->callback) {
+        handle->callback(handle);
+    }
+}
+
+static uint64_t GPT__Nanoseconds(uint32_t time, GPT_Units units)
+{
+    return ((uint64_t)time * 1000000000ULL) / units;
+}
+
+GPT *GPT_Open(int32_t id, float speedHz, GPT_Mode mode)
+{
+    if ((id < 0) || (id >= MT3620_UNIT_GPT_COUNT) || GPTs[id].open) {
+        return NULL;
+    }
+
+    GPT *handle = &GPTs[id];
+    handle->open       = true;
+    handle->enabled    = false;
+    handle->mode       = mode;
+    handle->speed      = speedHz;
+    handle->callback   = NULL;
+    handle->event.fire = GPT__Fire;
+    handle->event.arg  = handle;
+    return handle;
+}
+
+void GPT_Close(GPT *handle)
+{
+    if (handle) {
+        GPT_Stop(handle);
+        handle->open = false;
+    }
+}
+
+int32_t GPT_Stop(GPT *handle)
+{
+    if (!handle) {
+        return ERROR_PARAMETER;
+    }
+
+    handle->enabled = false;
+    Host_Cancel(&handle->event);
+    return ERROR_NONE;
+}
+
+bool GPT_IsEnabled(GPT *handle)
+{
+    return (handle && handle->enabled);
+}
+
+int32_t GPT_StartTimeout(GPT *handle, uint32_t timeout, GPT_Units units,
+                         void (*callback)(GPT *))
+{
+    if (!handle || (timeout == 0)) {
+        return ERROR_PARAMETER;
+    }
+    if (handle->enabled) {
+        return ERROR_BUSY;
+    }
+
+    handle->enabled  = true;
+    handle->period   = GPT__Nanoseconds(timeout, units);
+    handle->callback = callback;
+    Host_Schedule(&handle->event, handle->period);
+    return ERROR_NONE;
+}
+
+int32_t GPT_Start_Freerun(GPT *handle)
+{
+    if (!handle) {
+        return ERROR_PARAMETER;
+    }
+
+    handle->enabled = true;
+    handle->start   = now;
+    return ERROR_NONE;
+}
+
+uint32_t GPT_GetRunningTime(GPT *handle, GPT_Units units)
+{
+    if (!handle || !handle->enabled) {
+        return 0;
+    }
+
+    return (uint32_t)(((now - handle->start) * units) / 1000000000ULL);
+}
+
+uint32_t GPT_GetCount(GPT *handle)
+{
+    if (!handle || !handle->enabled) {
+        return 0;
+    }
+
+    return (uint32_t)((double)(now - handle->start) * handle->speed / 1e9);
+}
@@ -0,0 +1,36 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef HOST_H_
+#define HOST_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Simulated time and interrupts for the host build.
+//
+// Nothing happens behind the code under test's back: simulated peripherals
+// schedule events, and the events are only fired (as if they were interrupts)
+// when that code waits for an interrupt. Time jumps straight to the next
+// event, so timeouts cost nothing to test.
+
+typedef struct {
+    uint64_t time; // [ns]
+    bool     pending;
+    void   (*fire)(void *arg);
+    void    *arg;
+} Host_Event;
+
+// Time since the start of the process. [ns]
+uint64_t Host_Now(void);
+// Fires event after delay nanoseconds, rescheduling a pending event moves it.
+void     Host_Schedule(Host_Event *event, uint64_t delay);
+void     Host_Cancel(Host_Event *event);
+
+// Fires the next event, returns false if none are pending.
+bool     Host_Step(void);
+// Stand-in for wfi, a wait with nothing pending would never return so it
+// aborts instead.
+void     Host_WaitForInterrupt(void);
+
+#endif // #ifndef HOST_H_
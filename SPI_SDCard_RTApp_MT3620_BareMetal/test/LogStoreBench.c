@@ -0,0 +1,117 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Host.h"
+#include "LogStore.h"
+#include "SD.h"
+#include "SDEmu.h"
+#include "Test.h"
+
+// Measures the record log on a simulated card, usage: LogStoreBench [records]
+//
+// Times are on the simulated clock, so they're the time the bus transfers and
+// the card's delays and busy signalling take with SDEmu's default timings,
+// not the host's time. They're for comparing changes to LogStore.c against
+// each other; the sample's button B gives the figures for a real card.
+
+// The same layout as the sample.
+#define LOG_ADDR           64
+#define LOG_SEGMENTS       256
+#define LOG_SEGMENT_BLOCKS 8
+#define LOG_RECORD_LEN     32
+#define BLOCK_LEN          512
+#define SEGMENT_LEN        (LOG_SEGMENT_BLOCKS * BLOCK_LEN)
+
+static SDEmu  *emu  = NULL;
+static SDCard *card = NULL;
+
+static uint8_t segmentBuffer[SEGMENT_LEN];
+static uint8_t readBuffer[SEGMENT_LEN];
+
+static LogStore *openLog(uint64_t *time)
+{
+    uint64_t  start = Host_Now();
+    LogStore *store = LogStore_Open(card, LOG_ADDR, LOG_SEGMENTS,
+                                    segmentBuffer, sizeof(segmentBuffer));
+    CHECK(store);
+    *time = (Host_Now() - start);
+    return store;
+}
+
+// Appends records to the log, then reopens it and reads it back.
+static void benchLog(uint32_t count)
+{
+    uint64_t time;
+    LogStore *store = openLog(&time);
+
+    uint32_t record[LOG_RECORD_LEN / sizeof(uint32_t)] = {0};
+    uint64_t start = Host_Now();
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        record[0] = (uint32_t)Host_Now();
+        record[1] = i;
+        CHECK(LogStore_Append(store, record, sizeof(record)));
+    }
+    CHECK(LogStore_Flush(store));
+    time = (Host_Now() - start);
+
+    LogStore_Stats stats;
+    LogStore_GetStats(store, &stats);
+    printf("append %u x %u B  %10.0f records/s  %6.2f MB/s  %u segment writes\n",
+           (unsigned)count, LOG_RECORD_LEN, (count / (time / 1e9)),
+           ((double)count * LOG_RECORD_LEN / (time / 1e3)), (unsigned)stats.segmentsWritten);
+    CHECK(LogStore_Close(store));
+
+    store = openLog(&time);
+    LogStore_GetStats(store, &stats);
+    printf("recover  %8.3f ms  %u segment headers read\n", (time / 1e6),
+           (unsigned)stats.recoveryReads);
+
+    LogStore_Iterator iterator;
+    CHECK(LogStore_Iterate(store, &iterator, readBuffer, sizeof(readBuffer)));
+    uint32_t read = 0;
+    uint16_t len;
+    start = Host_Now();
+    while (LogStore_Next(&iterator, record, sizeof(record), &len)) {
+        read++;
+    }
+    time = (Host_Now() - start);
+    printf("read back %u records  %10.0f records/s\n", (unsigned)read, (read / (time / 1e9)));
+    CHECK(LogStore_Close(store));
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t count = 65536;
+    if (argc > 1) {
+        count = (uint32_t)strtoul(argv[1], NULL, 0);
+    }
+    CHECK(count > 0);
+
+    SDEmu_Config config;
+    SDEmu_DefaultConfig(&config);
+    config.blocks = (LOG_ADDR + (LOG_SEGMENTS * LOG_SEGMENT_BLOCKS));
+
+    unlink("LogStoreBench.img");
+    emu = SDEmu_Open("LogStoreBench.img", &config);
+    CHECK(emu);
+    card = SD_Open(SDEmu_Interface(emu));
+    CHECK(card);
+
+    // An empty log, then the same again on top of it, which finds the end of
+    // the first pass (or of the wrapped log if it filled the range).
+    unsigned pass;
+    for (pass = 0; pass < 2; pass++) {
+        printf("pass %u, log of %u segments of %u blocks\n", (pass + 1),
+               LOG_SEGMENTS, LOG_SEGMENT_BLOCKS);
+        benchLog(count);
+    }
+
+    CHECK(SD_Close(card));
+    SDEmu_Close(emu);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,293 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "LogStore.h"
+#include "SD.h"
+#include "SDEmu.h"
+#include "Test.h"
+
+#define BLOCK_LEN      512
+#define LOG_ADDR       64
+#define LOG_SEGMENTS   8
+#define SEGMENT_BLOCKS 2
+#define SEGMENT_LEN    (SEGMENT_BLOCKS * BLOCK_LEN)
+
+// Nine of these fill a segment, with a length prefix each.
+#define RECORD_LEN         100
+#define RECORDS_PER_SEGMENT 9
+
+static SDEmu    *emu   = NULL;
+static SDCard   *card  = NULL;
+static LogStore *store = NULL;
+
+static uint8_t segmentBuffer[SEGMENT_LEN];
+static uint8_t readBuffer[SEGMENT_LEN];
+
+static void fillRecord(uint8_t *data, uint32_t index, uint16_t len)
+{
+    uint16_t i;
+    for (i = 0; i < len; i++) {
+        data[i] = (uint8_t)((index * 31) + i);
+    }
+}
+
+static void openLog(void)
+{
+    store = LogStore_Open(card, LOG_ADDR, LOG_SEGMENTS, segmentBuffer, sizeof(segmentBuffer));
+    CHECK(store);
+}
+
+static void reopenLog(void)
+{
+    CHECK(LogStore_Close(store));
+    openLog();
+}
+
+static void appendRecords(uint32_t first, uint32_t count, uint16_t len)
+{
+    uint8_t record[RECORD_LEN];
+    uint32_t i;
+    for (i = first; i < (first + count); i++) {
+        fillRecord(record, i, len);
+        CHECK(LogStore_Append(store, record, len));
+    }
+}
+
+// Checks the log holds exactly records [first, first + count) of length len.
+static void checkLog(uint32_t first, uint32_t count, uint16_t len)
+{
+    LogStore_Iterator iterator;
+    CHECK(LogStore_Iterate(store, &iterator, readBuffer, sizeof(readBuffer)));
+
+    uint8_t  record[RECORD_LEN], expect[RECORD_LEN];
+    uint16_t length;
+    uint32_t i;
+    for (i = first; i < (first + count); i++) {
+        CHECK(LogStore_Next(&iterator, record, sizeof(record), &length));
+        CHECK_EQ(length, len);
+        fillRecord(expect, i, len);
+        CHECK(memcmp(record, expect, len) == 0);
+    }
+    CHECK(!LogStore_Next(&iterator, record, sizeof(record), &length));
+}
+
+static void eraseLog(void)
+{
+    memset(readBuffer, 0x00, sizeof(readBuffer));
+    uint32_t addr;
+    for (addr = LOG_ADDR; addr < (LOG_ADDR + (LOG_SEGMENTS * SEGMENT_BLOCKS)); addr++) {
+        CHECK_EQ(pwrite(SDEmu_File(emu), readBuffer, BLOCK_LEN, ((off_t)addr * BLOCK_LEN)),
+                 BLOCK_LEN);
+    }
+}
+
+// Corrupts the last block of a segment, as if power was lost part way
+// through writing it.
+static void tearSegment(uint32_t segment)
+{
+    memset(readBuffer, 0xA5, BLOCK_LEN);
+    off_t addr = (LOG_ADDR + (segment * SEGMENT_BLOCKS) + (SEGMENT_BLOCKS - 1));
+    CHECK_EQ(pwrite(SDEmu_File(emu), readBuffer, BLOCK_LEN, (addr * BLOCK_LEN)), BLOCK_LEN);
+}
+
+static void testAppend(void)
+{
+    eraseLog();
+    openLog();
+    checkLog(0, 0, RECORD_LEN);
+
+    // Records of every length, including empty ones, read back in order.
+    uint8_t record[RECORD_LEN], expect[RECORD_LEN];
+    uint16_t len;
+    for (len = 0; len <= RECORD_LEN; len++) {
+        fillRecord(record, len, len);
+        CHECK(LogStore_Append(store, record, len));
+    }
+
+    // Unflushed records are included, and survive a close and reopen.
+    unsigned pass;
+    for (pass = 0; pass < 2; pass++) {
+        LogStore_Iterator iterator;
+        CHECK(LogStore_Iterate(store, &iterator, readBuffer, sizeof(readBuffer)));
+        uint16_t length;
+        for (len = 0; len <= RECORD_LEN; len++) {
+            CHECK(LogStore_Next(&iterator, record, sizeof(record), &length));
+            CHECK_EQ(length, len);
+            fillRecord(expect, len, len);
+            CHECK(memcmp(record, expect, len) == 0);
+        }
+        CHECK(!LogStore_Next(&iterator, record, sizeof(record), &length));
+        reopenLog();
+    }
+
+    // Records which would never fit in a segment are refused.
+    CHECK(!LogStore_Append(store, readBuffer, (SEGMENT_LEN - 17)));
+    CHECK(LogStore_Close(store));
+}
+
+static void testWrap(void)
+{
+    eraseLog();
+    openLog();
+
+    // Three more segments than the log holds, the oldest three are replaced.
+    const uint32_t total = ((LOG_SEGMENTS + 3) * RECORDS_PER_SEGMENT);
+    appendRecords(0, total, RECORD_LEN);
+    CHECK(LogStore_Flush(store));
+
+    LogStore_Stats stats;
+    LogStore_GetStats(store, &stats);
+    CHECK_EQ(stats.records, total);
+    CHECK_EQ(stats.segmentsWritten, (LOG_SEGMENTS + 3));
+
+    const uint32_t first = (3 * RECORDS_PER_SEGMENT);
+    checkLog(first, (total - first), RECORD_LEN);
+    reopenLog();
+    checkLog(first, (total - first), RECORD_LEN);
+
+    // Appending carries on from the newest segment.
+    appendRecords(total, RECORDS_PER_SEGMENT, RECORD_LEN);
+    reopenLog();
+    checkLog((first + RECORDS_PER_SEGMENT), (total - first), RECORD_LEN);
+    CHECK(LogStore_Close(store));
+}
+
+static void testTorn(void)
+{
+    // A torn newest segment is dropped along with its records, and the next
+    // segment written replaces it.
+    eraseLog();
+    openLog();
+    appendRecords(0, (3 * RECORDS_PER_SEGMENT), RECORD_LEN);
+    CHECK(LogStore_Close(store));
+    tearSegment(2);
+
+    openLog();
+    checkLog(0, (2 * RECORDS_PER_SEGMENT), RECORD_LEN);
+    appendRecords(100, RECORDS_PER_SEGMENT, RECORD_LEN);
+    reopenLog();
+
+    LogStore_Iterator iterator;
+    CHECK(LogStore_Iterate(store, &iterator, readBuffer, sizeof(readBuffer)));
+    uint8_t  record[RECORD_LEN], expect[RECORD_LEN];
+    uint16_t length;
+    uint32_t count = 0;
+    while (LogStore_Next(&iterator, record, sizeof(record), &length)) {
+        uint32_t index = ((count < (2 * RECORDS_PER_SEGMENT)) ? count
+            : (100 + count - (2 * RECORDS_PER_SEGMENT)));
+        fillRecord(expect, index, RECORD_LEN);
+        CHECK(memcmp(record, expect, RECORD_LEN) == 0);
+        count++;
+    }
+    CHECK_EQ(count, (3 * RECORDS_PER_SEGMENT));
+    CHECK(LogStore_Close(store));
+
+    // Once wrapped, tearing the rewrite of segment 0 leaves the rest of the
+    // previous pass.
+    eraseLog();
+    openLog();
+    appendRecords(0, ((LOG_SEGMENTS + 1) * RECORDS_PER_SEGMENT), RECORD_LEN);
+    CHECK(LogStore_Close(store));
+    tearSegment(0);
+
+    openLog();
+    checkLog(RECORDS_PER_SEGMENT, ((LOG_SEGMENTS - 1) * RECORDS_PER_SEGMENT), RECORD_LEN);
+    CHECK(LogStore_Close(store));
+
+    // A log whose only segment is torn is empty.
+    eraseLog();
+    openLog();
+    appendRecords(0, RECORDS_PER_SEGMENT, RECORD_LEN);
+    CHECK(LogStore_Close(store));
+    tearSegment(0);
+
+    openLog();
+    checkLog(0, 0, RECORD_LEN);
+    appendRecords(0, 1, RECORD_LEN);
+    reopenLog();
+    checkLog(0, 1, RECORD_LEN);
+    CHECK(LogStore_Close(store));
+}
+
+static void testRecovery(void)
+{
+    // The newest segment is found with a binary search over the headers, so
+    // opening reads log2(segments) of them plus the first and the oldest.
+    unsigned used;
+    for (used = 0; used <= (LOG_SEGMENTS + 2); used++) {
+        eraseLog();
+        openLog();
+        appendRecords(0, (used * RECORDS_PER_SEGMENT), RECORD_LEN);
+        CHECK(LogStore_Close(store));
+
+        openLog();
+        LogStore_Stats stats;
+        LogStore_GetStats(store, &stats);
+        CHECK(stats.recoveryReads <= 5);
+
+        uint32_t kept = ((used < LOG_SEGMENTS) ? used : LOG_SEGMENTS);
+        checkLog(((used - kept) * RECORDS_PER_SEGMENT), (kept * RECORDS_PER_SEGMENT),
+                 RECORD_LEN);
+        CHECK(LogStore_Close(store));
+    }
+
+    // A store opened with a different segment length starts afresh.
+    eraseLog();
+    openLog();
+    appendRecords(0, (2 * RECORDS_PER_SEGMENT), RECORD_LEN);
+    CHECK(LogStore_Close(store));
+    store = LogStore_Open(card, LOG_ADDR, LOG_SEGMENTS, segmentBuffer, BLOCK_LEN);
+    CHECK(store);
+    checkLog(0, 0, RECORD_LEN);
+    CHECK(LogStore_Close(store));
+}
+
+static void testWriteFailure(void)
+{
+    eraseLog();
+    openLog();
+    appendRecords(0, RECORDS_PER_SEGMENT, RECORD_LEN);
+
+    // A segment which can't be written stays pending, so the flush can be
+    // tried again.
+    SDEmu_Faults *faults = SDEmu_GetFaults(emu);
+    faults->badBlock = LOG_ADDR;
+    CHECK(!LogStore_Flush(store));
+    faults->badBlock = UINT32_MAX;
+    checkLog(0, RECORDS_PER_SEGMENT, RECORD_LEN);
+
+    CHECK(LogStore_Flush(store));
+    reopenLog();
+    checkLog(0, RECORDS_PER_SEGMENT, RECORD_LEN);
+    CHECK(LogStore_Close(store));
+
+    CHECK(!LogStore_Open(NULL, LOG_ADDR, LOG_SEGMENTS, segmentBuffer, sizeof(segmentBuffer)));
+    CHECK(!LogStore_Open(card, LOG_ADDR, 0, segmentBuffer, sizeof(segmentBuffer)));
+    CHECK(!LogStore_Open(card, LOG_ADDR, LOG_SEGMENTS, segmentBuffer, (BLOCK_LEN - 1)));
+}
+
+int main(void)
+{
+    SDEmu_Config config;
+    SDEmu_DefaultConfig(&config);
+    config.blocks = 1024;
+
+    unlink("LogStoreTest.img");
+    emu = SDEmu_Open("LogStoreTest.img", &config);
+    CHECK(emu);
+    card = SD_Open(SDEmu_Interface(emu));
+    CHECK(card);
+
+    testAppend();
+    testWrap();
+    testTorn();
+    testRecovery();
+    testWriteFailure();
+
+    CHECK(SD_Close(card));
+    SDEmu_Close(emu);
+    return EXIT_SUCCESS;
+}
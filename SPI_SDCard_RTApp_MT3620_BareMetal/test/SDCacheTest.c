@@ -0,0 +1,291 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "SD.h"
+#include "SDCache.h"
+#include "SDEmu.h"
+#include "Test.h"
+
+#define BLOCK_LEN     512
+#define CACHE_ENTRIES 8
+
+static SDEmu   *emu   = NULL;
+static SDCard  *card  = NULL;
+static SDCache *cache = NULL;
+
+static uint8_t cacheBuffer[CACHE_ENTRIES * BLOCK_LEN];
+static uint8_t block[BLOCK_LEN];
+
+static void fillBlock(uint8_t *data, uint32_t addr, uint8_t seed)
+{
+    unsigned i;
+    for (i = 0; i < BLOCK_LEN; i++) {
+        data[i] = (uint8_t)((addr * 13) + i + seed);
+    }
+}
+
+// Checks the image behind the card holds the pattern for addr.
+static void checkImage(uint32_t addr, uint8_t seed)
+{
+    uint8_t image[BLOCK_LEN], expect[BLOCK_LEN];
+    fillBlock(expect, addr, seed);
+    CHECK_EQ(pread(SDEmu_File(emu), image, BLOCK_LEN, ((off_t)addr * BLOCK_LEN)),
+             BLOCK_LEN);
+    CHECK(memcmp(image, expect, BLOCK_LEN) == 0);
+}
+
+static void checkRead(uint32_t addr, uint8_t seed)
+{
+    uint8_t expect[BLOCK_LEN];
+    fillBlock(expect, addr, seed);
+    memset(block, 0x00, sizeof(block));
+    CHECK(SDCache_ReadBlock(cache, addr, block));
+    CHECK(memcmp(block, expect, BLOCK_LEN) == 0);
+}
+
+static void writeBlock(uint32_t addr, uint8_t seed)
+{
+    fillBlock(block, addr, seed);
+    CHECK(SDCache_WriteBlock(cache, addr, block));
+}
+
+static void checkStats(uint32_t hits, uint32_t misses, uint32_t evictions)
+{
+    SDCache_Stats stats;
+    SDCache_GetStats(cache, &stats);
+    CHECK_EQ(stats.hits, hits);
+    CHECK_EQ(stats.misses, misses);
+    CHECK_EQ(stats.evictions, evictions);
+}
+
+static void testHits(void)
+{
+    SDCache_ResetStats(cache);
+    SDEmu_ResetStats(emu);
+
+    checkRead(10, 0);
+    checkRead(10, 0);
+    checkRead(11, 0);
+    checkRead(10, 0);
+    checkStats(2, 2, 0);
+
+    // Hits don't touch the card.
+    SDEmu_Stats stats;
+    SDEmu_GetStats(emu, &stats);
+    CHECK_EQ(stats.blocksRead, 2);
+}
+
+static void testLRU(void)
+{
+    // Fill the cache, then use the first block again so the second is the
+    // least recently used.
+    uint32_t addr;
+    for (addr = 20; addr < (20 + CACHE_ENTRIES); addr++) {
+        checkRead(addr, 0);
+    }
+    checkRead(20, 0);
+
+    SDCache_ResetStats(cache);
+    checkRead(40, 0);
+    checkStats(0, 1, 1);
+    checkRead(20, 0);
+    checkStats(1, 1, 1);
+    checkRead(21, 0);
+    checkStats(1, 2, 2);
+}
+
+static void testWriteBack(void)
+{
+    SDCache_ResetStats(cache);
+    SDEmu_ResetStats(emu);
+
+    // Writes stay in the cache, and are read back from it.
+    uint32_t addr;
+    for (addr = 100; addr < 106; addr++) {
+        writeBlock(addr, 0x40);
+    }
+    checkImage(100, 0);
+    checkRead(103, 0x40);
+
+    SDEmu_Stats stats;
+    SDEmu_GetStats(emu, &stats);
+    CHECK_EQ(stats.blocksWritten, 0);
+    CHECK_EQ(stats.blocksRead, 0);
+
+    // The run of dirty blocks is written back with one multi-block write.
+    CHECK(SDCache_Flush(cache));
+    for (addr = 100; addr < 106; addr++) {
+        checkImage(addr, 0x40);
+    }
+
+    SDEmu_GetStats(emu, &stats);
+    CHECK_EQ(stats.commands[25], 1);
+    CHECK_EQ(stats.commands[24], 0);
+    CHECK_EQ(stats.blocksWritten, 6);
+
+    SDCache_Stats cacheStats;
+    SDCache_GetStats(cache, &cacheStats);
+    CHECK_EQ(cacheStats.writeBackBlocks, 6);
+    CHECK_EQ(cacheStats.writeBackRuns, 1);
+
+    // Clean blocks aren't written again.
+    CHECK(SDCache_Flush(cache));
+    SDEmu_GetStats(emu, &stats);
+    CHECK_EQ(stats.blocksWritten, 6);
+}
+
+static void testEviction(void)
+{
+    SDCache_ResetStats(cache);
+    SDEmu_ResetStats(emu);
+
+    // Two separate dirty runs, written out of order.
+    writeBlock(202, 0x50);
+    writeBlock(200, 0x50);
+    writeBlock(201, 0x50);
+    writeBlock(300, 0x50);
+
+    // Evicting the least recently used block writes back its whole run.
+    uint32_t addr;
+    for (addr = 400; addr < (400 + CACHE_ENTRIES - 4); addr++) {
+        checkRead(addr, 0);
+    }
+    SDEmu_Stats stats;
+    SDEmu_GetStats(emu, &stats);
+    CHECK_EQ(stats.blocksWritten, 0);
+
+    checkRead(500, 0);
+    SDEmu_GetStats(emu, &stats);
+    CHECK_EQ(stats.blocksWritten, 3);
+    CHECK_EQ(stats.commands[25], 1);
+    checkImage(200, 0x50);
+    checkImage(201, 0x50);
+    checkImage(202, 0x50);
+    checkImage(300, 0);
+
+    // The rest of the run is clean now, so evicting it writes nothing.
+    checkRead(501, 0);
+    checkRead(502, 0);
+    SDEmu_GetStats(emu, &stats);
+    CHECK_EQ(stats.blocksWritten, 3);
+
+    // The other run goes next.
+    checkRead(503, 0);
+    SDEmu_GetStats(emu, &stats);
+    CHECK_EQ(stats.blocksWritten, 4);
+    checkImage(300, 0x50);
+}
+
+static void testWriteFailure(void)
+{
+    SDCache_ResetStats(cache);
+    SDEmu_Faults *faults = SDEmu_GetFaults(emu);
+
+    uint32_t addr;
+    for (addr = 600; addr < 604; addr++) {
+        writeBlock(addr, 0x60);
+    }
+
+    // Blocks accepted before the failure are clean, the rest stay dirty, and
+    // the run isn't tried again for its remaining blocks.
+    SDEmu_ResetStats(emu);
+    faults->badBlock = 602;
+    CHECK(!SDCache_Flush(cache));
+    checkImage(600, 0x60);
+    checkImage(601, 0x60);
+    checkImage(602, 0);
+    checkImage(603, 0);
+
+    SDCache_Stats stats;
+    SDCache_GetStats(cache, &stats);
+    CHECK_EQ(stats.writeBackBlocks, 2);
+    CHECK_EQ(stats.writeBackRuns, 1);
+
+    SDEmu_Stats emuStats;
+    SDEmu_GetStats(emu, &emuStats);
+    CHECK_EQ(emuStats.commands[25], 1);
+
+    faults->badBlock = UINT32_MAX;
+    SDEmu_ResetStats(emu);
+    CHECK(SDCache_Flush(cache));
+    checkImage(602, 0x60);
+    checkImage(603, 0x60);
+
+    SDEmu_GetStats(emu, &emuStats);
+    CHECK_EQ(emuStats.blocksWritten, 2);
+
+    // An eviction which can't write back fails, keeping the dirty block.
+    writeBlock(700, 0x70);
+    for (addr = 710; addr < (710 + CACHE_ENTRIES - 1); addr++) {
+        checkRead(addr, 0);
+    }
+    faults->writeErrors = 1;
+    CHECK(!SDCache_ReadBlock(cache, 720, block));
+    CHECK_EQ(faults->writeErrors, 0);
+    checkImage(700, 0);
+    checkRead(700, 0x70);
+}
+
+static void testClose(void)
+{
+    // A close which can't write back keeps the cache and its dirty blocks.
+    SDEmu_Faults *faults = SDEmu_GetFaults(emu);
+    writeBlock(801, 0x80);
+    faults->badBlock = 801;
+    CHECK(!SDCache_Close(cache));
+    checkImage(801, 0);
+    checkRead(801, 0x80);
+    faults->badBlock = UINT32_MAX;
+
+    writeBlock(800, 0x80);
+    checkImage(800, 0);
+    CHECK(SDCache_Close(cache));
+    checkImage(800, 0x80);
+    checkImage(801, 0x80);
+
+    // Closed caches are reused.
+    cache = SDCache_Open(card, cacheBuffer, sizeof(cacheBuffer));
+    CHECK(cache);
+    checkRead(800, 0x80);
+
+    CHECK(!SDCache_Open(card, cacheBuffer, (BLOCK_LEN - 1)));
+    CHECK(!SDCache_Open(NULL, cacheBuffer, sizeof(cacheBuffer)));
+}
+
+int main(void)
+{
+    SDEmu_Config config;
+    SDEmu_DefaultConfig(&config);
+    config.blocks = 1024;
+
+    unlink("SDCacheTest.img");
+    emu = SDEmu_Open("SDCacheTest.img", &config);
+    CHECK(emu);
+
+    uint32_t addr;
+    for (addr = 0; addr < config.blocks; addr++) {
+        fillBlock(block, addr, 0);
+        CHECK_EQ(pwrite(SDEmu_File(emu), block, BLOCK_LEN, ((off_t)addr * BLOCK_LEN)),
+                 BLOCK_LEN);
+    }
+
+    card = SD_Open(SDEmu_Interface(emu));
+    CHECK(card);
+    cache = SDCache_Open(card, cacheBuffer, sizeof(cacheBuffer));
+    CHECK(cache);
+
+    testHits();
+    testLRU();
+    testWriteBack();
+    testEviction();
+    testWriteFailure();
+    testClose();
+
+    CHECK(SDCache_Close(cache));
+    CHECK(SD_Close(card));
+    SDEmu_Close(emu);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,798 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CRC.h"
+#include "Host.h"
+#include "SDEmu.h"
+
+#define SDEMU_BLOCK_LEN    512
+// The ISU buffer limits each transfer to 32 bytes.
+#define SDEMU_TRANSFER_LEN 32
+#define SDEMU_TRANSFER_MAX 64
+// Room for a response, the read delay and a whole data packet.
+#define SDEMU_OUT_LEN      4096
+
+#define R1_IDLE            0x01
+#define R1_ILLEGAL_COMMAND 0x04
+#define R1_COM_CRC_ERROR   0x08
+#define R1_ERASE_SEQ_ERROR 0x10
+#define R1_ADDRESS_ERROR   0x20
+#define R1_PARAMETER_ERROR 0x40
+
+#define TOKEN_START        0xFE
+#define TOKEN_START_MULT   0xFC
+#define TOKEN_STOP_TRAN    0xFD
+#define ERROR_TOKEN_ECC    0x04
+#define ERROR_TOKEN_RANGE  0x08
+
+#define DATA_RESP_ACCEPTED    0x05
+#define DATA_RESP_CRC_ERROR   0x0B
+#define DATA_RESP_WRITE_ERROR 0x0D
+
+typedef enum {
+    SDEMU_COMMAND,     // Waiting for a command.
+    SDEMU_WRITE_TOKEN, // Waiting for a data token, or a command.
+    SDEMU_WRITE_DATA,  // Receiving a data packet and its CRC.
+} SDEmu_State;
+
+struct SPIMaster {
+    SDEmu       *card;
+    bool         selectEnable;
+    uint32_t     speed;
+
+    // Transfer sequence in flight.
+    bool         busy;
+    int32_t      status;
+    SPITransfer  transfer[SDEMU_TRANSFER_MAX];
+    uint32_t     count;
+    void       (*callback)(int32_t status, uintptr_t dataCount);
+    Host_Event   done;
+};
+
+struct SDEmu {
+    bool          open;
+    int           file;
+    SDEmu_Config  config;
+    SDEmu_Faults  faults;
+    SDEmu_Stats   stats;
+    SPIMaster     interface;
+
+    bool          idle;
+    unsigned      initPolls;
+    bool          appCmd;
+    bool          crcEnabled;
+    bool          highSpeed;
+
+    uint8_t       frame[6];
+    unsigned      frameLen;
+
+    SDEmu_State   state;
+    bool          multi;
+    bool          streaming;
+    // Next block to be read or written.
+    uint32_t      addr;
+    uint32_t      wellWritten;
+    uint32_t      eraseStart;
+    uint32_t      eraseEnd;
+    uint8_t       packet[SDEMU_BLOCK_LEN + 2];
+    unsigned      packetLen;
+
+    // Bytes to be clocked out, followed by busy bytes.
+    uint8_t       out[SDEMU_OUT_LEN];
+    unsigned      outHead;
+    unsigned      outLen;
+    unsigned      busy;
+};
+
+static SDEmu SDEmu_Cards[SDEMU_CARD_MAX] = {0};
+
+static void SDEmu__Push(SDEmu *card, uint8_t byte)
+{
+    if (card->outLen >= SDEMU_OUT_LEN) {
+        fprintf(stderr, "SDEmu: output overflow, is readDelay too long?\n");
+        abort();
+    }
+    card->out[(card->outHead + card->outLen++) % SDEMU_OUT_LEN] = byte;
+}
+
+static void SDEmu__Fill(SDEmu *card, uint8_t byte, unsigned count)
+{
+    for (; count > 0; count--) {
+        SDEmu__Push(card, byte);
+    }
+}
+
+static void SDEmu__Respond(SDEmu *card, uint8_t r1)
+{
+    SDEmu__Fill(card, 0xFF, card->config.responseDelay);
+    SDEmu__Push(card, (r1 | (card->idle ? R1_IDLE : 0)));
+}
+
+static void SDEmu__PushPacket(SDEmu *card, const uint8_t *data, unsigned len)
+{
+    uint16_t crc = CRC_ITU16(data, len, 0x0000);
+    if (card->faults.readCrcErrors > 0) {
+        card->faults.readCrcErrors--;
+        crc ^= 0x0001;
+    }
+
+    // Data clocked in too fast picks up a flipped bit.
+    bool corrupt = (card->interface.speed > card->config.maxSpeed);
+
+    SDEmu__Fill(card, 0xFF, card->config.readDelay);
+    SDEmu__Push(card, TOKEN_START);
+    unsigned i;
+    for (i = 0; i < len; i++) {
+        SDEmu__Push(card, (data[i] ^ ((corrupt && (i == 0)) ? 0x01 : 0x00)));
+    }
+    SDEmu__Push(card, (crc >> 8));
+    SDEmu__Push(card, (crc & 0xFF));
+}
+
+static void SDEmu__PushError(SDEmu *card, uint8_t token)
+{
+    SDEmu__Fill(card, 0xFF, card->config.readDelay);
+    SDEmu__Push(card, token);
+}
+
+static bool SDEmu__ReadBlock(SDEmu *card, uint32_t block)
+{
+    if (block >= card->config.blocks) {
+        SDEmu__PushError(card, ERROR_TOKEN_RANGE);
+        return false;
+    }
+    if (block == card->faults.badBlock) {
+        SDEmu__PushError(card, ERROR_TOKEN_ECC);
+        return false;
+    }
+
+    uint8_t data[SDEMU_BLOCK_LEN];
+    if (pread(card->file, data, sizeof(data),
+              ((off_t)block * SDEMU_BLOCK_LEN)) != sizeof(data)) {
+        SDEmu__PushError(card, ERROR_TOKEN_ECC);
+        return false;
+    }
+
+    card->stats.blocksRead++;
+    SDEmu__PushPacket(card, data, sizeof(data));
+    return true;
+}
+
+static bool SDEmu__WriteBlock(SDEmu *card, uint32_t block, const uint8_t *data)
+{
+    if ((block >= card->config.blocks)
+        || (pwrite(card->file, data, SDEMU_BLOCK_LEN,
+                   ((off_t)block * SDEMU_BLOCK_LEN)) != SDEMU_BLOCK_LEN)) {
+        return false;
+    }
+
+    card->stats.blocksWritten++;
+    return true;
+}
+
+static bool SDEmu__Erase(SDEmu *card, uint32_t first, uint32_t last)
+{
+    if ((first > last) || (last >= card->config.blocks)) {
+        return false;
+    }
+
+    uint8_t zero[SDEMU_BLOCK_LEN] = {0};
+    uint32_t block;
+    for (block = first; block <= last; block++) {
+        if (pwrite(card->file, zero, sizeof(zero),
+                   ((off_t)block * SDEMU_BLOCK_LEN)) != sizeof(zero)) {
+            return false;
+        }
+        card->stats.blocksErased++;
+    }
+    return true;
+}
+
+static void SDEmu__Reset(SDEmu *card)
+{
+    card->idle       = true;
+    card->initPolls  = card->config.initPolls;
+    card->appCmd     = false;
+    card->crcEnabled = false;
+    card->highSpeed  = false;
+    card->state      = SDEMU_COMMAND;
+    card->streaming  = false;
+    card->busy       = 0;
+}
+
+// CSD version 2.0, as found on SDHC and SDXC cards.
+static void SDEmu__CSD(const SDEmu *card, uint8_t csd[16])
+{
+    uint32_t cSize = ((card->config.blocks / 1024) - 1);
+
+    memset(csd, 0x00, 16);
+    csd[ 0] = 0x40;
+    csd[ 1] = 0x0E;
+    // TRAN_SPEED is 25 MHz, or 50 MHz in high-speed mode.
+    csd[ 3] = (card->highSpeed ? 0x5A : 0x32);
+    csd[ 4] = 0x5B;
+    csd[ 5] = 0x59;
+    csd[ 7] = ((cSize >> 16) & 0x3F);
+    csd[ 8] = (cSize >> 8);
+    csd[ 9] = cSize;
+    csd[10] = 0x7F;
+    csd[11] = 0x80;
+    csd[12] = 0x0A;
+    csd[13] = 0x40;
+    csd[15] = (CRC_7(csd, 15, 0x00) | 0x01);
+}
+
+// CMD6 status for function group 1, the other groups only have their
+// default function.
+static void SDEmu__SwitchFunction(SDEmu *card, uint32_t argument)
+{
+    uint8_t status[64] = {0};
+    status[1]  = 100; // [mA]
+    status[13] = (card->config.highSpeed ? 0x03 : 0x01);
+
+    unsigned function = (argument & 0xF);
+    if (function == 0xF) {
+        function = (card->highSpeed ? 1 : 0);
+    } else if ((function > 1) || ((function == 1) && !card->config.highSpeed)) {
+        function = 0xF;
+    }
+    status[16] = function;
+
+    if ((argument & 0x80000000) && (function != 0xF)) {
+        card->highSpeed = (function == 1);
+    }
+
+    SDEmu__PushPacket(card, status, sizeof(status));
+}
+
+static void SDEmu__AppCommand(SDEmu *card, unsigned index, uint32_t argument)
+{
+    switch (index) {
+    case 41: // APP_SEND_OP_COND
+        if (card->initPolls > 0) {
+            card->initPolls--;
+        } else {
+            card->idle = false;
+        }
+        SDEmu__Respond(card, 0x00);
+        return;
+
+    case 22: // APP_SEND_NUM_WR_BLOCKS
+        if (!card->idle) {
+            uint8_t count[4] = {
+                (card->wellWritten >> 24), (card->wellWritten >> 16),
+                (card->wellWritten >>  8),  card->wellWritten,
+            };
+            SDEmu__Respond(card, 0x00);
+            SDEmu__PushPacket(card, count, sizeof(count));
+            return;
+        }
+        break;
+
+    case 23: // APP_SET_WR_BLK_ERASE_COUNT
+        if (!card->idle) {
+            SDEmu__Respond(card, 0x00);
+            return;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    SDEmu__Respond(card, R1_ILLEGAL_COMMAND);
+}
+
+static void SDEmu__Command(SDEmu *card)
+{
+    const uint8_t *frame = card->frame;
+    unsigned index    = (frame[0] & 0x3F);
+    uint32_t argument = (((uint32_t)frame[1] << 24) | ((uint32_t)frame[2] << 16)
+                       | ((uint32_t)frame[3] << 8) | frame[4]);
+
+    bool app = card->appCmd;
+    card->appCmd = false;
+    card->stats.commands[index]++;
+    if (card->busy > 0) {
+        card->stats.busyCommands++;
+    }
+
+    // A command ends any read stream or write in progress.
+    card->outLen    = 0;
+    card->streaming = false;
+    card->state     = SDEMU_COMMAND;
+
+    // CMD0 and CMD8 are always checked, as the card may be in SD mode.
+    if ((card->crcEnabled || (index == 0) || (index == 8))
+        && (frame[5] != (CRC_7(frame, 5, 0x00) | 0x01))) {
+        card->stats.crcErrors++;
+        SDEmu__Respond(card, R1_COM_CRC_ERROR);
+        return;
+    }
+
+    if (app) {
+        SDEmu__AppCommand(card, index, argument);
+        return;
+    }
+
+    // Only a few commands are accepted before initialization.
+    switch (index) {
+    case 0: case 8: case 55: case 58: case 59:
+        break;
+
+    default:
+        if (card->idle) {
+            SDEmu__Respond(card, R1_ILLEGAL_COMMAND);
+            return;
+        }
+        break;
+    }
+
+    switch (index) {
+    case 0: // GO_IDLE_STATE
+        SDEmu__Reset(card);
+        SDEmu__Respond(card, 0x00);
+        break;
+
+    case 6: // SWITCH_FUNC
+        SDEmu__Respond(card, 0x00);
+        SDEmu__SwitchFunction(card, argument);
+        break;
+
+    case 8: // SEND_IF_COND
+        SDEmu__Respond(card, 0x00);
+        SDEmu__Push(card, 0x00);
+        SDEmu__Push(card, 0x00);
+        SDEmu__Push(card, ((argument >> 8) & 0x0F));
+        SDEmu__Push(card, (argument & 0xFF));
+        break;
+
+    case 9: // SEND_CSD
+    {
+        uint8_t csd[16];
+        SDEmu__CSD(card, csd);
+        SDEmu__Respond(card, 0x00);
+        SDEmu__PushPacket(card, csd, sizeof(csd));
+        break;
+    }
+
+    case 12: // STOP_TRANSMISSION
+        // A stuff byte follows the command before the response.
+        SDEmu__Push(card, 0xFF);
+        SDEmu__Fill(card, 0xA5, card->config.stopData);
+        SDEmu__Respond(card, 0x00);
+        card->busy = card->config.stopBusy;
+        break;
+
+    case 16: // SET_BLOCKLEN
+        // The block length of SDHC cards is fixed.
+        SDEmu__Respond(card, ((argument == SDEMU_BLOCK_LEN) ? 0x00 : R1_PARAMETER_ERROR));
+        break;
+
+    case 17: // READ_SINGLE_BLOCK
+    case 18: // READ_MULTIPLE_BLOCK
+        if (argument >= card->config.blocks) {
+            SDEmu__Respond(card, R1_ADDRESS_ERROR);
+            break;
+        }
+        SDEmu__Respond(card, 0x00);
+        if (index == 17) {
+            SDEmu__ReadBlock(card, argument);
+        } else {
+            card->streaming = true;
+            card->addr      = argument;
+        }
+        break;
+
+    case 24: // WRITE_BLOCK
+    case 25: // WRITE_MULTIPLE_BLOCK
+        if (argument >= card->config.blocks) {
+            SDEmu__Respond(card, R1_ADDRESS_ERROR);
+            break;
+        }
+        SDEmu__Respond(card, 0x00);
+        card->state       = SDEMU_WRITE_TOKEN;
+        card->multi       = (index == 25);
+        card->addr        = argument;
+        card->wellWritten = 0;
+        break;
+
+    case 32: // ERASE_WR_BLK_START
+    case 33: // ERASE_WR_BLK_END
+        if (argument >= card->config.blocks) {
+            SDEmu__Respond(card, R1_ADDRESS_ERROR);
+            break;
+        }
+        if (index == 32) {
+            card->eraseStart = argument;
+        } else {
+            card->eraseEnd = argument;
+        }
+        SDEmu__Respond(card, 0x00);
+        break;
+
+    case 38: // ERASE
+        if (!SDEmu__Erase(card, card->eraseStart, card->eraseEnd)) {
+            SDEmu__Respond(card, R1_ERASE_SEQ_ERROR);
+            break;
+        }
+        SDEmu__Respond(card, 0x00);
+        card->busy = card->config.eraseBusy;
+        break;
+
+    case 55: // APP_CMD
+        card->appCmd = true;
+        SDEmu__Respond(card, 0x00);
+        break;
+
+    case 58: // READ_OCR
+    {
+        // Power up status and card capacity status (block addressing).
+        uint32_t ocr = (card->idle ? 0x00FF8000 : 0xC0FF8000);
+        SDEmu__Respond(card, 0x00);
+        SDEmu__Push(card, (ocr >> 24));
+        SDEmu__Push(card, (ocr >> 16));
+        SDEmu__Push(card, (ocr >>  8));
+        SDEmu__Push(card, ocr);
+        break;
+    }
+
+    case 59: // CRC_ON_OFF
+        card->crcEnabled = (argument & 1);
+        SDEmu__Respond(card, 0x00);
+        break;
+
+    default:
+        SDEmu__Respond(card, R1_ILLEGAL_COMMAND);
+        break;
+    }
+}
+
+static void SDEmu__ReceiveCommand(SDEmu *card, uint8_t byte)
+{
+    // Commands start with a 0 start bit and a 1 transmission bit.
+    if ((card->frameLen == 0) && ((byte & 0xC0) != 0x40)) {
+        return;
+    }
+
+    card->frame[card->frameLen++] = byte;
+    if (card->frameLen == sizeof(card->frame)) {
+        card->frameLen = 0;
+        SDEmu__Command(card);
+    }
+}
+
+static void SDEmu__ReceiveToken(SDEmu *card, uint8_t byte)
+{
+    if ((card->frameLen == 0) && !card->multi && (byte == TOKEN_START)) {
+        card->state     = SDEMU_WRITE_DATA;
+        card->packetLen = 0;
+        return;
+    }
+
+    if ((card->frameLen == 0) && card->multi) {
+        if (byte == TOKEN_START_MULT) {
+            card->state     = SDEMU_WRITE_DATA;
+            card->packetLen = 0;
+            return;
+        }
+        if (byte == TOKEN_STOP_TRAN) {
+            // Busy starts after the byte following the stop token.
+            card->state = SDEMU_COMMAND;
+            SDEmu__Push(card, 0xFF);
+            card->busy = card->config.stopBusy;
+            return;
+        }
+    }
+
+    SDEmu__ReceiveCommand(card, byte);
+}
+
+static void SDEmu__ReceiveData(SDEmu *card, uint8_t byte)
+{
+    card->packet[card->packetLen++] = byte;
+    if (card->packetLen < sizeof(card->packet)) {
+        return;
+    }
+
+    uint16_t crc = ((card->packet[SDEMU_BLOCK_LEN] << 8)
+                   | card->packet[SDEMU_BLOCK_LEN + 1]);
+
+    uint8_t response = DATA_RESP_ACCEPTED;
+    if (card->crcEnabled
+        && (CRC_ITU16(card->packet, SDEMU_BLOCK_LEN, 0x0000) != crc)) {
+        card->stats.crcErrors++;
+        response = DATA_RESP_CRC_ERROR;
+    } else if (card->faults.writeCrcErrors > 0) {
+        card->faults.writeCrcErrors--;
+        response = DATA_RESP_CRC_ERROR;
+    } else if (card->faults.writeErrors > 0) {
+        card->faults.writeErrors--;
+        response = DATA_RESP_WRITE_ERROR;
+    } else if ((card->addr == card->faults.badBlock)
+        || !SDEmu__WriteBlock(card, card->addr, card->packet)) {
+        response = DATA_RESP_WRITE_ERROR;
+    }
+
+    // The data response follows the CRC straight away.
+    SDEmu__Push(card, response);
+    if (response == DATA_RESP_ACCEPTED) {
+        card->addr++;
+        card->wellWritten++;
+        card->busy = card->config.writeBusy;
+    }
+
+    card->state = (card->multi ? SDEMU_WRITE_TOKEN : SDEMU_COMMAND);
+}
+
+// Clocks a byte each way.
+static uint8_t SDEmu__Exchange(SDEmu *card, uint8_t mosi)
+{
+    if (!card->interface.selectEnable) {
+        card->frameLen = 0;
+        return 0xFF;
+    }
+
+    uint8_t miso = 0xFF;
+    if ((card->outLen == 0) && (card->busy == 0) && card->streaming) {
+        // The stream stops at the first block that can't be read.
+        card->streaming = SDEmu__ReadBlock(card, card->addr++);
+    }
+    if (card->outLen > 0) {
+        miso = card->out[card->outHead];
+        card->outHead = ((card->outHead + 1) % SDEMU_OUT_LEN);
+        card->outLen--;
+    } else if (card->busy > 0) {
+        card->busy--;
+        miso = 0x00;
+    }
+
+    switch (card->state) {
+    case SDEMU_WRITE_TOKEN:
+        SDEmu__ReceiveToken(card, mosi);
+        break;
+
+    case SDEMU_WRITE_DATA:
+        SDEmu__ReceiveData(card, mosi);
+        break;
+
+    default:
+        SDEmu__ReceiveCommand(card, mosi);
+        break;
+    }
+
+    return miso;
+}
+
+static void SDEmu__TransferDone(void *arg)
+{
+    SPIMaster *interface = arg;
+    SDEmu     *card      = interface->card;
+    interface->busy = false;
+
+    uintptr_t total = 0;
+    if (interface->status == ERROR_NONE) {
+        uint32_t t;
+        for (t = 0; t < interface->count; t++) {
+            const SPITransfer *transfer = &interface->transfer[t];
+            const uint8_t *write = transfer->writeData;
+            uint8_t       *read  = transfer->readData;
+
+            uintptr_t i;
+            for (i = 0; i < transfer->length; i++) {
+                uint8_t miso = SDEmu__Exchange(card, (write ? write[i] : 0xFF));
+                if (read) {
+                    read[i] = miso;
+                }
+            }
+            total += transfer->length;
+        }
+    }
+
+    card->stats.sequences++;
+    interface->callback(interface->status, total);
+}
+
+
+void SDEmu_DefaultConfig(SDEmu_Config *config)
+{
+    config->blocks        = 16384;
+    config->initPolls     = 2;
+    config->responseDelay = 1;
+    config->readDelay     = 4;
+    config->writeBusy     = 64;
+    config->stopBusy      = 8;
+    config->stopData      = 0;
+    config->eraseBusy     = 256;
+    config->latency       = 2000;
+    config->highSpeed     = true;
+    config->maxSpeed      = 50000000;
+}
+
+SDEmu *SDEmu_Open(const char *path, const SDEmu_Config *config)
+{
+    SDEmu *card = NULL;
+    unsigned c;
+    for (c = 0; (c < SDEMU_CARD_MAX) && !card; c++) {
+        if (!SDEmu_Cards[c].open) {
+            card = &SDEmu_Cards[c];
+        }
+    }
+    if (!card || !path) {
+        return NULL;
+    }
+
+    SDEmu_Config defaults;
+    if (!config) {
+        SDEmu_DefaultConfig(&defaults);
+        config = &defaults;
+    }
+    if ((config->blocks < 1024) || (config->responseDelay < 1)
+        || (config->responseDelay > 8)) {
+        return NULL;
+    }
+
+    int file = open(path, (O_RDWR | O_CREAT), 0644);
+    if (file < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    off_t size = ((off_t)config->blocks * SDEMU_BLOCK_LEN);
+    if ((fstat(file, &st) != 0)
+        || ((st.st_size < size) && (ftruncate(file, size) != 0))) {
+        close(file);
+        return NULL;
+    }
+
+    memset(card, 0x00, sizeof(*card));
+    card->open   = true;
+    card->file   = file;
+    card->config = *config;
+    card->faults.badBlock = UINT32_MAX;
+
+    card->interface.card         = card;
+    card->interface.selectEnable = true;
+    card->interface.speed        = 400000;
+    card->interface.done.fire    = SDEmu__TransferDone;
+    card->interface.done.arg     = &card->interface;
+
+    SDEmu__Reset(card);
+    return card;
+}
+
+void SDEmu_Close(SDEmu *card)
+{
+    if (!card || !card->open) {
+        return;
+    }
+
+    Host_Cancel(&card->interface.done);
+    close(card->file);
+    card->open = false;
+}
+
+SPIMaster *SDEmu_Interface(SDEmu *card)
+{
+    return (card ? &card->interface : NULL);
+}
+
+int SDEmu_File(const SDEmu *card)
+{
+    return (card ? card->file : -1);
+}
+
+SDEmu_Config *SDEmu_GetConfig(SDEmu *card)
+{
+    return (card ? &card->config : NULL);
+}
+
+SDEmu_Faults *SDEmu_GetFaults(SDEmu *card)
+{
+    return (card ? &card->faults : NULL);
+}
+
+void SDEmu_GetStats(const SDEmu *card, SDEmu_Stats *stats)
+{
+    if (card && stats) {
+        *stats = card->stats;
+    }
+}
+
+void SDEmu_ResetStats(SDEmu *card)
+{
+    if (card) {
+        memset(&card->stats, 0x00, sizeof(card->stats));
+    }
+}
+
+
+// SPIMaster
+
+int32_t SPIMaster_Configure(SPIMaster *handle, bool cpol, bool cpha, uint32_t busSpeed)
+{
+    if (!handle || cpol || cpha || (busSpeed == 0)) {
+        return ERROR_PARAMETER;
+    }
+
+    handle->speed = busSpeed;
+    return ERROR_NONE;
+}
+
+int32_t SPIMaster_SelectEnable(SPIMaster *handle, bool enable)
+{
+    if (!handle) {
+        return ERROR_PARAMETER;
+    }
+    if (handle->busy) {
+        return ERROR_BUSY;
+    }
+
+    handle->selectEnable = enable;
+    return ERROR_NONE;
+}
+
+int32_t SPIMaster_TransferSequentialAsync(
+    SPIMaster *handle, SPITransfer *transfer, uint32_t count,
+    void (*callback)(int32_t status, uintptr_t dataCount))
+{
+    if (!handle || !transfer || (count == 0)
+        || (count > SDEMU_TRANSFER_MAX) || !callback) {
+        return ERROR_PARAMETER;
+    }
+    if (handle->busy) {
+        return ERROR_BUSY;
+    }
+
+    uint64_t bytes = 0;
+    uint32_t t;
+    for (t = 0; t < count; t++) {
+        if ((transfer[t].length == 0)
+            || (transfer[t].length > SDEMU_TRANSFER_LEN)
+            || (!transfer[t].writeData && !transfer[t].readData)) {
+            return ERROR_PARAMETER;
+        }
+        handle->transfer[t] = transfer[t];
+        bytes += transfer[t].length;
+    }
+
+    SDEmu *card = handle->card;
+    handle->count    = count;
+    handle->callback = callback;
+    handle->busy     = true;
+    handle->status   = ERROR_NONE;
+
+    // A stalled transfer is left busy until it's cancelled.
+    if (card->faults.stalls > 0) {
+        card->faults.stalls--;
+        return ERROR_NONE;
+    }
+
+    if (card->faults.transferErrors > 0) {
+        card->faults.transferErrors--;
+        handle->status = ERROR;
+    }
+
+    uint64_t time = card->config.latency
+        + ((bytes * 8 * 1000000000ULL) / handle->speed);
+    Host_Schedule(&handle->done, time);
+    return ERROR_NONE;
+}
+
+int32_t SPIMaster_TransferCancel(SPIMaster *handle)
+{
+    if (!handle) {
+        return ERROR_PARAMETER;
+    }
+
+    Host_Cancel(&handle->done);
+    handle->busy = false;
+    return ERROR_NONE;
+}
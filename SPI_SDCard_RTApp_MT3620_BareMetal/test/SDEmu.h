@@ -0,0 +1,80 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef SD_EMU_H_
+#define SD_EMU_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lib/SPIMaster.h"
+
+// Simulated SDHC card in SPI mode, backed by an image file, for running
+// SD.c on the host. Each card comes with the SPIMaster it's wired to, which
+// clocks bytes through the card's state machine and completes each transfer
+// from Host_WaitForInterrupt after the time it would take on the bus.
+//
+// The card supports CMD0/6/8/9/12/16/17/18/24/25/32/33/38/55/58/59 and
+// ACMD22/23/41, with R1/R3/R7 responses, data tokens and error tokens, data
+// response tokens and busy signalling. CRCs are checked on CMD0 and CMD8,
+// and on everything once enabled by CRC_ON_OFF. Erased blocks read as 0x00.
+
+#define SDEMU_CARD_MAX 4
+
+typedef struct SDEmu SDEmu;
+
+typedef struct {
+    uint32_t blocks;        // Capacity in 512 byte blocks.
+    unsigned initPolls;     // ACMD41s answered as still idle before ready.
+    unsigned responseDelay; // Bytes before an R1 response (NCR, 1 to 8).
+    unsigned readDelay;     // Bytes before a read data token (NAC).
+    unsigned writeBusy;     // Bytes of busy after each written block.
+    unsigned stopBusy;      // Bytes of busy after a stop token or CMD12.
+    // Bytes of the read still clocked out after CMD12 and its stuff byte,
+    // ahead of the response.
+    unsigned stopData;
+    unsigned eraseBusy;     // Bytes of busy after CMD38.
+    uint32_t latency;       // Added to every transfer sequence. [ns]
+    bool     highSpeed;     // Whether CMD6 can switch to high-speed mode.
+    // Read data is corrupted when clocked faster than this. [Hz]
+    uint32_t maxSpeed;
+} SDEmu_Config;
+
+// Faults to inject, each count is decremented as it's used up.
+typedef struct {
+    unsigned transferErrors; // Transfer sequences completing with ERROR.
+    unsigned stalls;         // Transfer sequences which never complete.
+    unsigned readCrcErrors;  // Read data packets sent with a corrupted CRC.
+    unsigned writeCrcErrors; // Written blocks rejected with a CRC error.
+    unsigned writeErrors;    // Written blocks rejected with a write error.
+    // Reads of this block get an error token and writes a write error,
+    // UINT32_MAX for none.
+    uint32_t badBlock;
+} SDEmu_Faults;
+
+typedef struct {
+    uint32_t commands[64]; // Commands received by index (ACMDs included).
+    uint32_t crcErrors;    // Commands and blocks received with a bad CRC.
+    uint32_t blocksRead;
+    uint32_t blocksWritten;
+    uint32_t blocksErased;
+    uint32_t sequences;    // Transfer sequences completed.
+    // Commands sent before the card's busy signal had been clocked out.
+    uint32_t busyCommands;
+} SDEmu_Stats;
+
+void       SDEmu_DefaultConfig(SDEmu_Config *config);
+
+// Opens an image, growing it to the configured capacity if needed.
+SDEmu     *SDEmu_Open(const char *path, const SDEmu_Config *config);
+void       SDEmu_Close(SDEmu *card);
+
+SPIMaster *SDEmu_Interface(SDEmu *card);
+int        SDEmu_File(const SDEmu *card);
+// Can be changed at any time, e.g. to add latency or busy time.
+SDEmu_Config *SDEmu_GetConfig(SDEmu *card);
+SDEmu_Faults *SDEmu_GetFaults(SDEmu *card);
+void       SDEmu_GetStats(const SDEmu *card, SDEmu_Stats *stats);
+void       SDEmu_ResetStats(SDEmu *card);
+
+#endif // #ifndef SD_EMU_H_
@@ -0,0 +1,256 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "Host.h"
+#include "SD.h"
+#include "SDEmu.h"
+#include "SDReadAhead.h"
+#include "Test.h"
+
+#define BLOCK_LEN    512
+#define CHUNK_BLOCKS 4
+#define CHUNK_COUNT  4
+
+static SDEmu       *emu       = NULL;
+static SDCard      *card      = NULL;
+static SDReadAhead *readAhead = NULL;
+static GPT         *freerun   = NULL;
+
+static uint8_t buffer[CHUNK_COUNT * CHUNK_BLOCKS * BLOCK_LEN];
+static uint8_t block[BLOCK_LEN];
+
+static void fillBlock(uint8_t *data, uint32_t addr, uint8_t seed)
+{
+    unsigned i;
+    for (i = 0; i < BLOCK_LEN; i++) {
+        data[i] = (uint8_t)((addr * 17) + i + seed);
+    }
+}
+
+static void checkRead(uint32_t addr, uint8_t seed)
+{
+    uint8_t expect[BLOCK_LEN];
+    fillBlock(expect, addr, seed);
+    memset(block, 0x00, sizeof(block));
+    CHECK(SDReadAhead_ReadBlock(readAhead, addr, block));
+    CHECK(memcmp(block, expect, BLOCK_LEN) == 0);
+}
+
+static void checkStats(uint32_t hits, uint32_t stalls, uint32_t misses)
+{
+    SDReadAhead_Stats stats;
+    SDReadAhead_GetStats(readAhead, &stats);
+    CHECK_EQ(stats.hits, hits);
+    CHECK_EQ(stats.stalls, stalls);
+    CHECK_EQ(stats.misses, misses);
+}
+
+// Stands in for the application working on a block, long enough for every
+// read in flight to finish.
+static void work(void)
+{
+    while (Host_Step()) {
+    }
+}
+
+static void testSequential(void)
+{
+    SDReadAhead_ResetStats(readAhead);
+    SDEmu_ResetStats(emu);
+
+    // A single read is a miss of just that block, the next in order starts
+    // reading ahead a chunk at a time into the rest of the ring.
+    checkRead(100, 0);
+    checkStats(0, 0, 1);
+    checkRead(101, 0);
+    checkStats(0, 0, 2);
+
+    SDReadAhead_Stats stats;
+    SDReadAhead_GetStats(readAhead, &stats);
+    CHECK_EQ(stats.prefetchBlocks, ((CHUNK_COUNT - 1) * CHUNK_BLOCKS));
+
+    // With time to read ahead, the rest of the ring's blocks are hits.
+    work();
+    uint32_t addr;
+    for (addr = 102; addr < (101 + (CHUNK_COUNT * CHUNK_BLOCKS)); addr++) {
+        checkRead(addr, 0);
+    }
+    checkStats(((CHUNK_COUNT * CHUNK_BLOCKS) - 1), 0, 2);
+
+    // Moving on to each chunk queued a read of another into the one left
+    // behind, which hasn't had time to arrive.
+    checkRead(addr, 0);
+    checkStats(((CHUNK_COUNT * CHUNK_BLOCKS) - 1), 1, 2);
+    SDReadAhead_GetStats(readAhead, &stats);
+    CHECK(stats.stallTicks > 0);
+
+    // Reading straight through, every block after the first two comes from a
+    // chunk read ahead, one multi-block read per chunk.
+    for (addr++; addr < 400; addr++) {
+        checkRead(addr, 0);
+    }
+    SDReadAhead_GetStats(readAhead, &stats);
+    CHECK_EQ(stats.misses, 2);
+    CHECK_EQ((stats.hits + stats.stalls), (400 - 102));
+
+    // Once the chunks still in flight have been read.
+    SDReadAhead_Reset(readAhead);
+    SDEmu_Stats emuStats;
+    SDEmu_GetStats(emu, &emuStats);
+    CHECK_EQ(emuStats.commands[17], 1);
+    CHECK_EQ(emuStats.commands[18], ((stats.prefetchBlocks / CHUNK_BLOCKS) + 1));
+}
+
+static void testSeek(void)
+{
+    checkRead(500, 0);
+    checkRead(501, 0);
+    work();
+    checkRead(502, 0);
+
+    // A read out of order is a miss which throws away the chunks read ahead
+    // and stops reading ahead until reads are in order again.
+    SDReadAhead_ResetStats(readAhead);
+    SDEmu_ResetStats(emu);
+    checkRead(600, 0);
+    checkStats(0, 0, 1);
+
+    SDReadAhead_Stats stats;
+    SDReadAhead_GetStats(readAhead, &stats);
+    CHECK_EQ(stats.discardBlocks, ((CHUNK_COUNT - 1) * CHUNK_BLOCKS));
+    CHECK_EQ(stats.prefetchBlocks, 0);
+
+    // Going back to a block which had been read ahead reads it again.
+    checkRead(505, 0);
+    checkStats(0, 0, 2);
+    SDEmu_Stats emuStats;
+    SDEmu_GetStats(emu, &emuStats);
+    CHECK_EQ(emuStats.commands[17], 2);
+    CHECK_EQ(emuStats.commands[18], 0);
+
+    // In order again, reading ahead starts over.
+    checkRead(506, 0);
+    work();
+    checkRead(507, 0);
+    checkStats(1, 0, 3);
+}
+
+static void testReset(void)
+{
+    checkRead(700, 0);
+    checkRead(701, 0);
+    work();
+
+    // Blocks read ahead are stale once the card is written, until reset.
+    uint8_t data[BLOCK_LEN];
+    fillBlock(data, 703, 0x33);
+    CHECK(SD_WriteBlock(card, 703, data));
+    checkRead(702, 0);
+    checkRead(703, 0);
+
+    SDReadAhead_Reset(readAhead);
+    SDReadAhead_ResetStats(readAhead);
+    checkRead(703, 0x33);
+    checkStats(0, 0, 1);
+
+    // A reset also forgets the last block, so the next isn't in order.
+    SDReadAhead_Reset(readAhead);
+    checkRead(704, 0);
+    checkStats(0, 0, 2);
+    SDReadAhead_Stats stats;
+    SDReadAhead_GetStats(readAhead, &stats);
+    CHECK_EQ(stats.prefetchBlocks, 0);
+}
+
+static void testErrors(void)
+{
+    // A chunk which fails to arrive is read again on demand.
+    SDEmu_Faults *faults = SDEmu_GetFaults(emu);
+    checkRead(800, 0);
+    faults->badBlock = 810;
+    checkRead(801, 0);
+    work();
+    faults->badBlock = UINT32_MAX;
+
+    SDReadAhead_ResetStats(readAhead);
+    uint32_t addr;
+    for (addr = 802; addr < 816; addr++) {
+        checkRead(addr, 0);
+    }
+    SDReadAhead_Stats stats;
+    SDReadAhead_GetStats(readAhead, &stats);
+    CHECK_EQ(stats.misses, 1);
+
+    // A block which can't be read at all fails the read, without losing track
+    // of the requests in flight.
+    faults->badBlock = 900;
+    CHECK(!SDReadAhead_ReadBlock(readAhead, 900, block));
+    faults->badBlock = UINT32_MAX;
+    CHECK(SD_Idle(card));
+    checkRead(900, 0);
+
+    CHECK(!SDReadAhead_ReadBlock(readAhead, 901, NULL));
+    CHECK(!SDReadAhead_GetBlock(NULL, 901));
+}
+
+static void testOpen(void)
+{
+    // Only one at a time, and the buffer must hold two chunks.
+    CHECK(!SDReadAhead_Open(card, buffer, sizeof(buffer), CHUNK_BLOCKS, NULL));
+    SDReadAhead_Close(readAhead);
+
+    CHECK(!SDReadAhead_Open(card, buffer, ((2 * CHUNK_BLOCKS * BLOCK_LEN) - 1),
+                            CHUNK_BLOCKS, NULL));
+    CHECK(!SDReadAhead_Open(card, buffer, sizeof(buffer), 0, NULL));
+    CHECK(!SDReadAhead_Open(NULL, buffer, sizeof(buffer), CHUNK_BLOCKS, NULL));
+
+    readAhead = SDReadAhead_Open(card, buffer, (2 * CHUNK_BLOCKS * BLOCK_LEN),
+                                 CHUNK_BLOCKS, NULL);
+    CHECK(readAhead);
+    checkRead(10, 0);
+    checkRead(11, 0);
+    SDReadAhead_Close(readAhead);
+    CHECK(SD_Idle(card));
+}
+
+int main(void)
+{
+    SDEmu_Config config;
+    SDEmu_DefaultConfig(&config);
+    config.blocks = 1024;
+
+    unlink("SDReadAheadTest.img");
+    emu = SDEmu_Open("SDReadAheadTest.img", &config);
+    CHECK(emu);
+
+    uint32_t addr;
+    for (addr = 0; addr < config.blocks; addr++) {
+        fillBlock(block, addr, 0);
+        CHECK_EQ(pwrite(SDEmu_File(emu), block, BLOCK_LEN, ((off_t)addr * BLOCK_LEN)),
+                 BLOCK_LEN);
+    }
+
+    // Times stalls in microseconds.
+    freerun = GPT_Open(MT3620_UNIT_GPT1, 1000000, GPT_MODE_NONE);
+    CHECK(freerun);
+    CHECK_EQ(GPT_Start_Freerun(freerun), ERROR_NONE);
+
+    card = SD_Open(SDEmu_Interface(emu));
+    CHECK(card);
+    readAhead = SDReadAhead_Open(card, buffer, sizeof(buffer), CHUNK_BLOCKS, freerun);
+    CHECK(readAhead);
+
+    testSequential();
+    testSeek();
+    testReset();
+    testErrors();
+    testOpen();
+
+    CHECK(SD_Close(card));
+    SDEmu_Close(emu);
+    GPT_Close(freerun);
+    return EXIT_SUCCESS;
+}
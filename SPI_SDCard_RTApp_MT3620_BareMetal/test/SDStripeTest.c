@@ -0,0 +1,253 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "Host.h"
+#include "SD.h"
+#include "SDEmu.h"
+#include "SDStripe.h"
+#include "Test.h"
+
+#define BLOCK_LEN    512
+#define CARD_COUNT   2
+#define STRIPE_ADDR  16
+#define UNIT_BLOCKS  4
+#define MAX_BLOCKS   128
+
+static SDEmu    *emus[CARD_COUNT];
+static SDCard   *cards[CARD_COUNT];
+static SDStripe *stripe = NULL;
+
+static uint8_t data[MAX_BLOCKS * BLOCK_LEN];
+static uint8_t readBack[MAX_BLOCKS * BLOCK_LEN];
+
+// Distinct contents for each block of the striped range.
+static void fillBlocks(uint8_t *buffer, uint32_t addr, uint32_t count, uint8_t seed)
+{
+    uint32_t b;
+    unsigned i;
+    for (b = 0; b < count; b++) {
+        for (i = 0; i < BLOCK_LEN; i++) {
+            buffer[(b * BLOCK_LEN) + i] = (uint8_t)(((addr + b) * 11) + i + seed);
+        }
+    }
+}
+
+// Checks block addr of the striped range is where the round-robin mapping
+// puts it, and holds the pattern.
+static void checkMapped(uint32_t addr, uint8_t seed)
+{
+    uint32_t unit     = (addr / UNIT_BLOCKS);
+    unsigned c        = (unit % CARD_COUNT);
+    uint32_t cardAddr = (STRIPE_ADDR + ((unit / CARD_COUNT) * UNIT_BLOCKS) + (addr % UNIT_BLOCKS));
+
+    uint8_t image[BLOCK_LEN], expect[BLOCK_LEN];
+    fillBlocks(expect, addr, 1, seed);
+    CHECK_EQ(pread(SDEmu_File(emus[c]), image, BLOCK_LEN, ((off_t)cardAddr * BLOCK_LEN)),
+             BLOCK_LEN);
+    CHECK(memcmp(image, expect, BLOCK_LEN) == 0);
+}
+
+static void writeStripe(uint32_t addr, uint32_t count, uint8_t seed)
+{
+    fillBlocks(data, addr, count, seed);
+    CHECK(SDStripe_WriteBlocks(stripe, addr, count, data));
+}
+
+static void checkStripe(uint32_t addr, uint32_t count, uint8_t seed)
+{
+    fillBlocks(data, addr, count, seed);
+    memset(readBack, 0x00, (count * BLOCK_LEN));
+    CHECK(SDStripe_ReadBlocks(stripe, addr, count, readBack));
+    CHECK(memcmp(readBack, data, (count * BLOCK_LEN)) == 0);
+}
+
+static void resetStats(void)
+{
+    SDStripe_ResetStats(stripe);
+    unsigned c;
+    for (c = 0; c < CARD_COUNT; c++) {
+        SDEmu_ResetStats(emus[c]);
+    }
+}
+
+static void testMapping(void)
+{
+    // Whole units alternate between the cards.
+    resetStats();
+    writeStripe(0, (8 * UNIT_BLOCKS), 0x10);
+
+    uint32_t addr;
+    for (addr = 0; addr < (8 * UNIT_BLOCKS); addr++) {
+        checkMapped(addr, 0x10);
+    }
+
+    SDStripe_Stats stats;
+    SDStripe_GetStats(stripe, &stats);
+    CHECK_EQ(stats.requests, 8);
+    CHECK_EQ(stats.blocks, (8 * UNIT_BLOCKS));
+
+    // Each card gets half, and nothing outside the striped range is touched.
+    unsigned c;
+    SDEmu_Stats emuStats;
+    for (c = 0; c < CARD_COUNT; c++) {
+        SDEmu_GetStats(emus[c], &emuStats);
+        CHECK_EQ(emuStats.blocksWritten, (4 * UNIT_BLOCKS));
+
+        uint8_t image[BLOCK_LEN], zero[BLOCK_LEN] = {0};
+        CHECK_EQ(pread(SDEmu_File(emus[c]), image, BLOCK_LEN,
+                       ((off_t)(STRIPE_ADDR - 1) * BLOCK_LEN)), BLOCK_LEN);
+        CHECK(memcmp(image, zero, BLOCK_LEN) == 0);
+        CHECK_EQ(pread(SDEmu_File(emus[c]), image, BLOCK_LEN,
+                       ((off_t)(STRIPE_ADDR + (4 * UNIT_BLOCKS)) * BLOCK_LEN)), BLOCK_LEN);
+        CHECK(memcmp(image, zero, BLOCK_LEN) == 0);
+    }
+
+    // Reads are split the same way, a multi-block read per unit.
+    resetStats();
+    checkStripe(0, (8 * UNIT_BLOCKS), 0x10);
+    for (c = 0; c < CARD_COUNT; c++) {
+        SDEmu_GetStats(emus[c], &emuStats);
+        CHECK_EQ(emuStats.commands[18], 4);
+    }
+}
+
+static void testPartialUnits(void)
+{
+    // Starting and ending part way through a unit, one request per piece.
+    resetStats();
+    writeStripe(3, 6, 0x20);
+
+    SDStripe_Stats stats;
+    SDStripe_GetStats(stripe, &stats);
+    CHECK_EQ(stats.requests, 3);
+    CHECK_EQ(stats.blocks, 6);
+
+    uint32_t addr;
+    for (addr = 3; addr < 9; addr++) {
+        checkMapped(addr, 0x20);
+    }
+    // The rest of the units it touched keep their earlier contents.
+    checkMapped(2, 0x10);
+    checkMapped(9, 0x10);
+
+    // Reads of a single block within a unit, and across units.
+    checkStripe(5, 1, 0x20);
+    checkStripe(2, 1, 0x10);
+    checkStripe(6, 3, 0x20);
+
+    // A transfer within one unit goes to one card.
+    resetStats();
+    writeStripe(13, 2, 0x30);
+    SDEmu_Stats emuStats;
+    SDEmu_GetStats(emus[1], &emuStats);
+    CHECK_EQ(emuStats.blocksWritten, 2);
+    SDEmu_GetStats(emus[0], &emuStats);
+    CHECK_EQ(emuStats.blocksWritten, 0);
+    checkMapped(13, 0x30);
+    checkMapped(14, 0x30);
+}
+
+static void testOverlap(void)
+{
+    // More units than fit in flight wait for the card's oldest request, and
+    // both cards transfer at the same time, so the whole takes about half as
+    // long as on one card.
+    resetStats();
+    uint64_t start = Host_Now();
+    writeStripe(0, MAX_BLOCKS, 0x40);
+    uint64_t striped = (Host_Now() - start);
+
+    SDStripe_Stats stats;
+    SDStripe_GetStats(stripe, &stats);
+    CHECK_EQ(stats.requests, (MAX_BLOCKS / UNIT_BLOCKS));
+    CHECK(stats.waits > 0);
+    checkStripe(0, MAX_BLOCKS, 0x40);
+
+    start = Host_Now();
+    CHECK(SD_WriteBlocks(cards[0], STRIPE_ADDR, (MAX_BLOCKS / CARD_COUNT), data, NULL));
+    CHECK(SD_WriteBlocks(cards[0], STRIPE_ADDR, (MAX_BLOCKS / CARD_COUNT), data, NULL));
+    uint64_t single = (Host_Now() - start);
+    CHECK(striped < ((single * 3) / 4));
+
+    // Put back what the single card writes overwrote.
+    writeStripe(0, MAX_BLOCKS, 0x40);
+}
+
+static void testErrors(void)
+{
+    // A failure on one card fails the transfer, but every request is waited
+    // for before returning, and the stripe carries on working.
+    SDEmu_Faults *faults = SDEmu_GetFaults(emus[1]);
+    faults->badBlock = (STRIPE_ADDR + UNIT_BLOCKS);
+    fillBlocks(data, 0, (4 * UNIT_BLOCKS), 0x50);
+    CHECK(!SDStripe_WriteBlocks(stripe, 0, (4 * UNIT_BLOCKS), data));
+    faults->badBlock = UINT32_MAX;
+
+    unsigned c;
+    for (c = 0; c < CARD_COUNT; c++) {
+        CHECK(SD_Idle(cards[c]));
+    }
+    checkMapped(0, 0x50);
+    writeStripe(0, (4 * UNIT_BLOCKS), 0x50);
+    checkStripe(0, (4 * UNIT_BLOCKS), 0x50);
+
+    CHECK(!SDStripe_ReadBlocks(stripe, 0, 1, NULL));
+    CHECK(!SDStripe_WriteBlocks(NULL, 0, 1, data));
+}
+
+static void testOpen(void)
+{
+    // Only one stripe at a time, and closed stripes are reused.
+    CHECK(!SDStripe_Open(cards, CARD_COUNT, STRIPE_ADDR, UNIT_BLOCKS));
+    SDStripe_Close(stripe);
+
+    CHECK(!SDStripe_Open(cards, 0, STRIPE_ADDR, UNIT_BLOCKS));
+    CHECK(!SDStripe_Open(cards, CARD_COUNT, STRIPE_ADDR, 0));
+    CHECK(!SDStripe_Open(NULL, CARD_COUNT, STRIPE_ADDR, UNIT_BLOCKS));
+    SDCard *missing[CARD_COUNT] = { cards[0], NULL };
+    CHECK(!SDStripe_Open(missing, CARD_COUNT, STRIPE_ADDR, UNIT_BLOCKS));
+
+    // A single card stripe is just the range on that card.
+    stripe = SDStripe_Open(cards, 1, STRIPE_ADDR, UNIT_BLOCKS);
+    CHECK(stripe);
+    fillBlocks(data, 0, 8, 0x60);
+    CHECK(SDStripe_WriteBlocks(stripe, 0, 8, data));
+    CHECK(SD_ReadBlocks(cards[0], STRIPE_ADDR, 8, readBack));
+    CHECK(memcmp(readBack, data, (8 * BLOCK_LEN)) == 0);
+    SDStripe_Close(stripe);
+}
+
+int main(void)
+{
+    SDEmu_Config config;
+    SDEmu_DefaultConfig(&config);
+    config.blocks = 1024;
+
+    static const char *const paths[CARD_COUNT] = { "SDStripeTest0.img", "SDStripeTest1.img" };
+    unsigned c;
+    for (c = 0; c < CARD_COUNT; c++) {
+        unlink(paths[c]);
+        emus[c] = SDEmu_Open(paths[c], &config);
+        CHECK(emus[c]);
+        cards[c] = SD_Open(SDEmu_Interface(emus[c]));
+        CHECK(cards[c]);
+    }
+
+    stripe = SDStripe_Open(cards, CARD_COUNT, STRIPE_ADDR, UNIT_BLOCKS);
+    CHECK(stripe);
+
+    testMapping();
+    testPartialUnits();
+    testOverlap();
+    testErrors();
+    testOpen();
+
+    for (c = 0; c < CARD_COUNT; c++) {
+        CHECK(SD_Close(cards[c]));
+        SDEmu_Close(emus[c]);
+    }
+    return EXIT_SUCCESS;
+}
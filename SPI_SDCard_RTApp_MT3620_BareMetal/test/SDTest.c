@@ -0,0 +1,583 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "CRC.h"
+#include "Host.h"
+#include "SD.h"
+#include "SDEmu.h"
+#include "Test.h"
+
+#define BLOCK_LEN 512
+
+static uint8_t blocks[2][64 * BLOCK_LEN];
+
+static void fillPattern(uint8_t *data, uint32_t addr, uint32_t count, uint8_t seed)
+{
+    uint32_t i;
+    for (i = 0; i < (count * BLOCK_LEN); i++) {
+        data[i] = (uint8_t)((addr + (i / BLOCK_LEN)) * 7 + i + seed);
+    }
+}
+
+// Checks the image behind the card holds data at addr.
+static void checkImage(SDEmu *emu, uint32_t addr, uint32_t count, const uint8_t *data)
+{
+    static uint8_t image[sizeof(blocks[0])];
+    CHECK(count <= (sizeof(image) / BLOCK_LEN));
+    CHECK_EQ(pread(SDEmu_File(emu), image, (count * BLOCK_LEN),
+                   ((off_t)addr * BLOCK_LEN)), (count * BLOCK_LEN));
+    CHECK(memcmp(image, data, (count * BLOCK_LEN)) == 0);
+}
+
+static SDEmu *openImage(const char *path, const SDEmu_Config *config)
+{
+    unlink(path);
+    SDEmu *emu = SDEmu_Open(path, config);
+    CHECK(emu);
+
+    // Give every block distinct contents, so speed verification has
+    // something to compare.
+    static uint8_t data[64 * BLOCK_LEN];
+    uint32_t blocks = (config ? config->blocks : 16384), addr;
+    for (addr = 0; addr < blocks; addr += 64) {
+        fillPattern(data, addr, 64, 0x5A);
+        CHECK_EQ(pwrite(SDEmu_File(emu), data, sizeof(data),
+                        ((off_t)addr * BLOCK_LEN)), sizeof(data));
+    }
+    return emu;
+}
+
+
+// Raw SPI traffic, to check the simulated card itself.
+
+static volatile bool rawDone = false;
+
+static void rawCallback(int32_t status, uintptr_t dataCount)
+{
+    CHECK_EQ(status, ERROR_NONE);
+    rawDone = true;
+}
+
+static void rawTransfer(SPIMaster *interface, const void *write, void *read, uintptr_t length)
+{
+    SPITransfer transfer = { .writeData = write, .readData = read, .length = length };
+    rawDone = false;
+    CHECK_EQ(SPIMaster_TransferSequentialAsync(interface, &transfer, 1, rawCallback),
+             ERROR_NONE);
+    while (!rawDone) {
+        Host_WaitForInterrupt();
+    }
+}
+
+static uint8_t rawCommand(SPIMaster *interface, uint8_t index, uint32_t argument,
+                          bool goodCRC, void *response, uintptr_t responseLen)
+{
+    uint8_t frame[6] = {
+        (0x40 | index), (argument >> 24), (argument >> 16), (argument >> 8), argument,
+    };
+    frame[5] = (CRC_7(frame, 5, 0x00) | 0x01) ^ (goodCRC ? 0x00 : 0x80);
+    rawTransfer(interface, frame, NULL, sizeof(frame));
+
+    uint8_t r1 = 0xFF;
+    unsigned i;
+    for (i = 0; (i < 9) && (r1 == 0xFF); i++) {
+        rawTransfer(interface, NULL, &r1, 1);
+    }
+    if (response && ((r1 & 0x7C) == 0)) {
+        rawTransfer(interface, NULL, response, responseLen);
+    }
+    return r1;
+}
+
+static void testProtocol(void)
+{
+    SDEmu *emu = openImage("SDTestRaw.img", NULL);
+    SPIMaster *interface = SDEmu_Interface(emu);
+
+    // CMD0 needs a valid CRC even though CRCs are off.
+    CHECK_EQ(rawCommand(interface, 0, 0, false, NULL, 0) & 0x08, 0x08);
+    CHECK_EQ(rawCommand(interface, 0, 0, true, NULL, 0), 0x01);
+
+    // Data commands are refused until initialization completes.
+    CHECK_EQ(rawCommand(interface, 17, 0, true, NULL, 0), 0x05);
+
+    uint8_t r7[4];
+    CHECK_EQ(rawCommand(interface, 8, 0x1AA, true, r7, sizeof(r7)), 0x01);
+    CHECK_EQ(r7[2], 0x01);
+    CHECK_EQ(r7[3], 0xAA);
+
+    uint8_t ocr[4];
+    CHECK_EQ(rawCommand(interface, 58, 0, true, ocr, sizeof(ocr)), 0x01);
+    CHECK_EQ(ocr[0] & 0x80, 0x00);
+
+    unsigned polls;
+    for (polls = 0; polls < 10; polls++) {
+        CHECK_EQ(rawCommand(interface, 55, 0, true, NULL, 0) & 0xFE, 0x00);
+        if (rawCommand(interface, 41, 0x40000000, true, NULL, 0) == 0x00) {
+            break;
+        }
+    }
+    CHECK_EQ(polls, 2);
+
+    // Powered up, with block addressing.
+    CHECK_EQ(rawCommand(interface, 58, 0, true, ocr, sizeof(ocr)), 0x00);
+    CHECK_EQ(ocr[0], 0xC0);
+
+    // SDHC cards only take a block length of 512.
+    CHECK_EQ(rawCommand(interface, 16, 512, true, NULL, 0), 0x00);
+    CHECK_EQ(rawCommand(interface, 16, 1024, true, NULL, 0), 0x40);
+    CHECK_EQ(rawCommand(interface, 17, 16384, true, NULL, 0), 0x20);
+
+    // Once CRCs are on every command is checked.
+    CHECK_EQ(rawCommand(interface, 13, 0, false, NULL, 0), 0x04);
+    CHECK_EQ(rawCommand(interface, 59, 1, true, NULL, 0), 0x00);
+    CHECK_EQ(rawCommand(interface, 16, 512, false, NULL, 0), 0x08);
+
+    // A single block read: data token, the block and its CRC.
+    CHECK_EQ(rawCommand(interface, 17, 3, true, NULL, 0), 0x00);
+    uint8_t token = 0xFF;
+    for (polls = 0; (polls < 16) && (token == 0xFF); polls++) {
+        rawTransfer(interface, NULL, &token, 1);
+    }
+    CHECK_EQ(token, 0xFE);
+    uint8_t packet[BLOCK_LEN + 2];
+    unsigned offset;
+    for (offset = 0; offset < sizeof(packet); offset += 32) {
+        uintptr_t len = (sizeof(packet) - offset);
+        rawTransfer(interface, NULL, &packet[offset], (len < 32 ? len : 32));
+    }
+    checkImage(emu, 3, 1, packet);
+    CHECK_EQ(CRC_ITU16(packet, BLOCK_LEN, 0x0000),
+             ((packet[BLOCK_LEN] << 8) | packet[BLOCK_LEN + 1]));
+
+    SDEmu_Stats stats;
+    SDEmu_GetStats(emu, &stats);
+    CHECK_EQ(stats.crcErrors, 2);
+    CHECK_EQ(stats.blocksRead, 1);
+
+    SDEmu_Close(emu);
+}
+
+
+// The driver against the simulated card.
+
+static SDEmu  *emu  = NULL;
+static SDCard *card = NULL;
+
+static void checkReadBack(uint32_t addr, uint32_t count, const uint8_t *data)
+{
+    memset(blocks[1], 0x00, (count * BLOCK_LEN));
+    CHECK(SD_ReadBlocks(card, addr, count, blocks[1]));
+    CHECK(memcmp(blocks[1], data, (count * BLOCK_LEN)) == 0);
+}
+
+static void testOpen(void)
+{
+    SDEmu_Stats stats;
+    SDEmu_GetStats(emu, &stats);
+    CHECK(stats.commands[0] >= 1);
+    CHECK(stats.commands[8] >= 1);
+    CHECK_EQ(stats.commands[41], 3);
+    CHECK_EQ(stats.commands[6], 2);
+    CHECK(stats.commands[9] >= 1);
+
+    // High-speed mode doubles TRAN_SPEED to 50 MHz, which the card handles.
+    CHECK(SD_IsHighSpeed(card));
+    CHECK_EQ(SD_GetTranSpeed(card), 50000000);
+    CHECK_EQ(SD_GetBlockLen(card), BLOCK_LEN);
+
+    SD_ErrorStats errors;
+    SD_GetErrorStats(card, &errors);
+    CHECK_EQ(errors.verifyErrors, 0);
+
+    CHECK(SD_SetBlockLen(card, BLOCK_LEN));
+    CHECK(!SD_SetBlockLen(card, 2 * BLOCK_LEN));
+    CHECK_EQ(SD_GetBlockLen(card), BLOCK_LEN);
+}
+
+static void testReadWrite(void)
+{
+    // Reads of what's already in the image.
+    uint8_t *data = blocks[0];
+    fillPattern(data, 40, 20, 0x5A);
+    checkReadBack(40, 20, data);
+    memset(blocks[1], 0x00, BLOCK_LEN);
+    CHECK(SD_ReadBlock(card, 45, blocks[1]));
+    CHECK(memcmp(blocks[1], &data[5 * BLOCK_LEN], BLOCK_LEN) == 0);
+
+    // A single block write and a multi-block write, which pre-erases.
+    fillPattern(data, 100, 1, 0x11);
+    CHECK(SD_WriteBlock(card, 100, data));
+    checkImage(emu, 100, 1, data);
+
+    SDEmu_ResetStats(emu);
+    fillPattern(data, 200, 64, 0x22);
+    SD_WriteStatus status;
+    CHECK(SD_WriteBlocks(card, 200, 64, data, &status));
+    CHECK_EQ(status.written, 64);
+    CHECK(!status.failed);
+    CHECK_EQ(status.dataResponse, 0x05);
+    checkImage(emu, 200, 64, data);
+    checkReadBack(200, 64, data);
+
+    SDEmu_Stats stats;
+    SDEmu_GetStats(emu, &stats);
+    CHECK_EQ(stats.commands[25], 1);
+    CHECK_EQ(stats.commands[23], 1);
+    CHECK_EQ(stats.commands[18], 1);
+    CHECK_EQ(stats.blocksWritten, 64);
+    // The card streams ahead until it sees STOP_TRANSMISSION.
+    CHECK(stats.blocksRead >= 64);
+
+    // Gathered from separate buffers.
+    const void *gather[3] = {
+        &data[9 * BLOCK_LEN], &data[2 * BLOCK_LEN], &data[30 * BLOCK_LEN],
+    };
+    CHECK(SD_WriteBlocksGather(card, 300, 3, gather, &status));
+    CHECK_EQ(status.written, 3);
+    checkImage(emu, 300, 1, gather[0]);
+    checkImage(emu, 301, 1, gather[1]);
+    checkImage(emu, 302, 1, gather[2]);
+
+    // The last block of the card, and past it.
+    fillPattern(data, 16383, 1, 0x33);
+    CHECK(SD_WriteBlocks(card, 16383, 1, data, NULL));
+    checkReadBack(16383, 1, data);
+    CHECK(!SD_ReadBlocks(card, 16383, 2, blocks[1]));
+    CHECK(!SD_ReadBlock(card, 16384, blocks[1]));
+    CHECK(!SD_WriteBlocks(card, 16384, 1, data, NULL));
+}
+
+static void testErase(void)
+{
+    SDEmu_ResetStats(emu);
+    CHECK(SD_EraseBlocks(card, 500, 599));
+
+    SDEmu_Stats stats;
+    SDEmu_GetStats(emu, &stats);
+    CHECK_EQ(stats.blocksErased, 100);
+
+    static const uint8_t zero[64 * BLOCK_LEN] = {0};
+    checkImage(emu, 500, 64, zero);
+    checkImage(emu, 564, 36, zero);
+    checkReadBack(550, 50, zero);
+
+    uint8_t *data = blocks[0];
+    fillPattern(data, 600, 1, 0x5A);
+    checkReadBack(600, 1, data);
+
+    CHECK(!SD_EraseBlocks(card, 600, 599));
+    CHECK(!SD_EraseBlocks(card, 16000, 16384));
+}
+
+static void testCRC(void)
+{
+    CHECK(SD_SetCRC(card, true));
+    SDEmu_Faults *faults = SDEmu_GetFaults(emu);
+
+    SD_ErrorStats before, after;
+    SD_GetErrorStats(card, &before);
+
+    // Corrupted read packets are read again.
+    uint8_t *data = blocks[0];
+    fillPattern(data, 1000, 16, 0x5A);
+    faults->readCrcErrors = 1;
+    checkReadBack(1000, 1, data);
+    faults->readCrcErrors = 2;
+    checkReadBack(1000, 16, data);
+    CHECK_EQ(faults->readCrcErrors, 0);
+
+    // Rejected write packets are sent again.
+    fillPattern(data, 1100, 16, 0x44);
+    faults->writeCrcErrors = 1;
+    SD_WriteStatus status;
+    CHECK(SD_WriteBlocks(card, 1100, 16, data, &status));
+    CHECK_EQ(status.written, 16);
+    CHECK_EQ(faults->writeCrcErrors, 0);
+    checkImage(emu, 1100, 16, data);
+
+    // A block the card streamed ahead of STOP_TRANSMISSION may have taken
+    // one of the corrupted CRCs without being checked.
+    SD_GetErrorStats(card, &after);
+    CHECK(after.crcErrors - before.crcErrors >= 3);
+    CHECK(after.crcErrors - before.crcErrors <= 4);
+
+    // Commands and blocks sent by the driver carry good CRCs.
+    SDEmu_Stats stats;
+    SDEmu_GetStats(emu, &stats);
+    CHECK_EQ(stats.crcErrors, 0);
+
+    // Three link errors without an error free request in between lower the
+    // clock a step.
+    fillPattern(data, 1000, 1, 0x5A);
+    checkReadBack(1000, 1, data);
+    SD_GetErrorStats(card, &before);
+    uint32_t speed = SD_GetTranSpeed(card);
+
+    faults->readCrcErrors = 3;
+    checkReadBack(1000, 1, data);
+    SD_GetErrorStats(card, &after);
+    CHECK_EQ(after.crcErrors - before.crcErrors, 3);
+    CHECK_EQ(after.downshifts - before.downshifts, 1);
+    CHECK(SD_GetTranSpeed(card) < speed);
+
+    // A packet which keeps failing its CRC fails the request.
+    faults->readCrcErrors = 10;
+    CHECK(!SD_ReadBlocks(card, 1000, 4, blocks[1]));
+    faults->readCrcErrors = 0;
+    checkReadBack(1000, 1, data);
+}
+
+static void testWriteError(void)
+{
+    SDEmu_Faults *faults = SDEmu_GetFaults(emu);
+    uint8_t *data = blocks[0];
+
+    // The card counts the blocks written before the failure (ACMD22).
+    faults->badBlock = 1203;
+    fillPattern(data, 1200, 8, 0x55);
+    SDEmu_ResetStats(emu);
+    SD_WriteStatus status;
+    CHECK(!SD_WriteBlocks(card, 1200, 8, data, &status));
+    CHECK(status.failed);
+    CHECK_EQ(status.written, 3);
+    CHECK_EQ(status.dataResponse, 0x0D);
+    checkImage(emu, 1200, 3, data);
+
+    SDEmu_Stats stats;
+    SDEmu_GetStats(emu, &stats);
+    CHECK_EQ(stats.commands[22], 1);
+    CHECK_EQ(stats.commands[12], 1);
+
+    // Reads of a bad block get an error token.
+    CHECK(!SD_ReadBlocks(card, 1200, 8, blocks[1]));
+    CHECK(!SD_ReadBlock(card, 1203, blocks[1]));
+    faults->badBlock = UINT32_MAX;
+    checkReadBack(1200, 3, data);
+
+    // A single block write is rejected without a count.
+    faults->writeErrors = 1;
+    CHECK(!SD_WriteBlocks(card, 1300, 1, data, &status));
+    CHECK_EQ(status.written, 0);
+    CHECK_EQ(status.dataResponse, 0x0D);
+
+    // SD_WriteBlock retries.
+    faults->writeErrors = 2;
+    CHECK(SD_WriteBlock(card, 1300, data));
+    checkImage(emu, 1300, 1, data);
+}
+
+static void testTimeouts(void)
+{
+    SDEmu_Faults *faults = SDEmu_GetFaults(emu);
+    SD_ErrorStats before, after;
+    SD_GetErrorStats(card, &before);
+
+    uint8_t *data = blocks[0];
+    fillPattern(data, 2000, 8, 0x5A);
+
+    // A transfer which never completes is cancelled by the timer.
+    uint64_t start = Host_Now();
+    faults->stalls = 1;
+    CHECK(!SD_ReadBlocks(card, 2000, 8, blocks[1]));
+    CHECK(Host_Now() - start >= 200000000ULL);
+    CHECK_EQ(faults->stalls, 0);
+    checkReadBack(2000, 8, data);
+
+    // An SPI error fails the request.
+    faults->transferErrors = 1;
+    CHECK(!SD_ReadBlocks(card, 2000, 8, blocks[1]));
+    checkReadBack(2000, 8, data);
+
+    SD_GetErrorStats(card, &after);
+    CHECK_EQ(after.timeouts - before.timeouts, 1);
+    CHECK_EQ(after.transferErrors - before.transferErrors, 1);
+    CHECK_EQ(after.failedRequests - before.failedRequests, 2);
+
+    // A bus too slow for the driver's timeout.
+    SDEmu_Config *config = SDEmu_GetConfig(emu);
+    uint32_t latency = config->latency;
+    config->latency = 300000000;
+    CHECK(!SD_ReadBlock(card, 2000, blocks[1]));
+    config->latency = latency;
+    checkReadBack(2000, 8, data);
+}
+
+static void testSlowCard(void)
+{
+    SDEmu_Config *config = SDEmu_GetConfig(emu);
+    SDEmu_Config saved = *config;
+
+    // Long waits for data tokens and busy are polled in growing chunks.
+    config->readDelay = 1500;
+    config->writeBusy = 4000;
+    config->stopBusy  = 4000;
+
+    uint8_t *data = blocks[0];
+    fillPattern(data, 3000, 8, 0x66);
+    SD_WriteStatus status;
+    CHECK(SD_WriteBlocks(card, 3000, 8, data, &status));
+    CHECK_EQ(status.written, 8);
+
+    SD_TransferStats transfers;
+    SD_ResetTransferStats();
+    checkReadBack(3000, 8, data);
+    SD_GetTransferStats(&transfers);
+    CHECK(transfers.pollBytes >= (8 * 1500));
+    CHECK(transfers.polls < (8 * 16));
+
+    // A byte at a time works too, just with a poll per byte.
+    CHECK(SD_SetPolling(card, 1, 1));
+    config->readDelay = 40;
+    SD_ResetTransferStats();
+    checkReadBack(3000, 2, data);
+    SD_GetTransferStats(&transfers);
+    CHECK_EQ(transfers.polls, transfers.pollBytes);
+    CHECK(SD_SetPolling(card, 8, SD_POLL_LEN_MAX));
+
+    *config = saved;
+}
+
+static void testStopResponse(void)
+{
+    SDEmu_Config *config = SDEmu_GetConfig(emu);
+    SDEmu_Config saved = *config;
+
+    // Read data can still follow STOP_TRANSMISSION, which mustn't be taken
+    // for the R1, or the busy which follows it is missed.
+    config->stopData      = 2;
+    config->responseDelay = 4;
+    config->stopBusy      = 64;
+    // Polled a byte at a time, so the R1 isn't clocked out along with it.
+    CHECK(SD_SetPolling(card, 1, 1));
+
+    uint8_t *data = blocks[0];
+    fillPattern(data, 3500, 4, 0x5A);
+    SDEmu_ResetStats(emu);
+    checkReadBack(3500, 4, data);
+    checkReadBack(3500, 1, data);
+
+    SDEmu_Stats stats;
+    SDEmu_GetStats(emu, &stats);
+    CHECK_EQ(stats.commands[12], 1);
+    CHECK_EQ(stats.busyCommands, 0);
+
+    CHECK(SD_SetPolling(card, 8, SD_POLL_LEN_MAX));
+    *config = saved;
+}
+
+typedef struct {
+    unsigned order[8];
+    unsigned count;
+} Completions;
+
+static Completions completions;
+
+static void requestDone(SD_Request *request)
+{
+    completions.order[completions.count++] = (unsigned)(uintptr_t)request->userData;
+}
+
+static void testAsync(void)
+{
+    uint8_t *data = blocks[0];
+    fillPattern(data, 4000, 16, 0x77);
+    memset(&completions, 0, sizeof(completions));
+
+    SD_Request requests[4] = {
+        { .type = SD_REQUEST_WRITE, .addr = 4000, .count = 16, .data = data },
+        { .type = SD_REQUEST_READ,  .addr = 4000, .count = 8,  .data = blocks[1] },
+        { .type = SD_REQUEST_READ,  .addr = 4008, .count = 8,
+          .data = &blocks[1][8 * BLOCK_LEN] },
+        { .type = SD_REQUEST_ERASE, .addr = 4100, .count = 4 },
+    };
+
+    unsigned i;
+    for (i = 0; i < 4; i++) {
+        requests[i].callback = requestDone;
+        requests[i].userData = (void *)(uintptr_t)i;
+        CHECK(SD_Submit(card, &requests[i]));
+    }
+    CHECK(!SD_Idle(card));
+    CHECK_EQ(completions.count, 0);
+
+    // The card can't be closed under its requests.
+    CHECK(!SD_Close(card));
+
+    CHECK(SD_Wait(&requests[3]));
+    CHECK(SD_Idle(card));
+    CHECK_EQ(completions.count, 4);
+    for (i = 0; i < 4; i++) {
+        CHECK_EQ(completions.order[i], i);
+        CHECK_EQ(requests[i].status, SD_REQUEST_DONE);
+    }
+    CHECK(memcmp(blocks[1], data, (16 * BLOCK_LEN)) == 0);
+    checkImage(emu, 4000, 16, data);
+}
+
+static void testNegotiation(void)
+{
+    // A card which can't keep up with its own TRAN_SPEED.
+    SDEmu_Config config;
+    SDEmu_DefaultConfig(&config);
+    config.blocks    = 2048;
+    config.highSpeed = false;
+    config.maxSpeed  = 20000000;
+    SDEmu *slowEmu = openImage("SDTestSlow.img", &config);
+
+    SDCard *slow = SD_Open(SDEmu_Interface(slowEmu));
+    CHECK(slow);
+    CHECK(!SD_IsHighSpeed(slow));
+    CHECK_EQ(SD_GetTranSpeed(slow), 20000000);
+
+    SD_ErrorStats errors;
+    SD_GetErrorStats(slow, &errors);
+    // Only 25 MHz is tried before 20 MHz, faster clocks are above TRAN_SPEED.
+    CHECK_EQ(errors.verifyErrors, 1);
+
+    // Cards on separate interfaces run concurrently.
+    static uint8_t other[8 * BLOCK_LEN];
+    SD_Request a = { .type = SD_REQUEST_READ, .addr = 100, .count = 8, .data = blocks[1] };
+    SD_Request b = { .type = SD_REQUEST_READ, .addr = 100, .count = 8, .data = other };
+    CHECK(SD_Submit(card, &a));
+    CHECK(SD_Submit(slow, &b));
+    CHECK_EQ(a.status, SD_REQUEST_ACTIVE);
+    CHECK_EQ(b.status, SD_REQUEST_ACTIVE);
+    CHECK(SD_Wait(&a));
+    CHECK(SD_Wait(&b));
+    checkImage(slowEmu, 100, 8, other);
+    checkImage(emu, 100, 8, blocks[1]);
+
+    // Only one card per interface.
+    CHECK(!SD_Open(SDEmu_Interface(slowEmu)));
+
+    CHECK(SD_Close(slow));
+    SDEmu_Close(slowEmu);
+}
+
+int main(void)
+{
+    testProtocol();
+
+    emu = openImage("SDTest.img", NULL);
+    card = SD_Open(SDEmu_Interface(emu));
+    CHECK(card);
+
+    testOpen();
+    testReadWrite();
+    testErase();
+    testAsync();
+    testNegotiation();
+    testWriteError();
+    testTimeouts();
+    testSlowCard();
+    testStopResponse();
+    testCRC();
+
+    CHECK(SD_Close(card));
+    SDEmu_Close(emu);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,25 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef MT3620_HOST_COMMON_H_
+#define MT3620_HOST_COMMON_H_
+
+// Host stand-ins for the parts of the mt3620-m4-drivers headers used by the
+// sample, so it can be built and tested on a development machine. The
+// implementations are in Host.c and SDEmu.c.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ERROR_NONE         0
+#define ERROR             -1
+#define ERROR_BUSY        -2
+#define ERROR_UNSUPPORTED -3
+#define ERROR_PARAMETER   -4
+#define ERROR_HANDLE      -5
+#define ERROR_TIMEOUT     -6
+#define ERROR_DMA         -7
+#define ERROR_SPECIFIC    -255
+
+#endif // #ifndef MT3620_HOST_COMMON_H_
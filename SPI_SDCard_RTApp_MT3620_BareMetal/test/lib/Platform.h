@@ -0,0 +1,24 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef MT3620_HOST_PLATFORM_H_
+#define MT3620_HOST_PLATFORM_H_
+
+#include "Common.h"
+
+typedef enum {
+    MT3620_UNIT_GPT0,
+    MT3620_UNIT_GPT1,
+    MT3620_UNIT_GPT2,
+    MT3620_UNIT_GPT3,
+    MT3620_UNIT_GPT4,
+    MT3620_UNIT_GPT_COUNT,
+
+    MT3620_UNIT_ISU0,
+    MT3620_UNIT_ISU1,
+    MT3620_UNIT_ISU2,
+    MT3620_UNIT_ISU3,
+    MT3620_UNIT_ISU4,
+} Platform_Unit;
+
+#endif // #ifndef MT3620_HOST_PLATFORM_H_
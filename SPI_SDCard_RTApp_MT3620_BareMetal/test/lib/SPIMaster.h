@@ -0,0 +1,25 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef MT3620_HOST_SPI_MASTER_H_
+#define MT3620_HOST_SPI_MASTER_H_
+
+#include "Platform.h"
+
+// Interfaces are created by SDEmu_Open, each with a simulated card attached.
+typedef struct SPIMaster SPIMaster;
+
+typedef struct {
+    const void *writeData;
+    void       *readData;
+    uintptr_t   length;
+} SPITransfer;
+
+int32_t SPIMaster_Configure(SPIMaster *handle, bool cpol, bool cpha, uint32_t busSpeed);
+int32_t SPIMaster_SelectEnable(SPIMaster *handle, bool enable);
+int32_t SPIMaster_TransferSequentialAsync(
+    SPIMaster *handle, SPITransfer *transfer, uint32_t count,
+    void (*callback)(int32_t status, uintptr_t dataCount));
+int32_t SPIMaster_TransferCancel(SPIMaster *handle);
+
+#endif // #ifndef MT3620_HOST_SPI_MASTER_H_
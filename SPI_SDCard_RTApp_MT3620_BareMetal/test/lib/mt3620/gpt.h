@@ -0,0 +1,12 @@
+/* Copyright (c) Codethink Ltd. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef MT3620_HOST_REG_GPT_H_
+#define MT3620_HOST_REG_GPT_H_
+
+#define MT3620_GPT_012_LOW_SPEED  32768
+#define MT3620_GPT_012_HIGH_SPEED 1000
+#define MT3620_GPT_3_LOW_SPEED    1000000
+#define MT3620_GPT_3_HIGH_SPEED   26000000
+
+#endif // #ifndef MT3620_HOST_REG_GPT_H_